@@ -9,6 +9,15 @@ CuSuite* StreamParseGetSuite();
 CuSuite* FramerGetSuite();
 CuSuite* UtilGetSuite();
 CuSuite* WSMessageGetSuite();
+CuSuite* DNSCacheGetSuite();
+CuSuite* SRVGetSuite();
+CuSuite* PoolGetSuite();
+CuSuite* TLSClientGetSuite();
+CuSuite* XMLPoolGetSuite();
+CuSuite* OriginGetSuite();
+CuSuite* LogGetSuite();
+CuSuite* MetricsGetSuite();
+CuSuite* HistogramGetSuite();
 
 void RunAllTests(void) {
 	CuString *output = CuStringNew();
@@ -21,6 +30,15 @@ void RunAllTests(void) {
 	CuSuiteAddSuite(suite, FramerGetSuite());
 	CuSuiteAddSuite(suite, UtilGetSuite());
 	CuSuiteAddSuite(suite, WSMessageGetSuite());
+	CuSuiteAddSuite(suite, DNSCacheGetSuite());
+	CuSuiteAddSuite(suite, SRVGetSuite());
+	CuSuiteAddSuite(suite, PoolGetSuite());
+	CuSuiteAddSuite(suite, TLSClientGetSuite());
+	CuSuiteAddSuite(suite, XMLPoolGetSuite());
+	CuSuiteAddSuite(suite, OriginGetSuite());
+	CuSuiteAddSuite(suite, LogGetSuite());
+	CuSuiteAddSuite(suite, MetricsGetSuite());
+	CuSuiteAddSuite(suite, HistogramGetSuite());
 
 	CuSuiteRun(suite);
 	CuSuiteSummary(suite, output);
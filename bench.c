@@ -0,0 +1,1014 @@
+/* jabsocket_bench - microbenchmarks for the protocol hot paths
+
+   Every benchmark works on inputs generated from fixed data, so two runs
+   on the same machine measure the same work. The iteration count of a
+   benchmark is calibrated to take about --time milliseconds, the
+   measurement is repeated --repeat times and the median is reported. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include "jabsocketConfig.h"
+#include "base64.h"
+#include "framer.h"
+#include "parseconfig.h"
+#include "rqparser.h"
+#include "util.h"
+#include "wsmessage.h"
+
+/* Allocation counting
+
+   With glibc the allocator entry points are replaced by wrappers that
+   count the calls and forward them to glibc's own allocator, so that
+   allocations made inside expat, libyaml and libc are counted too.
+   Sanitizer builds bring their own allocator and don't count. */
+
+static unsigned long allocations = 0;
+
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__) && \
+	!defined(__SANITIZE_THREAD__)
+#define BENCH_COUNT_ALLOCATIONS 1
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+void *
+malloc(size_t size)
+{
+	allocations++;
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	allocations++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	allocations++;
+	return __libc_realloc(ptr, size);
+}
+
+void
+free(void *ptr)
+{
+	__libc_free(ptr);
+}
+#else
+#define BENCH_COUNT_ALLOCATIONS 0
+#endif
+
+typedef struct _bench_t bench_t;
+
+struct _bench_t
+{
+	const char *name;
+	int param;   /* implementation, engine, ... */
+	size_t size; /* input or chunk size */
+	/* setup prepares the input outside of the measurement; returns 0 if
+	   the benchmark can't run here (e.g. the CPU lacks the instructions) */
+	int (*setup)(bench_t *bench);
+	void (*run)(bench_t *bench, unsigned long iterations);
+	void (*teardown)(bench_t *bench);
+	size_t bytes; /* bytes processed by one operation, set by setup */
+	void *ctx;
+};
+
+typedef struct _result_t
+{
+	unsigned long iterations;
+	double ns_per_op;
+	double bytes_per_sec;
+	double allocs_per_op;
+} result_t;
+
+static double
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Deterministic pseudo-random numbers for the generated inputs */
+static unsigned long bench_seed = 1;
+
+static unsigned long
+bench_random(void)
+{
+	bench_seed = bench_seed * 6364136223846793005UL + 1442695040888963407UL;
+	return (bench_seed >> 33) & 0x7fffffff;
+}
+
+static void
+bench_fail(bench_t *bench, const char *what)
+{
+	fprintf(stderr, "jabsocket_bench: %s: %s\n", bench->name, what);
+	exit(1);
+}
+
+/* unmask */
+
+static int
+unmask_setup(bench_t *bench)
+{
+	byte *data;
+	size_t i;
+
+	if (!unmask_set_impl(bench->param))
+		return 0;
+	data = (byte*) malloc(bench->size);
+	if (data == NULL)
+		return 0;
+	bench_seed = 1;
+	for (i = 0; i < bench->size; i++)
+		data[i] = (byte) bench_random();
+	bench->ctx = data;
+	bench->bytes = bench->size;
+	return 1;
+}
+
+static void
+unmask_run(bench_t *bench, unsigned long iterations)
+{
+	byte mask[] = { 0x37, 0xfa, 0x21, 0x3d };
+	unsigned long i;
+
+	for (i = 0; i < iterations; i++)
+		unmask((byte*) bench->ctx, bench->size, mask);
+}
+
+static void
+unmask_teardown(bench_t *bench)
+{
+	free(bench->ctx);
+	unmask_init();
+}
+
+/* wsmsg_add, wsmsg_get_frame and wsmsg_get_message
+
+   The input is a recorded browser stream: 256 masked text frames with
+   stanza sized payloads and a ping every 32 frames, delivered in reads
+   of bench->size bytes. */
+
+#define WSSTREAM_FRAMES 256
+#define WSSTREAM_MAX_PAYLOAD 4096
+
+typedef struct _wsbench_t
+{
+	jsconf_t *conf;
+	wsmsg_t *wsmsg;
+	buffer_t *buffer;
+	byte *stream;
+	size_t length;
+	unsigned long messages; /* expected per pass */
+} wsbench_t;
+
+static size_t
+put_frame(byte *out, int opcode, byte *payload, size_t length)
+{
+	byte mask[4];
+	size_t header_size;
+	size_t i;
+
+	for (i = 0; i < 4; i++)
+		mask[i] = (byte) bench_random();
+	header_size = wsmsg_encode_header(out, 1, opcode, length);
+	out[1] |= 0x80;
+	memcpy(out + header_size, mask, 4);
+	header_size += 4;
+	for (i = 0; i < length; i++)
+		out[header_size + i] = payload[i] ^ mask[i % 4];
+	return header_size + length;
+}
+
+static int
+wsmsg_setup(bench_t *bench)
+{
+	wsbench_t *ws;
+	byte payload[WSSTREAM_MAX_PAYLOAD];
+	size_t length;
+	int i;
+
+	ws = (wsbench_t*) calloc(1, sizeof(wsbench_t));
+	if (ws == NULL)
+		return 0;
+	bench->ctx = ws;
+	ws->conf = config_create();
+	if (ws->conf == NULL)
+		return 0;
+	ws->conf->max_frame_size = 65536;
+	ws->conf->max_message_size = 65536;
+	ws->wsmsg = wsmsg_create(ws->conf);
+	ws->buffer = buffer_create(0);
+	ws->stream = (byte*) malloc(WSSTREAM_FRAMES *
+		(WSSTREAM_MAX_PAYLOAD + WSMSG_MAX_HEADER_SIZE + 4));
+	if ( (ws->wsmsg == NULL) || (ws->buffer == NULL) || (ws->stream == NULL) )
+		return 0;
+	memset(payload, 'x', sizeof(payload));
+	bench_seed = 1;
+	for (i = 0; i < WSSTREAM_FRAMES; i++)
+	{
+		if (i % 32 == 31)
+		{
+			ws->length += put_frame(ws->stream + ws->length, OPCODE_PING,
+				payload, 8);
+			continue;
+		}
+		/* Mostly short stanzas (presence, chat messages), some larger ones
+		   (roster, vCards) */
+		if (i % 16 == 0)
+			length = 1024 + bench_random() % (WSSTREAM_MAX_PAYLOAD - 1024);
+		else
+			length = 64 + bench_random() % 448;
+		ws->length += put_frame(ws->stream + ws->length, OPCODE_TEXT,
+			payload, length);
+		ws->messages++;
+	}
+	if (bench->size == 0)
+		bench->size = ws->length;
+	bench->bytes = ws->length;
+	return 1;
+}
+
+static void
+wsmsg_run(bench_t *bench, unsigned long iterations)
+{
+	wsbench_t *ws = (wsbench_t*) bench->ctx;
+	unsigned long i, messages;
+	size_t offset, n;
+	int fin, opcode, mask;
+
+	for (i = 0; i < iterations; i++)
+	{
+		messages = 0;
+		for (offset = 0; offset < ws->length; offset += n)
+		{
+			n = ws->length - offset;
+			if (n > bench->size)
+				n = bench->size;
+			wsmsg_add(ws->wsmsg, ws->stream + offset, n);
+			/* Pick up everything that is complete, as the read callback
+			   does */
+			while (1)
+			{
+				if (wsmsg_fail(ws->wsmsg))
+					bench_fail(bench, "wsmsg_add failed");
+				if (wsmsg_has_frame(ws->wsmsg))
+				{
+					if (!wsmsg_get_frame(ws->wsmsg, ws->buffer, &fin, &opcode,
+						&mask))
+						bench_fail(bench, "wsmsg_get_frame failed");
+					continue;
+				}
+				if (!wsmsg_has_message(ws->wsmsg))
+					break;
+				wsmsg_get_message(ws->wsmsg, ws->buffer, &opcode);
+				messages++;
+			}
+		}
+		if (messages != ws->messages)
+			bench_fail(bench, "lost messages");
+	}
+}
+
+static void
+wsmsg_teardown(bench_t *bench)
+{
+	wsbench_t *ws = (wsbench_t*) bench->ctx;
+
+	if (ws == NULL)
+		return;
+	if (ws->wsmsg != NULL)
+		wsmsg_delete(ws->wsmsg);
+	if (ws->buffer != NULL)
+		buffer_delete(ws->buffer);
+	if (ws->conf != NULL)
+		config_delete(ws->conf);
+	free(ws->stream);
+	free(ws);
+}
+
+/* framer_add and framer_get_frame2 (or framer_get_frame_ref, as the
+   connection manager uses it)
+
+   The input is a recorded server stream: the stream header, features and
+   a mix of presence, message and roster stanzas, delivered in TCP sized
+   reads of bench->size bytes. */
+
+#define FRAMER_FRAME_SIZE 65536
+
+typedef struct _framerbench_t
+{
+	framer_t *framer;
+	char *stream;
+	size_t length;
+	unsigned long stanzas; /* expected per pass, with the stream header */
+	byte frame[FRAMER_FRAME_SIZE];
+} framerbench_t;
+
+static const char *xmpp_header =
+	"<?xml version='1.0'?>"
+	"<stream:stream xmlns='jabber:client' "
+	"xmlns:stream='http://etherx.jabber.org/streams' id='3412871349' "
+	"from='example.com' version='1.0' xml:lang='en'>"
+	"<stream:features><bind xmlns='urn:ietf:params:xml:ns:xmpp-bind'/>"
+	"<session xmlns='urn:ietf:params:xml:ns:xmpp-session'/>"
+	"</stream:features>";
+
+static const char *xmpp_stanzas[] =
+{
+	"<presence from='alice@example.com/phone' to='bob@example.com/web' "
+	"xml:lang='en'><show>away</show><status>In a meeting</status>"
+	"<priority>5</priority><c xmlns='http://jabber.org/protocol/caps' "
+	"hash='sha-1' node='http://example.org/client' "
+	"ver='QgayPKawpkPSDYmwT/WM94uAlu0='/></presence>\r\n",
+
+	"<message from='alice@example.com/phone' to='bob@example.com/web' "
+	"type='chat' id='msg-7821'><body>Are we still on for lunch tomorrow? "
+	"I can book the place around the corner &amp; bring the slides.</body>"
+	"<active xmlns='http://jabber.org/protocol/chatstates'/>"
+	"<request xmlns='urn:xmpp:receipts'/></message>\r\n",
+
+	"<iq type='result' to='bob@example.com/web' id='roster_1'>"
+	"<query xmlns='jabber:iq:roster' ver='ver14'>"
+	"<item jid='alice@example.com' name='Alice' subscription='both'>"
+	"<group>Friends</group></item>"
+	"<item jid='carol@example.com' name='Carol' subscription='both'>"
+	"<group>Work</group></item>"
+	"<item jid='dave@example.net' name='Dave' subscription='to'/>"
+	"<item jid='eve@example.org' subscription='from'>"
+	"<group>Work</group><group>Friends</group></item>"
+	"</query></iq>\r\n",
+
+	"<message from='carol@example.com/desk' to='bob@example.com/web' "
+	"type='chat' id='msg-7822'>"
+	"<composing xmlns='http://jabber.org/protocol/chatstates'/></message>\r\n",
+
+	"<iq from='example.com' to='bob@example.com/web' id='ping-42' "
+	"type='get'><ping xmlns='urn:xmpp:ping'/></iq>\r\n"
+};
+
+#define XMPP_STANZA_COUNT (sizeof(xmpp_stanzas) / sizeof(xmpp_stanzas[0]))
+#define FRAMER_STREAM_STANZAS 500
+
+static int
+framer_setup(bench_t *bench)
+{
+	framerbench_t *fb;
+	const char *stanza;
+	size_t length, n;
+	int i;
+
+	fb = (framerbench_t*) calloc(1, sizeof(framerbench_t));
+	if (fb == NULL)
+		return 0;
+	bench->ctx = fb;
+	fb->framer = framer_create_engine(bench->param, NULL);
+	if (fb->framer == NULL)
+		return 0;
+	length = strlen(xmpp_header);
+	for (i = 0; i < (int) XMPP_STANZA_COUNT; i++)
+		length += FRAMER_STREAM_STANZAS * strlen(xmpp_stanzas[i]);
+	fb->stream = (char*) malloc(length + 1);
+	if (fb->stream == NULL)
+		return 0;
+	strcpy(fb->stream, xmpp_header);
+	fb->length = strlen(xmpp_header);
+	/* stream header and features */
+	fb->stanzas = 2;
+	bench_seed = 1;
+	for (i = 0; i < FRAMER_STREAM_STANZAS; i++)
+	{
+		stanza = xmpp_stanzas[bench_random() % XMPP_STANZA_COUNT];
+		n = strlen(stanza);
+		memcpy(fb->stream + fb->length, stanza, n + 1);
+		fb->length += n;
+		fb->stanzas++;
+	}
+	bench->bytes = fb->length;
+	return 1;
+}
+
+static void
+framer_pass(bench_t *bench, unsigned long iterations, int ref)
+{
+	framerbench_t *fb = (framerbench_t*) bench->ctx;
+	unsigned long i, stanzas;
+	size_t offset, n, size;
+	data_t data;
+	byte *frame;
+
+	data_init(&data, fb->frame, sizeof(fb->frame));
+	for (i = 0; i < iterations; i++)
+	{
+		framer_reset(fb->framer);
+		stanzas = 0;
+		for (offset = 0; offset < fb->length; offset += n)
+		{
+			n = fb->length - offset;
+			if (n > bench->size)
+				n = bench->size;
+			if (!framer_add(fb->framer, (unsigned char*) fb->stream + offset, n))
+				bench_fail(bench, "framer_add failed");
+			if (ref)
+			{
+				while (framer_get_frame_ref(fb->framer, &frame, &size))
+					stanzas++;
+			}
+			else
+			{
+				while (framer_has_frame(fb->framer))
+				{
+					framer_get_frame2(fb->framer, &data, &size);
+					stanzas++;
+				}
+			}
+		}
+		if (stanzas != fb->stanzas)
+			bench_fail(bench, "lost stanzas");
+	}
+}
+
+static void
+framer_run(bench_t *bench, unsigned long iterations)
+{
+	framer_pass(bench, iterations, 0);
+}
+
+static void
+framer_ref_run(bench_t *bench, unsigned long iterations)
+{
+	framer_pass(bench, iterations, 1);
+}
+
+static void
+framer_teardown(bench_t *bench)
+{
+	framerbench_t *fb = (framerbench_t*) bench->ctx;
+
+	if (fb == NULL)
+		return;
+	if (fb->framer != NULL)
+		framer_delete(fb->framer);
+	free(fb->stream);
+	free(fb);
+}
+
+/* rq_add_line or rq_parse, then rq_analyze, on a browser handshake */
+
+static const char *handshake =
+	"GET /xmpp HTTP/1.1\r\n"
+	"Host: chat.example.com\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:120.0)\r\n"
+	"Accept: */*\r\n"
+	"Accept-Language: en-US,en;q=0.5\r\n"
+	"Accept-Encoding: gzip, deflate\r\n"
+	"Sec-WebSocket-Version: 13\r\n"
+	"Origin: https://www.example.com\r\n"
+	"Sec-WebSocket-Protocol: xmpp\r\n"
+	"Sec-WebSocket-Extensions: permessage-deflate\r\n"
+	"Sec-WebSocket-Key: x3JJHMbDL1EzLkh9GBhXDw==\r\n"
+	"Connection: keep-alive, Upgrade\r\n"
+	"Pragma: no-cache\r\n"
+	"Cache-Control: no-cache\r\n"
+	"Upgrade: websocket\r\n"
+	"\r\n";
+
+#define HANDSHAKE_MAX_LINES 32
+
+typedef struct _rqbench_t
+{
+	jsconf_t *conf;
+	request_t *request;
+	char *lines[HANDSHAKE_MAX_LINES];
+	int line_count;
+	char response[1024];
+} rqbench_t;
+
+static int
+rq_setup(bench_t *bench)
+{
+	rqbench_t *rb;
+	const char *line, *eol;
+	origin_t *origin;
+
+	rb = (rqbench_t*) calloc(1, sizeof(rqbench_t));
+	if (rb == NULL)
+		return 0;
+	bench->ctx = rb;
+	rb->conf = config_create();
+	rb->request = rq_create();
+	origin = (origin_t*) malloc(sizeof(origin_t));
+	if ( (rb->conf == NULL) || (rb->request == NULL) || (origin == NULL) )
+		return 0;
+	origin->url = strdup("https://*.example.com");
+	origin->next = NULL;
+	rb->conf->origin_list = origin;
+	config_compile_origins(rb->conf);
+	/* Lines as evbuffer_readln returns them, without \r\n */
+	for (line = handshake; *line != '\0'; line = eol + 2)
+	{
+		eol = strstr(line, "\r\n");
+		rb->lines[rb->line_count++] = strndup(line, eol - line);
+	}
+	bench->bytes = strlen(handshake);
+	return 1;
+}
+
+static void
+rq_run(bench_t *bench, unsigned long iterations)
+{
+	rqbench_t *rb = (rqbench_t*) bench->ctx;
+	unsigned long i;
+	int j;
+	str_t response;
+
+	str_init(&response, rb->response, sizeof(rb->response));
+	for (i = 0; i < iterations; i++)
+	{
+		rq_clear(rb->request);
+		if (bench->param)
+			rq_parse(rb->request, handshake, bench->bytes);
+		else
+		{
+			for (j = 0; j < rb->line_count; j++)
+				rq_add_line(rb->request, rb->lines[j]);
+		}
+		if (!rq_done(rb->request) ||
+			!rq_analyze(rb->request, rb->conf, &response))
+			bench_fail(bench, "handshake rejected");
+	}
+}
+
+static void
+rq_teardown(bench_t *bench)
+{
+	rqbench_t *rb = (rqbench_t*) bench->ctx;
+	int j;
+
+	if (rb == NULL)
+		return;
+	for (j = 0; j < rb->line_count; j++)
+		free(rb->lines[j]);
+	if (rb->request != NULL)
+		rq_delete(rb->request);
+	if (rb->conf != NULL)
+		config_delete(rb->conf);
+	free(rb);
+}
+
+/* base64_encode: the 20 byte SHA-1 of the handshake and a larger block */
+
+typedef struct _base64bench_t
+{
+	unsigned char *data;
+	char *out;
+} base64bench_t;
+
+static int
+base64_setup(bench_t *bench)
+{
+	base64bench_t *bb;
+	size_t i;
+
+	bb = (base64bench_t*) calloc(1, sizeof(base64bench_t));
+	if (bb == NULL)
+		return 0;
+	bench->ctx = bb;
+	bb->data = (unsigned char*) malloc(bench->size);
+	bb->out = (char*) malloc(4 * (bench->size / 3 + 1) + 1);
+	if ( (bb->data == NULL) || (bb->out == NULL) )
+		return 0;
+	bench_seed = 1;
+	for (i = 0; i < bench->size; i++)
+		bb->data[i] = (unsigned char) bench_random();
+	bench->bytes = bench->size;
+	return 1;
+}
+
+static void
+base64_run(bench_t *bench, unsigned long iterations)
+{
+	base64bench_t *bb = (base64bench_t*) bench->ctx;
+	unsigned long i;
+	str_t out;
+
+	str_init(&out, bb->out, 4 * (bench->size / 3 + 1) + 1);
+	for (i = 0; i < iterations; i++)
+		base64_encode(bb->data, bench->size, &out);
+}
+
+static void
+base64_teardown(bench_t *bench)
+{
+	base64bench_t *bb = (base64bench_t*) bench->ctx;
+
+	if (bb == NULL)
+		return;
+	free(bb->data);
+	free(bb->out);
+	free(bb);
+}
+
+/* config_check_origin against bench->size patterns (60% exact origins,
+   39% tenant wildcards, the rest left to fnmatch), compiled (param 1) or
+   scanned one by one (param 0) */
+
+#define ORIGIN_CHECKS 64
+
+typedef struct _originbench_t
+{
+	jsconf_t *conf;
+	char *checks[ORIGIN_CHECKS];
+} originbench_t;
+
+static int
+origin_setup(bench_t *bench)
+{
+	originbench_t *ob;
+	origin_t *origin;
+	char url[128];
+	size_t i, exact, wildcard;
+
+	ob = (originbench_t*) calloc(1, sizeof(originbench_t));
+	if (ob == NULL)
+		return 0;
+	bench->ctx = ob;
+	ob->conf = config_create();
+	if (ob->conf == NULL)
+		return 0;
+	exact = bench->size * 6 / 10;
+	wildcard = bench->size * 99 / 100;
+	for (i = 0; i < bench->size; i++)
+	{
+		if (i < exact)
+			snprintf(url, sizeof(url), "https://tenant%lu.example.com",
+				(unsigned long) i);
+		else if (i < wildcard)
+			snprintf(url, sizeof(url), "https://*.tenant%lu.example",
+				(unsigned long) i);
+		else
+			snprintf(url, sizeof(url), "https://app?.tenant%lu.example.org",
+				(unsigned long) i);
+		origin = (origin_t*) malloc(sizeof(origin_t));
+		if (origin == NULL)
+			return 0;
+		origin->url = strdup(url);
+		origin->next = ob->conf->origin_list;
+		ob->conf->origin_list = origin;
+	}
+	if (bench->param && !config_compile_origins(ob->conf))
+		return 0;
+	/* A quarter of the checks for each kind of pattern, a quarter that
+	   match nothing */
+	bench_seed = 1;
+	for (i = 0; i < ORIGIN_CHECKS; i++)
+	{
+		switch (i % 4)
+		{
+			case 0:
+				snprintf(url, sizeof(url), "https://tenant%lu.example.com",
+					bench_random() % exact);
+				break;
+			case 1:
+				snprintf(url, sizeof(url), "https://chat.tenant%lu.example",
+					exact + bench_random() % (wildcard - exact));
+				break;
+			case 2:
+				snprintf(url, sizeof(url), "https://app1.tenant%lu.example.org",
+					wildcard + bench_random() % (bench->size - wildcard));
+				break;
+			default:
+				snprintf(url, sizeof(url), "https://unknown%lu.example.com",
+					(unsigned long) i);
+				break;
+		}
+		ob->checks[i] = strdup(url);
+	}
+	return 1;
+}
+
+static void
+origin_run(bench_t *bench, unsigned long iterations)
+{
+	originbench_t *ob = (originbench_t*) bench->ctx;
+	unsigned long i;
+	int matches = 0;
+
+	for (i = 0; i < iterations; i++)
+		matches += config_check_origin(ob->conf,
+			ob->checks[i % ORIGIN_CHECKS]);
+	if ( (iterations >= ORIGIN_CHECKS) &&
+		(matches < (int) (iterations / ORIGIN_CHECKS) * ORIGIN_CHECKS * 3 / 4) )
+		bench_fail(bench, "origins not matched");
+}
+
+static void
+origin_teardown(bench_t *bench)
+{
+	originbench_t *ob = (originbench_t*) bench->ctx;
+	int i;
+
+	if (ob == NULL)
+		return;
+	for (i = 0; i < ORIGIN_CHECKS; i++)
+		free(ob->checks[i]);
+	if (ob->conf != NULL)
+		config_delete(ob->conf);
+	free(ob);
+}
+
+#define UNMASK_BENCH(impl, name, size) \
+	{ "unmask/" name "/" #size, impl, size, \
+		unmask_setup, unmask_run, unmask_teardown, 0, NULL }
+#define WSMSG_BENCH(name, size) \
+	{ "wsmsg/chunk=" name, 0, size, \
+		wsmsg_setup, wsmsg_run, wsmsg_teardown, 0, NULL }
+#define FRAMER_BENCH(name, engine, run) \
+	{ "framer/" name, engine, 1460, \
+		framer_setup, run, framer_teardown, 0, NULL }
+
+static bench_t benchmarks[] =
+{
+	UNMASK_BENCH(UNMASK_IMPL_SCALAR, "scalar", 64),
+	UNMASK_BENCH(UNMASK_IMPL_SCALAR, "scalar", 4096),
+	UNMASK_BENCH(UNMASK_IMPL_WORD, "word", 64),
+	UNMASK_BENCH(UNMASK_IMPL_WORD, "word", 4096),
+	UNMASK_BENCH(UNMASK_IMPL_SSE2, "sse2", 64),
+	UNMASK_BENCH(UNMASK_IMPL_SSE2, "sse2", 4096),
+	UNMASK_BENCH(UNMASK_IMPL_AVX2, "avx2", 64),
+	UNMASK_BENCH(UNMASK_IMPL_AVX2, "avx2", 4096),
+	WSMSG_BENCH("1", 1),
+	WSMSG_BENCH("16", 16),
+	WSMSG_BENCH("1460", 1460),
+	WSMSG_BENCH("16384", 16384),
+	WSMSG_BENCH("all", 0),
+	FRAMER_BENCH("expat/get_frame2", FRAMER_EXPAT, framer_run),
+	FRAMER_BENCH("expat/get_frame_ref", FRAMER_EXPAT, framer_ref_run),
+	FRAMER_BENCH("scanner/get_frame2", FRAMER_SCANNER, framer_run),
+	FRAMER_BENCH("scanner/get_frame_ref", FRAMER_SCANNER, framer_ref_run),
+	{ "rq/add_line+analyze", 0, 0, rq_setup, rq_run, rq_teardown, 0, NULL },
+	{ "rq/parse+analyze", 1, 0, rq_setup, rq_run, rq_teardown, 0, NULL },
+	{ "base64/encode/20", 0, 20,
+		base64_setup, base64_run, base64_teardown, 0, NULL },
+	{ "base64/encode/4096", 0, 4096,
+		base64_setup, base64_run, base64_teardown, 0, NULL },
+	{ "origin/linear/1000", 0, 1000,
+		origin_setup, origin_run, origin_teardown, 0, NULL },
+	{ "origin/compiled/1000", 1, 1000,
+		origin_setup, origin_run, origin_teardown, 0, NULL },
+};
+
+#define BENCHMARK_COUNT (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+struct params_t
+{
+	int json;
+	int list;
+	double time_ms;  /* target time of one measurement */
+	int repeat;
+	unsigned long iterations; /* fixed count instead of calibrating */
+};
+
+static void
+usage(char *prog)
+{
+	fprintf(stderr, "Usage: %s <options> [benchmark ...]\n", prog);
+	fprintf(stderr,
+"Runs the benchmarks whose names contain one of the given strings\n"
+"(all of them by default).\n"
+"Options:\n"
+"  --json, -j                          - Print the results as JSON\n"
+"  --list, -l                          - List the benchmarks\n"
+"  --time, -t <ms>                     - Time of one measurement\n"
+"                                        (default is 200)\n"
+"  --repeat, -r <n>                    - Measurements per benchmark,\n"
+"                                        the median is reported\n"
+"                                        (default is 5)\n"
+"  --iterations, -i <n>                - Fixed iteration count instead\n"
+"                                        of calibrating it\n"
+"  --help, -h                          - Help message\n"
+	);
+
+	exit(0);
+}
+
+static int
+parse_params(int argc, char **argv, struct params_t *params)
+{
+	int c;
+
+	memset( params, 0, sizeof(struct params_t) );
+	params->time_ms = 200;
+	params->repeat = 5;
+	while (1)
+	{
+		int option_index = 0;
+		static struct option long_options[] =
+			{
+				{"json",       0, 0, 'j'},
+				{"list",       0, 0, 'l'},
+				{"time",       1, 0, 't'},
+				{"repeat",     1, 0, 'r'},
+				{"iterations", 1, 0, 'i'},
+				{"help",       0, 0, 'h'},
+				{0, 0, 0, 0}
+			};
+
+		c = getopt_long(argc, argv, "jlt:r:i:h",
+			long_options, &option_index);
+		if (c == -1)
+			break;
+
+		switch (c) {
+			case 'j':
+				params->json = 1;
+				break;
+			case 'l':
+				params->list = 1;
+				break;
+			case 't':
+				params->time_ms = atof(optarg);
+				break;
+			case 'r':
+				params->repeat = atoi(optarg);
+				break;
+			case 'i':
+				params->iterations = strtoul(optarg, NULL, 10);
+				break;
+			case 'h':
+			case '?': /* invalid option */
+				usage(argv[0]);
+				break;
+		}
+	}
+	if ( (params->time_ms <= 0) || (params->repeat < 1) )
+		usage(argv[0]);
+	return 1;
+}
+
+static int
+bench_selected(bench_t *bench, int argc, char **argv)
+{
+	int i;
+
+	if (optind >= argc)
+		return 1;
+	for (i = optind; i < argc; i++)
+	{
+		if (strstr(bench->name, argv[i]) != NULL)
+			return 1;
+	}
+	return 0;
+}
+
+/* measure runs iterations operations and returns the time in ns; the
+   allocations made are added to *allocs */
+static double
+measure(bench_t *bench, unsigned long iterations, unsigned long *allocs)
+{
+	unsigned long before;
+	double start;
+
+	before = allocations;
+	start = now_ns();
+	bench->run(bench, iterations);
+	start = now_ns() - start;
+	*allocs = allocations - before;
+	return start;
+}
+
+static int
+compare_double(const void *a, const void *b)
+{
+	double x = *(const double*) a, y = *(const double*) b;
+
+	return (x > y) - (x < y);
+}
+
+static void
+bench_run(bench_t *bench, struct params_t *params, result_t *result)
+{
+	unsigned long iterations, allocs;
+	double ns, *samples;
+	int i;
+
+	/* Warm up, then grow the iteration count until one measurement
+	   takes the target time */
+	iterations = params->iterations;
+	if (iterations == 0)
+	{
+		iterations = 1;
+		while (1)
+		{
+			ns = measure(bench, iterations, &allocs);
+			if ( (ns >= params->time_ms * 1e6) || (iterations >= 1UL << 40) )
+				break;
+			if (ns < params->time_ms * 1e5)
+				iterations *= 10;
+			else
+				iterations = iterations * (params->time_ms * 1e6 / ns) + 1;
+		}
+	}
+	else
+		measure(bench, iterations, &allocs);
+
+	samples = (double*) malloc(params->repeat * sizeof(double));
+	if (samples == NULL)
+		bench_fail(bench, "out of memory");
+	for (i = 0; i < params->repeat; i++)
+		samples[i] = measure(bench, iterations, &allocs);
+	qsort(samples, params->repeat, sizeof(double), compare_double);
+	ns = samples[params->repeat / 2];
+	free(samples);
+
+	result->iterations = iterations;
+	result->ns_per_op = ns / iterations;
+	result->bytes_per_sec = bench->bytes * 1e9 / result->ns_per_op;
+	result->allocs_per_op = BENCH_COUNT_ALLOCATIONS ?
+		(double) allocs / iterations : -1;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct params_t params;
+	result_t result;
+	bench_t *bench;
+	size_t i;
+	int first = 1;
+
+	parse_params(argc, argv, &params);
+	unmask_init();
+
+	if (params.list)
+	{
+		for (i = 0; i < BENCHMARK_COUNT; i++)
+			printf("%s\n", benchmarks[i].name);
+		return 0;
+	}
+
+	if (params.json)
+		printf("{\n  \"version\": \"%d.%d.%d\",\n"
+			"  \"count_allocations\": %s,\n  \"benchmarks\": [",
+			jabsocket_VERSION_MAJOR, jabsocket_VERSION_MINOR,
+			jabsocket_VERSION_PATCH,
+			BENCH_COUNT_ALLOCATIONS ? "true" : "false");
+	else
+		printf("%-32s %12s %14s %12s %12s\n", "benchmark", "iterations",
+			"ns/op", "MB/s", "allocs/op");
+
+	for (i = 0; i < BENCHMARK_COUNT; i++)
+	{
+		bench = &benchmarks[i];
+		if (!bench_selected(bench, argc, argv))
+			continue;
+		if (!bench->setup(bench))
+		{
+			bench->teardown(bench);
+			if (!params.json)
+				printf("%-32s %12s\n", bench->name, "skipped");
+			continue;
+		}
+		bench_run(bench, &params, &result);
+		bench->teardown(bench);
+
+		if (params.json)
+		{
+			printf("%s\n    {\"name\": \"%s\", \"iterations\": %lu, "
+				"\"ns_per_op\": %.3f, \"bytes_per_op\": %lu, "
+				"\"bytes_per_sec\": %.0f, \"allocs_per_op\": %.3f}",
+				first ? "" : ",", bench->name, result.iterations,
+				result.ns_per_op, (unsigned long) bench->bytes,
+				result.bytes_per_sec, result.allocs_per_op);
+			first = 0;
+		}
+		else
+		{
+			printf("%-32s %12lu %14.1f ", bench->name,
+				result.iterations, result.ns_per_op);
+			if (bench->bytes == 0)
+				printf("%12s ", "-");
+			else
+				printf("%12.1f ", result.bytes_per_sec / 1e6);
+			if (result.allocs_per_op < 0)
+				printf("%12s\n", "-");
+			else
+				printf("%12.2f\n", result.allocs_per_op);
+		}
+		fflush(stdout);
+	}
+	if (params.json)
+		printf("\n  ]\n}\n");
+	return 0;
+}
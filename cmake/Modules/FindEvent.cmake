@@ -8,13 +8,15 @@
 # and following variables are set:
 #    EVENT_INCLUDE_DIR
 #    EVENT_LIBRARY
+#    EVENT_OPENSSL_LIBRARY (bufferevents over OpenSSL)
 
 FIND_PATH(EVENT_INCLUDE_DIR event.h)
 FIND_LIBRARY(EVENT_LIBRARY NAMES event libevent)
+FIND_LIBRARY(EVENT_OPENSSL_LIBRARY NAMES event_openssl libevent_openssl)
 
-IF (EVENT_INCLUDE_DIR AND EVENT_LIBRARY)
+IF (EVENT_INCLUDE_DIR AND EVENT_LIBRARY AND EVENT_OPENSSL_LIBRARY)
    SET(EVENT_FOUND TRUE)
-ENDIF (EVENT_INCLUDE_DIR AND EVENT_LIBRARY)
+ENDIF (EVENT_INCLUDE_DIR AND EVENT_LIBRARY AND EVENT_OPENSSL_LIBRARY)
 
 
 IF (EVENT_FOUND)
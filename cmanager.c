@@ -1,18 +1,48 @@
+#define _GNU_SOURCE /* memmem */
 #include "cmanager.h"
 #include <stdio.h>
 #include <string.h>
 #include <event2/dns.h>
 #include <event2/buffer.h>
+#include <event2/bufferevent_ssl.h>
 #include <errno.h>
+#include <netinet/in.h>
+#include <event2/util.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include "tlsclient.h"
+#include "log.h"
 
+#define XMPP_NS_TLS "urn:ietf:params:xml:ns:xmpp-tls"
+
+/* Sessions are counted by state in metrics_t, see METRICS_SESSION_STATES */
 typedef enum _cm_state_t
 {
 	ST_START,   /* Receiving initial <stream> element from browser */
 	ST_CONNECT, /* Connecting with XMPP server */
-	ST_FORWARD  /* Forwarding from browser to XMPP server and vice versa */
+	ST_FORWARD, /* Forwarding from browser to XMPP server and vice versa */
+	ST_CLOSED   /* Connection with XMPP server closed */
 } cm_state_t;
 
+/* STARTTLS negotiation with the XMPP server (xmpp_tls), in ST_CONNECT */
+enum
+{
+	STARTTLS_NONE,      /* not started (or the server doesn't offer it) */
+	STARTTLS_FEATURES,  /* waiting for the server's stream features */
+	STARTTLS_PROCEED,   /* <starttls/> sent, waiting for <proceed/> */
+	STARTTLS_HANDSHAKE, /* TLS handshake */
+	STARTTLS_DONE       /* the stream runs over TLS */
+};
+
 
+static void cm_resolved(int result, struct sockaddr *address,
+	socklen_t address_size, void *arg);
+static void cm_srv_resolved(int result, srv_record_t *records, size_t count,
+	void *arg);
+static void cm_connect_backend(cmanager_t *cm);
+static void cm_starttls(cmanager_t *cm);
+static void cm_write_batch(cmanager_t *cm);
+static void cm_set_state(cmanager_t *cm, int state);
 static void cm_onmessage(
 	cmanager_t *cm,
 	unsigned char *message,
@@ -26,19 +56,22 @@ cm_create(wsconn_t *conn)
 	if (cm != NULL)
 	{
 		cm->conn = conn;
+		cm->worker = (worker_t*) conn->cb_ctx;
 		cm->state = ST_START;
-		cm->parser = streamparser_create();
+		cm->parser = streamparser_create_pooled(cm->worker->xmlpool);
 		if (cm->parser == NULL)
 			goto Error;
 		cm->server = NULL;
 		cm->bev = NULL;
-		cm->dnsbase = NULL;
+		cm->dns_waiter = NULL;
 		cm->buffer = buffer_create(0); /* TODO: limited size buffer */
 		if (cm->buffer == NULL)
 			goto Error;
-		cm->framer = framer_create();
+		cm->framer = framer_create_engine(cm->worker->conf->framer_engine,
+			cm->worker->xmlpool);
 		if (cm->framer == NULL)
 			goto Error;
+		metric_add(&cm->worker->metrics.sessions[ST_START], 1);
 		return cm;
 	}
 
@@ -56,6 +89,8 @@ Error:
 int
 cm_reset(cmanager_t *cm)
 {
+	if (cm->parser == NULL)
+		return 0;
 	return streamparser_reset(cm->parser);
 }
 
@@ -64,12 +99,24 @@ cm_delete(void *ctx)
 {
 	cmanager_t *cm = (cmanager_t*) ctx;
 	cm_close(ctx);
+	metric_sub(&cm->worker->metrics.sessions[cm->state], 1);
 	free(cm);
 }
 
+/* cm_set_state moves the session to another state, keeping the number
+   of sessions in each state up to date */
+static void
+cm_set_state(cmanager_t *cm, int state)
+{
+	metric_sub(&cm->worker->metrics.sessions[cm->state], 1);
+	metric_add(&cm->worker->metrics.sessions[state], 1);
+	cm->state = state;
+}
+
 void
 cm_close(cmanager_t *cm)
 {
+	cm_set_state(cm, ST_CLOSED);
 	if (cm->framer != NULL)
 	{
 		framer_delete(cm->framer);
@@ -87,19 +134,39 @@ cm_close(cmanager_t *cm)
 	}
 	if (cm->bev != NULL)
 	{
+		/* Without close_notify, OpenSSL marks the session as not
+		   resumable when the SSL object is freed */
+		if (cm->starttls == STARTTLS_DONE)
+			SSL_shutdown(bufferevent_openssl_get_ssl(cm->bev));
 		bufferevent_free(cm->bev);
 		cm->bev = NULL;
 	}
-	if (cm->dnsbase != NULL)
+	cm->starttls = STARTTLS_NONE;
+	if (cm->dns_waiter != NULL)
 	{
-		evdns_base_free(cm->dnsbase, 1);
-		cm->dnsbase = NULL;
+		dnscache_cancel(cm->dns_waiter);
+		cm->dns_waiter = NULL;
+	}
+	if (cm->backend != NULL)
+	{
+		backend_release(cm->backend);
+		cm->backend = NULL;
 	}
 	if (cm->server != NULL)
 	{
 		free(cm->server);
 		cm->server = NULL;
 	}
+	if (cm->from != NULL)
+	{
+		free(cm->from);
+		cm->from = NULL;
+	}
+	if (cm->srv_target != NULL)
+	{
+		free(cm->srv_target);
+		cm->srv_target = NULL;
+	}
 }
 
 static void
@@ -175,12 +242,19 @@ cm_onmessage(cmanager_t *cm, unsigned char *message, size_t message_length)
 				server = streamparser_get_server(cm->parser);
 				// printf("Got server: %s\n", server);
 				cm->server = strdup(server);
+				if (streamparser_get_from(cm->parser) != NULL)
+					cm->from = strdup(streamparser_get_from(cm->parser));
+				/* The stream header has been seen, the parser can go back
+				   to the worker's pool. */
+				streamparser_delete(cm->parser);
+				cm->parser = NULL;
+				cm_set_state(cm, ST_CONNECT);
 				cm_connect(cm);
-				cm->state = ST_CONNECT;
 			}
 			break;
 		case ST_FORWARD:
 			bufferevent_write(cm->bev, message, message_length);
+			metrics_observe(&cm->worker->metrics.to_xmpp, cm->conn->read_time);
 			// show_bytes(message, message_length);
 			break;
 	}
@@ -189,8 +263,149 @@ cm_onmessage(cmanager_t *cm, unsigned char *message, size_t message_length)
 void
 cm_connect(cmanager_t *cm)
 {
-	/* Initiate conect with cm->server via cm->bev */
+	jsconf_t *conf = cm->worker->conf;
+	dnscache_t *cache = cm->worker->dnscache;
+
+	/* Find the XMPP server of cm->server: a server of its pool of static
+	   servers from the configuration, the target of an SRV record, or the
+	   domain itself. Names are resolved through the worker's DNS cache;
+	   cm_resolved initiates the connection. */
+	cm->started = metrics_now();
+	cm->port = conf->xmpp_port;
+	cm->pool = poolset_find(cm->worker->pools, cm->server);
+	if (cm->pool != NULL)
+	{
+		cm_connect_backend(cm);
+	}
+	else if (conf->xmpp_srv && srv_applicable(cm->server))
+	{
+		cm->dns_waiter = dnscache_resolve_srv(cache, cm->server,
+			cm_srv_resolved, cm);
+	}
+	else
+	{
+		cm->dns_waiter = dnscache_resolve(cache, cm->server, cm_resolved, cm);
+	}
+}
+
+/* cm_connect_backend sends the session to a server of its pool that it
+   hasn't tried yet */
+static void
+cm_connect_backend(cmanager_t *cm)
+{
+	backend_t *backend;
+	const char *key;
+
+	key = cm->conn->host;
+	if ( (cm->worker->pools->balance == BALANCE_HASH_JID) &&
+		(cm->from != NULL) )
+		key = cm->from;
+	backend = pool_select(cm->pool, key, cm->tried);
+	if (backend == NULL)
+	{
+		LOG(LOG_WARNING, "cmanager.c:cm_connect_backend: no XMPP server of "
+			"%s left to try", cm->server);
+		wsconn_onclosed(cm->conn);
+		cm_close(cm);
+		return;
+	}
+	if (cm->tried != 0)
+		metric_add(&cm->worker->metrics.xmpp_failovers, 1);
+	cm->tried |= (uint64_t) 1 << backend->index;
+	cm->backend = backend;
+	backend_acquire(backend);
+	cm->port = backend->port;
+	cm->dns_waiter = dnscache_resolve(cm->worker->dnscache, backend->host,
+		cm_resolved, cm);
+}
+
+/* cm_failed handles a failed lookup of or connection to the XMPP server:
+   a session with a pool is retried on another server of the pool, other
+   sessions are closed */
+static void
+cm_failed(cmanager_t *cm)
+{
+	if (cm->bev != NULL)
+	{
+		bufferevent_free(cm->bev);
+		cm->bev = NULL;
+	}
+	if (cm->starttls != STARTTLS_NONE)
+	{
+		/* The next server gets the stream header again */
+		cm->starttls = STARTTLS_NONE;
+		framer_reset(cm->framer);
+	}
+	if (cm->backend != NULL)
+	{
+		backend_failed(cm->backend);
+		backend_release(cm->backend);
+		cm->backend = NULL;
+		cm_connect_backend(cm);
+		return;
+	}
+	wsconn_onclosed(cm->conn);
+	cm_close(cm);
+}
+
+static void
+cm_srv_resolved(int result, srv_record_t *records, size_t count, void *arg)
+{
+	cmanager_t *cm = (cmanager_t*) arg;
+	srv_record_t *record;
+	unsigned int random;
+
+	cm->dns_waiter = NULL;
+	if (!result)
+	{
+		/* No SRV records, connect to the domain itself (RFC 6120,
+		   section 3.2.2) */
+		cm->dns_waiter = dnscache_resolve(cm->worker->dnscache, cm->server,
+			cm_resolved, cm);
+		return;
+	}
+
+	evutil_secure_rng_get_bytes(&random, sizeof(random));
+	record = &records[srv_select(records, count, random)];
+	cm->port = record->port;
+	/* records belong to the cache and may go away with the next lookup */
+	free(cm->srv_target);
+	cm->srv_target = strdup(record->target);
+	if (cm->srv_target == NULL)
+	{
+		cm_failed(cm);
+		return;
+	}
+	LOG(LOG_DEBUG, "cmanager.c:cm_srv_resolved: XMPP server of %s is %s:%d",
+		cm->server, cm->srv_target, cm->port);
+	cm->dns_waiter = dnscache_resolve(cm->worker->dnscache, cm->srv_target,
+		cm_resolved, cm);
+}
+
+static void
+cm_resolved(int result, struct sockaddr *address, socklen_t address_size,
+	void *arg)
+{
+	cmanager_t *cm = (cmanager_t*) arg;
 	struct event_base *base;
+	struct sockaddr_storage server_address;
+	struct timeval timeout;
+
+	cm->dns_waiter = NULL;
+	if (!result)
+	{
+		LOG(LOG_WARNING, "cmanager.c:cm_resolved: couldn't resolve %s",
+			(cm->backend != NULL) ? cm->backend->host : cm->server);
+		metric_add(&cm->worker->metrics.dns_failures, 1);
+		goto Error;
+	}
+	metrics_observe(&cm->worker->metrics.dns, cm->started);
+
+	memcpy(&server_address, address, address_size);
+	if (server_address.ss_family == AF_INET)
+		((struct sockaddr_in*) &server_address)->sin_port = htons(cm->port);
+	else if (server_address.ss_family == AF_INET6)
+		((struct sockaddr_in6*) &server_address)->sin6_port = htons(cm->port);
 
 	base = cm->conn->wsserver->base;
 	cm->bev = bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE);
@@ -198,29 +413,36 @@ cm_connect(cmanager_t *cm)
 		goto Error;
 	bufferevent_setcb(cm->bev, cm_readcb, NULL, cm_eventcb, cm);
 	bufferevent_enable(cm->bev, EV_READ|EV_WRITE);
-	
-	cm->dnsbase = evdns_base_new(base, 1);
-	if (cm->dnsbase == NULL)
-		goto Error;
+	if (cm->worker->conf->xmpp_connect_timeout > 0)
+	{
+		/* The write timeout covers connecting; cm_eventcb removes it */
+		timeout.tv_sec = cm->worker->conf->xmpp_connect_timeout;
+		timeout.tv_usec = 0;
+		bufferevent_set_timeouts(cm->bev, NULL, &timeout);
+	}
 
-	/* TODO: how do we get a nonstandard XMPP port (not 5222)? */
-	if (bufferevent_socket_connect_hostname(cm->bev,
-		cm->dnsbase, AF_UNSPEC, cm->server, 5222) < 0)
-			goto Error;
+	cm->started = metrics_now();
+	if (bufferevent_socket_connect(cm->bev,
+		(struct sockaddr*) &server_address, address_size) < 0)
+	{
+		metric_add(&cm->worker->metrics.xmpp_connect_failures, 1);
+		goto Error;
+	}
+	return;
 
 Error:
-	return;
+	cm_failed(cm);
 }
 
 static int
-is_prefix(char *prefix, char *str)
+is_prefix(const char *prefix, const unsigned char *data, size_t length)
 {
 	size_t n;
 
-	if (strlen(prefix) > strlen(str))
-		return 0;
 	n = strlen(prefix);
-	return (strncmp(str, prefix, n) == 0);
+	if (n > length)
+		return 0;
+	return (memcmp(data, prefix, n) == 0);
 }
 
 void
@@ -228,63 +450,368 @@ cm_readcb(struct bufferevent *bev, void *ptr)
 {
 	cmanager_t *cm = (cmanager_t*) ptr;
 	struct evbuffer *input = bufferevent_get_input(bev);
-	char buf[1025]; /* Buffer for 1024 characters + null termination */
-	int n;
+	struct evbuffer_iovec vec[8];
+	int n, i;
 	int res;
 	int begin = 1;
-	data_t data;
-	static byte data_buffer[65536];
-
-	data_init( &data, data_buffer, sizeof(data_buffer) );
+	size_t consumed;
+	byte *frame;
+	size_t frame_size;
+	uint64_t arrival = metrics_now();
 
-	while ((n = evbuffer_remove(input, buf, 1024)) > 0)
+	/* Feed the framer directly from the input evbuffer's chains instead of
+	   copying through an intermediate buffer first. */
+	while ( (n = evbuffer_peek(input, -1, NULL, vec, 8)) > 0 )
 	{
-		// printf("\nParsing data from XMPP server:\n");
-		// show_bytes((unsigned char *) buf, n);
+		if (n > 8)
+			n = 8;
+		consumed = 0;
+		for (i = 0; i < n; i++)
+		{
+			unsigned char *chunk = (unsigned char*) vec[i].iov_base;
+
+			/* If the stream is restarted (after TLS negotiation or
+			   authentication, reset the framer. */
+			if (begin &&
+				( is_prefix("<?xml", chunk, vec[i].iov_len) ||
+				  is_prefix("<stream:stream", chunk, vec[i].iov_len) ) )
+			{
+				framer_reset(cm->framer);
+			}
 
-		/* If the stream is restarted (after TLS negotiation or
-		   authentication, reset the framer. */
-		buf[n] = '\0'; /* Add null byte at the end of string, just in case. */
-		if (begin && 
-			( is_prefix("<?xml", buf) ||
-			  is_prefix("<stream:stream", buf) ) )
+			res = framer_add(cm->framer, chunk, vec[i].iov_len);
+			begin = 0;
+			consumed += vec[i].iov_len;
+			if (!res)
+			{
+				evbuffer_drain(input, consumed);
+				return; /* TODO: set error */
+			}
+		}
+		evbuffer_drain(input, consumed);
+	}
+	if (cm->state == ST_CONNECT)
+	{
+		/* Negotiating STARTTLS, the server's stanzas are for jabsocket */
+		cm_starttls(cm);
+		if (cm->state != ST_FORWARD)
+			return;
+	}
+	if (cm->worker->conf->coalesce_writes)
+		cm_write_batch(cm);
+	else
+	{
+		/* Stanzas go from the framer's buffer to the browser's output
+		   buffer with a single copy, whatever their size. */
+		while ( framer_get_frame_ref(cm->framer, &frame, &frame_size) )
 		{
-			framer_reset(cm->framer);
+			LOG(LOG_DEBUG, "cmanager.c:cm_readcb: stanza of %lu bytes",
+				(unsigned long) frame_size);
+			metric_add(&cm->worker->metrics.stanzas, 1);
+			wsconn_write(cm->conn, frame, frame_size);
 		}
+	}
+	wsconn_mark_output(cm->conn, arrival);
+}
+
+/* cm_write_batch writes all stanzas the framer has ready as WebSocket
+   frames (still one stanza per message) with a single reservation in the
+   browser's output buffer. */
+static void
+cm_write_batch(cmanager_t *cm)
+{
+	worker_t *worker = cm->worker;
+	frame_t *frame;
+	size_t total = 0;
+	size_t frame_size;
+	wsbatch_t batch;
+	byte *data;
+
+	for (frame = cm->framer->head; frame != NULL; frame = frame->next)
+		total += wsbatch_frame_size(frame->size);
+	if (total == 0)
+		return;
+	if ( !wsbatch_begin(cm->conn, &batch, total) )
+		return;
+	while ( framer_get_frame_ref(cm->framer, &data, &frame_size) )
+		memcpy(wsbatch_add(&batch, frame_size), data, frame_size);
+	wsbatch_end(cm->conn, &batch);
+
+	metric_add(&worker->metrics.stanzas, batch.frames);
+	histogram_record(&worker->metrics.write_batch, batch.frames);
+}
+
+/* cm_server_name names the XMPP server of the session in log messages */
+static const char *
+cm_server_name(cmanager_t *cm)
+{
+	if (cm->backend != NULL)
+		return cm->backend->metrics->server;
+	if (cm->srv_target != NULL)
+		return cm->srv_target;
+	return cm->server;
+}
+
+/* cm_negotiation_timeout limits the time the XMPP server has to answer
+   while STARTTLS is negotiated; like connecting, it may take at most
+   xmpp_connect_timeout seconds */
+static void
+cm_negotiation_timeout(cmanager_t *cm)
+{
+	struct timeval timeout;
+
+	if (cm->worker->conf->xmpp_connect_timeout > 0)
+	{
+		timeout.tv_sec = cm->worker->conf->xmpp_connect_timeout;
+		timeout.tv_usec = 0;
+		bufferevent_set_timeouts(cm->bev, &timeout, NULL);
+	}
+	else
+		bufferevent_set_timeouts(cm->bev, NULL, NULL);
+}
+
+/* cm_is_element checks if a frame is an element called name, with any
+   namespace prefix */
+static int
+cm_is_element(const byte *data, size_t size, const char *name)
+{
+	size_t i, start, length = strlen(name);
+
+	if ( (size == 0) || (data[0] != '<') )
+		return 0;
+	start = 1;
+	for (i = 1; (i < size) && (strchr(" \t\r\n/>", data[i]) == NULL); i++)
+	{
+		if (data[i] == ':')
+			start = i + 1;
+	}
+	return (i - start == length) && (memcmp(data + start, name, length) == 0);
+}
+
+/* cm_start_tls starts the TLS handshake with the XMPP server after it
+   answered <starttls/> with <proceed/> */
+static void
+cm_start_tls(cmanager_t *cm)
+{
+	struct event_base *base = cm->conn->wsserver->base;
+	evutil_socket_t fd;
+	const char *host;
+	SSL *ssl;
+
+	host = (cm->backend != NULL) ? cm->backend->host :
+		(cm->srv_target != NULL) ? cm->srv_target : cm->server;
+	ssl = tlsclient_new_ssl(cm->worker->tls, cm->server, host, cm->port);
+	if (ssl == NULL)
+		goto Error;
+
+	/* The socket moves to a bufferevent that runs OpenSSL on it directly;
+	   a filter on top of the plain bufferevent would copy every stanza
+	   once more. Without its socket, the plain bufferevent doesn't close
+	   it when it is freed. */
+	fd = bufferevent_getfd(cm->bev);
+	bufferevent_setfd(cm->bev, -1);
+	bufferevent_free(cm->bev);
+	cm->bev = bufferevent_openssl_socket_new(base, fd, ssl,
+		BUFFEREVENT_SSL_CONNECTING, BEV_OPT_CLOSE_ON_FREE);
+	if (cm->bev == NULL)
+	{
+		SSL_free(ssl);
+		evutil_closesocket(fd);
+		goto Error;
+	}
+	/* Many servers close the connection without a TLS close_notify */
+	bufferevent_openssl_set_allow_dirty_shutdown(cm->bev, 1);
+	bufferevent_setcb(cm->bev, cm_readcb, NULL, cm_eventcb, cm);
+	bufferevent_enable(cm->bev, EV_READ|EV_WRITE);
+	cm_negotiation_timeout(cm);
+	cm->starttls = STARTTLS_HANDSHAKE;
+	return;
+
+Error:
+	LOG(LOG_WARNING, "cmanager.c:cm_start_tls: couldn't start TLS with "
+		"XMPP server %s", cm_server_name(cm));
+	metric_add(&cm->worker->metrics.xmpp_tls_failures, 1);
+	cm_failed(cm);
+}
 
-		res = framer_add(cm->framer, (unsigned char *) buf, n);
-		begin = 0;
-		if (!res)
-			return; /* TODO: set error */
+/* cm_starttls negotiates STARTTLS (RFC 6120, section 5.4) with the XMPP
+   server on behalf of the browser. The browser's stream header has been
+   sent; the server's stream header and features and its answer to
+   <starttls/> are consumed here, so the browser only sees the stream that
+   is opened again over TLS. */
+static void
+cm_starttls(cmanager_t *cm)
+{
+	byte *data;
+	size_t size;
+
+	if (cm->starttls == STARTTLS_FEATURES)
+	{
+		/* The features follow the server's stream header */
+		if (!framer_peek_frame(cm->framer, 1, &data, &size))
+			return;
+		if ( cm_is_element(data, size, "features") &&
+			(memmem(data, size, XMPP_NS_TLS, strlen(XMPP_NS_TLS)) != NULL) )
+		{
+			framer_get_frame_ref(cm->framer, &data, &size);
+			framer_get_frame_ref(cm->framer, &data, &size);
+			bufferevent_write(cm->bev, "<starttls xmlns='" XMPP_NS_TLS "'/>",
+				strlen("<starttls xmlns='" XMPP_NS_TLS "'/>"));
+			cm->starttls = STARTTLS_PROCEED;
+			return;
+		}
+		if (cm->worker->conf->xmpp_tls == XMPP_TLS_REQUIRED)
+		{
+			LOG(LOG_WARNING, "cmanager.c:cm_starttls: XMPP server %s doesn't "
+				"offer STARTTLS", cm_server_name(cm));
+			metric_add(&cm->worker->metrics.xmpp_tls_failures, 1);
+			cm_failed(cm);
+			return;
+		}
+		/* The stream goes on in the clear, beginning with the server's
+		   stream header and features */
+		bufferevent_set_timeouts(cm->bev, NULL, NULL);
+		buffer_remove_data(cm->buffer, buffer_get_length(cm->buffer));
+		cm->starttls = STARTTLS_NONE;
+		cm_set_state(cm, ST_FORWARD);
 	}
-	while (framer_has_frame(cm->framer))
+	else if (cm->starttls == STARTTLS_PROCEED)
 	{
-		size_t frame_size;
-		framer_get_frame2(cm->framer, &data, &frame_size);
-		wsconn_write( cm->conn, data_get_buffer(&data), data_get_length(&data) );
+		if (!framer_get_frame_ref(cm->framer, &data, &size))
+			return;
+		if (!cm_is_element(data, size, "proceed"))
+		{
+			LOG(LOG_WARNING, "cmanager.c:cm_starttls: XMPP server %s refused "
+				"STARTTLS", cm_server_name(cm));
+			metric_add(&cm->worker->metrics.xmpp_tls_failures, 1);
+			cm_failed(cm);
+			return;
+		}
+		cm_start_tls(cm);
 	}
 }
 
+/* cm_tls_established opens the stream again over TLS (RFC 6120, section
+   5.4.3.3) with the browser's stream header; from here on, everything the
+   server sends goes to the browser */
+static void
+cm_tls_established(cmanager_t *cm)
+{
+	SSL *ssl = bufferevent_openssl_get_ssl(cm->bev);
+	unsigned char *data;
+	size_t length;
+
+	if (SSL_session_reused(ssl))
+		metric_add(&cm->worker->metrics.xmpp_tls_resumed, 1);
+	else
+		metric_add(&cm->worker->metrics.xmpp_tls_full, 1);
+	LOG(LOG_DEBUG, "cmanager.c:cm_tls_established: %s with XMPP server %s, "
+		"%s, %s handshake", SSL_get_version(ssl), cm_server_name(cm),
+		SSL_get_cipher_name(ssl), SSL_session_reused(ssl) ? "resumed" : "full");
+
+	bufferevent_set_timeouts(cm->bev, NULL, NULL);
+	framer_reset(cm->framer);
+	buffer_peek_data(cm->buffer, &data, &length);
+	bufferevent_write(cm->bev, data, length);
+	buffer_remove_data(cm->buffer, length);
+	cm->starttls = STARTTLS_DONE;
+	cm_set_state(cm, ST_FORWARD);
+}
+
+/* cm_tls_error describes why the STARTTLS negotiation failed */
+static const char *
+cm_tls_error(cmanager_t *cm, short events, char *buf, size_t size)
+{
+	unsigned long error;
+	long result;
+
+	if (events & BEV_EVENT_TIMEOUT)
+		return "timeout";
+	if (cm->starttls == STARTTLS_HANDSHAKE)
+	{
+		result = SSL_get_verify_result(bufferevent_openssl_get_ssl(cm->bev));
+		if (result != X509_V_OK)
+			return X509_verify_cert_error_string(result);
+		error = bufferevent_get_openssl_error(cm->bev);
+		if (error != 0)
+		{
+			ERR_error_string_n(error, buf, size);
+			return buf;
+		}
+	}
+	if (events & BEV_EVENT_EOF)
+		return "connection closed";
+	return evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR());
+}
+
 void
 cm_eventcb(struct bufferevent *bev, short events, void *ptr)
 {
 	cmanager_t *cm = (cmanager_t*) ptr;
 	unsigned char *data;
 	size_t length;
+	char error[256];
 
 	if (events & BEV_EVENT_CONNECTED)
 	{
+		if (cm->starttls == STARTTLS_HANDSHAKE)
+		{
+			cm_tls_established(cm);
+			return;
+		}
 		buffer_peek_data(cm->buffer, &data, &length);
 		bufferevent_write(bev, data, length);
+		metrics_observe(&cm->worker->metrics.xmpp_connect, cm->started);
+		if (cm->worker->tls != NULL)
+		{
+			/* The stream header stays in the buffer, to be sent again
+			   over TLS */
+			cm_negotiation_timeout(cm);
+			cm->starttls = STARTTLS_FEATURES;
+			return;
+		}
+		bufferevent_set_timeouts(bev, NULL, NULL);
 		buffer_remove_data(cm->buffer, length);
-		cm->state = ST_FORWARD;
+		cm_set_state(cm, ST_FORWARD);
+		return;
+	}
+	/* A failed connection is retried on another server of the pool */
+	if ( (cm->state == ST_CONNECT) &&
+		(events & (BEV_EVENT_EOF | BEV_EVENT_ERROR | BEV_EVENT_TIMEOUT)) )
+	{
+		if (cm->starttls == STARTTLS_NONE)
+		{
+			metric_add(&cm->worker->metrics.xmpp_connect_failures, 1);
+			LOG(LOG_WARNING, "cmanager.c:cm_eventcb: couldn't connect to the "
+				"XMPP server %s: %s", cm_server_name(cm),
+				(events & BEV_EVENT_TIMEOUT) ? "timeout" :
+				evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+		}
+		else
+		{
+			metric_add(&cm->worker->metrics.xmpp_tls_failures, 1);
+			LOG(LOG_WARNING, "cmanager.c:cm_eventcb: STARTTLS with XMPP "
+				"server %s failed: %s", cm_server_name(cm),
+				cm_tls_error(cm, events, error, sizeof(error)));
+			/* The cached session may be what the server didn't like */
+			if (cm->starttls == STARTTLS_HANDSHAKE)
+				tlsclient_forget(cm->worker->tls,
+					bufferevent_openssl_get_ssl(bev));
+		}
+		cm_failed(cm);
 		return;
 	}
-	if (events & BEV_EVENT_ERROR)
+	/* The browser's connection is closed when the XMPP server closes its
+	   end as well as on errors */
+	if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR))
 	{
-		char *reason = "XMPP connection failed";
-		printf("   BEV_EVENT_ERROR: %s\n",
-			evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR() ) );
+		if (events & BEV_EVENT_ERROR)
+			LOG(LOG_WARNING, "cmanager.c:cm_eventcb: connection to XMPP "
+				"server %s failed: %s", cm_server_name(cm),
+				evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+		else
+			LOG(LOG_INFO, "cmanager.c:cm_eventcb: XMPP server %s closed "
+				"the connection", cm_server_name(cm));
 		wsconn_onclosed(cm->conn);
 		cm_close(cm);
 	}
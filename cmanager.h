@@ -4,17 +4,28 @@
 #include "wsserver.h"
 #include "streamparse.h"
 #include "framer.h"
+#include "worker.h"
+#include "pool.h"
 
 typedef struct _cmanager_t_
 {
 	int state;
 	wsconn_t *conn;
+	worker_t *worker; /* worker that owns the connection */
 	streamparser_t *parser;
 	char *server; /* URL of the XMPP server */
+	char *from; /* JID of the user from the stream header, may be NULL */
+	int port; /* port of the XMPP server */
+	pool_t *pool; /* pool of cm->server, NULL if it has none */
+	backend_t *backend; /* server of the pool the session is sent to */
+	uint64_t tried; /* servers of the pool tried so far, see pool_select */
+	char *srv_target; /* host name of the XMPP server from its SRV record */
+	int starttls; /* state of the STARTTLS negotiation (xmpp_tls) */
 	struct bufferevent *bev; /* bufferevent for connection with XMPP server */
-	struct evdns_base *dnsbase;
+	dnscache_waiter_t *dns_waiter; /* pending lookup of the XMPP server */
 	buffer_t *buffer;
 	framer_t *framer;
+	uint64_t started; /* start of the DNS lookup or connection (metrics_now) */
 } cmanager_t;
 
 void *cm_create(wsconn_t *conn);
@@ -2,6 +2,10 @@
 #include "CuTest.h"
 #include <string.h>
 #include "parseconfig.h"
+#include "framer.h"
+#include "pool.h"
+#include "tlsclient.h"
+#include "log.h"
 #include <stdio.h>
 #include <syslog.h>
 
@@ -43,6 +47,138 @@ void TestConfig(CuTest *tc)
 	config_delete(conf);
 }
 
+void TestConfigTuning(CuTest *tc)
+{
+	int res;
+	jsconf_t *conf;
+
+	/* Defaults */
+	conf = config_create();
+	CuAssertPtrNotNull(tc, conf);
+	CuAssertIntEquals(tc, 1, conf->workers);
+	CuAssertIntEquals(tc, 300, conf->dns_cache_ttl);
+	CuAssertIntEquals(tc, 30, conf->dns_negative_ttl);
+	CuAssertIntEquals(tc, 0, conf->reverse_dns);
+	CuAssertIntEquals(tc, 0, conf->coalesce_writes);
+	CuAssertIntEquals(tc, FRAMER_EXPAT, conf->framer_engine);
+	CuAssertIntEquals(tc, LOG_BACKEND_SYSLOG, conf->log_backend);
+	CuAssertIntEquals(tc, 1, conf->log_async);
+	CuAssertIntEquals(tc, LOG_DEFAULT_RING_SIZE, conf->log_ring_size);
+	CuAssertIntEquals(tc, 0, conf->metrics_port);
+	CuAssertPtrEquals(tc, NULL, conf->metrics_listen);
+	CuAssertIntEquals(tc, 5222, conf->xmpp_port);
+	CuAssertIntEquals(tc, 1, conf->xmpp_srv);
+	CuAssertPtrEquals(tc, NULL, conf->xmpp_servers);
+	CuAssertIntEquals(tc, BALANCE_LEAST_CONNECTIONS, conf->xmpp_balance);
+	CuAssertIntEquals(tc, 10, conf->xmpp_check_interval);
+	CuAssertIntEquals(tc, 2, conf->xmpp_check_timeout);
+	CuAssertIntEquals(tc, 10, conf->xmpp_connect_timeout);
+	CuAssertIntEquals(tc, XMPP_TLS_NO, conf->xmpp_tls);
+	CuAssertIntEquals(tc, 1, conf->xmpp_tls_verify);
+	CuAssertPtrEquals(tc, NULL, conf->xmpp_tls_ca_file);
+	CuAssertIntEquals(tc, TLSCLIENT_DEFAULT_CACHE_SIZE,
+		conf->xmpp_tls_session_cache);
+	config_delete(conf);
+
+	conf = config_create();
+	res = config_parse(conf, "./test/jabsocket-tuning.conf");
+	CuAssertTrue(tc, res);
+	CuAssertIntEquals(tc, 4, conf->workers);
+	CuAssertIntEquals(tc, 600, conf->dns_cache_ttl);
+	CuAssertIntEquals(tc, 10, conf->dns_negative_ttl);
+	CuAssertIntEquals(tc, 1, conf->reverse_dns);
+	CuAssertIntEquals(tc, 65536, conf->buffer_growth_limit);
+	CuAssertIntEquals(tc, 8192, conf->buffer_shrink_threshold);
+	CuAssertIntEquals(tc, 1, conf->coalesce_writes);
+	CuAssertIntEquals(tc, FRAMER_SCANNER, conf->framer_engine);
+	CuAssertIntEquals(tc, LOG_BACKEND_FILE, conf->log_backend);
+	CuAssertStrEquals(tc, "/var/log/jabsocket.log", conf->log_file);
+	CuAssertIntEquals(tc, 0, conf->log_async);
+	CuAssertIntEquals(tc, 4096, conf->log_ring_size);
+	CuAssertIntEquals(tc, 9100, conf->metrics_port);
+	CuAssertStrEquals(tc, "127.0.0.2", conf->metrics_listen);
+	CuAssertIntEquals(tc, 5223, conf->xmpp_port);
+	CuAssertIntEquals(tc, 0, conf->xmpp_srv);
+	CuAssertIntEquals(tc, BALANCE_HASH_JID, conf->xmpp_balance);
+	CuAssertIntEquals(tc, 5, conf->xmpp_check_interval);
+	CuAssertIntEquals(tc, 1, conf->xmpp_check_timeout);
+	CuAssertIntEquals(tc, 3, conf->xmpp_connect_timeout);
+	CuAssertIntEquals(tc, XMPP_TLS_REQUIRED, conf->xmpp_tls);
+	CuAssertIntEquals(tc, 0, conf->xmpp_tls_verify);
+	CuAssertStrEquals(tc, "/etc/ssl/certs/xmpp-ca.pem", conf->xmpp_tls_ca_file);
+	CuAssertIntEquals(tc, 64, conf->xmpp_tls_session_cache);
+	/* Keys after the xmpp_servers mapping are still read */
+	CuAssertIntEquals(tc, LOG_WARNING, conf->log_level);
+	config_delete(conf);
+}
+
+void TestConfigXMPPServers(CuTest *tc)
+{
+	int res;
+	jsconf_t *conf;
+	xmpp_server_t *server;
+
+	conf = config_create();
+	CuAssertPtrNotNull(tc, conf);
+	res = config_parse(conf, "./test/jabsocket-tuning.conf");
+	CuAssertTrue(tc, res);
+
+	server = config_find_xmpp_server(conf, "Example.COM");
+	CuAssertPtrNotNull(tc, server);
+	CuAssertStrEquals(tc, "xmpp1.example.com", server->host);
+	CuAssertIntEquals(tc, 5269, server->port);
+
+	server = config_find_xmpp_server(conf, "example.net");
+	CuAssertPtrNotNull(tc, server);
+	CuAssertStrEquals(tc, "2001:db8::1", server->host);
+	CuAssertIntEquals(tc, 5222, server->port);
+
+	/* An IPv6 address without brackets has no port */
+	server = config_find_xmpp_server(conf, "example.org");
+	CuAssertPtrNotNull(tc, server);
+	CuAssertStrEquals(tc, "2001:db8::2", server->host);
+	CuAssertIntEquals(tc, 0, server->port);
+
+	/* A pool, in the order of the configuration */
+	server = config_find_xmpp_server(conf, "pool.example.com");
+	CuAssertPtrNotNull(tc, server);
+	CuAssertStrEquals(tc, "xmpp1.example.com", server->host);
+	CuAssertIntEquals(tc, 0, server->port);
+	server = server->next;
+	CuAssertPtrNotNull(tc, server);
+	CuAssertStrEquals(tc, "pool.example.com", server->domain);
+	CuAssertStrEquals(tc, "xmpp2.example.com", server->host);
+	CuAssertIntEquals(tc, 5223, server->port);
+
+	/* Other domains use the "*" entry */
+	server = config_find_xmpp_server(conf, "other.example");
+	CuAssertPtrNotNull(tc, server);
+	CuAssertStrEquals(tc, "localhost", server->host);
+	CuAssertIntEquals(tc, 0, server->port);
+
+	/* Invalid servers */
+	CuAssertIntEquals(tc, 0, config_add_xmpp_server(conf, "a", ""));
+	CuAssertIntEquals(tc, 0, config_add_xmpp_server(conf, "a", ":5222"));
+	CuAssertIntEquals(tc, 0, config_add_xmpp_server(conf, "a", "host:0"));
+	CuAssertIntEquals(tc, 0, config_add_xmpp_server(conf, "a", "host:70000"));
+	CuAssertIntEquals(tc, 0, config_add_xmpp_server(conf, "a", "host:x"));
+	CuAssertIntEquals(tc, 0, config_add_xmpp_server(conf, "a", "[::1"));
+	CuAssertIntEquals(tc, 0, config_add_xmpp_server(conf, "a", "[::1]x"));
+	config_delete(conf);
+
+	/* Without a "*" entry, unlisted domains have no static server */
+	conf = config_create();
+	CuAssertPtrNotNull(tc, conf);
+	CuAssertIntEquals(tc, 1,
+		config_add_xmpp_server(conf, "example.com", "10.0.0.1:5223"));
+	CuAssertPtrEquals(tc, NULL, config_find_xmpp_server(conf, "example.net"));
+	server = config_find_xmpp_server(conf, "example.com");
+	CuAssertPtrNotNull(tc, server);
+	CuAssertStrEquals(tc, "10.0.0.1", server->host);
+	CuAssertIntEquals(tc, 5223, server->port);
+	config_delete(conf);
+}
+
 void TestCheckOrigin(CuTest *tc)
 {
 	int res;
@@ -83,6 +219,8 @@ CuSuite* ConfigGetSuite()
 {
 	CuSuite* suite = CuSuiteNew();
 	SUITE_ADD_TEST(suite, TestConfig);
+	SUITE_ADD_TEST(suite, TestConfigTuning);
+	SUITE_ADD_TEST(suite, TestConfigXMPPServers);
 	SUITE_ADD_TEST(suite, TestCheckOrigin);
 	return suite;
 }
@@ -0,0 +1,592 @@
+#include "dnscache.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <netinet/in.h>
+#include <event2/util.h>
+
+static void dnscache_hosts_cb(int err, struct evutil_addrinfo *res,
+	void *arg);
+static void dnscache_ipv4_cb(int result, char type, int count, int ttl,
+	void *addresses, void *arg);
+static void dnscache_ipv6_cb(int result, char type, int count, int ttl,
+	void *addresses, void *arg);
+static void dnscache_srv_cb(int result, srv_record_t *records, size_t count,
+	unsigned int ttl, void *arg);
+
+dnscache_t *
+dnscache_create(struct event_base *base, struct evdns_base *dnsbase,
+	int ttl, int negative_ttl)
+{
+	dnscache_t *cache;
+
+	cache = (dnscache_t*) malloc(sizeof(*cache));
+	if (cache == NULL)
+		return NULL;
+	memset(cache, 0, sizeof(*cache));
+	cache->base = base;
+	cache->dnsbase = dnsbase;
+	cache->ttl = ttl;
+	cache->negative_ttl = negative_ttl;
+
+	/* Only evdns_getaddrinfo consults the hosts file, but its answers
+	   don't carry the TTL. A resolver without name servers answers
+	   numeric addresses and names from the hosts file at once, and
+	   everything else is looked up with the TTL on dnsbase. */
+	if (base != NULL)
+	{
+		cache->hostsbase = evdns_base_new(base, 0);
+		if (cache->hostsbase == NULL)
+			goto Error;
+		evdns_base_load_hosts(cache->hostsbase, "/etc/hosts");
+	}
+	return cache;
+
+Error:
+	free(cache);
+	return NULL;
+}
+
+static void
+dnscache_free_entry(dnscache_entry_t *entry)
+{
+	dnscache_waiter_t *current, *next;
+
+	current = entry->waiters;
+	while (current != NULL)
+	{
+		next = current->next;
+		free(current);
+		current = next;
+	}
+	free(entry->records);
+	free(entry->domain);
+	free(entry);
+}
+
+void
+dnscache_delete(dnscache_t *cache)
+{
+	size_t i;
+	dnscache_entry_t *current, *next;
+
+	for (i = 0; i < DNSCACHE_TABLE_SIZE; i++)
+	{
+		current = cache->table[i];
+		while (current != NULL)
+		{
+			next = current->next;
+			/* The callbacks are invoked later with DNS_ERR_CANCEL and
+			   don't touch the entry. */
+			if (current->requests[0] != NULL)
+				evdns_cancel_request(cache->dnsbase, current->requests[0]);
+			if (current->requests[1] != NULL)
+				evdns_cancel_request(cache->dnsbase, current->requests[1]);
+			if (current->srv_request != NULL)
+				srv_cancel(current->srv_request);
+			dnscache_free_entry(current);
+			current = next;
+		}
+	}
+	if (cache->hostsbase != NULL)
+		evdns_base_free(cache->hostsbase, 0);
+	free(cache);
+}
+
+static unsigned int
+dnscache_hash(const char *domain)
+{
+	unsigned int hash = 5381;
+	const char *pch;
+
+	for (pch = domain; *pch != '\0'; pch++)
+		hash = hash * 33 + (unsigned char) tolower(*pch);
+	return hash % DNSCACHE_TABLE_SIZE;
+}
+
+static dnscache_entry_t *
+dnscache_find(dnscache_t *cache, int type, const char *domain)
+{
+	dnscache_entry_t *entry;
+
+	for (entry = cache->table[dnscache_hash(domain)]; entry != NULL;
+		entry = entry->next)
+	{
+		if ( (entry->type == type) && (strcasecmp(entry->domain, domain) == 0) )
+			return entry;
+	}
+	return NULL;
+}
+
+/* dnscache_sweep removes expired entries that don't have a query in
+   flight. */
+static void
+dnscache_sweep(dnscache_t *cache, time_t now)
+{
+	size_t i;
+	dnscache_entry_t **link, *entry;
+
+	for (i = 0; i < DNSCACHE_TABLE_SIZE; i++)
+	{
+		link = &cache->table[i];
+		while (*link != NULL)
+		{
+			entry = *link;
+			if ( (entry->state != DC_PENDING) && (entry->expires <= now) )
+			{
+				*link = entry->next;
+				dnscache_free_entry(entry);
+				cache->count--;
+			}
+			else
+				link = &entry->next;
+		}
+	}
+}
+
+static dnscache_entry_t *
+dnscache_get_entry(dnscache_t *cache, int type, const char *domain,
+	time_t now)
+{
+	dnscache_entry_t *entry;
+	unsigned int index;
+
+	entry = dnscache_find(cache, type, domain);
+	if (entry != NULL)
+		return entry;
+
+	if (cache->count >= DNSCACHE_MAX_ENTRIES)
+		dnscache_sweep(cache, now);
+
+	entry = (dnscache_entry_t*) malloc(sizeof(*entry));
+	if (entry == NULL)
+		return NULL;
+	memset(entry, 0, sizeof(*entry));
+	entry->domain = strdup(domain);
+	if (entry->domain == NULL)
+	{
+		free(entry);
+		return NULL;
+	}
+	entry->cache = cache;
+	entry->type = type;
+	entry->state = DC_FAILED;
+	index = dnscache_hash(domain);
+	entry->next = cache->table[index];
+	cache->table[index] = entry;
+	cache->count++;
+	return entry;
+}
+
+static dnscache_entry_t *
+dnscache_lookup_type(dnscache_t *cache, int type, const char *domain,
+	time_t now)
+{
+	dnscache_entry_t *entry;
+
+	entry = dnscache_find(cache, type, domain);
+	if (entry == NULL)
+		return NULL;
+	if ( (entry->state != DC_PENDING) && (entry->expires <= now) )
+		return NULL;
+	return entry;
+}
+
+dnscache_entry_t *
+dnscache_lookup(dnscache_t *cache, const char *domain, time_t now)
+{
+	return dnscache_lookup_type(cache, DC_ADDRESS, domain, now);
+}
+
+dnscache_entry_t *
+dnscache_lookup_srv(dnscache_t *cache, const char *domain, time_t now)
+{
+	return dnscache_lookup_type(cache, DC_SRV, domain, now);
+}
+
+dnscache_entry_t *
+dnscache_store(dnscache_t *cache, const char *domain,
+	struct sockaddr *address, socklen_t address_size, unsigned int ttl,
+	time_t now)
+{
+	dnscache_entry_t *entry;
+
+	entry = dnscache_get_entry(cache, DC_ADDRESS, domain, now);
+	if (entry == NULL)
+		return NULL;
+	if ( (address != NULL) && (address_size <= sizeof(entry->address)) )
+	{
+		memcpy(&entry->address, address, address_size);
+		entry->address_size = address_size;
+		entry->state = DC_RESOLVED;
+		if (ttl > (unsigned int) cache->ttl)
+			ttl = cache->ttl;
+		entry->expires = now + ttl;
+	}
+	else
+	{
+		entry->address_size = 0;
+		entry->state = DC_FAILED;
+		entry->expires = now + cache->negative_ttl;
+	}
+	return entry;
+}
+
+
+dnscache_entry_t *
+dnscache_store_srv(dnscache_t *cache, const char *domain,
+	srv_record_t *records, size_t count, unsigned int ttl, time_t now)
+{
+	dnscache_entry_t *entry;
+
+	entry = dnscache_get_entry(cache, DC_SRV, domain, now);
+	if (entry == NULL)
+		return NULL;
+	free(entry->records);
+	entry->records = NULL;
+	entry->record_count = 0;
+	if (count > SRV_MAX_RECORDS)
+		count = SRV_MAX_RECORDS;
+	if ( (records != NULL) && (count > 0) )
+		entry->records = (srv_record_t*) malloc(count * sizeof(*records));
+	if (entry->records != NULL)
+	{
+		memcpy(entry->records, records, count * sizeof(*records));
+		entry->record_count = count;
+		entry->state = DC_RESOLVED;
+		if (ttl > (unsigned int) cache->ttl)
+			ttl = cache->ttl;
+		entry->expires = now + ttl;
+	}
+	else
+	{
+		entry->state = DC_FAILED;
+		entry->expires = now + cache->negative_ttl;
+	}
+	return entry;
+}
+
+/* Copy of the answer in an entry. Waiters are called with the copy, since
+   a lookup started by one of them may sweep the entry. */
+typedef struct _dnscache_result_t
+{
+	int type;
+	int state;
+	struct sockaddr_storage address;
+	socklen_t address_size;
+	srv_record_t records[SRV_MAX_RECORDS];
+	size_t record_count;
+} dnscache_result_t;
+
+static void
+dnscache_copy_result(dnscache_entry_t *entry, dnscache_result_t *result)
+{
+	result->type = entry->type;
+	result->state = entry->state;
+	result->address_size = entry->address_size;
+	if (entry->address_size > 0)
+		memcpy(&result->address, &entry->address, entry->address_size);
+	result->record_count = entry->record_count;
+	if (entry->record_count > 0)
+		memcpy(result->records, entry->records,
+			entry->record_count * sizeof(*entry->records));
+}
+
+static void
+dnscache_notify(dnscache_result_t *result, dnscache_cb_t cb,
+	dnscache_srv_cb_t srv_cb, void *arg)
+{
+	if (result->type == DC_SRV)
+	{
+		if (result->state == DC_RESOLVED)
+			srv_cb(1, result->records, result->record_count, arg);
+		else
+			srv_cb(0, NULL, 0, arg);
+	}
+	else
+	{
+		if (result->state == DC_RESOLVED)
+			cb(1, (struct sockaddr*) &result->address, result->address_size,
+				arg);
+		else
+			cb(0, NULL, 0, arg);
+	}
+}
+
+static void
+dnscache_notify_entry(dnscache_entry_t *entry, dnscache_cb_t cb,
+	dnscache_srv_cb_t srv_cb, void *arg)
+{
+	dnscache_result_t result;
+
+	dnscache_copy_result(entry, &result);
+	dnscache_notify(&result, cb, srv_cb, arg);
+}
+
+/* dnscache_complete calls the waiters of an entry whose query has
+   completed */
+static void
+dnscache_complete(dnscache_entry_t *entry)
+{
+	dnscache_result_t result;
+	dnscache_waiter_t *current, *next;
+
+	dnscache_copy_result(entry, &result);
+
+	/* Detach the waiters before calling them, a callback may start
+	   another lookup. */
+	current = entry->waiters;
+	entry->waiters = NULL;
+	while (current != NULL)
+	{
+		next = current->next;
+		dnscache_notify(&result, current->cb, current->srv_cb, current->arg);
+		free(current);
+		current = next;
+	}
+}
+
+static void
+dnscache_hosts_cb(int err, struct evutil_addrinfo *res, void *arg)
+{
+	dnscache_entry_t *entry = (dnscache_entry_t*) arg;
+
+	/* Anything but an answer (including EVUTIL_EAI_CANCEL for names that
+	   would need a name server) leaves the entry pending */
+	if ( (err == 0) && (res != NULL) )
+	{
+		dnscache_store(entry->cache, entry->domain, res->ai_addr,
+			res->ai_addrlen, entry->cache->ttl, time(NULL));
+	}
+	if (res != NULL)
+		evutil_freeaddrinfo(res);
+}
+
+/* dnscache_address_cb handles the answer to the A (index 0) or AAAA
+   (index 1) query of an entry. The first IPv4 address is used as soon as
+   it arrives, an IPv6 address only when there is no IPv4 address; it is
+   kept in entry->address until then. */
+static void
+dnscache_address_cb(dnscache_entry_t *entry, int index, int result,
+	int count, int ttl, void *addresses)
+{
+	dnscache_t *cache = entry->cache;
+	struct sockaddr_in *sin = (struct sockaddr_in*) &entry->address;
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6*) &entry->address;
+	struct sockaddr_storage address;
+	socklen_t address_size;
+
+	entry->requests[index] = NULL;
+	if ( (result == DNS_ERR_NONE) && (count > 0) &&
+		( (index == 0) || (entry->address_size == 0) ) )
+	{
+		memset(&entry->address, 0, sizeof(entry->address));
+		if (index == 0)
+		{
+			sin->sin_family = AF_INET;
+			memcpy(&sin->sin_addr, addresses, sizeof(sin->sin_addr));
+			entry->address_size = sizeof(*sin);
+		}
+		else
+		{
+			sin6->sin6_family = AF_INET6;
+			memcpy(&sin6->sin6_addr, addresses, sizeof(sin6->sin6_addr));
+			entry->address_size = sizeof(*sin6);
+		}
+		entry->address_ttl = (ttl > 0) ? ttl : 0;
+	}
+
+	/* Wait for the A answer, and for the AAAA answer if there is no
+	   address yet */
+	if (entry->requests[0] != NULL)
+		return;
+	if ( (entry->address_size == 0) && (entry->requests[1] != NULL) )
+		return;
+	if (entry->requests[1] != NULL)
+	{
+		evdns_cancel_request(cache->dnsbase, entry->requests[1]);
+		entry->requests[1] = NULL;
+	}
+
+	/* dnscache_store copies into entry->address */
+	address_size = entry->address_size;
+	memcpy(&address, &entry->address, sizeof(address));
+	dnscache_store(cache, entry->domain,
+		(address_size > 0) ? (struct sockaddr*) &address : NULL,
+		address_size, entry->address_ttl, time(NULL));
+	dnscache_complete(entry);
+}
+
+static void
+dnscache_ipv4_cb(int result, char type, int count, int ttl,
+	void *addresses, void *arg)
+{
+	/* arg may be freed after a cancel */
+	if (result == DNS_ERR_CANCEL)
+		return;
+	dnscache_address_cb((dnscache_entry_t*) arg, 0, result, count, ttl,
+		addresses);
+}
+
+static void
+dnscache_ipv6_cb(int result, char type, int count, int ttl,
+	void *addresses, void *arg)
+{
+	if (result == DNS_ERR_CANCEL)
+		return;
+	dnscache_address_cb((dnscache_entry_t*) arg, 1, result, count, ttl,
+		addresses);
+}
+
+static void
+dnscache_srv_cb(int result, srv_record_t *records, size_t count,
+	unsigned int ttl, void *arg)
+{
+	dnscache_entry_t *entry = (dnscache_entry_t*) arg;
+
+	entry->srv_request = NULL;
+	dnscache_store_srv(entry->cache, entry->domain, result ? records : NULL,
+		count, ttl, time(NULL));
+	dnscache_complete(entry);
+}
+
+/* dnscache_query starts the DNS query of a pending entry; the entry may
+   already be resolved when dnscache_query returns */
+static void
+dnscache_query(dnscache_entry_t *entry)
+{
+	dnscache_t *cache = entry->cache;
+	struct evdns_getaddrinfo_request *request;
+	struct evdns_request *ipv4_request, *ipv6_request;
+	srv_request_t *srv_request;
+	struct evutil_addrinfo hints;
+
+	if (entry->type == DC_SRV)
+	{
+		srv_request = srv_resolve(cache->base, cache->dnsbase, entry->domain,
+			dnscache_srv_cb, entry);
+		if (entry->state == DC_PENDING)
+			entry->srv_request = srv_request;
+		return;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	if (cache->hostsbase != NULL)
+	{
+		request = evdns_getaddrinfo(cache->hostsbase, entry->domain, NULL,
+			&hints, dnscache_hosts_cb, entry);
+		if (request != NULL) /* not a local name */
+			evdns_getaddrinfo_cancel(request);
+		if (entry->state != DC_PENDING)
+			return;
+	}
+
+	/* The callbacks of both queries are deferred to the event loop */
+	entry->address_size = 0;
+	ipv4_request = evdns_base_resolve_ipv4(cache->dnsbase, entry->domain, 0,
+		dnscache_ipv4_cb, entry);
+	ipv6_request = evdns_base_resolve_ipv6(cache->dnsbase, entry->domain, 0,
+		dnscache_ipv6_cb, entry);
+	entry->requests[0] = ipv4_request;
+	entry->requests[1] = ipv6_request;
+	if ( (ipv4_request == NULL) && (ipv6_request == NULL) )
+		dnscache_store(cache, entry->domain, NULL, 0, 0, time(NULL));
+}
+
+static dnscache_waiter_t *
+dnscache_wait(dnscache_t *cache, int type, const char *domain,
+	dnscache_cb_t cb, dnscache_srv_cb_t srv_cb, void *arg)
+{
+	dnscache_entry_t *entry;
+	dnscache_waiter_t *waiter;
+	dnscache_result_t failure;
+	time_t now;
+
+	now = time(NULL);
+	entry = dnscache_lookup_type(cache, type, domain, now);
+	if ( (entry != NULL) && (entry->state != DC_PENDING) )
+	{
+		if (entry->state == DC_RESOLVED)
+			cache->hits++;
+		else
+			cache->negative_hits++;
+		dnscache_notify_entry(entry, cb, srv_cb, arg);
+		return NULL;
+	}
+
+	waiter = (dnscache_waiter_t*) malloc(sizeof(*waiter));
+	if (waiter == NULL)
+		goto Error;
+	waiter->cb = cb;
+	waiter->srv_cb = srv_cb;
+	waiter->arg = arg;
+
+	if (entry != NULL) /* query already in flight */
+	{
+		cache->coalesced++;
+	}
+	else
+	{
+		cache->misses++;
+		entry = dnscache_get_entry(cache, type, domain, now);
+		if (entry == NULL)
+			goto Error;
+		entry->state = DC_PENDING;
+		dnscache_query(entry);
+		if (entry->state != DC_PENDING)
+		{
+			/* Answered immediately (numeric address or hosts file, or
+			   the query couldn't be sent) */
+			free(waiter);
+			dnscache_notify_entry(entry, cb, srv_cb, arg);
+			return NULL;
+		}
+	}
+
+	waiter->entry = entry;
+	waiter->next = entry->waiters;
+	entry->waiters = waiter;
+	return waiter;
+
+Error:
+	free(waiter);
+	failure.type = type;
+	failure.state = DC_FAILED;
+	dnscache_notify(&failure, cb, srv_cb, arg);
+	return NULL;
+}
+
+dnscache_waiter_t *
+dnscache_resolve(dnscache_t *cache, const char *domain,
+	dnscache_cb_t cb, void *arg)
+{
+	return dnscache_wait(cache, DC_ADDRESS, domain, cb, NULL, arg);
+}
+
+dnscache_waiter_t *
+dnscache_resolve_srv(dnscache_t *cache, const char *domain,
+	dnscache_srv_cb_t cb, void *arg)
+{
+	return dnscache_wait(cache, DC_SRV, domain, NULL, cb, arg);
+}
+
+void
+dnscache_cancel(dnscache_waiter_t *waiter)
+{
+	dnscache_waiter_t **link;
+
+	for (link = &waiter->entry->waiters; *link != NULL;
+		link = &(*link)->next)
+	{
+		if (*link == waiter)
+		{
+			*link = waiter->next;
+			free(waiter);
+			return;
+		}
+	}
+}
@@ -0,0 +1,125 @@
+#ifndef _DNSCACHE_H_
+#define _DNSCACHE_H_
+
+#include <time.h>
+#include <sys/socket.h>
+#include <event2/dns.h>
+#include "srv.h"
+
+/* Cache of resolved XMPP server addresses and of the SRV records of XMPP
+   domains, keyed by domain.
+
+   There is one cache per worker (next to the worker's evdns_base), so it
+   is only ever used from one thread and needs no locking. Addresses and
+   SRV records are kept for their TTL, but at most ttl seconds; numeric
+   addresses and names from the hosts file are kept for ttl seconds and
+   failed lookups for negative_ttl seconds.
+   Concurrent lookups of the same domain are coalesced: only one DNS query
+   is in flight and all waiters are called when it completes.
+ */
+
+#define DNSCACHE_TABLE_SIZE 256
+#define DNSCACHE_MAX_ENTRIES 4096
+
+/* Entry states */
+enum
+{
+	DC_PENDING,  /* DNS query in flight */
+	DC_RESOLVED, /* address is valid */
+	DC_FAILED    /* negative entry */
+};
+
+/* Entry types */
+enum
+{
+	DC_ADDRESS, /* A/AAAA lookup */
+	DC_SRV      /* SRV lookup of the XMPP client service */
+};
+
+/* Result callback; result is 1 on success, 0 on failure. On success,
+   address contains the resolved address with port 0. */
+typedef void (*dnscache_cb_t)(int result, struct sockaddr *address,
+	socklen_t address_size, void *arg);
+
+/* Result callback of SRV lookups; result is 1 if count > 0 records were
+   found. The records are only valid until the callback returns. */
+typedef void (*dnscache_srv_cb_t)(int result, srv_record_t *records,
+	size_t count, void *arg);
+
+typedef struct _dnscache_t dnscache_t;
+typedef struct _dnscache_entry_t dnscache_entry_t;
+typedef struct _dnscache_waiter_t dnscache_waiter_t;
+
+struct _dnscache_waiter_t
+{
+	dnscache_cb_t cb;
+	dnscache_srv_cb_t srv_cb;
+	void *arg;
+	dnscache_entry_t *entry;
+	dnscache_waiter_t *next;
+};
+
+struct _dnscache_entry_t
+{
+	char *domain;
+	int type; /* DC_ADDRESS or DC_SRV */
+	int state;
+	struct sockaddr_storage address;
+	socklen_t address_size;
+	unsigned int address_ttl; /* TTL of address while a query is pending */
+	srv_record_t *records; /* DC_SRV */
+	size_t record_count;
+	time_t expires;
+	dnscache_t *cache;
+	struct evdns_request *requests[2]; /* A and AAAA queries in flight */
+	srv_request_t *srv_request;
+	dnscache_waiter_t *waiters;
+	dnscache_entry_t *next; /* next entry in the hash chain */
+};
+
+struct _dnscache_t
+{
+	struct event_base *base;
+	struct evdns_base *dnsbase;
+	struct evdns_base *hostsbase; /* hosts file only, no name servers */
+	dnscache_entry_t *table[DNSCACHE_TABLE_SIZE];
+	size_t count;
+	int ttl;          /* maximum lifetime of positive entries in seconds */
+	int negative_ttl; /* lifetime of negative entries in seconds */
+
+	/* Statistics */
+	unsigned long hits;          /* answered from a positive entry */
+	unsigned long negative_hits; /* answered from a negative entry */
+	unsigned long misses;        /* needed a DNS query */
+	unsigned long coalesced;     /* joined a query already in flight */
+};
+
+dnscache_t *dnscache_create(struct event_base *base,
+	struct evdns_base *dnsbase, int ttl, int negative_ttl);
+void dnscache_delete(dnscache_t *cache);
+
+/* dnscache_resolve resolves domain. If the answer is cached, cb is called
+   before dnscache_resolve returns and the return value is NULL. Otherwise
+   the returned waiter can be passed to dnscache_cancel until cb has been
+   called. */
+dnscache_waiter_t *dnscache_resolve(dnscache_t *cache, const char *domain,
+	dnscache_cb_t cb, void *arg);
+
+/* dnscache_resolve_srv looks up the SRV records of the XMPP client service
+   of domain, with the same conventions as dnscache_resolve */
+dnscache_waiter_t *dnscache_resolve_srv(dnscache_t *cache,
+	const char *domain, dnscache_srv_cb_t cb, void *arg);
+void dnscache_cancel(dnscache_waiter_t *waiter);
+
+/* Lower-level interface, also used by unit tests */
+dnscache_entry_t *dnscache_lookup(dnscache_t *cache, const char *domain,
+	time_t now);
+dnscache_entry_t *dnscache_store(dnscache_t *cache, const char *domain,
+	struct sockaddr *address, socklen_t address_size, unsigned int ttl,
+	time_t now);
+dnscache_entry_t *dnscache_lookup_srv(dnscache_t *cache, const char *domain,
+	time_t now);
+dnscache_entry_t *dnscache_store_srv(dnscache_t *cache, const char *domain,
+	srv_record_t *records, size_t count, unsigned int ttl, time_t now);
+
+#endif /* _DNSCACHE_H_ */
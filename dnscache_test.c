@@ -0,0 +1,272 @@
+#include <stdlib.h>
+#include "CuTest.h"
+#include <string.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <event2/event.h>
+#include "dnscache.h"
+
+static struct sockaddr_in
+make_address(const char *ip)
+{
+	struct sockaddr_in sin;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	inet_pton(AF_INET, ip, &sin.sin_addr);
+	return sin;
+}
+
+void TestDNSCacheStore(CuTest *tc)
+{
+	dnscache_t *cache;
+	dnscache_entry_t *entry;
+	struct sockaddr_in sin = make_address("10.1.2.3");
+	time_t now = 1000;
+
+	cache = dnscache_create(NULL, NULL, 60, 5);
+	CuAssertPtrNotNull(tc, cache);
+
+	/* Empty cache */
+	CuAssertTrue( tc, dnscache_lookup(cache, "example.com", now) == NULL );
+
+	/* Positive entry, lookup is case-insensitive */
+	entry = dnscache_store(cache, "example.com", (struct sockaddr*) &sin,
+		sizeof(sin), 3600, now);
+	CuAssertPtrNotNull(tc, entry);
+	entry = dnscache_lookup(cache, "Example.COM", now + 59);
+	CuAssertPtrNotNull(tc, entry);
+	CuAssertIntEquals(tc, DC_RESOLVED, entry->state);
+	CuAssertIntEquals(tc, sizeof(sin), entry->address_size);
+	CuAssertTrue( tc, memcmp(&entry->address, &sin, sizeof(sin)) == 0 );
+
+	/* Expired after ttl seconds, even if the record TTL is longer */
+	CuAssertTrue( tc, dnscache_lookup(cache, "example.com", now + 60) == NULL );
+
+	/* Refreshing the entry reuses it */
+	dnscache_store(cache, "example.com", (struct sockaddr*) &sin,
+		sizeof(sin), 3600, now + 60);
+	CuAssertIntEquals(tc, 1, cache->count);
+	CuAssertPtrNotNull( tc, dnscache_lookup(cache, "example.com", now + 100) );
+
+	dnscache_delete(cache);
+}
+
+void TestDNSCacheNegative(CuTest *tc)
+{
+	dnscache_t *cache;
+	dnscache_entry_t *entry;
+	time_t now = 1000;
+
+	cache = dnscache_create(NULL, NULL, 60, 5);
+	CuAssertPtrNotNull(tc, cache);
+
+	entry = dnscache_store(cache, "nosuchdomain.example", NULL, 0, 0, now);
+	CuAssertPtrNotNull(tc, entry);
+	entry = dnscache_lookup(cache, "nosuchdomain.example", now + 4);
+	CuAssertPtrNotNull(tc, entry);
+	CuAssertIntEquals(tc, DC_FAILED, entry->state);
+
+	/* Negative entries use the shorter lifetime */
+	CuAssertTrue( tc,
+		dnscache_lookup(cache, "nosuchdomain.example", now + 5) == NULL );
+
+	dnscache_delete(cache);
+}
+
+void TestDNSCacheTTL(CuTest *tc)
+{
+	dnscache_t *cache;
+	struct sockaddr_in sin = make_address("10.1.2.3");
+	time_t now = 1000;
+
+	cache = dnscache_create(NULL, NULL, 60, 5);
+	CuAssertPtrNotNull(tc, cache);
+
+	/* A record TTL shorter than the cache's ttl wins */
+	dnscache_store(cache, "example.com", (struct sockaddr*) &sin,
+		sizeof(sin), 10, now);
+	CuAssertPtrNotNull( tc, dnscache_lookup(cache, "example.com", now + 9) );
+	CuAssertTrue( tc, dnscache_lookup(cache, "example.com", now + 10) == NULL );
+
+	/* TTL 0: usable by the waiters of the query, but not cached */
+	dnscache_store(cache, "example.com", (struct sockaddr*) &sin,
+		sizeof(sin), 0, now);
+	CuAssertTrue( tc, dnscache_lookup(cache, "example.com", now) == NULL );
+
+	dnscache_delete(cache);
+}
+
+static int resolve_result;
+static struct sockaddr_in resolve_address;
+
+static void
+resolve_cb(int result, struct sockaddr *address, socklen_t address_size,
+	void *arg)
+{
+	resolve_result = result;
+	if (result)
+		memcpy(&resolve_address, address, sizeof(resolve_address));
+	(*(int*) arg)++;
+}
+
+void TestDNSCacheHit(CuTest *tc)
+{
+	dnscache_t *cache;
+	struct sockaddr_in sin = make_address("192.0.2.7");
+	dnscache_waiter_t *waiter;
+	int calls = 0;
+
+	cache = dnscache_create(NULL, NULL, 60, 5);
+	CuAssertPtrNotNull(tc, cache);
+	dnscache_store(cache, "cached.example", (struct sockaddr*) &sin,
+		sizeof(sin), 3600, time(NULL));
+	dnscache_store(cache, "failed.example", NULL, 0, 0, time(NULL));
+
+	/* A cached answer is delivered synchronously */
+	waiter = dnscache_resolve(cache, "cached.example", resolve_cb, &calls);
+	CuAssertTrue(tc, waiter == NULL);
+	CuAssertIntEquals(tc, 1, calls);
+	CuAssertIntEquals(tc, 1, resolve_result);
+	CuAssertTrue( tc,
+		resolve_address.sin_addr.s_addr == sin.sin_addr.s_addr );
+	CuAssertIntEquals(tc, 1, cache->hits);
+
+	waiter = dnscache_resolve(cache, "failed.example", resolve_cb, &calls);
+	CuAssertTrue(tc, waiter == NULL);
+	CuAssertIntEquals(tc, 2, calls);
+	CuAssertIntEquals(tc, 0, resolve_result);
+	CuAssertIntEquals(tc, 1, cache->negative_hits);
+	CuAssertIntEquals(tc, 0, cache->misses);
+
+	dnscache_delete(cache);
+}
+
+void TestDNSCacheLocal(CuTest *tc)
+{
+	struct event_base *base;
+	struct evdns_base *dnsbase;
+	dnscache_t *cache;
+	dnscache_entry_t *entry;
+	time_t now;
+	int calls = 0;
+
+	base = event_base_new();
+	CuAssertPtrNotNull(tc, base);
+	dnsbase = evdns_base_new(base, 0);
+	CuAssertPtrNotNull(tc, dnsbase);
+	cache = dnscache_create(base, dnsbase, 60, 5);
+	CuAssertPtrNotNull(tc, cache);
+
+	/* Numeric addresses are answered at once and kept for ttl seconds */
+	now = time(NULL);
+	CuAssertTrue( tc, dnscache_resolve(cache, "127.0.0.1", resolve_cb,
+		&calls) == NULL );
+	CuAssertIntEquals(tc, 1, calls);
+	CuAssertIntEquals(tc, 1, resolve_result);
+	CuAssertTrue( tc,
+		resolve_address.sin_addr.s_addr == htonl(INADDR_LOOPBACK) );
+	entry = dnscache_lookup(cache, "127.0.0.1", now);
+	CuAssertPtrNotNull(tc, entry);
+	CuAssertTrue(tc, entry->expires >= now + 60);
+
+	dnscache_delete(cache);
+	evdns_base_free(dnsbase, 0);
+	event_base_free(base);
+}
+
+static int srv_result;
+static char srv_target[SRV_MAX_TARGET];
+
+static void
+resolve_srv_cb(int result, srv_record_t *records, size_t count, void *arg)
+{
+	srv_result = result;
+	if (result)
+		strcpy(srv_target, records[0].target);
+	(*(int*) arg)++;
+}
+
+void TestDNSCacheSRV(CuTest *tc)
+{
+	dnscache_t *cache;
+	dnscache_entry_t *entry;
+	struct sockaddr_in sin = make_address("10.1.2.3");
+	srv_record_t records[2];
+	time_t now = time(NULL);
+	int calls = 0;
+
+	cache = dnscache_create(NULL, NULL, 60, 5);
+	CuAssertPtrNotNull(tc, cache);
+	memset(records, 0, sizeof(records));
+	records[0].priority = 10;
+	records[0].port = 5222;
+	strcpy(records[0].target, "xmpp1.example.com");
+	records[1].priority = 20;
+	records[1].port = 5223;
+	strcpy(records[1].target, "xmpp2.example.com");
+
+	/* SRV and address entries of a domain are separate */
+	dnscache_store(cache, "example.com", (struct sockaddr*) &sin,
+		sizeof(sin), 3600, now);
+	CuAssertTrue( tc, dnscache_lookup_srv(cache, "example.com", now) == NULL );
+	entry = dnscache_store_srv(cache, "example.com", records, 2, 30, now);
+	CuAssertPtrNotNull(tc, entry);
+	CuAssertIntEquals(tc, 2, cache->count);
+	entry = dnscache_lookup_srv(cache, "EXAMPLE.com", now);
+	CuAssertPtrNotNull(tc, entry);
+	CuAssertIntEquals(tc, DC_RESOLVED, entry->state);
+	CuAssertIntEquals(tc, 2, entry->record_count);
+	CuAssertIntEquals(tc, 5223, entry->records[1].port);
+	CuAssertStrEquals(tc, "xmpp2.example.com", entry->records[1].target);
+	CuAssertIntEquals(tc, DC_RESOLVED,
+		dnscache_lookup(cache, "example.com", now)->state);
+
+	/* Records are kept for their TTL, but at most for the cache's ttl */
+	CuAssertPtrNotNull( tc, dnscache_lookup_srv(cache, "example.com", now + 29) );
+	CuAssertTrue( tc, dnscache_lookup_srv(cache, "example.com", now + 30) == NULL );
+	dnscache_store_srv(cache, "example.com", records, 2, 3600, now);
+	CuAssertPtrNotNull( tc, dnscache_lookup_srv(cache, "example.com", now + 59) );
+	CuAssertTrue( tc, dnscache_lookup_srv(cache, "example.com", now + 60) == NULL );
+
+	/* No records: negative entry */
+	entry = dnscache_store_srv(cache, "example.net", NULL, 0, 0, now);
+	CuAssertIntEquals(tc, DC_FAILED, entry->state);
+	CuAssertPtrNotNull( tc, dnscache_lookup_srv(cache, "example.net", now + 4) );
+	CuAssertTrue( tc, dnscache_lookup_srv(cache, "example.net", now + 5) == NULL );
+
+	/* Cached answers are delivered synchronously */
+	CuAssertTrue( tc, dnscache_resolve_srv(cache, "example.com",
+		resolve_srv_cb, &calls) == NULL );
+	CuAssertIntEquals(tc, 1, calls);
+	CuAssertIntEquals(tc, 1, srv_result);
+	CuAssertStrEquals(tc, "xmpp1.example.com", srv_target);
+	CuAssertTrue( tc, dnscache_resolve_srv(cache, "example.net",
+		resolve_srv_cb, &calls) == NULL );
+	CuAssertIntEquals(tc, 2, calls);
+	CuAssertIntEquals(tc, 0, srv_result);
+
+	/* Without an event base the query can't be sent; this fails at once
+	   and is cached as a negative entry */
+	CuAssertTrue( tc, dnscache_resolve_srv(cache, "example.org",
+		resolve_srv_cb, &calls) == NULL );
+	CuAssertIntEquals(tc, 3, calls);
+	CuAssertIntEquals(tc, 0, srv_result);
+	CuAssertIntEquals(tc, 1, cache->misses);
+	CuAssertIntEquals(tc, DC_FAILED,
+		dnscache_lookup_srv(cache, "example.org", now)->state);
+
+	dnscache_delete(cache);
+}
+
+CuSuite* DNSCacheGetSuite()
+{
+	CuSuite* suite = CuSuiteNew();
+	SUITE_ADD_TEST(suite, TestDNSCacheStore);
+	SUITE_ADD_TEST(suite, TestDNSCacheNegative);
+	SUITE_ADD_TEST(suite, TestDNSCacheTTL);
+	SUITE_ADD_TEST(suite, TestDNSCacheHit);
+	SUITE_ADD_TEST(suite, TestDNSCacheLocal);
+	SUITE_ADD_TEST(suite, TestDNSCacheSRV);
+	return suite;
+}
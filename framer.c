@@ -9,18 +9,29 @@ static void XMLCALL framer_end(void *data, const char *el);
 static void framer_add_frame(framer_t *framer, int index, int size);
 static void framer_remove_frame(framer_t *framer);
 static int framer_initialize(framer_t *framer);
+static void framer_scan_cb(void *ctx, int what, const char *name,
+	size_t name_length, size_t index, size_t size);
 
-framer_t *
-framer_create()
+/* framer_setup_parser prepares the framing engine for a new stream: the
+   tag scanner, which needs no allocation, or an expat parser taken from
+   the pool (or reset, if the framer already has one). */
+static int
+framer_setup_parser(framer_t *framer)
 {
-	framer_t *framer = (framer_t*) malloc(sizeof(*framer));
-	
-	if (framer == NULL)
-		goto Error;
-	memset(framer, 0, sizeof(*framer));
-	framer->parser = XML_ParserCreateNS(NULL, /* ':' */ '\xFF');
+	if (framer->engine == FRAMER_SCANNER)
+	{
+		xmlscan_init(&framer->scan, framer_scan_cb, framer);
+		return 1;
+	}
+
 	if (framer->parser == NULL)
-		goto Error;
+	{
+		framer->parser = xmlpool_get(framer->pool);
+		if (framer->parser == NULL)
+			return 0;
+	}
+	else if ( !xmlpool_reset(framer->pool, framer->parser) )
+		return 0;
 	XML_SetElementHandler(
 		framer->parser,
 		framer_start,
@@ -28,6 +39,31 @@ framer_create()
 	XML_SetUserData(
 		framer->parser,
 		framer);
+#ifdef HAVE_XML_SETREPARSEDEFERRALENABLED
+	/* Report a stanza as soon as its end tag has arrived */
+	XML_SetReparseDeferralEnabled(framer->parser, XML_FALSE);
+#endif
+	return 1;
+}
+
+framer_t *
+framer_create()
+{
+	return framer_create_engine(FRAMER_EXPAT, NULL);
+}
+
+framer_t *
+framer_create_engine(int engine, xmlpool_t *pool)
+{
+	framer_t *framer = (framer_t*) malloc(sizeof(*framer));
+	
+	if (framer == NULL)
+		goto Error;
+	memset(framer, 0, sizeof(*framer));
+	framer->engine = engine;
+	framer->pool = pool;
+	if ( !framer_setup_parser(framer) )
+		goto Error;
 	framer->level = 0;
 	framer->error = 0;
 	framer->index = 0;
@@ -46,27 +82,17 @@ Error:
 	{
 		if (framer->buffer != NULL)
 			buffer_delete(framer->buffer);
-		if (framer->parser != NULL)
-			XML_ParserFree(framer->parser);
+		xmlpool_put(framer->pool, framer->parser);
+		free(framer);
 	}
 	return NULL;
 }
 
 static void
-framer_cleanup(framer_t *framer)
+framer_free_frames(framer_t *framer)
 {
 	frame_t *current, *next;
 
-	if (framer->parser != NULL)
-	{
-		XML_ParserFree(framer->parser);
-		framer->parser = NULL;
-	}
-	if (framer->buffer != NULL)
-	{
-		buffer_delete(framer->buffer);
-		framer->buffer = NULL;
-	}
 	current = framer->head;
 	while (current != NULL)
 	{
@@ -74,48 +100,33 @@ framer_cleanup(framer_t *framer)
 		free(current);
 		current = next;
 	}
-	
+	framer->head = framer->tail = NULL;
 }
 
-
 void
 framer_delete(framer_t *framer)
 {
-	framer_cleanup(framer);
+	/* The parser goes back to the pool for the next stream */
+	xmlpool_put(framer->pool, framer->parser);
+	if (framer->buffer != NULL)
+		buffer_delete(framer->buffer);
+	framer_free_frames(framer);
 	free(framer);
 }
 
+/* framer_initialize prepares the framer for a restarted stream, keeping
+   its parser and buffer. */
 static int
 framer_initialize(framer_t *framer)
 {
-	framer_cleanup(framer);
-
-	framer->parser = XML_ParserCreateNS(NULL, /* ':' */ '\xFF');
-	if (framer->parser == NULL)
-		goto Error;
-	XML_SetElementHandler(
-		framer->parser,
-		framer_start,
-		framer_end);
-	XML_SetUserData(
-		framer->parser,
-		framer);
+	framer_free_frames(framer);
+	buffer_clear(framer->buffer);
+	buffer_shrink(framer->buffer);
 	framer->level = 0;
 	framer->error = 0;
 	framer->index = 0;
 	framer->buffer_index = 0;
-	framer->head = framer->tail = NULL;
-	
-	framer->buffer = buffer_create(0);
-	if (framer->buffer == NULL)
-		goto Error;
-
-	return 1;
-
-Error:
-	if (framer->parser != NULL)
-		XML_ParserFree(framer->parser);
-	return 0;
+	return framer_setup_parser(framer);
 }
 
 int
@@ -129,6 +140,20 @@ framer_add(framer_t *framer, unsigned char *message, size_t length)
 {
 	enum XML_Status status;
 
+	/* Give back the memory of a large stanza once it has been taken */
+	buffer_shrink(framer->buffer);
+
+	if (framer->engine == FRAMER_SCANNER)
+	{
+		if ( !xmlscan_add(&framer->scan, message, length) )
+		{
+			framer->error = 1;
+			return 0;
+		}
+		buffer_append(framer->buffer, message, length);
+		return 1;
+	}
+
 	status = XML_Parse(framer->parser, (char *)message, length, 0);
 	if (status == XML_STATUS_ERROR)
 	{
@@ -146,36 +171,64 @@ framer_has_frame(framer_t *framer)
 	return (framer->head != NULL);
 }
 
+/* framer_on_start and framer_on_end do the framing for both engines:
+   index and size locate the start or end tag in the stream. */
+static void
+framer_on_start(framer_t *framer, int is_stream, int index)
+{
+	if (is_stream)
+	{
+		/* Opening stream element */
+		framer->level = 0; /* Reset level */
+	}
+	else if (framer->level == 1)
+	{
+		/* Stanza opening */
+		framer->index = index;
+	}
+	framer->level++;
+}
+
+static void
+framer_on_end(framer_t *framer, int is_stream, int index, int size)
+{
+	framer->level--;
+	if (framer->level == 1)
+	{
+		/* Stanza closing: add new frame at the end of the list. */
+		framer_add_frame(framer, framer->index, index + size - framer->index);
+	}
+	else if (is_stream)
+	{
+		/* Stream closing */
+		framer_add_frame(framer, index, size);
+	}
+}
+
 static void XMLCALL
 framer_start(void *data, const char *el, const char **attr)
 {
 	framer_t *framer = (framer_t*) data;
 	char *sep;
-	char *name;
+	int is_stream;
 	
 	// printf("start: element %s level %d\n", el, framer->level);
 	sep = strchr(el, '\xFF');
-	if (sep != NULL)
+	if (sep == NULL)
 	{
-		name = sep + 1;
-		// printf("   bare element name: %s\n", name);
-		if (strcmp(name, "stream") == 0)
-		{
-			// printf("   Opening stream element\n");
-			framer->level = 0; /* Reset level */
-			framer_add_frame(
-				framer,
-				XML_GetCurrentByteIndex(framer->parser),
-				XML_GetCurrentByteCount(framer->parser) );
-		}
-		else if (framer->level == 1)
-		{
-			// printf("   Stanza opening\n");
-			framer->index = XML_GetCurrentByteIndex(framer->parser);
-		}
+		framer->level++;
+		return;
+	}
+	is_stream = (strcmp(sep + 1, "stream") == 0);
+	framer_on_start(framer, is_stream,
+		XML_GetCurrentByteIndex(framer->parser) );
+	if (is_stream)
+	{
+		framer_add_frame(
+			framer,
+			XML_GetCurrentByteIndex(framer->parser),
+			XML_GetCurrentByteCount(framer->parser) );
 	}
-	
-	framer->level++;
 }
 
 static void
@@ -219,35 +272,57 @@ static void XMLCALL
 framer_end(void *data, const char *el)
 {
 	framer_t *framer = (framer_t*) data;
-	int end_index;
 	char *sep;
-	char *name = NULL;
-
-	framer->level--;
-	// printf("end: element %s level %d\n", el, framer->level);
+	int is_stream = 0;
 
 	/* Get the bare element name (without namespace) */
 	sep = strchr(el, '\xFF');
 	if (sep != NULL)
-		name = sep + 1;
+		is_stream = (strcmp(sep + 1, "stream") == 0);
 
-	if (framer->level == 1)
-	{
-		// printf("   Stanza closing\n");
-		end_index = XML_GetCurrentByteIndex(framer->parser) +
-			XML_GetCurrentByteCount(framer->parser);
-		// printf("   Stanza from %d to %d\n", framer->index, end_index);
+	framer_on_end(framer, is_stream,
+		XML_GetCurrentByteIndex(framer->parser),
+		XML_GetCurrentByteCount(framer->parser) );
+}
+
+/* is_stream_name checks whether the local part of a qualified name is
+   "stream" */
+static int
+is_stream_name(const char *name, size_t length)
+{
+	const char *local = name;
+	size_t i;
 
-		/* Add new frame at the end of the list. */
-		framer_add_frame(framer, framer->index, end_index - framer->index);
+	for (i = 0; i < length; i++)
+	{
+		if (name[i] == ':')
+			local = name + i + 1;
 	}
-	else if ( (name != NULL) && (strcmp(name, "stream")  == 0) )
+	return ( (size_t) (name + length - local) == 6 ) &&
+		(memcmp(local, "stream", 6) == 0);
+}
+
+static void
+framer_scan_cb(void *ctx, int what, const char *name, size_t name_length,
+	size_t index, size_t size)
+{
+	framer_t *framer = (framer_t*) ctx;
+	int is_stream = is_stream_name(name, name_length);
+
+	switch (what)
 	{
-		// printf("   Stream closing\n");
-		framer_add_frame(
-			framer,
-			XML_GetCurrentByteIndex(framer->parser),
-			XML_GetCurrentByteCount(framer->parser));
+		case XMLSCAN_START:
+			framer_on_start(framer, is_stream, index);
+			if (is_stream)
+				framer_add_frame(framer, index, size);
+			break;
+		case XMLSCAN_END:
+			framer_on_end(framer, is_stream, index, size);
+			break;
+		case XMLSCAN_EMPTY:
+			framer_on_start(framer, 0, index);
+			framer_on_end(framer, 0, index, size);
+			break;
 	}
 }
 
@@ -312,3 +387,41 @@ framer_get_frame2(framer_t *framer, data_t *data, size_t *size)
 	                     data->buffer if the buffer was large enough. */
 }
 
+int
+framer_get_frame_ref(framer_t *framer, byte **data, size_t *size)
+{
+	int delta;
+
+	if (framer->head == NULL)
+		return 0;
+	if (framer->head->index > framer->buffer_index)
+	{
+		/* Remove data before stanza (e.g. \r\n between stanzas) */
+		delta = framer->head->index - framer->buffer_index;
+		buffer_remove_data(framer->buffer, delta);
+		framer->buffer_index += delta;
+	}
+
+	/* Removing data from a buffer_t only advances its read pointer, the
+	   bytes stay where they are until the next append. */
+	*data = framer->buffer->data;
+	*size = framer->head->size;
+	buffer_remove_data(framer->buffer, *size);
+	framer->buffer_index += *size;
+	framer_remove_frame(framer);
+	return 1;
+}
+
+int
+framer_peek_frame(framer_t *framer, int n, byte **data, size_t *size)
+{
+	frame_t *frame;
+
+	for (frame = framer->head; (frame != NULL) && (n > 0); n--)
+		frame = frame->next;
+	if (frame == NULL)
+		return 0;
+	*data = framer->buffer->data + (frame->index - framer->buffer_index);
+	*size = frame->size;
+	return 1;
+}
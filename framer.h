@@ -4,6 +4,15 @@
 #include <stdlib.h>
 #include <expat.h>
 #include "util.h"
+#include "xmlscan.h"
+#include "xmlpool.h"
+
+/* Framing engines */
+enum
+{
+	FRAMER_EXPAT,  /* full expat parser */
+	FRAMER_SCANNER /* xmlscan, tracks tag nesting only */
+};
 
 typedef struct _frame_t frame_t;
 
@@ -16,7 +25,10 @@ struct _frame_t
 
 typedef struct _framer_t
 {
+	int engine; /* FRAMER_EXPAT or FRAMER_SCANNER */
 	XML_Parser parser;
+	xmlpool_t *pool; /* where the parser comes from, may be NULL */
+	xmlscan_t scan;
 	int level;
 	int error; /* TODO: add error checking */
 	int index; /* Starting index of a stanza */
@@ -27,6 +39,7 @@ typedef struct _framer_t
 } framer_t;
 
 framer_t *framer_create();
+framer_t *framer_create_engine(int engine, xmlpool_t *pool);
 void framer_delete(framer_t *framer);
 int framer_reset(framer_t *framer);
 
@@ -35,5 +48,16 @@ int framer_has_frame(framer_t *framer);
 int framer_get_frame(framer_t *framer, char **data, size_t *size);
 void framer_get_frame2(framer_t *framer, data_t *data, size_t *size);
 
+/* framer_get_frame_ref removes the next frame and points data to it
+   inside the framer's own buffer, without copying. The frame stays valid
+   until the next call of framer_add or framer_reset. Returns 0 if there
+   is no frame. */
+int framer_get_frame_ref(framer_t *framer, byte **data, size_t *size);
+
+/* framer_peek_frame points data to the frame after the first n frames
+   without removing any frame. Returns 0 if there are no more than n
+   frames. */
+int framer_peek_frame(framer_t *framer, int n, byte **data, size_t *size);
+
 #endif /* _FRAMER_H_ */
 
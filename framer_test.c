@@ -137,11 +137,203 @@ void TestFramer2(CuTest *tc)
 	CuAssertIntEquals( tc, 152, data_get_length(&data) );
 }
 
+/* Inputs for the differential tests of the two framing engines */
+static const char *framer_inputs[] =
+{
+	/* Stream header with XML declaration, features, stanzas, close */
+	"<?xml version='1.0'?>"
+	"<stream:stream xmlns:stream='http://etherx.jabber.org/streams' "
+	"xmlns='jabber:client' from='example.com' id='1' version='1.0'>"
+	"<stream:features><mechanisms "
+	"xmlns='urn:ietf:params:xml:ns:xmpp-sasl'><mechanism>PLAIN</mechanism>"
+	"</mechanisms></stream:features>"
+	"<message to='a@b' type='chat'><body>hello</body></message>\r\n"
+	" \n"
+	"<iq type='result' id='x'><query xmlns='jabber:iq:roster'>"
+	"<item jid='c@d' name='C'/><item jid='e@f'/></query></iq>"
+	"</stream:stream>\r\n",
+
+	/* Quotes, '>' and '/' in attribute values, comments, CDATA, PIs */
+	"<stream:stream xmlns:stream='http://etherx.jabber.org/streams' "
+	"xmlns='jabber:client'>"
+	"<message to=\"a@b/r>x\" id='it&apos;s/'><body>a &gt; b</body>"
+	"<!-- <not> a <tag/> --><x xmlns='y'/></message>"
+	"<!-- comment between stanzas -->"
+	"<message to='a@b'><body><![CDATA[<b>bold</b> ]]]></body></message>"
+	"<presence from='a@b/r' to='c@d'><?pi <x>?><show>away</show>"
+	"<status>a/b</status ></presence >",
+
+	/* Self-closing stanzas */
+	"<stream:stream xmlns:stream='http://etherx.jabber.org/streams' "
+	"xmlns='jabber:client'>"
+	"<presence/><presence from='a@b'/>"
+	"<presence type = 'unavailable' />"
+	"<message to='a@b'><body/></message>",
+
+	/* Stream restarted in the middle of the input */
+	"<stream:stream xmlns:stream='http://etherx.jabber.org/streams' "
+	"xmlns='jabber:client'><message><body>1</body></message>"
+	"<stream:stream xmlns:stream='http://etherx.jabber.org/streams' "
+	"xmlns='jabber:client'><message><body>2</body></message>"
+};
+
+/* run_framer feeds input to a new framer in chunks of chunk_size bytes and
+   collects the frames, separated by '|', in output */
+static int
+run_framer(int engine, const char *input, size_t chunk_size,
+	buffer_t *output)
+{
+	framer_t *framer;
+	size_t length = strlen(input);
+	size_t offset, n;
+	char *data;
+	size_t size;
+
+	framer = framer_create_engine(engine, NULL);
+	if (framer == NULL)
+		return 0;
+	for (offset = 0; offset < length; offset += n)
+	{
+		n = length - offset;
+		if (n > chunk_size)
+			n = chunk_size;
+		if ( !framer_add(framer, (unsigned char*) input + offset, n) )
+		{
+			framer_delete(framer);
+			return 0;
+		}
+		while (framer_has_frame(framer))
+		{
+			framer_get_frame(framer, &data, &size);
+			buffer_append(output, (unsigned char*) data, size);
+			buffer_append(output, (unsigned char*) "|", 1);
+			free(data);
+		}
+	}
+	framer_delete(framer);
+	return 1;
+}
+
+/* The scanner finds the same frames as expat, however the input is split */
+void TestFramerScanner(CuTest *tc)
+{
+	size_t chunks[] = { 1, 2, 3, 7, 64, 100000 };
+	size_t i, j;
+	buffer_t *expat_output, *scanner_output;
+
+	for (i = 0; i < sizeof(framer_inputs) / sizeof(framer_inputs[0]); i++)
+	{
+		for (j = 0; j < sizeof(chunks) / sizeof(chunks[0]); j++)
+		{
+			expat_output = buffer_create(0);
+			scanner_output = buffer_create(0);
+			CuAssertTrue( tc, run_framer(FRAMER_EXPAT, framer_inputs[i],
+				chunks[j], expat_output) );
+			CuAssertTrue( tc, run_framer(FRAMER_SCANNER, framer_inputs[i],
+				chunks[j], scanner_output) );
+			CuAssertTrue( tc, buffer_get_length(expat_output) > 0 );
+			CuAssertIntEquals( tc, buffer_get_length(expat_output),
+				buffer_get_length(scanner_output) );
+			CuAssertTrue( tc, memcmp(expat_output->data,
+				scanner_output->data,
+				buffer_get_length(expat_output) ) == 0 );
+			buffer_delete(expat_output);
+			buffer_delete(scanner_output);
+		}
+	}
+}
+
+/* Input that can't be XML is rejected by the scanner too */
+void TestFramerScannerError(CuTest *tc)
+{
+	framer_t *framer;
+	char *message = "<stream:stream xmlns='jabber:client'>< message/>";
+
+	framer = framer_create_engine(FRAMER_SCANNER, NULL);
+	CuAssertPtrNotNull(tc, framer);
+	CuAssertTrue( tc,
+		!framer_add(framer, (unsigned char*) message, strlen(message)) );
+	framer_delete(framer);
+
+	framer = framer_create_engine(FRAMER_SCANNER, NULL);
+	message = "<a><b <c>";
+	CuAssertTrue( tc,
+		!framer_add(framer, (unsigned char*) message, strlen(message)) );
+	framer_delete(framer);
+}
+
+/* framer_get_frame_ref hands out stanzas of any size without copying */
+void TestFramerFrameRef(CuTest *tc)
+{
+	int engines[] = { FRAMER_EXPAT, FRAMER_SCANNER };
+	char *header = "<stream:stream xmlns:stream="
+		"'http://etherx.jabber.org/streams' xmlns='jabber:client'>";
+	char *stanzas = "<presence/>\r\n<message><body>x</body></message>";
+	size_t body_size = 200000;
+	buffer_t *stanza;
+	byte *data, *first;
+	size_t size, first_size, offset, n;
+	framer_t *framer;
+	int i;
+
+	/* A 200 KB stanza, larger than any fixed scratch buffer */
+	stanza = buffer_create(0);
+	buffer_append(stanza, (byte*) "<message><body>", 15);
+	for (n = 0; n < body_size; n++)
+		buffer_append(stanza, (byte*) "y", 1);
+	buffer_append(stanza, (byte*) "</body></message>", 17);
+
+	for (i = 0; i < 2; i++)
+	{
+		framer = framer_create_engine(engines[i], NULL);
+		CuAssertPtrNotNull(tc, framer);
+		CuAssertTrue( tc, !framer_get_frame_ref(framer, &data, &size) );
+		framer_add(framer, (byte*) header, strlen(header));
+		CuAssertTrue( tc, framer_get_frame_ref(framer, &data, &size) );
+		CuAssertIntEquals( tc, strlen(header), size );
+
+		for (offset = 0; offset < buffer_get_length(stanza); offset += n)
+		{
+			n = buffer_get_length(stanza) - offset;
+			if (n > 4096)
+				n = 4096;
+			framer_add(framer, stanza->data + offset, n);
+		}
+		CuAssertTrue( tc, framer_get_frame_ref(framer, &data, &size) );
+		CuAssertIntEquals( tc, buffer_get_length(stanza), size );
+		CuAssertTrue( tc, memcmp(data, stanza->data, size) == 0 );
+
+		/* Frames taken one after another stay valid until framer_add */
+		framer_add(framer, (byte*) stanzas, strlen(stanzas));
+		/* Peeking leaves the frames in place */
+		CuAssertTrue( tc, framer_peek_frame(framer, 1, &data, &size) );
+		CuAssertIntEquals(tc, 33, size);
+		CuAssertTrue( tc, memcmp(data, "<message>", 9) == 0 );
+		CuAssertTrue( tc, framer_peek_frame(framer, 0, &data, &size) );
+		CuAssertIntEquals(tc, 11, size);
+		CuAssertTrue( tc, !framer_peek_frame(framer, 2, &data, &size) );
+		CuAssertTrue( tc, framer_get_frame_ref(framer, &first, &first_size) );
+		CuAssertTrue( tc, framer_get_frame_ref(framer, &data, &size) );
+		CuAssertTrue( tc, !framer_has_frame(framer) );
+		CuAssertIntEquals(tc, 11, first_size);
+		CuAssertTrue( tc, memcmp(first, "<presence/>", 11) == 0 );
+		CuAssertIntEquals(tc, 33, size);
+		CuAssertTrue( tc, memcmp(data, "<message><body>x</body></message>",
+			33) == 0 );
+
+		framer_delete(framer);
+	}
+	buffer_delete(stanza);
+}
+
 CuSuite* FramerGetSuite()
 {
 	CuSuite* suite = CuSuiteNew();
 	SUITE_ADD_TEST(suite, TestFramer);
 	SUITE_ADD_TEST(suite, TestFramer2);
+	SUITE_ADD_TEST(suite, TestFramerScanner);
+	SUITE_ADD_TEST(suite, TestFramerScannerError);
+	SUITE_ADD_TEST(suite, TestFramerFrameRef);
 	return suite;
 }
 
@@ -0,0 +1,115 @@
+#include "histogram.h"
+#include <string.h>
+
+void
+histogram_init(histogram_t *histogram)
+{
+	memset(histogram, 0, sizeof(histogram_t));
+}
+
+int
+histogram_bucket(uint64_t value)
+{
+	int exponent;
+
+	if (value < HISTOGRAM_SUB_BUCKETS)
+		return (int) value;
+	exponent = 63 - __builtin_clzll(value);
+	if (exponent >= HISTOGRAM_MAX_BITS)
+		return HISTOGRAM_BUCKETS - 1;
+	/* The top HISTOGRAM_SUB_BITS + 1 bits select the bucket */
+	return (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS +
+		(int) ((value >> (exponent - HISTOGRAM_SUB_BITS)) &
+			(HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+uint64_t
+histogram_bucket_limit(int bucket)
+{
+	int exponent, sub;
+
+	if (bucket < HISTOGRAM_SUB_BUCKETS)
+		return (uint64_t) bucket + 1;
+	exponent = bucket / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+	sub = bucket % HISTOGRAM_SUB_BUCKETS;
+	return (uint64_t) (HISTOGRAM_SUB_BUCKETS + sub + 1) <<
+		(exponent - HISTOGRAM_SUB_BITS);
+}
+
+static void
+histogram_add(atomic_ulong *counter, unsigned long n)
+{
+	atomic_store_explicit(counter,
+		atomic_load_explicit(counter, memory_order_relaxed) + n,
+		memory_order_relaxed);
+}
+
+void
+histogram_record(histogram_t *histogram, uint64_t value)
+{
+	histogram_add(&histogram->buckets[histogram_bucket(value)], 1);
+	histogram_add(&histogram->count, 1);
+	histogram_add(&histogram->sum, value);
+	if (value > atomic_load_explicit(&histogram->max, memory_order_relaxed))
+		atomic_store_explicit(&histogram->max, value, memory_order_relaxed);
+}
+
+void
+histogram_sum_init(histogram_sum_t *sum)
+{
+	memset(sum, 0, sizeof(histogram_sum_t));
+}
+
+void
+histogram_sum_add(histogram_sum_t *sum, histogram_t *histogram)
+{
+	unsigned long max;
+	int i;
+
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+		sum->buckets[i] += atomic_load_explicit(&histogram->buckets[i],
+			memory_order_relaxed);
+	sum->count += atomic_load_explicit(&histogram->count,
+		memory_order_relaxed);
+	sum->sum += atomic_load_explicit(&histogram->sum, memory_order_relaxed);
+	max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+	if (max > sum->max)
+		sum->max = max;
+}
+
+unsigned long
+histogram_sum_count_below(histogram_sum_t *sum, uint64_t limit)
+{
+	unsigned long count = 0;
+	int i;
+
+	/* Bucket limits are powers of two at the end of each octave */
+	for (i = 0; (i < HISTOGRAM_BUCKETS) &&
+		(histogram_bucket_limit(i) <= limit); i++)
+		count += sum->buckets[i];
+	return count;
+}
+
+uint64_t
+histogram_sum_quantile(histogram_sum_t *sum, double q)
+{
+	unsigned long rank, count = 0;
+	uint64_t limit;
+	int i;
+
+	if (sum->count == 0)
+		return 0;
+	rank = (unsigned long) (q * sum->count + 0.5);
+	if (rank < 1)
+		rank = 1;
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		count += sum->buckets[i];
+		if (count >= rank)
+			break;
+	}
+	if (i == HISTOGRAM_BUCKETS)
+		return sum->max;
+	limit = histogram_bucket_limit(i) - 1; /* largest value of the bucket */
+	return (limit < sum->max) ? limit : sum->max;
+}
@@ -0,0 +1,60 @@
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/* Log-linear histogram of durations in microseconds, in the style of
+   HdrHistogram: each power of two is split into HISTOGRAM_SUB_BUCKETS
+   equal buckets, so every recorded value is known to within 1/8 (12.5%)
+   with a fixed number of counters and no allocation. Values below
+   HISTOGRAM_SUB_BUCKETS have a bucket each; values of 2^HISTOGRAM_MAX_BITS
+   and more (over an hour) go to the last bucket.
+
+   Like the other metrics, a histogram is only updated by the thread that
+   owns it and read from other threads without locks. */
+
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS 32
+#define HISTOGRAM_BUCKETS \
+	((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+typedef struct _histogram_t
+{
+	atomic_ulong buckets[HISTOGRAM_BUCKETS];
+	atomic_ulong count;
+	atomic_ulong sum; /* sum of the values */
+	atomic_ulong max;
+} histogram_t;
+
+/* Snapshot of one or more histograms added together */
+typedef struct _histogram_sum_t
+{
+	unsigned long buckets[HISTOGRAM_BUCKETS];
+	unsigned long count;
+	unsigned long sum;
+	unsigned long max;
+} histogram_sum_t;
+
+void histogram_init(histogram_t *histogram);
+void histogram_record(histogram_t *histogram, uint64_t value);
+
+/* histogram_bucket returns the index of the bucket of value;
+   histogram_bucket_limit returns the smallest value of the next bucket */
+int histogram_bucket(uint64_t value);
+uint64_t histogram_bucket_limit(int bucket);
+
+void histogram_sum_init(histogram_sum_t *sum);
+void histogram_sum_add(histogram_sum_t *sum, histogram_t *histogram);
+
+/* histogram_sum_count_below returns the number of values smaller than
+   limit, which has to be a power of two */
+unsigned long histogram_sum_count_below(histogram_sum_t *sum, uint64_t limit);
+
+/* histogram_sum_quantile returns a value that at least the fraction q of
+   the recorded values doesn't exceed (the limit of the bucket where the
+   quantile falls, but at most the largest recorded value) */
+uint64_t histogram_sum_quantile(histogram_sum_t *sum, double q);
+
+#endif /* _HISTOGRAM_H_ */
@@ -0,0 +1,77 @@
+#include <stdlib.h>
+#include "CuTest.h"
+#include <string.h>
+#include "histogram.h"
+
+/* Every value falls into a bucket whose range contains it and which is at
+   most 1/8 of the value wide */
+void TestHistogramBuckets(CuTest *tc)
+{
+	uint64_t value, lower;
+	int bucket, previous = 0;
+
+	for (value = 0; value < (1 << 20); value++)
+	{
+		bucket = histogram_bucket(value);
+		CuAssertTrue(tc, bucket >= previous);
+		CuAssertTrue(tc, bucket < HISTOGRAM_BUCKETS);
+		lower = (bucket > 0) ? histogram_bucket_limit(bucket - 1) : 0;
+		CuAssertTrue(tc, lower <= value);
+		CuAssertTrue(tc, value < histogram_bucket_limit(bucket));
+		if (value >= HISTOGRAM_SUB_BUCKETS)
+			CuAssertTrue(tc,
+				(histogram_bucket_limit(bucket) - lower) * 8 <= value);
+		previous = bucket;
+	}
+	CuAssertIntEquals(tc, HISTOGRAM_BUCKETS - 1,
+		histogram_bucket(((uint64_t) 1 << HISTOGRAM_MAX_BITS) - 1));
+	CuAssertIntEquals(tc, HISTOGRAM_BUCKETS - 1,
+		histogram_bucket((uint64_t) 1 << 40));
+	CuAssertTrue(tc, histogram_bucket_limit(HISTOGRAM_BUCKETS - 1) ==
+		(uint64_t) 1 << HISTOGRAM_MAX_BITS);
+}
+
+void TestHistogramQuantiles(CuTest *tc)
+{
+	histogram_t *histogram0, *histogram1;
+	histogram_sum_t sum;
+	uint64_t value, q;
+
+	histogram0 = (histogram_t*) malloc(sizeof(histogram_t));
+	histogram1 = (histogram_t*) malloc(sizeof(histogram_t));
+	histogram_init(histogram0);
+	histogram_init(histogram1);
+
+	/* 1..10000 spread over two histograms */
+	for (value = 1; value <= 10000; value++)
+		histogram_record( (value % 2) ? histogram0 : histogram1, value );
+
+	histogram_sum_init(&sum);
+	histogram_sum_add(&sum, histogram0);
+	histogram_sum_add(&sum, histogram1);
+	CuAssertIntEquals(tc, 10000, sum.count);
+	CuAssertIntEquals(tc, 10000, sum.max);
+	CuAssertTrue(tc, sum.sum == 10000UL * 10001 / 2);
+
+	q = histogram_sum_quantile(&sum, 0.5);
+	CuAssertTrue(tc, (q >= 5000) && (q <= 5000 + 5000 / 8));
+	q = histogram_sum_quantile(&sum, 0.99);
+	CuAssertTrue(tc, (q >= 9900) && (q <= 10000));
+	CuAssertIntEquals(tc, 10000, histogram_sum_quantile(&sum, 1.0));
+	CuAssertIntEquals(tc, 1, histogram_sum_quantile(&sum, 0.0));
+
+	CuAssertIntEquals(tc, 1023, histogram_sum_count_below(&sum, 1024));
+	CuAssertIntEquals(tc, 10000, histogram_sum_count_below(&sum, 16384));
+	CuAssertIntEquals(tc, 0, histogram_sum_count_below(&sum, 1));
+
+	free(histogram0);
+	free(histogram1);
+}
+
+CuSuite* HistogramGetSuite()
+{
+	CuSuite* suite = CuSuiteNew();
+	SUITE_ADD_TEST(suite, TestHistogramBuckets);
+	SUITE_ADD_TEST(suite, TestHistogramQuantiles);
+	return suite;
+}
@@ -0,0 +1,932 @@
+/* jabsocket_loadgen - load generator for jabsocket
+
+   Opens many WebSocket connections with the xmpp subprotocol, opens an
+   XMPP stream on each and sends a mix of stanzas in masked frames. The
+   stanzas carry their send time in the id attribute, so when the XMPP
+   server echoes them (as jabsocket_mockxmpp does) the round trip time
+   through jabsocket is known without keeping any state.
+
+   Each thread runs its own event loop with its share of the connections.
+   Reported are the connect rate and the latency of the TCP connect, the
+   WebSocket handshake, the stream opening (until the stream features
+   arrive) and the stanza round trip, and the stanza throughput. */
+
+#define _GNU_SOURCE /* memmem */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include "base64.h"
+#include "histogram.h"
+#include "parseconfig.h"
+#include "util.h"
+#include "wsmessage.h"
+
+#define LOADGEN_MAX_SOURCES 64
+#define LOADGEN_TICK_MS 10 /* interval of the connection ramp */
+/* Longest --domain (RFC 7622, section 3.2); stanzas are built in the
+   scratch space behind the largest payload, which leaves room for it */
+#define LOADGEN_MAX_DOMAIN 1023
+
+/* Stanza kinds of the mix */
+enum
+{
+	STANZA_MESSAGE,
+	STANZA_PRESENCE,
+	STANZA_IQ,
+	STANZA_KINDS
+};
+
+struct params_t
+{
+	char *host;     /* jabsocket address */
+	int port;
+	char *path;
+	char *origin;
+	char *domain;   /* to attribute of the stream header */
+	int connections;
+	double connect_rate; /* new connections per second */
+	int threads;
+	double duration;     /* seconds */
+	double rate;         /* stanzas per second per connection, 0 = as fast
+	                        as the echoes come back */
+	int window;          /* stanzas in flight per connection if rate is 0 */
+	int size;            /* payload bytes of messages and presences */
+	int mix[STANZA_KINDS]; /* weights of the stanza kinds */
+	int json;
+	struct sockaddr_storage sources[LOADGEN_MAX_SOURCES];
+	int source_count;    /* local addresses, to get past the port limit */
+	struct sockaddr_storage address;
+	int address_size;
+};
+
+typedef struct _lgstats_t
+{
+	unsigned long attempts;
+	unsigned long connected;
+	unsigned long connect_errors;
+	unsigned long handshakes;
+	unsigned long handshake_errors; /* not 101 or closed during handshake */
+	unsigned long sessions;         /* stream features received */
+	unsigned long closed;           /* closed after the session started */
+	unsigned long stanzas_sent;
+	unsigned long stanzas_received;
+	unsigned long bytes_sent;       /* including frame headers */
+	unsigned long bytes_received;
+	uint64_t first_attempt;
+	uint64_t last_connected;
+	histogram_t connect;
+	histogram_t handshake;
+	histogram_t session;
+	histogram_t rtt;
+} lgstats_t;
+
+typedef struct _lgthread_t lgthread_t;
+
+/* Connection states */
+enum
+{
+	LG_ST_CONNECTING,
+	LG_ST_HANDSHAKE, /* waiting for the 101 response */
+	LG_ST_OPENING,   /* waiting for the stream features */
+	LG_ST_READY,     /* sending stanzas */
+	LG_ST_CLOSED
+};
+
+typedef struct _lgconn_t
+{
+	lgthread_t *thread;
+	struct bufferevent *bev;
+	struct event *timer; /* next stanza, if rate > 0 */
+	wsmsg_t *wsmsg;
+	buffer_t *message;
+	int state;
+	uint64_t started; /* start of the current phase */
+} lgconn_t;
+
+struct _lgthread_t
+{
+	int id;
+	pthread_t thread;
+	struct event_base *base;
+	struct event *ramp;
+	const struct timeval *send_interval; /* common timeout of the stanzas */
+	lgconn_t **conns;
+	int count;  /* connections of this thread */
+	int opened;
+	double credit; /* connections the ramp may open */
+	unsigned long seed;
+	lgstats_t stats;
+	byte scratch[65536 + 4096]; /* stanza being framed */
+};
+
+static struct params_t params;
+static jsconf_t *conf; /* frame limits of the decoders */
+
+static void lgconn_send(lgconn_t *conn);
+static void lgconn_close(lgconn_t *conn);
+
+static uint64_t
+now_us(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static unsigned long
+lg_random(lgthread_t *thread)
+{
+	thread->seed = thread->seed * 6364136223846793005UL + 1442695040888963407UL;
+	return (thread->seed >> 33) & 0x7fffffff;
+}
+
+static void
+usage(char *prog)
+{
+	fprintf(stderr, "Usage: %s <options>\n", prog);
+	fprintf(stderr,
+"Options:\n"
+"  --host, -H <address>                - jabsocket address\n"
+"                                        (default is 127.0.0.1)\n"
+"  --port, -p <port>                   - jabsocket port (default is 5000)\n"
+"  --path, -P <path>                   - Request path (default is /)\n"
+"  --origin, -o <origin>               - Origin header\n"
+"                                        (default is http://localhost)\n"
+"  --domain, -d <domain>               - XMPP domain (default is localhost)\n"
+"  --connections, -c <n>               - Connections (default is 100)\n"
+"  --connect-rate, -C <n>              - New connections per second\n"
+"                                        (default is 1000)\n"
+"  --threads, -t <n>                   - Threads (default is 1)\n"
+"  --duration, -D <seconds>            - Duration of the test\n"
+"                                        (default is 10)\n"
+"  --rate, -r <n>                      - Stanzas per second per connection;\n"
+"                                        0 sends the next one when an echo\n"
+"                                        comes back (default is 1)\n"
+"  --window, -w <n>                    - Stanzas in flight per connection\n"
+"                                        with --rate 0 (default is 1)\n"
+"  --size, -s <bytes>                  - Payload of messages and presences\n"
+"                                        (default is 100)\n"
+"  --mix, -m <message>:<presence>:<iq> - Weights of the stanza kinds\n"
+"                                        (default is 70:20:10)\n"
+"  --source, -S <address>              - Local address to connect from,\n"
+"                                        can be repeated\n"
+"  --json, -j                          - Print the results as JSON\n"
+"  --help, -h                          - Help message\n"
+	);
+
+	exit(0);
+}
+
+static int
+parse_params(int argc, char **argv, struct params_t *params)
+{
+	int c;
+	char text[128];
+	int size;
+
+	memset( params, 0, sizeof(struct params_t) );
+	params->host = "127.0.0.1";
+	params->port = 5000;
+	params->path = "/";
+	params->origin = "http://localhost";
+	params->domain = "localhost";
+	params->connections = 100;
+	params->connect_rate = 1000;
+	params->threads = 1;
+	params->duration = 10;
+	params->rate = 1;
+	params->window = 1;
+	params->size = 100;
+	params->mix[STANZA_MESSAGE] = 70;
+	params->mix[STANZA_PRESENCE] = 20;
+	params->mix[STANZA_IQ] = 10;
+	while (1)
+	{
+		int option_index = 0;
+		static struct option long_options[] =
+			{
+				{"host",         1, 0, 'H'},
+				{"port",         1, 0, 'p'},
+				{"path",         1, 0, 'P'},
+				{"origin",       1, 0, 'o'},
+				{"domain",       1, 0, 'd'},
+				{"connections",  1, 0, 'c'},
+				{"connect-rate", 1, 0, 'C'},
+				{"threads",      1, 0, 't'},
+				{"duration",     1, 0, 'D'},
+				{"rate",         1, 0, 'r'},
+				{"window",       1, 0, 'w'},
+				{"size",         1, 0, 's'},
+				{"mix",          1, 0, 'm'},
+				{"source",       1, 0, 'S'},
+				{"json",         0, 0, 'j'},
+				{"help",         0, 0, 'h'},
+				{0, 0, 0, 0}
+			};
+
+		c = getopt_long(argc, argv, "H:p:P:o:d:c:C:t:D:r:w:s:m:S:jh",
+			long_options, &option_index);
+		if (c == -1)
+			break;
+
+		switch (c) {
+			case 'H':
+				params->host = optarg;
+				break;
+			case 'p':
+				params->port = atoi(optarg);
+				break;
+			case 'P':
+				params->path = optarg;
+				break;
+			case 'o':
+				params->origin = optarg;
+				break;
+			case 'd':
+				params->domain = optarg;
+				break;
+			case 'c':
+				params->connections = atoi(optarg);
+				break;
+			case 'C':
+				params->connect_rate = atof(optarg);
+				break;
+			case 't':
+				params->threads = atoi(optarg);
+				break;
+			case 'D':
+				params->duration = atof(optarg);
+				break;
+			case 'r':
+				params->rate = atof(optarg);
+				break;
+			case 'w':
+				params->window = atoi(optarg);
+				break;
+			case 's':
+				params->size = atoi(optarg);
+				break;
+			case 'm':
+				if (sscanf(optarg, "%d:%d:%d", &params->mix[STANZA_MESSAGE],
+					&params->mix[STANZA_PRESENCE], &params->mix[STANZA_IQ]) != 3)
+					usage(argv[0]);
+				break;
+			case 'S':
+				size = sizeof(params->sources[0]);
+				snprintf(text, sizeof(text), "%s:0", optarg);
+				if ( (params->source_count == LOADGEN_MAX_SOURCES) ||
+					(evutil_parse_sockaddr_port(text,
+						(struct sockaddr*) &params->sources[params->source_count],
+						&size) < 0) )
+					usage(argv[0]);
+				params->source_count++;
+				break;
+			case 'j':
+				params->json = 1;
+				break;
+			case 'h':
+			case '?': /* invalid option */
+				usage(argv[0]);
+				break;
+		}
+	}
+	if ( (params->connections < 1) || (params->connect_rate <= 0) ||
+		(params->threads < 1) || (params->duration <= 0) ||
+		(params->rate < 0) || (params->window < 1) || (params->size < 0) ||
+		(params->size > 65536) ||
+		(strlen(params->domain) > LOADGEN_MAX_DOMAIN) ||
+		(params->mix[STANZA_MESSAGE] + params->mix[STANZA_PRESENCE] +
+			params->mix[STANZA_IQ] <= 0) )
+		usage(argv[0]);
+	if (params->threads > params->connections)
+		params->threads = params->connections;
+
+	snprintf(text, sizeof(text), "%s:%d", params->host, params->port);
+	params->address_size = sizeof(params->address);
+	if (evutil_parse_sockaddr_port(text, (struct sockaddr*) &params->address,
+		&params->address_size) < 0)
+	{
+		fprintf(stderr, "jabsocket_loadgen: invalid address %s\n", text);
+		exit(1);
+	}
+	return 1;
+}
+
+/* lgconn_write_frame writes a masked text frame with the given payload */
+static void
+lgconn_write_frame(lgconn_t *conn, const char *payload, size_t length)
+{
+	lgthread_t *thread = conn->thread;
+	byte *frame = thread->scratch;
+	byte mask[4];
+	size_t header_size;
+	unsigned long key;
+
+	key = lg_random(thread);
+	memcpy(mask, &key, 4);
+	header_size = wsmsg_encode_header(frame, 1, OPCODE_TEXT, length);
+	frame[1] |= 0x80;
+	memcpy(frame + header_size, mask, 4);
+	header_size += 4;
+	memmove(frame + header_size, payload, length);
+	unmask(frame + header_size, length, mask);
+	bufferevent_write(conn->bev, frame, header_size + length);
+	thread->stats.bytes_sent += header_size + length;
+}
+
+/* lgconn_send sends one stanza of the mix */
+static void
+lgconn_send(lgconn_t *conn)
+{
+	lgthread_t *thread = conn->thread;
+	char *stanza = (char*) thread->scratch + 1024;
+	int total, pick, kind;
+	size_t length;
+
+	total = params.mix[STANZA_MESSAGE] + params.mix[STANZA_PRESENCE] +
+		params.mix[STANZA_IQ];
+	pick = lg_random(thread) % total;
+	for (kind = 0; pick >= params.mix[kind]; kind++)
+		pick -= params.mix[kind];
+
+	/* The stanza is built behind the space for the frame header and
+	   moved in front when framed */
+	switch (kind)
+	{
+		case STANZA_MESSAGE:
+			length = sprintf(stanza, "<message to='echo@%s' type='chat' "
+				"id='t%llu'><body>", params.domain,
+				(unsigned long long) now_us());
+			memset(stanza + length, 'x', params.size);
+			length += params.size;
+			length += sprintf(stanza + length, "</body></message>");
+			break;
+		case STANZA_PRESENCE:
+			length = sprintf(stanza, "<presence id='t%llu'><status>",
+				(unsigned long long) now_us());
+			memset(stanza + length, 'x', params.size);
+			length += params.size;
+			length += sprintf(stanza + length, "</status></presence>");
+			break;
+		default:
+			length = sprintf(stanza, "<iq type='get' to='%s' id='t%llu'>"
+				"<ping xmlns='urn:xmpp:ping'/></iq>", params.domain,
+				(unsigned long long) now_us());
+			break;
+	}
+	lgconn_write_frame(conn, stanza, length);
+	thread->stats.stanzas_sent++;
+}
+
+static void
+lgconn_timer_cb(evutil_socket_t fd, short what, void *ctx)
+{
+	lgconn_t *conn = (lgconn_t*) ctx;
+
+	lgconn_send(conn);
+	evtimer_add(conn->timer, conn->thread->send_interval);
+}
+
+/* lgconn_start begins sending stanzas once the stream is open */
+static void
+lgconn_start(lgconn_t *conn)
+{
+	lgthread_t *thread = conn->thread;
+	struct timeval first;
+	uint64_t delay;
+	int i;
+
+	conn->state = LG_ST_READY;
+	thread->stats.sessions++;
+	histogram_record(&thread->stats.session, now_us() - conn->started);
+	if (params.rate == 0)
+	{
+		for (i = 0; i < params.window; i++)
+			lgconn_send(conn);
+		return;
+	}
+	conn->timer = evtimer_new(thread->base, lgconn_timer_cb, conn);
+	if (conn->timer == NULL)
+		return;
+	/* Spread the connections over the interval */
+	delay = lg_random(thread) % (uint64_t) (1e6 / params.rate + 1);
+	first.tv_sec = delay / 1000000;
+	first.tv_usec = delay % 1000000;
+	evtimer_add(conn->timer, &first);
+}
+
+/* lgconn_handshake checks the response to the upgrade request; returns 0
+   while it is incomplete */
+static int
+lgconn_handshake(lgconn_t *conn, struct evbuffer *input)
+{
+	lgthread_t *thread = conn->thread;
+	struct evbuffer_ptr end;
+	char *status;
+	size_t length;
+	int ok;
+	char *stream;
+
+	end = evbuffer_search(input, "\r\n\r\n", 4, NULL);
+	if (end.pos < 0)
+		return 0;
+	status = evbuffer_readln(input, &length, EVBUFFER_EOL_CRLF_STRICT);
+	ok = (status != NULL) && (strncmp(status, "HTTP/1.1 101", 12) == 0);
+	free(status);
+	evbuffer_drain(input, end.pos + 4 - length - 2);
+	if (!ok)
+	{
+		thread->stats.handshake_errors++;
+		lgconn_close(conn);
+		return 0;
+	}
+	thread->stats.handshakes++;
+	histogram_record(&thread->stats.handshake, now_us() - conn->started);
+
+	stream = (char*) thread->scratch + 1024;
+	length = sprintf(stream, "<stream:stream to='%s' xmlns='jabber:client' "
+		"xmlns:stream='http://etherx.jabber.org/streams' version='1.0'>",
+		params.domain);
+	conn->state = LG_ST_OPENING;
+	conn->started = now_us();
+	lgconn_write_frame(conn, stream, length);
+	return 1;
+}
+
+/* lgconn_message handles a message from jabsocket */
+static void
+lgconn_message(lgconn_t *conn)
+{
+	lgthread_t *thread = conn->thread;
+	byte *data = conn->message->data;
+	size_t length = buffer_get_length(conn->message);
+	byte *id;
+	uint64_t sent = 0;
+
+	if (conn->state == LG_ST_OPENING)
+	{
+		if (memmem(data, length, "<stream:features", 16) != NULL)
+			lgconn_start(conn);
+		return;
+	}
+	id = (byte*) memmem(data, length, " id='t", 6);
+	if (id == NULL)
+		return;
+	for (id += 6; (id < data + length) && (*id >= '0') && (*id <= '9'); id++)
+		sent = sent * 10 + (*id - '0');
+	histogram_record(&thread->stats.rtt, now_us() - sent);
+	thread->stats.stanzas_received++;
+	if (params.rate == 0)
+		lgconn_send(conn);
+}
+
+static void
+lgconn_read_cb(struct bufferevent *bev, void *ctx)
+{
+	lgconn_t *conn = (lgconn_t*) ctx;
+	struct evbuffer *input = bufferevent_get_input(bev);
+	struct evbuffer_iovec extent;
+	int fin, opcode, mask;
+
+	conn->thread->stats.bytes_received += evbuffer_get_length(input);
+	if ( (conn->state == LG_ST_HANDSHAKE) && !lgconn_handshake(conn, input) )
+		return;
+
+	while (evbuffer_peek(input, -1, NULL, &extent, 1) > 0)
+	{
+		wsmsg_add(conn->wsmsg, extent.iov_base, extent.iov_len);
+		evbuffer_drain(input, extent.iov_len);
+	}
+	while (1)
+	{
+		if (wsmsg_fail(conn->wsmsg))
+		{
+			lgconn_close(conn);
+			return;
+		}
+		if (wsmsg_has_frame(conn->wsmsg))
+		{
+			if (!wsmsg_get_frame(conn->wsmsg, conn->message, &fin, &opcode,
+				&mask) || (opcode == OPCODE_CLOSE))
+			{
+				lgconn_close(conn);
+				return;
+			}
+			continue;
+		}
+		if (!wsmsg_has_message(conn->wsmsg))
+			break;
+		wsmsg_get_message(conn->wsmsg, conn->message, &opcode);
+		lgconn_message(conn);
+	}
+}
+
+static void
+lgconn_event_cb(struct bufferevent *bev, short events, void *ctx)
+{
+	lgconn_t *conn = (lgconn_t*) ctx;
+	lgthread_t *thread = conn->thread;
+	struct evbuffer *output;
+	char key[32];
+	byte nonce[16];
+	str_t key_str;
+	int i;
+
+	if (events & BEV_EVENT_CONNECTED)
+	{
+		thread->stats.connected++;
+		thread->stats.last_connected = now_us();
+		histogram_record(&thread->stats.connect,
+			thread->stats.last_connected - conn->started);
+
+		for (i = 0; i < 16; i++)
+			nonce[i] = (byte) lg_random(thread);
+		str_init(&key_str, key, sizeof(key));
+		base64_encode(nonce, sizeof(nonce), &key_str);
+		output = bufferevent_get_output(bev);
+		evbuffer_add_printf(output,
+			"GET %s HTTP/1.1\r\n"
+			"Host: %s:%d\r\n"
+			"Upgrade: websocket\r\n"
+			"Connection: Upgrade\r\n"
+			"Sec-WebSocket-Key: %s\r\n"
+			"Sec-WebSocket-Version: 13\r\n"
+			"Sec-WebSocket-Protocol: xmpp\r\n"
+			"Origin: %s\r\n"
+			"\r\n",
+			params.path, params.host, params.port, str_get_string(&key_str),
+			params.origin);
+		conn->state = LG_ST_HANDSHAKE;
+		conn->started = now_us();
+		return;
+	}
+	if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR))
+	{
+		if (conn->state == LG_ST_CONNECTING)
+			thread->stats.connect_errors++;
+		else if (conn->state != LG_ST_READY)
+			thread->stats.handshake_errors++;
+		lgconn_close(conn);
+	}
+}
+
+/* lgconn_close counts a session that ends and frees the connection's
+   resources; the connection stays in the thread's list */
+static void
+lgconn_close(lgconn_t *conn)
+{
+	if (conn->state == LG_ST_READY)
+		conn->thread->stats.closed++;
+	conn->state = LG_ST_CLOSED;
+	if (conn->timer != NULL)
+	{
+		event_free(conn->timer);
+		conn->timer = NULL;
+	}
+	if (conn->bev != NULL)
+	{
+		bufferevent_free(conn->bev);
+		conn->bev = NULL;
+	}
+	if (conn->wsmsg != NULL)
+	{
+		wsmsg_delete(conn->wsmsg);
+		conn->wsmsg = NULL;
+	}
+	if (conn->message != NULL)
+	{
+		buffer_delete(conn->message);
+		conn->message = NULL;
+	}
+}
+
+static void
+lgconn_open(lgthread_t *thread)
+{
+	lgconn_t *conn;
+	struct sockaddr *source;
+	evutil_socket_t fd = -1;
+	int index = thread->opened++;
+
+	thread->stats.attempts++;
+	conn = (lgconn_t*) calloc(1, sizeof(lgconn_t));
+	if (conn == NULL)
+		goto Error;
+	thread->conns[index] = conn;
+	conn->thread = thread;
+	conn->state = LG_ST_CONNECTING;
+	conn->wsmsg = wsmsg_create(conf);
+	conn->message = buffer_create(0);
+	if ( (conn->wsmsg == NULL) || (conn->message == NULL) )
+		goto Error;
+
+	if (params.source_count > 0)
+	{
+		/* Bind the connections to the local addresses in turn */
+		source = (struct sockaddr*)
+			&params.sources[(index * params.threads + thread->id) %
+				params.source_count];
+		fd = socket(source->sa_family, SOCK_STREAM, 0);
+		if ( (fd < 0) || (evutil_make_socket_nonblocking(fd) < 0) ||
+			(bind(fd, source, source->sa_family == AF_INET6 ?
+				sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in)) < 0) )
+			goto Error;
+	}
+	conn->bev = bufferevent_socket_new(thread->base, fd, BEV_OPT_CLOSE_ON_FREE);
+	if (conn->bev == NULL)
+		goto Error;
+	fd = -1;
+	bufferevent_setcb(conn->bev, lgconn_read_cb, NULL, lgconn_event_cb, conn);
+	bufferevent_enable(conn->bev, EV_READ | EV_WRITE);
+	conn->started = now_us();
+	if (bufferevent_socket_connect(conn->bev,
+		(struct sockaddr*) &params.address, params.address_size) < 0)
+		goto Error;
+	return;
+
+Error:
+	thread->stats.connect_errors++;
+	if (fd >= 0)
+		evutil_closesocket(fd);
+	if (conn != NULL)
+		lgconn_close(conn);
+}
+
+/* ramp_cb opens the connections at the configured rate */
+static void
+ramp_cb(evutil_socket_t fd, short what, void *ctx)
+{
+	lgthread_t *thread = (lgthread_t*) ctx;
+
+	thread->credit += params.connect_rate / params.threads *
+		LOADGEN_TICK_MS / 1000.0;
+	while ( (thread->credit >= 1) && (thread->opened < thread->count) )
+	{
+		lgconn_open(thread);
+		thread->credit--;
+	}
+	if (thread->opened == thread->count)
+		event_del(thread->ramp);
+}
+
+static void *
+lgthread_run(void *arg)
+{
+	lgthread_t *thread = (lgthread_t*) arg;
+	struct timeval tick = { 0, LOADGEN_TICK_MS * 1000 };
+	struct timeval duration;
+	struct timeval interval;
+
+	thread->stats.first_attempt = now_us();
+	/* All stanza timers of a thread share one interval */
+	if (params.rate > 0)
+	{
+		interval.tv_sec = (long) (1 / params.rate);
+		interval.tv_usec = (long) (1e6 / params.rate) % 1000000;
+		thread->send_interval = event_base_init_common_timeout(thread->base,
+			&interval);
+	}
+	thread->credit = 1;
+	ramp_cb(-1, 0, thread);
+	if (thread->opened < thread->count)
+		event_add(thread->ramp, &tick);
+	duration.tv_sec = (long) params.duration;
+	duration.tv_usec = (long) ((params.duration - duration.tv_sec) * 1e6);
+	event_base_loopexit(thread->base, &duration);
+	event_base_dispatch(thread->base);
+	return NULL;
+}
+
+static lgthread_t *
+lgthread_create(int id)
+{
+	lgthread_t *thread;
+
+	thread = (lgthread_t*) calloc(1, sizeof(lgthread_t));
+	if (thread == NULL)
+		goto Error;
+	thread->id = id;
+	thread->seed = id + 1;
+	thread->count = params.connections / params.threads +
+		(id < params.connections % params.threads);
+	thread->conns = (lgconn_t**) calloc(thread->count, sizeof(lgconn_t*));
+	if (thread->conns == NULL)
+		goto Error;
+	histogram_init(&thread->stats.connect);
+	histogram_init(&thread->stats.handshake);
+	histogram_init(&thread->stats.session);
+	histogram_init(&thread->stats.rtt);
+	thread->base = event_base_new();
+	if (thread->base == NULL)
+		goto Error;
+	thread->ramp = event_new(thread->base, -1, EV_PERSIST, ramp_cb, thread);
+	if (thread->ramp == NULL)
+		goto Error;
+	return thread;
+
+Error:
+	if (thread != NULL)
+	{
+		if (thread->base != NULL)
+			event_base_free(thread->base);
+		free(thread->conns);
+		free(thread);
+	}
+	return NULL;
+}
+
+static void
+lgthread_delete(lgthread_t *thread)
+{
+	int i;
+
+	for (i = 0; i < thread->opened; i++)
+	{
+		if (thread->conns[i] != NULL)
+		{
+			lgconn_close(thread->conns[i]);
+			free(thread->conns[i]);
+		}
+	}
+	free(thread->conns);
+	event_free(thread->ramp);
+	event_base_free(thread->base);
+	free(thread);
+}
+
+/* Results */
+
+static void
+print_latency(const char *name, histogram_t **histograms, int count,
+	int json, int last)
+{
+	histogram_sum_t sum;
+	int i;
+
+	histogram_sum_init(&sum);
+	for (i = 0; i < count; i++)
+		histogram_sum_add(&sum, histograms[i]);
+	if (json)
+		printf("    \"%s\": {\"count\": %lu, \"mean_ms\": %.3f, "
+			"\"p50_ms\": %.3f, \"p90_ms\": %.3f, \"p99_ms\": %.3f, "
+			"\"max_ms\": %.3f}%s\n", name, sum.count,
+			sum.count ? sum.sum / 1e3 / sum.count : 0,
+			histogram_sum_quantile(&sum, 0.5) / 1e3,
+			histogram_sum_quantile(&sum, 0.9) / 1e3,
+			histogram_sum_quantile(&sum, 0.99) / 1e3,
+			sum.max / 1e3, last ? "" : ",");
+	else
+		printf("%-12s %10lu %10.3f %10.3f %10.3f %10.3f %10.3f\n", name,
+			sum.count, sum.count ? sum.sum / 1e3 / sum.count : 0,
+			histogram_sum_quantile(&sum, 0.5) / 1e3,
+			histogram_sum_quantile(&sum, 0.9) / 1e3,
+			histogram_sum_quantile(&sum, 0.99) / 1e3,
+			sum.max / 1e3);
+}
+
+static void
+print_results(lgthread_t **threads, double elapsed)
+{
+	lgstats_t total;
+	histogram_t *histograms[4][params.threads];
+	uint64_t first = 0, last = 0;
+	double connect_time, connect_rate;
+	int i;
+
+	memset(&total, 0, sizeof(total));
+	for (i = 0; i < params.threads; i++)
+	{
+		lgstats_t *stats = &threads[i]->stats;
+
+		total.attempts += stats->attempts;
+		total.connected += stats->connected;
+		total.connect_errors += stats->connect_errors;
+		total.handshakes += stats->handshakes;
+		total.handshake_errors += stats->handshake_errors;
+		total.sessions += stats->sessions;
+		total.closed += stats->closed;
+		total.stanzas_sent += stats->stanzas_sent;
+		total.stanzas_received += stats->stanzas_received;
+		total.bytes_sent += stats->bytes_sent;
+		total.bytes_received += stats->bytes_received;
+		if ( (first == 0) || (stats->first_attempt < first) )
+			first = stats->first_attempt;
+		if (stats->last_connected > last)
+			last = stats->last_connected;
+		histograms[0][i] = &stats->connect;
+		histograms[1][i] = &stats->handshake;
+		histograms[2][i] = &stats->session;
+		histograms[3][i] = &stats->rtt;
+	}
+	connect_time = (last > first) ? (last - first) / 1e6 : 0;
+	connect_rate = (connect_time > 0) ? total.connected / connect_time : 0;
+
+	if (params.json)
+	{
+		printf("{\n  \"connections\": {\"attempted\": %lu, \"connected\": %lu, "
+			"\"connect_errors\": %lu, \"handshakes\": %lu, "
+			"\"handshake_errors\": %lu, \"sessions\": %lu, \"closed\": %lu, "
+			"\"connect_rate\": %.1f},\n", total.attempts, total.connected,
+			total.connect_errors, total.handshakes, total.handshake_errors,
+			total.sessions, total.closed, connect_rate);
+		printf("  \"stanzas\": {\"sent\": %lu, \"received\": %lu, "
+			"\"sent_per_sec\": %.1f, \"received_per_sec\": %.1f, "
+			"\"bytes_sent_per_sec\": %.0f, \"bytes_received_per_sec\": %.0f},\n",
+			total.stanzas_sent, total.stanzas_received,
+			total.stanzas_sent / elapsed, total.stanzas_received / elapsed,
+			total.bytes_sent / elapsed, total.bytes_received / elapsed);
+		printf("  \"latency\": {\n");
+		print_latency("connect", histograms[0], params.threads, 1, 0);
+		print_latency("handshake", histograms[1], params.threads, 1, 0);
+		print_latency("stream", histograms[2], params.threads, 1, 0);
+		print_latency("rtt", histograms[3], params.threads, 1, 1);
+		printf("  }\n}\n");
+		return;
+	}
+	printf("connections: %lu attempted, %lu connected, %lu connect errors, "
+		"%lu handshakes, %lu handshake errors, %lu sessions, %lu closed\n",
+		total.attempts, total.connected, total.connect_errors,
+		total.handshakes, total.handshake_errors, total.sessions,
+		total.closed);
+	printf("connect rate: %.1f/s\n", connect_rate);
+	printf("stanzas: %lu sent (%.1f/s), %lu received (%.1f/s)\n",
+		total.stanzas_sent, total.stanzas_sent / elapsed,
+		total.stanzas_received, total.stanzas_received / elapsed);
+	printf("bytes: %.2f MB/s sent, %.2f MB/s received\n",
+		total.bytes_sent / elapsed / 1e6, total.bytes_received / elapsed / 1e6);
+	printf("%-12s %10s %10s %10s %10s %10s %10s\n", "latency (ms)", "count",
+		"mean", "p50", "p90", "p99", "max");
+	print_latency("connect", histograms[0], params.threads, 0, 0);
+	print_latency("handshake", histograms[1], params.threads, 0, 0);
+	print_latency("stream", histograms[2], params.threads, 0, 0);
+	print_latency("rtt", histograms[3], params.threads, 0, 1);
+}
+
+int
+main(int argc, char **argv)
+{
+	lgthread_t **threads;
+	struct rlimit limit;
+	uint64_t start;
+	int i;
+
+	parse_params(argc, argv, &params);
+	signal(SIGPIPE, SIG_IGN);
+	unmask_init();
+
+	/* Every connection needs a descriptor */
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+	{
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+		if (limit.rlim_cur < (rlim_t) params.connections + 64)
+			fprintf(stderr, "jabsocket_loadgen: only %lu descriptors "
+				"available, raise the limit (ulimit -n)\n",
+				(unsigned long) limit.rlim_cur);
+	}
+
+	conf = config_create();
+	threads = (lgthread_t**) calloc(params.threads, sizeof(lgthread_t*));
+	if ( (conf == NULL) || (threads == NULL) )
+		return 1;
+	for (i = 0; i < params.threads; i++)
+	{
+		threads[i] = lgthread_create(i);
+		if (threads[i] == NULL)
+		{
+			fprintf(stderr, "jabsocket_loadgen: couldn't create thread %d\n", i);
+			return 1;
+		}
+	}
+
+	start = now_us();
+	for (i = 0; i < params.threads; i++)
+	{
+		if (pthread_create(&threads[i]->thread, NULL, lgthread_run,
+			threads[i]) != 0)
+		{
+			fprintf(stderr, "jabsocket_loadgen: couldn't start thread %d\n", i);
+			return 1;
+		}
+	}
+	for (i = 0; i < params.threads; i++)
+		pthread_join(threads[i]->thread, NULL);
+
+	print_results(threads, (now_us() - start) / 1e6);
+
+	for (i = 0; i < params.threads; i++)
+		lgthread_delete(threads[i]);
+	free(threads);
+	config_delete(conf);
+	return 0;
+}
@@ -1,26 +1,375 @@
 #include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
-void
+/* One message in a ring */
+typedef struct _logentry_t
+{
+	int priority;
+	time_t time;
+	char text[LOG_MESSAGE_SIZE];
+} logentry_t;
+
+/* Ring of messages written by one thread and read by the log thread.
+   Only the owning thread moves tail and only the log thread moves head,
+   so no locking is needed. */
+typedef struct _logring_t logring_t;
+struct _logring_t
+{
+	logentry_t *entries;
+	size_t size; /* a power of two */
+	atomic_size_t head; /* next entry to write out */
+	atomic_size_t tail; /* next free entry */
+	atomic_ulong dropped;
+	logring_t *next;
+};
+
+int log_runtime_level = LOG_DEBUG;
+static int log_backend = LOG_BACKEND_SYSLOG;
+static FILE *log_fh = NULL;
+static int log_opened = 0;
+static size_t log_ring_size;
+
+static atomic_int log_async = 0;
+static unsigned log_generation = 0;
+static _Atomic(logring_t*) log_rings = NULL;
+static pthread_t log_thread;
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+static atomic_int log_sleeping = 0;
+static int log_stop = 0;
+static unsigned long log_dropped_reported = 0;
+
+static __thread logring_t *log_thread_ring = NULL;
+static __thread unsigned log_thread_generation = 0;
+
+static const char *
+log_level_name(int priority)
+{
+	static const char *names[] = {
+		"EMERG", "ALERT", "CRIT", "ERR", "WARNING", "NOTICE", "INFO", "DEBUG"
+	};
+
+	return names[LOG_PRI(priority)];
+}
+
+/* log_write writes one formatted message to the backend */
+static void
+log_write(int priority, time_t time, const char *text)
+{
+	struct tm tm;
+	char stamp[32];
+
+	if (log_backend == LOG_BACKEND_SYSLOG)
+	{
+		syslog(priority, "%s", text);
+		return;
+	}
+	localtime_r(&time, &tm);
+	strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+	fprintf(log_fh, "%s jabsocket[%d]: %s: %s\n", stamp, (int) getpid(),
+		log_level_name(priority), text);
+}
+
+static logring_t *
+log_ring_create(size_t size)
+{
+	logring_t *ring;
+
+	ring = (logring_t*) malloc(sizeof(logring_t));
+	if (ring == NULL)
+		goto Error;
+	memset(ring, 0, sizeof(logring_t));
+	ring->entries = (logentry_t*) malloc(size * sizeof(logentry_t));
+	if (ring->entries == NULL)
+		goto Error;
+	ring->size = size;
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	atomic_init(&ring->dropped, 0);
+	return ring;
+
+Error:
+	free(ring);
+	return NULL;
+}
+
+/* log_get_ring returns the ring of the calling thread, creating it on the
+   first message the thread logs */
+static logring_t *
+log_get_ring()
+{
+	logring_t *ring;
+
+	if ( (log_thread_ring != NULL) &&
+		(log_thread_generation == log_generation) )
+		return log_thread_ring;
+
+	ring = log_ring_create(log_ring_size);
+	if (ring == NULL)
+		return NULL;
+	pthread_mutex_lock(&log_mutex);
+	ring->next = atomic_load(&log_rings);
+	atomic_store(&log_rings, ring);
+	log_thread_generation = log_generation;
+	pthread_mutex_unlock(&log_mutex);
+	log_thread_ring = ring;
+	return ring;
+}
+
+/* log_push formats a message into the ring of the calling thread; returns
+   0 if the thread has no ring */
+static int
+log_push(int priority, const char *format, va_list ap)
+{
+	logring_t *ring;
+	logentry_t *entry;
+	size_t tail;
+
+	ring = log_get_ring();
+	if (ring == NULL)
+		return 0;
+	tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	if (tail - atomic_load_explicit(&ring->head, memory_order_acquire) ==
+		ring->size)
+	{
+		atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+		return 1;
+	}
+	entry = &ring->entries[tail & (ring->size - 1)];
+	entry->priority = priority;
+	entry->time = time(NULL);
+	vsnprintf(entry->text, sizeof(entry->text), format, ap);
+	atomic_store(&ring->tail, tail + 1);
+
+	/* Wake up the log thread if it has gone to sleep */
+	if (atomic_load(&log_sleeping))
+	{
+		pthread_mutex_lock(&log_mutex);
+		atomic_store(&log_sleeping, 0);
+		pthread_cond_signal(&log_cond);
+		pthread_mutex_unlock(&log_mutex);
+	}
+	return 1;
+}
+
+/* log_drain writes out all queued messages; returns the number of
+   messages written */
+static size_t
+log_drain()
+{
+	logring_t *ring;
+	logentry_t *entry;
+	size_t head, tail, count = 0;
+	unsigned long dropped = 0;
+	char text[64];
+
+	for (ring = atomic_load(&log_rings); ring != NULL; ring = ring->next)
+	{
+		head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+		tail = atomic_load(&ring->tail);
+		for (; head != tail; head++)
+		{
+			entry = &ring->entries[head & (ring->size - 1)];
+			log_write(entry->priority, entry->time, entry->text);
+			atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+			count++;
+		}
+		dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+	}
+	if (dropped > log_dropped_reported)
+	{
+		snprintf(text, sizeof(text), "log.c: dropped %lu log messages",
+			dropped - log_dropped_reported);
+		log_write(LOG_WARNING, time(NULL), text);
+		log_dropped_reported = dropped;
+	}
+	if ( (count > 0) && (log_fh != NULL) )
+		fflush(log_fh);
+	return count;
+}
+
+static void *
+log_thread_run(void *arg)
+{
+	struct timespec deadline;
+	int stop = 0;
+
+	(void) arg;
+	while (!stop)
+	{
+		if (log_drain() > 0)
+			continue;
+
+		/* Nothing to write: announce that we're going to sleep and look
+		   once more, so a message pushed in between isn't missed */
+		atomic_store(&log_sleeping, 1);
+		if (log_drain() > 0)
+		{
+			atomic_store(&log_sleeping, 0);
+			continue;
+		}
+		pthread_mutex_lock(&log_mutex);
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += 100000000; /* 100 ms */
+		if (deadline.tv_nsec >= 1000000000)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		if ( atomic_load(&log_sleeping) && !log_stop )
+			pthread_cond_timedwait(&log_cond, &log_mutex, &deadline);
+		atomic_store(&log_sleeping, 0);
+		stop = log_stop;
+		pthread_mutex_unlock(&log_mutex);
+	}
+	log_drain();
+	return NULL;
+}
+
+/* log_free_rings frees the rings left over from a previous logopen. They
+   are not freed in logclose, since other threads may still be logging
+   while the process exits. */
+static void
+log_free_rings()
+{
+	logring_t *ring, *next;
+
+	ring = atomic_exchange(&log_rings, NULL);
+	while (ring != NULL)
+	{
+		next = ring->next;
+		free(ring->entries);
+		free(ring);
+		ring = next;
+	}
+}
+
+int
 logopen(jsconf_t *conf)
 {
-	openlog("jabsocket", LOG_PID, LOG_DAEMON);
-	setlogmask( LOG_UPTO(conf->log_level) );
+	log_runtime_level = conf->log_level;
+	log_backend = conf->log_backend;
+	switch (log_backend)
+	{
+		case LOG_BACKEND_FILE:
+			if (conf->log_file == NULL)
+			{
+				fprintf(stderr, "log_backend is file, but log_file is not set\n");
+				return 0;
+			}
+			log_fh = fopen(conf->log_file, "a");
+			if (log_fh == NULL)
+			{
+				fprintf(stderr, "Error opening log file %s: %s\n",
+					conf->log_file, strerror(errno));
+				return 0;
+			}
+			break;
+		case LOG_BACKEND_STDERR:
+			log_fh = stderr;
+			break;
+		default:
+			log_backend = LOG_BACKEND_SYSLOG;
+			openlog("jabsocket", LOG_PID, LOG_DAEMON);
+			setlogmask( LOG_UPTO(conf->log_level) );
+			break;
+	}
+	log_opened = 1;
 
+	if (conf->log_async)
+	{
+		log_free_rings();
+		log_ring_size = 1;
+		while (log_ring_size < (size_t) conf->log_ring_size)
+			log_ring_size *= 2;
+		log_generation++;
+		log_stop = 0;
+		log_dropped_reported = 0;
+		if (pthread_create(&log_thread, NULL, log_thread_run, NULL) != 0)
+		{
+			fprintf(stderr, "Error starting the log thread, logging "
+				"synchronously\n");
+			return 1;
+		}
+		atomic_store(&log_async, 1);
+	}
+	return 1;
 }
 
 void
-LOG(int priority, const char *format, ...)
+logclose()
+{
+	if (!log_opened)
+		return;
+	if (atomic_exchange(&log_async, 0))
+	{
+		pthread_mutex_lock(&log_mutex);
+		log_stop = 1;
+		pthread_cond_signal(&log_cond);
+		pthread_mutex_unlock(&log_mutex);
+		pthread_join(log_thread, NULL);
+	}
+	if (log_backend == LOG_BACKEND_FILE)
+		fclose(log_fh);
+	else if (log_backend == LOG_BACKEND_SYSLOG)
+		closelog();
+	log_fh = NULL;
+	log_backend = LOG_BACKEND_SYSLOG;
+	log_runtime_level = LOG_DEBUG;
+	log_opened = 0;
+}
+
+unsigned long
+log_get_dropped()
+{
+	logring_t *ring;
+	unsigned long dropped = 0;
+
+	for (ring = atomic_load(&log_rings); ring != NULL; ring = ring->next)
+		dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+	return dropped;
+}
+
+void
+log_message(int priority, const char *format, ...)
 {
 	va_list ap;
 
 	va_start(ap, format);
-	vsyslog(priority, format, ap);
+	VLOG(priority, format, ap);
 	va_end(ap);
 }
 
 void
 VLOG(int priority, const char *format, va_list ap)
 {
-	vsyslog(priority, format, ap);
-}
+	char text[LOG_MESSAGE_SIZE];
+	va_list copy;
 
+	if ( !LOG_ENABLED(priority) )
+		return;
+	if (!log_opened)
+	{
+		vsyslog(priority, format, ap);
+		return;
+	}
+	if (atomic_load_explicit(&log_async, memory_order_relaxed))
+	{
+		va_copy(copy, ap);
+		if (log_push(priority, format, copy))
+		{
+			va_end(copy);
+			return;
+		}
+		va_end(copy);
+	}
+	vsnprintf(text, sizeof(text), format, ap);
+	log_write(priority, time(NULL), text);
+}
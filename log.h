@@ -2,11 +2,55 @@
 #define _LOG_H_
 
 #include "parseconfig.h"
+#include "jabsocketConfig.h"
 #include <stdarg.h>
 
-void logopen(jsconf_t *conf);
-void LOG(int priority, const char *format, ...);
+/* Log backends (log_backend in the configuration) */
+enum
+{
+	LOG_BACKEND_SYSLOG,
+	LOG_BACKEND_FILE,
+	LOG_BACKEND_STDERR
+};
+
+#define LOG_MESSAGE_SIZE 512 /* longer messages are truncated */
+#define LOG_DEFAULT_RING_SIZE 1024
+
+/* logopen opens the configured backend. With log_async, LOG formats the
+   message into a ring buffer owned by the calling thread and a separate
+   thread writes the messages to the backend, so a slow backend never
+   blocks an event loop; when a ring is full the message is dropped and
+   counted. Returns 0 if the backend can't be opened. Until logopen is
+   called, messages go directly to syslog. */
+int logopen(jsconf_t *conf);
+
+/* logclose writes out the queued messages, stops the log thread and
+   closes the backend */
+void logclose();
+
+/* log_get_dropped returns the number of messages dropped so far */
+unsigned long log_get_dropped();
+
+/* Current minimum log level (log_level in the configuration) */
+extern int log_runtime_level;
+
+/* LOG_ENABLED tells whether a message of the given priority would be
+   logged. Priorities above LOG_COMPILE_LEVEL (set with the CMake option of
+   the same name) are known to be disabled at compile time, so LOG calls
+   with them are removed by the compiler along with their arguments; the
+   others cost one comparison when disabled at run time. Use it to guard
+   code that only prepares arguments for LOG. */
+#define LOG_ENABLED(priority) \
+	( (LOG_PRI(priority) <= LOG_COMPILE_LEVEL) && \
+	  (LOG_PRI(priority) <= log_runtime_level) )
+
+#define LOG(priority, ...) \
+	do { \
+		if (LOG_ENABLED(priority)) \
+			log_message((priority), __VA_ARGS__); \
+	} while (0)
+
+void log_message(int priority, const char *format, ...);
 void VLOG(int priority, const char *format, va_list ap);
 
 #endif /* _LOG_H_ */
-
@@ -0,0 +1,116 @@
+#include <stdlib.h>
+#include "CuTest.h"
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "log.h"
+
+#define LOG_TEST_MESSAGES 1000
+
+static void *
+log_test_thread(void *arg)
+{
+	int i;
+
+	for (i = 0; i < LOG_TEST_MESSAGES; i++)
+		LOG(LOG_INFO, "log_test: thread %d message %d", *(int*) arg, i);
+	return NULL;
+}
+
+static jsconf_t *
+log_test_conf(CuTest *tc, const char *file, int ring_size)
+{
+	jsconf_t *conf = config_create();
+
+	CuAssertPtrNotNull(tc, conf);
+	conf->log_level = LOG_INFO;
+	conf->log_backend = LOG_BACKEND_FILE;
+	conf->log_file = strdup(file);
+	conf->log_ring_size = ring_size;
+	unlink(file);
+	return conf;
+}
+
+/* Messages from several threads all arrive in the file, in order for each
+   thread; messages below the log level are not written */
+void TestLogAsyncFile(CuTest *tc)
+{
+	const char *file = "/tmp/jabsocket_log_test.log";
+	jsconf_t *conf;
+	pthread_t threads[2];
+	int ids[2] = {0, 1};
+	int next[2] = {0, 0};
+	char line[LOG_MESSAGE_SIZE + 64];
+	FILE *fh;
+	char *text;
+	int id, number, i;
+
+	conf = log_test_conf(tc, file, 2 * LOG_TEST_MESSAGES);
+	CuAssertTrue(tc, logopen(conf));
+	LOG(LOG_DEBUG, "log_test: filtered");
+	for (i = 0; i < 2; i++)
+		pthread_create(&threads[i], NULL, log_test_thread, &ids[i]);
+	for (i = 0; i < 2; i++)
+		pthread_join(threads[i], NULL);
+	logclose();
+	CuAssertIntEquals(tc, 0, log_get_dropped());
+
+	fh = fopen(file, "r");
+	CuAssertPtrNotNull(tc, fh);
+	while (fgets(line, sizeof(line), fh) != NULL)
+	{
+		CuAssertTrue(tc, strstr(line, "filtered") == NULL);
+		text = strstr(line, ": INFO: log_test: thread ");
+		CuAssertPtrNotNull(tc, text);
+		CuAssertIntEquals(tc, 2, sscanf(text, ": INFO: log_test: thread %d "
+			"message %d", &id, &number));
+		CuAssertIntEquals(tc, next[id], number);
+		next[id]++;
+	}
+	fclose(fh);
+	CuAssertIntEquals(tc, LOG_TEST_MESSAGES, next[0]);
+	CuAssertIntEquals(tc, LOG_TEST_MESSAGES, next[1]);
+	unlink(file);
+	config_delete(conf);
+}
+
+/* With a tiny ring some messages are dropped; every message is either
+   written or counted as dropped */
+void TestLogDrops(CuTest *tc)
+{
+	const char *file = "/tmp/jabsocket_log_test.log";
+	jsconf_t *conf;
+	char line[LOG_MESSAGE_SIZE + 64];
+	FILE *fh;
+	int id = 0, written = 0;
+	unsigned long dropped;
+
+	conf = log_test_conf(tc, file, 4);
+	CuAssertTrue(tc, logopen(conf));
+	log_test_thread(&id);
+	logclose();
+	dropped = log_get_dropped();
+
+	fh = fopen(file, "r");
+	CuAssertPtrNotNull(tc, fh);
+	while (fgets(line, sizeof(line), fh) != NULL)
+	{
+		if (strstr(line, "log_test: thread") != NULL)
+			written++;
+		else
+			CuAssertTrue(tc, strstr(line, "log.c: dropped") != NULL);
+	}
+	fclose(fh);
+	CuAssertIntEquals(tc, LOG_TEST_MESSAGES, written + (int) dropped);
+	unlink(file);
+	config_delete(conf);
+}
+
+CuSuite* LogGetSuite()
+{
+	CuSuite* suite = CuSuiteNew();
+	SUITE_ADD_TEST(suite, TestLogAsyncFile);
+	SUITE_ADD_TEST(suite, TestLogDrops);
+	return suite;
+}
@@ -5,6 +5,7 @@
 #include "parseconfig.h"
 #include <event2/util.h>
 #include "cmanager.h"
+#include "worker.h"
 #include "log.h"
 #include <signal.h>
 #include "jabsocketConfig.h"
@@ -89,17 +90,30 @@ parse_params(int argc, char **argv, struct params_t *params)
 	return 1;
 }
 
+static worker_t **workers = NULL;
+static int worker_count = 0;
+
+/* Workers' counters, for the metrics endpoint and the SIGUSR1 dump */
+static metrics_t **metrics = NULL;
+static int metrics_count = 0;
+
+/* signal_callback runs on worker 0's event loop on SIGINT and SIGTERM. It
+   stops all workers; main then cleans up and closes the log. */
 void
 signal_callback(evutil_socket_t socket, short what, void *ctx)
 {
-	LOG(LOG_INFO, "main.c:signal_callback exiting");
+	int i;
+
+	LOG(LOG_INFO, "main.c:signal_callback exiting (signal %d)", (int) socket);
+	for (i = 1; i < worker_count; i++)
+		worker_stop(workers[i]);
+	event_base_loopbreak(workers[0]->base);
 }
 
 void
-sig_handler(int sig)
+dump_callback(evutil_socket_t socket, short what, void *ctx)
 {
-	LOG(LOG_INFO, "main.c:sig_handler exiting (signal %d)", sig);
-	exit(0);
+	metrics_dump(metrics, metrics_count);
 }
 
 int
@@ -111,9 +125,10 @@ main(int argc, char **argv)
 	struct evutil_addrinfo hints;
 	struct evutil_addrinfo *answer = NULL;
 	int err;
-	wsserver_t *wsserver;
-	struct event_base *base;
-	struct event *signal_event;
+	int i;
+	struct event *int_event, *term_event;
+	metrics_server_t *metrics_server = NULL;
+	struct event *dump_event;
 
 	if ( !parse_params(argc, argv, &params) )
 		usage(argv[0]);
@@ -131,6 +146,9 @@ main(int argc, char **argv)
 		fprintf(stderr, "Error reading configuration\n");
 		exit(-1);
 	}
+	unmask_init();
+	buffer_set_growth_limit(conf->buffer_growth_limit);
+	buffer_set_shrink_threshold(conf->buffer_shrink_threshold);
 	
 	/* Get socket address that we will bind to. */
 
@@ -152,38 +170,115 @@ main(int argc, char **argv)
 		exit(-1);
 	}
 
-	base = event_base_new();
-	if (!base)
-	{
-		puts("Couldn't open event base");
+	if ( !logopen(conf) )
 		exit(-1);
-	}
-
-	logopen(conf);
+	/* Write out queued log messages if main exits early; otherwise the log
+	   is closed once the workers have stopped */
+	atexit(logclose);
+	LOG(LOG_INFO, "main.c:main: unmask implementation: %s",
+		unmask_impl_name( unmask_get_impl() ) );
 
-	wsserver = ws_create(base, answer->ai_addr, answer->ai_addrlen);
-	if (wsserver == NULL)
+	/* Create workers. Each worker has its own event loop and its own
+	   listener; with more than one worker the listeners share the port
+	   through SO_REUSEPORT. */
+	worker_count = conf->workers;
+	if (worker_count < 1)
+		worker_count = 1;
+	workers = (worker_t**) calloc(worker_count, sizeof(worker_t*));
+	if (workers == NULL)
 	{
-		fprintf(stderr, "Error creating WebSocket server\n");
+		fprintf(stderr, "Error creating workers\n");
 		exit(-1);
 	}
-	ws_set_config(wsserver, conf);
+	for (i = 0; i < worker_count; i++)
+	{
+		workers[i] = worker_create(i, conf, answer->ai_addr,
+			answer->ai_addrlen, (worker_count > 1) );
+		if (workers[i] == NULL)
+		{
+			fprintf(stderr, "Error creating WebSocket server\n");
+			exit(-1);
+		}
+	}
 	evutil_freeaddrinfo(answer);
 
-	ws_set_cb(wsserver, cm_create, cm_delete, cmanager, NULL);
-
-	/* NOTE: these don't work for some reason. */
-	signal_event = event_new(base, SIGINT, EV_SIGNAL|EV_PERSIST, signal_callback, NULL);
-	signal_event = event_new(base, SIGTERM, EV_SIGNAL|EV_PERSIST, signal_callback, NULL);
+	/* The metrics endpoint and the SIGUSR1 dump of the latency histograms
+	   run on the event loop of worker 0 and read the counters of all
+	   workers */
+	metrics = (metrics_t**) calloc(worker_count, sizeof(metrics_t*));
+	if (metrics == NULL)
+	{
+		fprintf(stderr, "Error creating metrics\n");
+		exit(-1);
+	}
+	for (i = 0; i < worker_count; i++)
+		metrics[i] = &workers[i]->metrics;
+	metrics_count = worker_count;
+	dump_event = evsignal_new(workers[0]->base, SIGUSR1, dump_callback, NULL);
+	if ( (dump_event == NULL) || (event_add(dump_event, NULL) != 0) )
+	{
+		fprintf(stderr, "Error setting up SIGUSR1\n");
+		exit(-1);
+	}
+	if (conf->metrics_port > 0)
+	{
+		metrics_server = metrics_server_create(workers[0]->base, conf,
+			metrics, worker_count);
+		if (metrics_server == NULL)
+		{
+			fprintf(stderr, "Error creating metrics endpoint\n");
+			exit(-1);
+		}
+	}
 
-	/* NOTE: I have to set up signal handlers in the standard way - outside
-	   libevent, in order to log an exit message. */
-	signal(SIGINT, sig_handler);
-	signal(SIGTERM, sig_handler);
+	/* SIGINT and SIGTERM are handled on the event loop of worker 0, not in
+	   a signal handler, so that logging and stopping the other workers
+	   is safe */
+	int_event = evsignal_new(workers[0]->base, SIGINT, signal_callback,
+		NULL);
+	term_event = evsignal_new(workers[0]->base, SIGTERM, signal_callback,
+		NULL);
+	if ( (int_event == NULL) || (event_add(int_event, NULL) != 0) ||
+		(term_event == NULL) || (event_add(term_event, NULL) != 0) )
+	{
+		fprintf(stderr, "Error setting up SIGINT and SIGTERM\n");
+		exit(-1);
+	}
+	/* A peer that went away must not kill the process: the write fails
+	   with EPIPE and the bufferevent reports the error instead. */
+	signal(SIGPIPE, SIG_IGN);
 
-	event_base_dispatch(base);
+	/* Workers 1..N-1 run in their own threads, worker 0 runs in the main
+	   thread. */
+	for (i = 1; i < worker_count; i++)
+	{
+		if ( !worker_start(workers[i]) )
+		{
+			fprintf(stderr, "Error starting worker %d\n", i);
+			/* Stop the workers already running before the log is closed */
+			while (--i > 0)
+			{
+				worker_stop(workers[i]);
+				worker_join(workers[i]);
+			}
+			exit(-1);
+		}
+	}
+	worker_run(workers[0]);
 
-	ws_delete(wsserver);
+	for (i = 1; i < worker_count; i++)
+		worker_join(workers[i]);
+	if (metrics_server != NULL)
+		metrics_server_delete(metrics_server);
+	event_free(int_event);
+	event_free(term_event);
+	event_free(dump_event);
+	free(metrics);
+	for (i = 0; i < worker_count; i++)
+		worker_delete(workers[i]);
+	free(workers);
+	logclose();
+	config_delete(conf);
 	return 0;
 }
 
@@ -0,0 +1,359 @@
+#include "metrics.h"
+#include <string.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <time.h>
+#include <event2/http.h>
+#include "log.h"
+
+static const int handshake_statuses[METRICS_HANDSHAKE_STATUSES] = {
+	101, 400, 403, 404, 405, 426, 0 /* any other status */
+};
+
+/* Names of the states of cmanager.c, in the same order */
+static const char *session_states[METRICS_SESSION_STATES] = {
+	"start", "connect", "forward", "closed"
+};
+
+struct _metrics_server_t
+{
+	struct evhttp *http;
+	metrics_t **metrics;
+	int count;
+};
+
+void
+metrics_init(metrics_t *metrics)
+{
+	memset(metrics, 0, sizeof(metrics_t));
+}
+
+uint64_t
+metrics_now()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void
+metrics_observe(histogram_t *histogram, uint64_t start)
+{
+	histogram_record(histogram, metrics_now() - start);
+}
+
+void
+metrics_handshake(metrics_t *metrics, int status)
+{
+	int i;
+
+	for (i = 0; i < METRICS_HANDSHAKE_STATUSES - 1; i++)
+	{
+		if (handshake_statuses[i] == status)
+			break;
+	}
+	metric_add(&metrics->handshakes[i], 1);
+}
+
+/* metrics_sum adds up the counter at offset in all metrics_t */
+static unsigned long
+metrics_sum(metrics_t **metrics, int count, size_t offset)
+{
+	unsigned long sum = 0;
+	int i;
+
+	for (i = 0; i < count; i++)
+		sum += metric_get( (metric_t*) ((char*) metrics[i] + offset) );
+	return sum;
+}
+
+#define METRICS_SUM(field) \
+	metrics_sum(metrics, count, offsetof(metrics_t, field))
+
+static void
+metrics_format_counter(struct evbuffer *out, const char *name,
+	const char *help, unsigned long value)
+{
+	evbuffer_add_printf(out, "# HELP %s %s\n# TYPE %s counter\n%s %lu\n",
+		name, help, name, name, value);
+}
+
+/* metrics_sum_histogram adds up the histogram at offset in all
+   metrics_t */
+static void
+metrics_sum_histogram(histogram_sum_t *sum, metrics_t **metrics, int count,
+	size_t offset)
+{
+	int i;
+
+	histogram_sum_init(sum);
+	for (i = 0; i < count; i++)
+		histogram_sum_add(sum, (histogram_t*) ((char*) metrics[i] + offset) );
+}
+
+/* Histograms are exposed with one bucket per power of two; the
+   log-linear buckets inside are only used for the quantiles of
+   metrics_dump. Values are integers (microseconds for durations), so the
+   values below 2^i are those up to 2^i - 1, which is the bucket's
+   (inclusive) le. Durations are divided by 1e6 to get seconds, counts are
+   exposed as they are (scale 1). */
+static void
+metrics_format_histogram(struct evbuffer *out, const char *name,
+	const char *help, metrics_t **metrics, int count, size_t offset,
+	double scale)
+{
+	histogram_sum_t sum;
+	int digits = (scale > 1) ? 6 : 0;
+	int i;
+
+	metrics_sum_histogram(&sum, metrics, count, offset);
+	evbuffer_add_printf(out, "# HELP %s %s\n# TYPE %s histogram\n",
+		name, help, name);
+	for (i = 0; i <= HISTOGRAM_MAX_BITS; i++)
+		evbuffer_add_printf(out, "%s_bucket{le=\"%.*f\"} %lu\n", name,
+			digits, (double) (((uint64_t) 1 << i) - 1) / scale,
+			histogram_sum_count_below(&sum, (uint64_t) 1 << i) );
+	evbuffer_add_printf(out, "%s_bucket{le=\"+Inf\"} %lu\n"
+		"%s_sum %.*f\n%s_count %lu\n", name, sum.count,
+		name, digits, sum.sum / scale, name, sum.count);
+}
+
+#define METRICS_HISTOGRAM(name, help, field) \
+	metrics_format_histogram(out, name, help, metrics, count, \
+		offsetof(metrics_t, field), 1e6)
+
+/* metrics_sum_backend adds up the counter at offset of backend i of all
+   workers; the workers have the same pools */
+static unsigned long
+metrics_sum_backend(metrics_t **metrics, int count, size_t i, size_t offset)
+{
+	unsigned long sum = 0;
+	int j;
+
+	for (j = 0; j < count; j++)
+		sum += metric_get( (metric_t*) ((char*) &metrics[j]->backends[i] +
+			offset) );
+	return sum;
+}
+
+static void
+metrics_format_backends(struct evbuffer *out, const char *name,
+	const char *type, const char *help, metrics_t **metrics, int count,
+	size_t offset)
+{
+	backend_metrics_t *backend;
+	size_t i;
+
+	evbuffer_add_printf(out, "# HELP %s %s\n# TYPE %s %s\n",
+		name, help, name, type);
+	for (i = 0; i < metrics[0]->backend_count; i++)
+	{
+		backend = &metrics[0]->backends[i];
+		evbuffer_add_printf(out, "%s{domain=\"%s\",server=\"%s\"} %lu\n",
+			name, backend->domain, backend->server,
+			metrics_sum_backend(metrics, count, i, offset));
+	}
+}
+
+void
+metrics_format(struct evbuffer *out, metrics_t **metrics, int count)
+{
+	int i;
+
+	metrics_format_counter(out, "jabsocket_connections_total",
+		"Connections accepted from browsers.", METRICS_SUM(connections));
+
+	evbuffer_add_printf(out, "# HELP jabsocket_handshakes_total Opening "
+		"handshakes by HTTP status of the response.\n"
+		"# TYPE jabsocket_handshakes_total counter\n");
+	for (i = 0; i < METRICS_HANDSHAKE_STATUSES; i++)
+	{
+		if (handshake_statuses[i] != 0)
+			evbuffer_add_printf(out,
+				"jabsocket_handshakes_total{status=\"%d\"} %lu\n",
+				handshake_statuses[i], METRICS_SUM(handshakes[i]));
+		else
+			evbuffer_add_printf(out,
+				"jabsocket_handshakes_total{status=\"other\"} %lu\n",
+				METRICS_SUM(handshakes[i]));
+	}
+	metrics_format_counter(out, "jabsocket_handshake_errors_total",
+		"Malformed opening handshakes.", METRICS_SUM(handshake_errors));
+
+	evbuffer_add_printf(out, "# HELP jabsocket_sessions Sessions by state.\n"
+		"# TYPE jabsocket_sessions gauge\n");
+	for (i = 0; i < METRICS_SESSION_STATES; i++)
+		evbuffer_add_printf(out, "jabsocket_sessions{state=\"%s\"} %lu\n",
+			session_states[i], METRICS_SUM(sessions[i]));
+
+	metrics_format_counter(out, "jabsocket_frames_received_total",
+		"WebSocket frames received from browsers.", METRICS_SUM(frames_in));
+	metrics_format_counter(out, "jabsocket_frames_sent_total",
+		"WebSocket frames sent to browsers.", METRICS_SUM(frames_out));
+	metrics_format_counter(out, "jabsocket_bytes_received_total",
+		"Bytes received from browsers.", METRICS_SUM(bytes_in));
+	metrics_format_counter(out, "jabsocket_bytes_sent_total",
+		"Bytes sent to browsers.", METRICS_SUM(bytes_out));
+	metrics_format_counter(out, "jabsocket_stanzas_total",
+		"Stanzas framed from XMPP servers.", METRICS_SUM(stanzas));
+
+	METRICS_HISTOGRAM("jabsocket_handshake_seconds",
+		"Time from accepting a connection to the handshake response.",
+		handshake);
+	METRICS_HISTOGRAM("jabsocket_xmpp_connect_seconds",
+		"Time to connect to the XMPP server.", xmpp_connect);
+	metrics_format_counter(out, "jabsocket_xmpp_connect_failures_total",
+		"Failed connections to XMPP servers.",
+		METRICS_SUM(xmpp_connect_failures));
+	metrics_format_counter(out, "jabsocket_xmpp_failovers_total",
+		"Sessions retried on another server of a pool.",
+		METRICS_SUM(xmpp_failovers));
+	evbuffer_add_printf(out, "# HELP jabsocket_xmpp_tls_handshakes_total "
+		"TLS handshakes with XMPP servers, full or resuming a session.\n"
+		"# TYPE jabsocket_xmpp_tls_handshakes_total counter\n"
+		"jabsocket_xmpp_tls_handshakes_total{type=\"full\"} %lu\n"
+		"jabsocket_xmpp_tls_handshakes_total{type=\"resumed\"} %lu\n",
+		METRICS_SUM(xmpp_tls_full), METRICS_SUM(xmpp_tls_resumed));
+	metrics_format_counter(out, "jabsocket_xmpp_tls_failures_total",
+		"Failed STARTTLS negotiations and TLS handshakes with XMPP servers.",
+		METRICS_SUM(xmpp_tls_failures));
+	if ( (count > 0) && (metrics[0]->backend_count > 0) )
+	{
+		metrics_format_backends(out, "jabsocket_xmpp_server_connections",
+			"gauge", "Sessions connecting or connected to a server of a pool.",
+			metrics, count, offsetof(backend_metrics_t, connections));
+		metrics_format_backends(out, "jabsocket_xmpp_server_sessions_total",
+			"counter", "Sessions sent to a server of a pool.",
+			metrics, count, offsetof(backend_metrics_t, sessions));
+		metrics_format_backends(out, "jabsocket_xmpp_server_failures_total",
+			"counter", "Failed connections and health checks of a server of "
+			"a pool.", metrics, count, offsetof(backend_metrics_t, failures));
+		metrics_format_backends(out, "jabsocket_xmpp_server_up",
+			"gauge", "Number of workers that consider a server of a pool "
+			"healthy.", metrics, count, offsetof(backend_metrics_t, up));
+	}
+	METRICS_HISTOGRAM("jabsocket_dns_seconds",
+		"Time to resolve the XMPP server (including cache hits).", dns);
+	metrics_format_counter(out, "jabsocket_dns_failures_total",
+		"Failed lookups of XMPP servers.", METRICS_SUM(dns_failures));
+
+	METRICS_HISTOGRAM("jabsocket_to_xmpp_seconds",
+		"Time from reading a message from the browser to writing it to "
+		"the XMPP server.", to_xmpp);
+	METRICS_HISTOGRAM("jabsocket_to_browser_seconds",
+		"Time from reading stanzas from the XMPP server to writing them "
+		"to the browser's socket.", to_browser);
+	metrics_format_histogram(out, "jabsocket_write_batch_stanzas",
+		"Stanzas written to the browser per write pass (coalesce_writes).",
+		metrics, count, offsetof(metrics_t, write_batch), 1);
+
+	metrics_format_counter(out, "jabsocket_log_dropped_total",
+		"Log messages dropped because a log queue was full.",
+		log_get_dropped());
+}
+
+static void
+metrics_dump_histogram(const char *name, const char *unit,
+	metrics_t **metrics, int count, size_t offset)
+{
+	histogram_sum_t sum;
+
+	metrics_sum_histogram(&sum, metrics, count, offset);
+	LOG(LOG_NOTICE, "metrics.c:metrics_dump: %s: count %lu, mean %.1f %s, "
+		"p50 %lu %s, p90 %lu %s, p99 %lu %s, p99.9 %lu %s, max %lu %s",
+		name, sum.count, sum.count > 0 ? (double) sum.sum / sum.count : 0.0,
+		unit, (unsigned long) histogram_sum_quantile(&sum, 0.5), unit,
+		(unsigned long) histogram_sum_quantile(&sum, 0.9), unit,
+		(unsigned long) histogram_sum_quantile(&sum, 0.99), unit,
+		(unsigned long) histogram_sum_quantile(&sum, 0.999), unit,
+		sum.max, unit);
+}
+
+void
+metrics_dump(metrics_t **metrics, int count)
+{
+	metrics_dump_histogram("handshake", "us", metrics, count,
+		offsetof(metrics_t, handshake));
+	metrics_dump_histogram("xmpp_connect", "us", metrics, count,
+		offsetof(metrics_t, xmpp_connect));
+	metrics_dump_histogram("dns", "us", metrics, count,
+		offsetof(metrics_t, dns));
+	metrics_dump_histogram("to_xmpp", "us", metrics, count,
+		offsetof(metrics_t, to_xmpp));
+	metrics_dump_histogram("to_browser", "us", metrics, count,
+		offsetof(metrics_t, to_browser));
+	metrics_dump_histogram("write_batch", "stanzas", metrics, count,
+		offsetof(metrics_t, write_batch));
+}
+
+static void
+metrics_http_cb(struct evhttp_request *req, void *arg)
+{
+	metrics_server_t *server = (metrics_server_t*) arg;
+	struct evbuffer *out;
+
+	if ( (evhttp_request_get_command(req) != EVHTTP_REQ_GET) ||
+		(strcmp(evhttp_request_get_uri(req), "/metrics") != 0) )
+	{
+		evhttp_send_error(req, HTTP_NOTFOUND, NULL);
+		return;
+	}
+	out = evbuffer_new();
+	if (out == NULL)
+	{
+		evhttp_send_error(req, HTTP_INTERNAL, NULL);
+		return;
+	}
+	metrics_format(out, server->metrics, server->count);
+	evhttp_add_header(evhttp_request_get_output_headers(req),
+		"Content-Type", "text/plain; version=0.0.4");
+	evhttp_send_reply(req, HTTP_OK, "OK", out);
+	evbuffer_free(out);
+}
+
+metrics_server_t *
+metrics_server_create(struct event_base *base, jsconf_t *conf,
+	metrics_t **metrics, int count)
+{
+	metrics_server_t *server;
+	const char *address;
+
+	address = (conf->metrics_listen != NULL) ? conf->metrics_listen :
+		"127.0.0.1";
+	server = (metrics_server_t*) malloc(sizeof(metrics_server_t));
+	if (server == NULL)
+		goto Error;
+	memset(server, 0, sizeof(metrics_server_t));
+	server->metrics = metrics;
+	server->count = count;
+	server->http = evhttp_new(base);
+	if (server->http == NULL)
+		goto Error;
+	if (evhttp_bind_socket(server->http, address, conf->metrics_port) != 0)
+	{
+		LOG(LOG_ERR, "metrics.c:metrics_server_create: couldn't listen on "
+			"%s:%d", address, conf->metrics_port);
+		goto Error;
+	}
+	evhttp_set_gencb(server->http, metrics_http_cb, server);
+	LOG(LOG_INFO, "metrics.c:metrics_server_create: metrics on %s:%d",
+		address, conf->metrics_port);
+	return server;
+
+Error:
+	if (server != NULL)
+	{
+		if (server->http != NULL)
+			evhttp_free(server->http);
+		free(server);
+	}
+	return NULL;
+}
+
+void
+metrics_server_delete(metrics_server_t *server)
+{
+	evhttp_free(server->http);
+	free(server);
+}
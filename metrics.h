@@ -0,0 +1,122 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include "parseconfig.h"
+#include "histogram.h"
+
+/* Counters of one worker. Only the worker's own thread updates them, so
+   an update is a plain load and store; they are atomic only so that the
+   metrics endpoint can read all workers' counters from another thread
+   without locks. */
+typedef atomic_ulong metric_t;
+
+/* Handshake responses counted by status (rq_analyze) */
+#define METRICS_HANDSHAKE_STATUSES 7
+/* Session states (the states of a connection manager, see cmanager.h) */
+#define METRICS_SESSION_STATES 4
+/* Length of the names of a server of a pool */
+#define METRICS_BACKEND_NAME 272
+
+/* Counters of one server of an XMPP server pool (see pool.h). Every worker
+   has its own array of them, for all pools, in the order of the
+   configuration. */
+typedef struct _backend_metrics_t
+{
+	char domain[METRICS_BACKEND_NAME]; /* domain of the pool */
+	char server[METRICS_BACKEND_NAME]; /* host:port */
+	metric_t connections; /* gauge: sessions connecting or connected */
+	metric_t sessions;    /* sessions sent to the server */
+	metric_t failures;    /* failed connections and health checks */
+	metric_t up;          /* gauge: 1 if the server is considered healthy */
+} backend_metrics_t;
+
+typedef struct _metrics_t
+{
+	metric_t connections; /* connections accepted from browsers */
+	metric_t handshakes[METRICS_HANDSHAKE_STATUSES];
+	metric_t handshake_errors; /* malformed requests, no response sent */
+	metric_t sessions[METRICS_SESSION_STATES]; /* gauge */
+	metric_t frames_in;  /* WebSocket frames from browsers */
+	metric_t frames_out; /* WebSocket frames to browsers */
+	metric_t bytes_in;
+	metric_t bytes_out;
+	metric_t stanzas; /* stanzas framed from XMPP servers */
+	metric_t xmpp_connect_failures;
+	metric_t xmpp_failovers; /* connections retried on another server */
+	metric_t xmpp_tls_full;     /* TLS handshakes with XMPP servers */
+	metric_t xmpp_tls_resumed;  /* ... that resumed a cached session */
+	metric_t xmpp_tls_failures; /* failed STARTTLS negotiations */
+	metric_t dns_failures;
+
+	/* XMPP server pools, set up by the worker */
+	backend_metrics_t *backends;
+	size_t backend_count;
+
+	/* Durations in microseconds */
+	histogram_t handshake;    /* connection accepted to handshake response */
+	histogram_t xmpp_connect; /* connecting to the XMPP server */
+	histogram_t dns;          /* resolving the XMPP server */
+	histogram_t to_xmpp;      /* message read from the browser to written
+	                             to the XMPP server */
+	histogram_t to_browser;   /* stanzas read from the XMPP server to
+	                             written to the browser's socket */
+
+	/* Stanzas written to the browser per write pass (coalesce_writes) */
+	histogram_t write_batch;
+} metrics_t;
+
+static inline void
+metric_add(metric_t *metric, unsigned long n)
+{
+	atomic_store_explicit(metric,
+		atomic_load_explicit(metric, memory_order_relaxed) + n,
+		memory_order_relaxed);
+}
+
+static inline void
+metric_sub(metric_t *metric, unsigned long n)
+{
+	atomic_store_explicit(metric,
+		atomic_load_explicit(metric, memory_order_relaxed) - n,
+		memory_order_relaxed);
+}
+
+static inline unsigned long
+metric_get(metric_t *metric)
+{
+	return atomic_load_explicit(metric, memory_order_relaxed);
+}
+
+void metrics_init(metrics_t *metrics);
+
+/* metrics_now returns a monotonic time in microseconds */
+uint64_t metrics_now();
+
+/* metrics_observe records a duration that started at start (metrics_now) */
+void metrics_observe(histogram_t *histogram, uint64_t start);
+
+/* metrics_handshake counts a handshake response with the given HTTP
+   status */
+void metrics_handshake(metrics_t *metrics, int status);
+
+/* metrics_format writes the sum of the counters of count workers to out
+   in the Prometheus text format */
+void metrics_format(struct evbuffer *out, metrics_t **metrics, int count);
+
+/* metrics_dump logs the count and quantiles of all durations and of the
+   write batch sizes (at LOG_NOTICE) */
+void metrics_dump(metrics_t **metrics, int count);
+
+/* HTTP server for the metrics endpoint (GET /metrics). It runs on an
+   event loop of one worker and reads the counters of all of them. */
+typedef struct _metrics_server_t metrics_server_t;
+
+metrics_server_t *metrics_server_create(struct event_base *base,
+	jsconf_t *conf, metrics_t **metrics, int count);
+void metrics_server_delete(metrics_server_t *server);
+
+#endif /* _METRICS_H_ */
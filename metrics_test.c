@@ -0,0 +1,176 @@
+#include <stdlib.h>
+#include "CuTest.h"
+#include <string.h>
+#include <event2/buffer.h>
+#include "metrics.h"
+
+static char *
+format_metrics(metrics_t **metrics, int count)
+{
+	struct evbuffer *out = evbuffer_new();
+	size_t length;
+	char *text;
+
+	metrics_format(out, metrics, count);
+	length = evbuffer_get_length(out);
+	text = (char*) malloc(length + 1);
+	evbuffer_remove(out, text, length);
+	text[length] = '\0';
+	evbuffer_free(out);
+	return text;
+}
+
+/* The counters of all workers are added up */
+void TestMetricsFormat(CuTest *tc)
+{
+	metrics_t worker0, worker1;
+	metrics_t *metrics[2] = {&worker0, &worker1};
+	char *text;
+
+	metrics_init(&worker0);
+	metrics_init(&worker1);
+	metric_add(&worker0.connections, 3);
+	metric_add(&worker1.connections, 4);
+	metrics_handshake(&worker0, 101);
+	metrics_handshake(&worker1, 101);
+	metrics_handshake(&worker1, 403);
+	metrics_handshake(&worker1, 500);
+	metric_add(&worker0.sessions[2], 2);
+	metric_add(&worker1.sessions[2], 1);
+	metric_sub(&worker1.sessions[2], 1);
+	metric_add(&worker0.bytes_out, 1000);
+	metric_add(&worker1.bytes_out, 24);
+	histogram_record(&worker0.xmpp_connect, 3);
+	histogram_record(&worker0.xmpp_connect, 1497);
+	histogram_record(&worker1.xmpp_connect, 500);
+	histogram_record(&worker1.xmpp_connect, 1024);
+	metric_add(&worker0.xmpp_tls_full, 2);
+	metric_add(&worker0.xmpp_tls_resumed, 5);
+	metric_add(&worker1.xmpp_tls_resumed, 1);
+	histogram_record(&worker0.write_batch, 1);
+	histogram_record(&worker0.write_batch, 12);
+	histogram_record(&worker1.write_batch, 3);
+
+	text = format_metrics(metrics, 2);
+	CuAssertPtrNotNull(tc, strstr(text,
+		"# TYPE jabsocket_connections_total counter\n"
+		"jabsocket_connections_total 7\n"));
+	CuAssertPtrNotNull(tc, strstr(text,
+		"jabsocket_handshakes_total{status=\"101\"} 2\n"));
+	CuAssertPtrNotNull(tc, strstr(text,
+		"jabsocket_handshakes_total{status=\"403\"} 1\n"));
+	CuAssertPtrNotNull(tc, strstr(text,
+		"jabsocket_handshakes_total{status=\"404\"} 0\n"));
+	CuAssertPtrNotNull(tc, strstr(text,
+		"jabsocket_handshakes_total{status=\"other\"} 1\n"));
+	CuAssertPtrNotNull(tc, strstr(text,
+		"jabsocket_sessions{state=\"forward\"} 2\n"));
+	CuAssertPtrNotNull(tc, strstr(text,
+		"jabsocket_sessions{state=\"start\"} 0\n"));
+	CuAssertPtrNotNull(tc, strstr(text, "jabsocket_bytes_sent_total 1024\n"));
+	CuAssertPtrNotNull(tc, strstr(text,
+		"jabsocket_xmpp_tls_handshakes_total{type=\"full\"} 2\n"
+		"jabsocket_xmpp_tls_handshakes_total{type=\"resumed\"} 6\n"));
+	CuAssertPtrNotNull(tc, strstr(text,
+		"jabsocket_xmpp_tls_failures_total 0\n"));
+	CuAssertPtrNotNull(tc, strstr(text,
+		"# TYPE jabsocket_xmpp_connect_seconds histogram\n"
+		"jabsocket_xmpp_connect_seconds_bucket{le=\"0.000000\"} 0\n"
+		"jabsocket_xmpp_connect_seconds_bucket{le=\"0.000001\"} 0\n"
+		"jabsocket_xmpp_connect_seconds_bucket{le=\"0.000003\"} 1\n"));
+	/* 1024 microseconds is above le="0.001023" */
+	CuAssertPtrNotNull(tc, strstr(text,
+		"jabsocket_xmpp_connect_seconds_bucket{le=\"0.000511\"} 2\n"
+		"jabsocket_xmpp_connect_seconds_bucket{le=\"0.001023\"} 2\n"
+		"jabsocket_xmpp_connect_seconds_bucket{le=\"0.002047\"} 4\n"));
+	CuAssertPtrNotNull(tc, strstr(text,
+		"jabsocket_xmpp_connect_seconds_bucket{le=\"+Inf\"} 4\n"
+		"jabsocket_xmpp_connect_seconds_sum 0.003024\n"
+		"jabsocket_xmpp_connect_seconds_count 4\n"));
+	/* Batch sizes are counts, not durations */
+	CuAssertPtrNotNull(tc, strstr(text,
+		"# TYPE jabsocket_write_batch_stanzas histogram\n"
+		"jabsocket_write_batch_stanzas_bucket{le=\"0\"} 0\n"
+		"jabsocket_write_batch_stanzas_bucket{le=\"1\"} 1\n"
+		"jabsocket_write_batch_stanzas_bucket{le=\"3\"} 2\n"
+		"jabsocket_write_batch_stanzas_bucket{le=\"7\"} 2\n"
+		"jabsocket_write_batch_stanzas_bucket{le=\"15\"} 3\n"));
+	CuAssertPtrNotNull(tc, strstr(text,
+		"jabsocket_write_batch_stanzas_bucket{le=\"+Inf\"} 3\n"
+		"jabsocket_write_batch_stanzas_sum 16\n"
+		"jabsocket_write_batch_stanzas_count 3\n"));
+	free(text);
+}
+
+/* Counters of the servers of pools are added up by server */
+void TestMetricsBackends(CuTest *tc)
+{
+	metrics_t worker0, worker1;
+	metrics_t *metrics[2] = {&worker0, &worker1};
+	backend_metrics_t backends0[2], backends1[2];
+	char *text;
+
+	metrics_init(&worker0);
+	metrics_init(&worker1);
+	text = format_metrics(metrics, 2);
+	CuAssertTrue(tc, strstr(text, "jabsocket_xmpp_server_") == NULL);
+	free(text);
+
+	memset(backends0, 0, sizeof(backends0));
+	memset(backends1, 0, sizeof(backends1));
+	strcpy(backends0[0].domain, "example.com");
+	strcpy(backends0[0].server, "xmpp1.example.com:5222");
+	strcpy(backends0[1].domain, "example.com");
+	strcpy(backends0[1].server, "[2001:db8::1]:5222");
+	worker0.backends = backends0;
+	worker0.backend_count = 2;
+	worker1.backends = backends1;
+	worker1.backend_count = 2;
+	metric_add(&backends0[0].connections, 3);
+	metric_add(&backends1[0].connections, 4);
+	metric_add(&backends1[1].failures, 2);
+	metric_add(&backends0[0].up, 1);
+	metric_add(&backends1[0].up, 1);
+	metric_add(&backends1[1].up, 1);
+	metric_add(&worker1.xmpp_failovers, 2);
+
+	text = format_metrics(metrics, 2);
+	CuAssertPtrNotNull(tc, strstr(text,
+		"# TYPE jabsocket_xmpp_server_connections gauge\n"
+		"jabsocket_xmpp_server_connections{domain=\"example.com\","
+		"server=\"xmpp1.example.com:5222\"} 7\n"
+		"jabsocket_xmpp_server_connections{domain=\"example.com\","
+		"server=\"[2001:db8::1]:5222\"} 0\n"));
+	CuAssertPtrNotNull(tc, strstr(text,
+		"jabsocket_xmpp_server_failures_total{domain=\"example.com\","
+		"server=\"[2001:db8::1]:5222\"} 2\n"));
+	CuAssertPtrNotNull(tc, strstr(text,
+		"jabsocket_xmpp_server_up{domain=\"example.com\","
+		"server=\"xmpp1.example.com:5222\"} 2\n"
+		"jabsocket_xmpp_server_up{domain=\"example.com\","
+		"server=\"[2001:db8::1]:5222\"} 1\n"));
+	CuAssertPtrNotNull(tc, strstr(text, "jabsocket_xmpp_failovers_total 2\n"));
+	free(text);
+}
+
+void TestMetricsObserve(CuTest *tc)
+{
+	metrics_t metrics;
+	uint64_t start;
+
+	metrics_init(&metrics);
+	start = metrics_now();
+	metrics_observe(&metrics.dns, start - 250);
+	CuAssertIntEquals(tc, 1, metric_get(&metrics.dns.count));
+	CuAssertTrue(tc, metric_get(&metrics.dns.sum) >= 250);
+	CuAssertTrue(tc, metric_get(&metrics.dns.sum) < 1000000);
+}
+
+CuSuite* MetricsGetSuite()
+{
+	CuSuite* suite = CuSuiteNew();
+	SUITE_ADD_TEST(suite, TestMetricsFormat);
+	SUITE_ADD_TEST(suite, TestMetricsBackends);
+	SUITE_ADD_TEST(suite, TestMetricsObserve);
+	return suite;
+}
@@ -0,0 +1,1002 @@
+/* jabsocket_mockxmpp - mock XMPP server for offline load tests
+
+   Answers the opening <stream:stream> of every client with a stream
+   header and stream features, then echoes every stanza the client sends
+   and optionally copies it to other sessions (fan-out). A script of steps
+   run on every new session can push rosters and floods of presences or
+   messages, and latency and disconnects can be injected, so jabsocket's
+   forwarding path can be measured and tested without an XMPP server.
+   With --starttls, clients have to negotiate TLS before the stream is
+   opened. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/listener.h>
+#include <event2/bufferevent_ssl.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <openssl/err.h>
+#include "framer.h"
+
+#define MOCK_MAX_STEPS 64
+#define MOCK_FLOOD_TICK_US 10000 /* shortest interval of flood timers */
+#define MOCK_NS_TLS "urn:ietf:params:xml:ns:xmpp-tls"
+#define MOCK_STREAM_HEADER "<?xml version='1.0'?>" \
+	"<stream:stream xmlns='jabber:client' " \
+	"xmlns:stream='http://etherx.jabber.org/streams' id='mock%lu' " \
+	"from='%s' version='1.0' xml:lang='en'>"
+
+/* Script steps */
+enum
+{
+	STEP_ROSTER,     /* roster <items> */
+	STEP_PRESENCE,   /* presence <count> <size> */
+	STEP_MESSAGE,    /* message <count> <size> */
+	STEP_FLOOD,      /* flood <rate> <size> <seconds> */
+	STEP_WAIT,       /* wait <ms> */
+	STEP_DISCONNECT  /* disconnect */
+};
+
+typedef struct _step_t
+{
+	int type;
+	double count; /* items, stanzas, stanzas per second or milliseconds */
+	int size;     /* payload bytes */
+	double seconds;
+} step_t;
+
+struct params_t
+{
+	char *listen; /* address to listen on */
+	int port;
+	char *domain; /* from attribute of the stream header */
+	int fanout;   /* other sessions that get a copy of a stanza, -1 = all */
+	double latency; /* milliseconds before a stanza is delivered */
+	double jitter;  /* up to this many milliseconds more */
+	unsigned long disconnect_after; /* stanzas received before a session
+	                                   is dropped, 0 = never */
+	double disconnect_probability;  /* of dropping a session per stanza */
+	int starttls; /* clients have to negotiate TLS */
+	char *cert;   /* PEM files of the certificate and its key, NULL for a */
+	char *key;    /* self-signed certificate */
+	step_t steps[MOCK_MAX_STEPS];
+	int step_count;
+};
+
+/* Client states */
+enum
+{
+	MOCK_ST_OPENING, /* waiting for the client's stream header */
+	MOCK_ST_STARTTLS,/* waiting for <starttls/> */
+	MOCK_ST_OPEN,    /* exchanging stanzas */
+	MOCK_ST_CLOSING  /* stream closed, flushing the output */
+};
+
+/* Output held back to add latency */
+typedef struct _delayed_t
+{
+	uint64_t deadline;
+	size_t length;
+} delayed_t;
+
+typedef struct _mockconn_t
+{
+	struct bufferevent *bev;
+	framer_t *framer;
+	int state;
+	int tls;                  /* 1 once the stream runs over TLS */
+	unsigned long id;
+	int index;                /* in sessions */
+	unsigned long received;   /* stanzas */
+	unsigned long generated;  /* stanzas sent by the script */
+	/* Script */
+	int step;
+	struct event *step_timer;
+	double flood_credit;
+	uint64_t flood_end;
+	/* Latency */
+	struct evbuffer *delayed;
+	delayed_t *queue;         /* ring of delayed stanzas */
+	size_t queue_first, queue_count, queue_size;
+	struct event *delay_timer;
+} mockconn_t;
+
+static struct params_t params;
+static struct event_base *base;
+static SSL_CTX *tls_ctx = NULL; /* --starttls */
+static mockconn_t **sessions = NULL; /* connected clients, for fan-out */
+static int session_count = 0;
+static int session_size = 0;
+static unsigned long seed = 1;
+
+static struct
+{
+	unsigned long connections;
+	unsigned long streams;
+	unsigned long stanzas_in;
+	unsigned long stanzas_out;
+	unsigned long generated;
+	unsigned long disconnects; /* injected */
+	unsigned long tls_handshakes;
+	unsigned long tls_resumed;
+} stats;
+
+static void mockconn_delete(mockconn_t *conn);
+static void mockconn_close(mockconn_t *conn);
+static void mockconn_event_cb(struct bufferevent *bev, short events,
+	void *ctx);
+static void mockconn_run_script(mockconn_t *conn);
+static void mockconn_read_cb(struct bufferevent *bev, void *ctx);
+
+static uint64_t
+now_us(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static double
+mock_random(void)
+{
+	seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+	return ((seed >> 33) & 0x7fffffff) / 2147483648.0;
+}
+
+static void
+usage(char *prog)
+{
+	fprintf(stderr, "Usage: %s <options>\n", prog);
+	fprintf(stderr,
+"Options:\n"
+"  --listen, -l <address>              - Address to listen on\n"
+"                                        (default is 127.0.0.1)\n"
+"  --port, -p <port>                   - Port (default is 5222)\n"
+"  --domain, -d <domain>               - Domain in the stream header\n"
+"                                        (default is localhost)\n"
+"  --fanout, -f <n>                    - Copy every stanza to n other\n"
+"                                        sessions as well, -1 for all\n"
+"                                        (default is 0, only echo)\n"
+"  --latency, -L <ms>                  - Delay of every stanza\n"
+"  --jitter, -J <ms>                   - Random additional delay\n"
+"  --disconnect-after, -a <n>          - Drop a session after it sent n\n"
+"                                        stanzas\n"
+"  --disconnect-probability, -P <p>    - Probability of dropping a\n"
+"                                        session at each stanza\n"
+"  --step, -s <step>                   - Add a step to the script run on\n"
+"                                        every session, can be repeated\n"
+"  --script, -S <file>                 - Add the steps in the file, one\n"
+"                                        per line\n"
+"  --starttls, -t                      - Require STARTTLS\n"
+"  --cert, -c <file>                   - Certificate for STARTTLS (PEM),\n"
+"                                        self-signed if not given\n"
+"  --key, -k <file>                    - Private key of the certificate\n"
+"  --help, -h                          - Help message\n"
+"Script steps:\n"
+"  roster <items>                      - Send a roster with items\n"
+"  presence <count> <size>             - Send presences with a status of\n"
+"                                        size bytes\n"
+"  message <count> <size>              - Send messages with a body of size\n"
+"                                        bytes\n"
+"  flood <rate> <size> <seconds>       - Send presences at rate per second\n"
+"  wait <ms>                           - Wait\n"
+"  disconnect                          - Close the stream\n"
+	);
+
+	exit(0);
+}
+
+/* parse_step adds the step in text to the script; returns 0 if it is
+   invalid */
+static int
+parse_step(const char *text, struct params_t *params)
+{
+	step_t *step;
+	char name[16];
+	int n;
+
+	n = sscanf(text, " %15s", name);
+	if ( (n < 1) || (name[0] == '#') )
+		return 1; /* blank line or comment */
+	if (params->step_count == MOCK_MAX_STEPS)
+		return 0;
+	step = &params->steps[params->step_count];
+	memset(step, 0, sizeof(*step));
+	if (strcmp(name, "roster") == 0)
+	{
+		step->type = STEP_ROSTER;
+		n = (sscanf(text, " %*s %lf", &step->count) == 1);
+	}
+	else if ( (strcmp(name, "presence") == 0) ||
+		(strcmp(name, "message") == 0) )
+	{
+		step->type = (name[0] == 'p') ? STEP_PRESENCE : STEP_MESSAGE;
+		n = (sscanf(text, " %*s %lf %d", &step->count, &step->size) == 2);
+	}
+	else if (strcmp(name, "flood") == 0)
+	{
+		step->type = STEP_FLOOD;
+		n = (sscanf(text, " %*s %lf %d %lf", &step->count, &step->size,
+			&step->seconds) == 3) && (step->count > 0);
+	}
+	else if (strcmp(name, "wait") == 0)
+	{
+		step->type = STEP_WAIT;
+		n = (sscanf(text, " %*s %lf", &step->count) == 1);
+	}
+	else if (strcmp(name, "disconnect") == 0)
+		step->type = STEP_DISCONNECT;
+	else
+		n = 0;
+	if ( !n || (step->count < 0) || (step->size < 0) )
+		return 0;
+	params->step_count++;
+	return 1;
+}
+
+static int
+parse_script(const char *file, struct params_t *params)
+{
+	FILE *fh;
+	char line[256];
+	int line_number = 0;
+
+	fh = fopen(file, "r");
+	if (fh == NULL)
+	{
+		fprintf(stderr, "jabsocket_mockxmpp: couldn't open %s\n", file);
+		return 0;
+	}
+	while (fgets(line, sizeof(line), fh) != NULL)
+	{
+		line_number++;
+		if (!parse_step(line, params))
+		{
+			fprintf(stderr, "jabsocket_mockxmpp: %s:%d: invalid step\n",
+				file, line_number);
+			fclose(fh);
+			return 0;
+		}
+	}
+	fclose(fh);
+	return 1;
+}
+
+static int
+parse_params(int argc, char **argv, struct params_t *params)
+{
+	int c;
+
+	memset( params, 0, sizeof(struct params_t) );
+	params->listen = "127.0.0.1";
+	params->port = 5222;
+	params->domain = "localhost";
+	while (1)
+	{
+		int option_index = 0;
+		static struct option long_options[] =
+			{
+				{"listen",                 1, 0, 'l'},
+				{"port",                   1, 0, 'p'},
+				{"domain",                 1, 0, 'd'},
+				{"fanout",                 1, 0, 'f'},
+				{"latency",                1, 0, 'L'},
+				{"jitter",                 1, 0, 'J'},
+				{"disconnect-after",       1, 0, 'a'},
+				{"disconnect-probability", 1, 0, 'P'},
+				{"step",                   1, 0, 's'},
+				{"script",                 1, 0, 'S'},
+				{"starttls",               0, 0, 't'},
+				{"cert",                   1, 0, 'c'},
+				{"key",                    1, 0, 'k'},
+				{"help",                   0, 0, 'h'},
+				{0, 0, 0, 0}
+			};
+
+		c = getopt_long(argc, argv, "l:p:d:f:L:J:a:P:s:S:tc:k:h",
+			long_options, &option_index);
+		if (c == -1)
+			break;
+
+		switch (c) {
+			case 'l':
+				params->listen = optarg;
+				break;
+			case 'p':
+				params->port = atoi(optarg);
+				break;
+			case 'd':
+				params->domain = optarg;
+				break;
+			case 'f':
+				params->fanout = atoi(optarg);
+				break;
+			case 'L':
+				params->latency = atof(optarg);
+				break;
+			case 'J':
+				params->jitter = atof(optarg);
+				break;
+			case 'a':
+				params->disconnect_after = strtoul(optarg, NULL, 10);
+				break;
+			case 'P':
+				params->disconnect_probability = atof(optarg);
+				break;
+			case 's':
+				if (!parse_step(optarg, params))
+				{
+					fprintf(stderr, "jabsocket_mockxmpp: invalid step: %s\n",
+						optarg);
+					exit(1);
+				}
+				break;
+			case 'S':
+				if (!parse_script(optarg, params))
+					exit(1);
+				break;
+			case 't':
+				params->starttls = 1;
+				break;
+			case 'c':
+				params->cert = optarg;
+				break;
+			case 'k':
+				params->key = optarg;
+				break;
+			case 'h':
+			case '?': /* invalid option */
+				usage(argv[0]);
+				break;
+		}
+	}
+	if ( (params->latency < 0) || (params->jitter < 0) ||
+		(params->fanout < -1) )
+		usage(argv[0]);
+	return 1;
+}
+
+/* Output */
+
+static void
+delay_cb(evutil_socket_t fd, short what, void *ctx)
+{
+	mockconn_t *conn = (mockconn_t*) ctx;
+	struct evbuffer *output = bufferevent_get_output(conn->bev);
+	delayed_t *head;
+	uint64_t now = now_us();
+	struct timeval wait;
+
+	while (conn->queue_count > 0)
+	{
+		head = &conn->queue[conn->queue_first];
+		if (head->deadline > now)
+		{
+			wait.tv_sec = (head->deadline - now) / 1000000;
+			wait.tv_usec = (head->deadline - now) % 1000000;
+			evtimer_add(conn->delay_timer, &wait);
+			return;
+		}
+		evbuffer_remove_buffer(conn->delayed, output, head->length);
+		conn->queue_first = (conn->queue_first + 1) % conn->queue_size;
+		conn->queue_count--;
+	}
+}
+
+/* mockconn_delay holds a stanza back for the configured latency; stanzas
+   keep their order, so the jitter never reorders them */
+static int
+mockconn_delay(mockconn_t *conn, const void *data, size_t length)
+{
+	delayed_t *queue, *entry;
+	uint64_t deadline;
+	size_t i, size;
+
+	if (conn->delay_timer == NULL)
+	{
+		conn->delayed = evbuffer_new();
+		conn->delay_timer = evtimer_new(base, delay_cb, conn);
+		if ( (conn->delayed == NULL) || (conn->delay_timer == NULL) )
+			return 0;
+	}
+	if (conn->queue_count == conn->queue_size)
+	{
+		size = conn->queue_size ? 2 * conn->queue_size : 16;
+		queue = (delayed_t*) malloc(size * sizeof(delayed_t));
+		if (queue == NULL)
+			return 0;
+		for (i = 0; i < conn->queue_count; i++)
+			queue[i] = conn->queue[(conn->queue_first + i) % conn->queue_size];
+		free(conn->queue);
+		conn->queue = queue;
+		conn->queue_first = 0;
+		conn->queue_size = size;
+	}
+	deadline = now_us() + (uint64_t) (1000 * (params.latency +
+		params.jitter * mock_random()));
+	if (conn->queue_count > 0)
+	{
+		entry = &conn->queue[(conn->queue_first + conn->queue_count - 1) %
+			conn->queue_size];
+		if (entry->deadline > deadline)
+			deadline = entry->deadline;
+	}
+	entry = &conn->queue[(conn->queue_first + conn->queue_count) %
+		conn->queue_size];
+	entry->deadline = deadline;
+	entry->length = length;
+	conn->queue_count++;
+	evbuffer_add(conn->delayed, data, length);
+	if (conn->queue_count == 1)
+		delay_cb(-1, 0, conn);
+	return 1;
+}
+
+/* mockconn_send sends a stanza to the client, after the latency */
+static void
+mockconn_send(mockconn_t *conn, const void *data, size_t length)
+{
+	stats.stanzas_out++;
+	if ( (params.latency > 0) || (params.jitter > 0) )
+	{
+		if (mockconn_delay(conn, data, length))
+			return;
+	}
+	bufferevent_write(conn->bev, data, length);
+}
+
+/* Script */
+
+static void
+send_roster(mockconn_t *conn, int items)
+{
+	struct evbuffer *roster;
+	int i;
+
+	roster = evbuffer_new();
+	if (roster == NULL)
+		return;
+	evbuffer_add_printf(roster, "<iq type='result' id='roster%lu'>"
+		"<query xmlns='jabber:iq:roster' ver='1'>", conn->id);
+	for (i = 0; i < items; i++)
+		evbuffer_add_printf(roster, "<item jid='contact%d@%s' "
+			"name='Contact %d' subscription='both'><group>%s</group></item>",
+			i, params.domain, i, (i % 3) ? "Friends" : "Work");
+	evbuffer_add_printf(roster, "</query></iq>");
+	mockconn_send(conn, evbuffer_pullup(roster, -1),
+		evbuffer_get_length(roster));
+	evbuffer_free(roster);
+	conn->generated++;
+	stats.generated++;
+}
+
+/* send_stanza sends a presence or a message from one of the contacts
+   with size bytes of text */
+static void
+send_stanza(mockconn_t *conn, int type, int size)
+{
+	static char *text = NULL;
+	static int text_size = 0;
+	char *stanza;
+	int length;
+
+	if (size + 256 > text_size)
+	{
+		stanza = (char*) realloc(text, size + 256);
+		if (stanza == NULL)
+			return;
+		text = stanza;
+		text_size = size + 256;
+	}
+	if (type == STEP_MESSAGE)
+		length = sprintf(text, "<message from='contact%lu@%s/mock' "
+			"type='chat' id='m%lu'><body>", conn->generated % 1000,
+			params.domain, conn->generated);
+	else
+		length = sprintf(text, "<presence from='contact%lu@%s/mock' "
+			"id='p%lu'><status>", conn->generated % 1000, params.domain,
+			conn->generated);
+	memset(text + length, 'x', size);
+	length += size;
+	length += sprintf(text + length, (type == STEP_MESSAGE) ?
+		"</body></message>" : "</status></presence>");
+	mockconn_send(conn, text, length);
+	conn->generated++;
+	stats.generated++;
+}
+
+static void
+step_cb(evutil_socket_t fd, short what, void *ctx)
+{
+	mockconn_t *conn = (mockconn_t*) ctx;
+
+	mockconn_run_script(conn);
+}
+
+/* mockconn_run_script runs the steps from conn->step until one of them
+   has to wait */
+static void
+mockconn_run_script(mockconn_t *conn)
+{
+	step_t *step;
+	struct timeval wait;
+	uint64_t interval, now;
+	int i;
+
+	while (conn->step < params.step_count)
+	{
+		step = &params.steps[conn->step];
+		switch (step->type)
+		{
+			case STEP_ROSTER:
+				send_roster(conn, (int) step->count);
+				break;
+			case STEP_PRESENCE:
+			case STEP_MESSAGE:
+				for (i = 0; i < (int) step->count; i++)
+					send_stanza(conn, step->type, step->size);
+				break;
+			case STEP_WAIT:
+				conn->step++;
+				wait.tv_sec = (long) step->count / 1000;
+				wait.tv_usec = (long) (step->count * 1000) % 1000000;
+				evtimer_add(conn->step_timer, &wait);
+				return;
+			case STEP_FLOOD:
+				now = now_us();
+				if (conn->flood_end == 0)
+				{
+					conn->flood_end = now + (uint64_t) (step->seconds * 1e6);
+					conn->flood_credit = 1;
+				}
+				interval = (uint64_t) (1e6 / step->count);
+				if (interval < MOCK_FLOOD_TICK_US)
+					interval = MOCK_FLOOD_TICK_US;
+				for (; conn->flood_credit >= 1; conn->flood_credit--)
+					send_stanza(conn, STEP_PRESENCE, step->size);
+				if (now < conn->flood_end)
+				{
+					conn->flood_credit += step->count * interval / 1e6;
+					wait.tv_sec = interval / 1000000;
+					wait.tv_usec = interval % 1000000;
+					evtimer_add(conn->step_timer, &wait);
+					return;
+				}
+				conn->flood_end = 0;
+				break;
+			case STEP_DISCONNECT:
+				stats.disconnects++;
+				mockconn_close(conn);
+				return;
+		}
+		conn->step++;
+	}
+}
+
+/* Sessions */
+
+/* mockconn_remove takes the session out of the fan-out list */
+static void
+mockconn_remove(mockconn_t *conn)
+{
+	if (conn->index < 0)
+		return;
+	/* Move the last session into the gap */
+	sessions[conn->index] = sessions[--session_count];
+	sessions[conn->index]->index = conn->index;
+	conn->index = -1;
+}
+
+static void
+mockconn_delete(mockconn_t *conn)
+{
+	mockconn_remove(conn);
+	if (conn->step_timer != NULL)
+		event_free(conn->step_timer);
+	if (conn->delay_timer != NULL)
+		event_free(conn->delay_timer);
+	if (conn->delayed != NULL)
+		evbuffer_free(conn->delayed);
+	if (conn->framer != NULL)
+		framer_delete(conn->framer);
+	free(conn->queue);
+	bufferevent_free(conn->bev);
+	free(conn);
+}
+
+static void
+mockconn_closed_cb(struct bufferevent *bev, void *ctx)
+{
+	mockconn_delete((mockconn_t*) ctx);
+}
+
+/* mockconn_close closes the stream and deletes the session once the
+   output has been written; stanzas still held back go out at once */
+static void
+mockconn_close(mockconn_t *conn)
+{
+	mockconn_remove(conn);
+	conn->state = MOCK_ST_CLOSING;
+	event_del(conn->step_timer);
+	if (conn->delay_timer != NULL)
+	{
+		event_del(conn->delay_timer);
+		bufferevent_write_buffer(conn->bev, conn->delayed);
+	}
+	bufferevent_disable(conn->bev, EV_READ);
+	bufferevent_setcb(conn->bev, NULL, mockconn_closed_cb,
+		mockconn_event_cb, conn);
+	bufferevent_write(conn->bev, "</stream:stream>", 16);
+}
+
+/* mockconn_open answers the client's stream header and starts the
+   script; with --starttls, a stream that doesn't run over TLS yet only
+   offers STARTTLS */
+static int
+mockconn_open(mockconn_t *conn)
+{
+	mockconn_t **grown;
+
+	if ( (tls_ctx != NULL) && !conn->tls )
+	{
+		evbuffer_add_printf(bufferevent_get_output(conn->bev),
+			MOCK_STREAM_HEADER "<stream:features>"
+			"<starttls xmlns='" MOCK_NS_TLS "'><required/></starttls>"
+			"</stream:features>", conn->id, params.domain);
+		conn->state = MOCK_ST_STARTTLS;
+		return 1;
+	}
+	if (session_count == session_size)
+	{
+		grown = (mockconn_t**) realloc(sessions,
+			(session_size ? 2 * session_size : 64) * sizeof(mockconn_t*));
+		if (grown == NULL)
+			return 0;
+		sessions = grown;
+		session_size = session_size ? 2 * session_size : 64;
+	}
+	conn->index = session_count;
+	sessions[session_count++] = conn;
+	conn->state = MOCK_ST_OPEN;
+	stats.streams++;
+
+	evbuffer_add_printf(bufferevent_get_output(conn->bev),
+		MOCK_STREAM_HEADER "<stream:features>"
+		"<bind xmlns='urn:ietf:params:xml:ns:xmpp-bind'/>"
+		"<session xmlns='urn:ietf:params:xml:ns:xmpp-session'/>"
+		"</stream:features>",
+		conn->id, params.domain);
+	conn->step_timer = evtimer_new(base, step_cb, conn);
+	if (conn->step_timer == NULL)
+		return 0;
+	return 1;
+}
+
+/* mockconn_stanza echoes a stanza from the client and copies it to the
+   fan-out sessions; returns 0 if the session was dropped */
+static int
+mockconn_stanza(mockconn_t *conn, byte *stanza, size_t length)
+{
+	int i, n, index;
+
+	stats.stanzas_in++;
+	conn->received++;
+	if ( ( (params.disconnect_after > 0) &&
+		   (conn->received > params.disconnect_after) ) ||
+		( (params.disconnect_probability > 0) &&
+		  (mock_random() < params.disconnect_probability) ) )
+	{
+		/* Drop the connection without closing the stream, as a crashed
+		   server would */
+		stats.disconnects++;
+		mockconn_delete(conn);
+		return 0;
+	}
+
+	mockconn_send(conn, stanza, length);
+	n = params.fanout;
+	if ( (n < 0) || (n > session_count - 1) )
+		n = session_count - 1;
+	for (i = 1; i <= n; i++)
+	{
+		index = (conn->index + i) % session_count;
+		mockconn_send(sessions[index], stanza, length);
+	}
+	return 1;
+}
+
+/* mockconn_start_tls answers <starttls/> and continues the session over
+   TLS, where the client opens a new stream */
+static int
+mockconn_start_tls(mockconn_t *conn, byte *frame, size_t frame_size)
+{
+	struct bufferevent *bev;
+	SSL *ssl;
+
+	if ( (frame_size < 9) || (memcmp(frame, "<starttls", 9) != 0) )
+		return 0;
+	bufferevent_write(conn->bev, "<proceed xmlns='" MOCK_NS_TLS "'/>",
+		strlen("<proceed xmlns='" MOCK_NS_TLS "'/>"));
+	ssl = SSL_new(tls_ctx);
+	if (ssl == NULL)
+		return 0;
+	/* <proceed/> is already in the output of the plain bufferevent, ahead
+	   of the handshake */
+	bev = bufferevent_openssl_filter_new(base, conn->bev, ssl,
+		BUFFEREVENT_SSL_ACCEPTING, BEV_OPT_CLOSE_ON_FREE);
+	if (bev == NULL)
+	{
+		SSL_free(ssl);
+		return 0;
+	}
+	bufferevent_openssl_set_allow_dirty_shutdown(bev, 1);
+	conn->bev = bev;
+	conn->tls = 1;
+	conn->state = MOCK_ST_OPENING;
+	framer_reset(conn->framer);
+	bufferevent_setcb(bev, mockconn_read_cb, NULL, mockconn_event_cb, conn);
+	bufferevent_enable(bev, EV_READ | EV_WRITE);
+	return 1;
+}
+
+static void
+mockconn_read_cb(struct bufferevent *bev, void *ctx)
+{
+	mockconn_t *conn = (mockconn_t*) ctx;
+	struct evbuffer *input = bufferevent_get_input(bev);
+	struct evbuffer_iovec extent;
+	byte *frame;
+	size_t frame_size;
+
+	while (evbuffer_peek(input, -1, NULL, &extent, 1) > 0)
+	{
+		if (!framer_add(conn->framer, extent.iov_base, extent.iov_len))
+		{
+			fprintf(stderr, "jabsocket_mockxmpp: session %lu: invalid XML\n",
+				conn->id);
+			mockconn_delete(conn);
+			return;
+		}
+		evbuffer_drain(input, extent.iov_len);
+	}
+	while ( framer_get_frame_ref(conn->framer, &frame, &frame_size) )
+	{
+		/* The first frame is the client's stream header */
+		if (conn->state == MOCK_ST_OPENING)
+		{
+			if (!mockconn_open(conn))
+			{
+				mockconn_delete(conn);
+				return;
+			}
+			if (conn->state == MOCK_ST_STARTTLS)
+				continue;
+			mockconn_run_script(conn);
+			if (conn->state == MOCK_ST_CLOSING)
+				return;
+			continue;
+		}
+		if (conn->state == MOCK_ST_STARTTLS)
+		{
+			if (!mockconn_start_tls(conn, frame, frame_size))
+			{
+				fprintf(stderr, "jabsocket_mockxmpp: session %lu: expected "
+					"<starttls/>\n", conn->id);
+				mockconn_delete(conn);
+			}
+			return;
+		}
+		if (!mockconn_stanza(conn, frame, frame_size))
+			return;
+	}
+}
+
+static void
+mockconn_event_cb(struct bufferevent *bev, short events, void *ctx)
+{
+	SSL *ssl;
+
+	if (events & BEV_EVENT_CONNECTED)
+	{
+		/* TLS handshake done */
+		ssl = bufferevent_openssl_get_ssl(bev);
+		if (ssl != NULL)
+		{
+			stats.tls_handshakes++;
+			if (SSL_session_reused(ssl))
+				stats.tls_resumed++;
+		}
+		return;
+	}
+	if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR))
+		mockconn_delete((mockconn_t*) ctx);
+}
+
+static void
+accept_cb(struct evconnlistener *listener, evutil_socket_t fd,
+	struct sockaddr *address, int socklen, void *ctx)
+{
+	mockconn_t *conn;
+
+	conn = (mockconn_t*) calloc(1, sizeof(mockconn_t));
+	if (conn == NULL)
+	{
+		evutil_closesocket(fd);
+		return;
+	}
+	conn->id = ++stats.connections;
+	conn->index = -1;
+	conn->state = MOCK_ST_OPENING;
+	conn->framer = framer_create_engine(FRAMER_SCANNER, NULL);
+	conn->bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
+	if ( (conn->framer == NULL) || (conn->bev == NULL) )
+	{
+		if (conn->framer != NULL)
+			framer_delete(conn->framer);
+		if (conn->bev != NULL)
+			bufferevent_free(conn->bev);
+		else
+			evutil_closesocket(fd);
+		free(conn);
+		return;
+	}
+	bufferevent_setcb(conn->bev, mockconn_read_cb, NULL, mockconn_event_cb,
+		conn);
+	bufferevent_enable(conn->bev, EV_READ | EV_WRITE);
+}
+
+static void
+print_stats(void)
+{
+	fprintf(stderr, "jabsocket_mockxmpp: %lu connections, %lu streams, "
+		"%d open, %lu stanzas in, %lu stanzas out (%lu generated), "
+		"%lu disconnects\n", stats.connections, stats.streams, session_count,
+		stats.stanzas_in, stats.stanzas_out, stats.generated,
+		stats.disconnects);
+	if (tls_ctx != NULL)
+		fprintf(stderr, "jabsocket_mockxmpp: %lu TLS handshakes, %lu "
+			"resumed\n", stats.tls_handshakes, stats.tls_resumed);
+}
+
+/* tls_self_signed gives ctx a self-signed certificate for the domain */
+static int
+tls_self_signed(SSL_CTX *ctx, const char *domain)
+{
+	EVP_PKEY *key;
+	X509 *cert;
+	X509_NAME *name;
+	int ok = 0;
+
+	key = EVP_EC_gen("P-256");
+	cert = X509_new();
+	if ( (key == NULL) || (cert == NULL) )
+		goto Exit;
+	X509_set_version(cert, 2);
+	ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+	X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+	X509_gmtime_adj(X509_getm_notAfter(cert), 365L * 86400);
+	X509_set_pubkey(cert, key);
+	name = X509_get_subject_name(cert);
+	X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+		(const unsigned char*) domain, -1, -1, 0);
+	X509_set_issuer_name(cert, name);
+	if (!X509_sign(cert, key, EVP_sha256()))
+		goto Exit;
+	ok = SSL_CTX_use_certificate(ctx, cert) &&
+		SSL_CTX_use_PrivateKey(ctx, key);
+
+Exit:
+	X509_free(cert);
+	EVP_PKEY_free(key);
+	return ok;
+}
+
+static SSL_CTX *
+tls_create(void)
+{
+	SSL_CTX *ctx;
+	int ok;
+
+	ctx = SSL_CTX_new(TLS_server_method());
+	if (ctx == NULL)
+		return NULL;
+	SSL_CTX_set_session_id_context(ctx, (const unsigned char*) "mockxmpp",
+		8);
+	if (params.cert != NULL)
+		ok = (SSL_CTX_use_certificate_chain_file(ctx, params.cert) == 1) &&
+			(SSL_CTX_use_PrivateKey_file(ctx,
+				(params.key != NULL) ? params.key : params.cert,
+				SSL_FILETYPE_PEM) == 1);
+	else
+		ok = tls_self_signed(ctx, params.domain);
+	if (!ok)
+	{
+		ERR_print_errors_fp(stderr);
+		SSL_CTX_free(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+static void
+signal_cb(evutil_socket_t sig, short what, void *ctx)
+{
+	print_stats();
+	if (sig != SIGUSR1)
+		event_base_loopbreak(base);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct evconnlistener *listener;
+	struct event *signals[3];
+	int signal_numbers[3] = { SIGINT, SIGTERM, SIGUSR1 };
+	struct sockaddr_storage address;
+	int address_size = sizeof(address);
+	char text[64];
+	int i;
+
+	parse_params(argc, argv, &params);
+	snprintf(text, sizeof(text), "%s:%d", params.listen, params.port);
+	if (evutil_parse_sockaddr_port(text, (struct sockaddr*) &address,
+		&address_size) < 0)
+	{
+		fprintf(stderr, "jabsocket_mockxmpp: invalid address %s\n", text);
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	if (params.starttls)
+	{
+		tls_ctx = tls_create();
+		if (tls_ctx == NULL)
+		{
+			fprintf(stderr, "jabsocket_mockxmpp: couldn't set up TLS\n");
+			return 1;
+		}
+	}
+
+	base = event_base_new();
+	if (base == NULL)
+		return 1;
+	listener = evconnlistener_new_bind(base, accept_cb, NULL,
+		LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, -1,
+		(struct sockaddr*) &address, address_size);
+	if (listener == NULL)
+	{
+		fprintf(stderr, "jabsocket_mockxmpp: couldn't listen on %s\n", text);
+		event_base_free(base);
+		return 1;
+	}
+	for (i = 0; i < 3; i++)
+	{
+		signals[i] = evsignal_new(base, signal_numbers[i], signal_cb, NULL);
+		if (signals[i] != NULL)
+			event_add(signals[i], NULL);
+	}
+	fprintf(stderr, "jabsocket_mockxmpp: listening on %s\n", text);
+	event_base_dispatch(base);
+
+	while (session_count > 0)
+		mockconn_delete(sessions[0]);
+	free(sessions);
+	for (i = 0; i < 3; i++)
+	{
+		if (signals[i] != NULL)
+			event_free(signals[i]);
+	}
+	evconnlistener_free(listener);
+	event_base_free(base);
+	if (tls_ctx != NULL)
+		SSL_CTX_free(tls_ctx);
+	return 0;
+}
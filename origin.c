@@ -0,0 +1,311 @@
+#include "origin.h"
+#include <string.h>
+#include <fnmatch.h>
+
+#define ORIGIN_EXACT_INITIAL_SIZE 16
+
+/* A pattern (or, in the trie, the part of a pattern before the '*') */
+struct _originpat_t
+{
+	char *text;
+	size_t length;
+	originpat_t *next;
+};
+
+/* Trie node; the path from the root to a node spells the end of the
+   pattern backwards, so the depth of the node is the length of the suffix */
+struct _originnode_t
+{
+	char c;
+	originnode_t *child;   /* first child */
+	originnode_t *sibling; /* next child of the parent */
+	originpat_t *prefixes; /* patterns that end at this node */
+};
+
+static size_t
+origin_hash(const char *s, size_t length)
+{
+	size_t hash = 2166136261u; /* FNV-1a */
+	size_t i;
+
+	for (i = 0; i < length; i++)
+	{
+		hash ^= (unsigned char) s[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static void
+origin_pat_delete(originpat_t *pat)
+{
+	originpat_t *next;
+
+	while (pat != NULL)
+	{
+		next = pat->next;
+		free(pat->text);
+		free(pat);
+		pat = next;
+	}
+}
+
+static int
+origin_pat_add(originpat_t **list, const char *text, size_t length)
+{
+	originpat_t *pat;
+
+	pat = (originpat_t*) malloc(sizeof(originpat_t));
+	if (pat == NULL)
+		goto Error;
+	pat->text = strndup(text, length);
+	if (pat->text == NULL)
+		goto Error;
+	pat->length = length;
+	pat->next = *list;
+	*list = pat;
+	return 1;
+
+Error:
+	free(pat);
+	return 0;
+}
+
+static void
+origin_node_delete(originnode_t *node)
+{
+	originnode_t *next;
+
+	while (node != NULL)
+	{
+		next = node->sibling;
+		origin_node_delete(node->child);
+		origin_pat_delete(node->prefixes);
+		free(node);
+		node = next;
+	}
+}
+
+static originnode_t *
+origin_node_create(char c)
+{
+	originnode_t *node;
+
+	node = (originnode_t*) malloc(sizeof(originnode_t));
+	if (node == NULL)
+		return NULL;
+	memset(node, 0, sizeof(originnode_t));
+	node->c = c;
+	return node;
+}
+
+static originnode_t *
+origin_node_find(originnode_t *node, char c)
+{
+	for (node = node->child; node != NULL; node = node->sibling)
+	{
+		if (node->c == c)
+			return node;
+	}
+	return NULL;
+}
+
+originset_t *
+originset_create()
+{
+	originset_t *set;
+
+	set = (originset_t*) malloc(sizeof(originset_t));
+	if (set == NULL)
+		goto Error;
+	memset(set, 0, sizeof(originset_t));
+	set->exact_size = ORIGIN_EXACT_INITIAL_SIZE;
+	set->exact = (char**) calloc(set->exact_size, sizeof(char*));
+	if (set->exact == NULL)
+		goto Error;
+	set->trie = origin_node_create('\0');
+	if (set->trie == NULL)
+		goto Error;
+	return set;
+
+Error:
+	if (set != NULL)
+	{
+		free(set->exact);
+		free(set);
+	}
+	return NULL;
+}
+
+void
+originset_delete(originset_t *set)
+{
+	size_t i;
+
+	if (set == NULL)
+		return;
+	for (i = 0; i < set->exact_size; i++)
+		free(set->exact[i]);
+	free(set->exact);
+	origin_node_delete(set->trie);
+	origin_pat_delete(set->globs);
+	free(set);
+}
+
+/* origin_exact_slot returns the slot holding s, or the empty slot where
+   s belongs */
+static size_t
+origin_exact_slot(char **table, size_t size, const char *s, size_t length)
+{
+	size_t i;
+
+	i = origin_hash(s, length) & (size - 1);
+	while (table[i] != NULL)
+	{
+		if ( (strncmp(table[i], s, length) == 0) && (table[i][length] == '\0') )
+			break;
+		i = (i + 1) & (size - 1);
+	}
+	return i;
+}
+
+static int
+origin_exact_add(originset_t *set, const char *pattern)
+{
+	char **table;
+	size_t size, i, slot;
+
+	/* Keep the table at most half full */
+	if (2 * (set->exact_count + 1) > set->exact_size)
+	{
+		size = 2 * set->exact_size;
+		table = (char**) calloc(size, sizeof(char*));
+		if (table == NULL)
+			return 0;
+		for (i = 0; i < set->exact_size; i++)
+		{
+			if (set->exact[i] == NULL)
+				continue;
+			slot = origin_exact_slot(table, size, set->exact[i],
+				strlen(set->exact[i]));
+			table[slot] = set->exact[i];
+		}
+		free(set->exact);
+		set->exact = table;
+		set->exact_size = size;
+	}
+
+	slot = origin_exact_slot(set->exact, set->exact_size, pattern,
+		strlen(pattern));
+	if (set->exact[slot] != NULL)
+		return 1; /* duplicate */
+	set->exact[slot] = strdup(pattern);
+	if (set->exact[slot] == NULL)
+		return 0;
+	set->exact_count++;
+	return 1;
+}
+
+static int
+origin_trie_add(originset_t *set, const char *pattern, const char *star)
+{
+	originnode_t *node, *next;
+	const char *p;
+
+	node = set->trie;
+	for (p = pattern + strlen(pattern); p > star + 1; )
+	{
+		p--;
+		next = origin_node_find(node, *p);
+		if (next == NULL)
+		{
+			next = origin_node_create(*p);
+			if (next == NULL)
+				return 0;
+			next->sibling = node->child;
+			node->child = next;
+		}
+		node = next;
+	}
+	return origin_pat_add(&node->prefixes, pattern, star - pattern);
+}
+
+int
+originset_add(originset_t *set, const char *pattern)
+{
+	const char *star = NULL;
+	const char *p;
+	int wildcards = 0;
+
+	for (p = pattern; *p != '\0'; p++)
+	{
+		switch (*p)
+		{
+			case '*':
+				star = p;
+				/* fall through */
+			case '?':
+			case '[':
+			case '\\':
+				wildcards++;
+				break;
+		}
+	}
+
+	set->count++;
+	if (wildcards == 0)
+		return origin_exact_add(set, pattern);
+	if ( (wildcards == 1) && (star != NULL) )
+		return origin_trie_add(set, pattern, star);
+	return origin_pat_add(&set->globs, pattern, strlen(pattern));
+}
+
+/* origin_match_prefixes checks the patterns ending at a trie node of depth
+   suffix_length */
+static int
+origin_match_prefixes(originpat_t *pat, const char *origin, size_t length,
+	size_t suffix_length)
+{
+	for (; pat != NULL; pat = pat->next)
+	{
+		if ( (pat->length + suffix_length <= length) &&
+			(memcmp(pat->text, origin, pat->length) == 0) )
+			return 1;
+	}
+	return 0;
+}
+
+int
+originset_match(originset_t *set, const char *origin)
+{
+	size_t length, i;
+	originnode_t *node;
+	originpat_t *pat;
+
+	length = strlen(origin);
+
+	if (set->exact_count > 0)
+	{
+		i = origin_exact_slot(set->exact, set->exact_size, origin, length);
+		if (set->exact[i] != NULL)
+			return 1;
+	}
+
+	node = set->trie;
+	for (i = 0; node != NULL; i++)
+	{
+		if ( (node->prefixes != NULL) &&
+			origin_match_prefixes(node->prefixes, origin, length, i) )
+			return 1;
+		if (i == length)
+			break;
+		node = origin_node_find(node, origin[length - 1 - i]);
+	}
+
+	for (pat = set->globs; pat != NULL; pat = pat->next)
+	{
+		if (fnmatch(pat->text, origin, 0) == 0)
+			return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,37 @@
+#ifndef _ORIGIN_H_
+#define _ORIGIN_H_
+
+#include <stdlib.h>
+
+/* Set of allowed origin patterns, compiled once when the configuration is
+   loaded. Patterns are fnmatch patterns (without flags) and are matched in
+   one of three ways:
+   - patterns without wildcards go into a hash set and are compared exactly;
+   - patterns with a single '*' and no other wildcard, like
+     "*.example.com" or an "https://" prefix followed by "*.tenant.example",
+     are stored in a trie keyed by the reversed part after the '*'; the part
+     before the '*' is compared at the trie node;
+   - any other pattern is matched with fnmatch. */
+typedef struct _originpat_t originpat_t;
+typedef struct _originnode_t originnode_t;
+
+typedef struct _originset_t
+{
+	char **exact;       /* open addressing hash table */
+	size_t exact_size;  /* slots in the table, a power of two */
+	size_t exact_count;
+	originnode_t *trie; /* root of the reversed suffix trie */
+	originpat_t *globs; /* patterns left to fnmatch */
+	size_t count;       /* all patterns in the set */
+} originset_t;
+
+originset_t *originset_create();
+void originset_delete(originset_t *set);
+
+/* originset_add adds a pattern to the set; returns 0 if out of memory */
+int originset_add(originset_t *set, const char *pattern);
+
+/* originset_match returns 1 if origin matches any pattern in the set */
+int originset_match(originset_t *set, const char *origin);
+
+#endif /* _ORIGIN_H_ */
@@ -0,0 +1,209 @@
+#include <stdlib.h>
+#include "CuTest.h"
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <fnmatch.h>
+#include "origin.h"
+#include "parseconfig.h"
+
+static const char *patterns[] = {
+	"https://example.com",
+	"https://*.tenant.example",
+	"*seconddomain.com",
+	"http://localhost:*",
+	"https://app?.example.org",
+	"https://[ab]*.example.net",
+	"*",
+	NULL
+};
+
+static const char *origins[] = {
+	"https://example.com",
+	"https://example.com:443",
+	"http://example.com",
+	"https://a.tenant.example",
+	"https://a.b.tenant.example",
+	"https://.tenant.example",
+	"https://tenant.example",
+	"http://a.tenant.example",
+	"seconddomain.com",
+	"subdomain.seconddomain.com",
+	"http://localhost:8080",
+	"http://localhost:",
+	"http://localhost",
+	"https://app1.example.org",
+	"https://app12.example.org",
+	"https://bx.example.net",
+	"https://cx.example.net",
+	"",
+	NULL
+};
+
+/* Every pattern alone and all patterns but "*" together have to give the
+   same result as fnmatch */
+void TestOriginSet(CuTest *tc)
+{
+	originset_t *set;
+	int i, j, expected;
+	char message[256];
+
+	for (i = 0; patterns[i] != NULL; i++)
+	{
+		set = originset_create();
+		CuAssertPtrNotNull(tc, set);
+		CuAssertTrue(tc, originset_add(set, patterns[i]));
+		for (j = 0; origins[j] != NULL; j++)
+		{
+			expected = (fnmatch(patterns[i], origins[j], 0) == 0);
+			snprintf(message, sizeof(message), "pattern '%s' origin '%s'",
+				patterns[i], origins[j]);
+			CuAssertIntEquals_Msg(tc, message, expected,
+				originset_match(set, origins[j]));
+		}
+		originset_delete(set);
+	}
+
+	set = originset_create();
+	CuAssertPtrNotNull(tc, set);
+	for (i = 0; patterns[i] != NULL; i++)
+	{
+		if (strcmp(patterns[i], "*") != 0)
+			CuAssertTrue(tc, originset_add(set, patterns[i]));
+	}
+	for (j = 0; origins[j] != NULL; j++)
+	{
+		expected = 0;
+		for (i = 0; patterns[i] != NULL; i++)
+		{
+			if ( (strcmp(patterns[i], "*") != 0) &&
+				(fnmatch(patterns[i], origins[j], 0) == 0) )
+				expected = 1;
+		}
+		CuAssertIntEquals_Msg(tc, origins[j], expected,
+			originset_match(set, origins[j]));
+	}
+	originset_delete(set);
+}
+
+/* Growing the hash set keeps all entries, duplicates are stored once */
+void TestOriginSetGrow(CuTest *tc)
+{
+	originset_t *set;
+	char origin[64];
+	int i;
+
+	set = originset_create();
+	CuAssertPtrNotNull(tc, set);
+	for (i = 0; i < 1000; i++)
+	{
+		snprintf(origin, sizeof(origin), "https://host%d.example", i);
+		CuAssertTrue(tc, originset_add(set, origin));
+		CuAssertTrue(tc, originset_add(set, origin));
+	}
+	CuAssertIntEquals(tc, 1000, set->exact_count);
+	for (i = 0; i < 1000; i++)
+	{
+		snprintf(origin, sizeof(origin), "https://host%d.example", i);
+		CuAssertTrue(tc, originset_match(set, origin));
+	}
+	CuAssertTrue(tc, !originset_match(set, "https://host1000.example"));
+	originset_delete(set);
+}
+
+static void
+add_origin(jsconf_t *conf, const char *url)
+{
+	origin_t *origin;
+
+	origin = (origin_t*) malloc(sizeof(origin_t));
+	origin->url = strdup(url);
+	origin->next = conf->origin_list;
+	conf->origin_list = origin;
+}
+
+/* Benchmark: checks per second against 1000 patterns (600 exact tenant
+   origins, 390 tenant wildcards and 10 patterns left to fnmatch), with
+   the linear fnmatch scan and with the compiled set */
+void TestOriginBenchmark(CuTest *tc)
+{
+	jsconf_t *conf;
+	char url[128];
+	char *checks[64];
+	int i, j, rounds = 2000;
+	int linear_matches = 0, compiled_matches = 0;
+	struct timespec start, end;
+	double linear_s, compiled_s;
+
+	conf = config_create();
+	CuAssertPtrNotNull(tc, conf);
+	for (i = 0; i < 1000; i++)
+	{
+		if (i < 600)
+			snprintf(url, sizeof(url), "https://tenant%d.example.com", i);
+		else if (i < 990)
+			snprintf(url, sizeof(url), "https://*.tenant%d.example", i);
+		else
+			snprintf(url, sizeof(url), "https://app?.tenant%d.example.org", i);
+		add_origin(conf, url);
+	}
+	for (i = 0; i < 64; i++)
+	{
+		switch (i % 4)
+		{
+			case 0:
+				snprintf(url, sizeof(url), "https://tenant%d.example.com", i * 9);
+				break;
+			case 1:
+				snprintf(url, sizeof(url), "https://chat.tenant%d.example",
+					600 + i * 6);
+				break;
+			case 2:
+				snprintf(url, sizeof(url), "https://app1.tenant%d.example.org",
+					990 + i % 10);
+				break;
+			default:
+				snprintf(url, sizeof(url), "https://unknown%d.example.com", i);
+				break;
+		}
+		checks[i] = strdup(url);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < rounds; i++)
+	{
+		for (j = 0; j < 64; j++)
+			linear_matches += config_check_origin(conf, checks[j]);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	linear_s = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	CuAssertTrue(tc, config_compile_origins(conf));
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < rounds; i++)
+	{
+		for (j = 0; j < 64; j++)
+			compiled_matches += config_check_origin(conf, checks[j]);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	compiled_s = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	CuAssertIntEquals(tc, rounds * 48, linear_matches);
+	CuAssertIntEquals(tc, linear_matches, compiled_matches);
+	printf("origin: 1000 patterns, fnmatch scan %.0f checks/s, "
+		"compiled %.0f checks/s\n",
+		rounds * 64 / linear_s, rounds * 64 / compiled_s);
+
+	for (i = 0; i < 64; i++)
+		free(checks[i]);
+	config_delete(conf);
+}
+
+CuSuite* OriginGetSuite()
+{
+	CuSuite* suite = CuSuiteNew();
+	SUITE_ADD_TEST(suite, TestOriginSet);
+	SUITE_ADD_TEST(suite, TestOriginSetGrow);
+	SUITE_ADD_TEST(suite, TestOriginBenchmark);
+	return suite;
+}
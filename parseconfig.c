@@ -3,7 +3,12 @@
 #include <sys/types.h>
 #include <regex.h>
 #include <fnmatch.h>
+#include <strings.h>
 #include "log.h"
+#include "util.h"
+#include "framer.h"
+#include "pool.h"
+#include "tlsclient.h"
 
 jsconf_t *
 config_create()
@@ -14,6 +19,24 @@ config_create()
 		return NULL;
 	memset(conf, 0, sizeof(jsconf_t));
 	conf->log_level = LOG_ERR; /* By default, only log errors. */
+	conf->log_backend = LOG_BACKEND_SYSLOG;
+	conf->log_async = 1;
+	conf->log_ring_size = LOG_DEFAULT_RING_SIZE;
+	conf->workers = 1;
+	conf->dns_cache_ttl = 300;
+	conf->dns_negative_ttl = 30;
+	conf->buffer_growth_limit = BUFFER_DEFAULT_GROWTH_LIMIT;
+	conf->buffer_shrink_threshold = 0;
+	conf->framer_engine = FRAMER_EXPAT;
+	conf->xmpp_port = 5222;
+	conf->xmpp_srv = 1;
+	conf->xmpp_balance = BALANCE_LEAST_CONNECTIONS;
+	conf->xmpp_check_interval = 10;
+	conf->xmpp_check_timeout = 2;
+	conf->xmpp_connect_timeout = 10;
+	conf->xmpp_tls = XMPP_TLS_NO;
+	conf->xmpp_tls_verify = 1;
+	conf->xmpp_tls_session_cache = TLSCLIENT_DEFAULT_CACHE_SIZE;
 	return conf;
 }
 
@@ -21,6 +44,7 @@ void
 config_delete(jsconf_t *conf)
 {
 	origin_t *current, *next;
+	xmpp_server_t *server, *next_server;
 	
 	current = conf->origin_list;
 	while (current != NULL)
@@ -30,13 +54,37 @@ config_delete(jsconf_t *conf)
 		free(current);
 		current = next;
 	}
+	server = conf->xmpp_servers;
+	while (server != NULL)
+	{
+		next_server = server->next;
+		free(server->domain);
+		free(server->host);
+		free(server);
+		server = next_server;
+	}
+	originset_delete(conf->origins);
 	free(conf->cidr);
 	free(conf->port);
 	free(conf->host);
 	free(conf->resource);
+	free(conf->log_file);
+	free(conf->metrics_listen);
+	free(conf->xmpp_tls_ca_file);
 	free(conf);
 }
 
+/* config_parse_bool returns 1 for the YAML true values (yes, true, on, 1)
+   and 0 for anything else */
+static int
+config_parse_bool(const char *value)
+{
+	return (strcasecmp(value, "yes") == 0) ||
+		(strcasecmp(value, "true") == 0) ||
+		(strcasecmp(value, "on") == 0) ||
+		(strcmp(value, "1") == 0);
+}
+
 int
 config_parse(jsconf_t *conf, const char *file)
 {
@@ -47,6 +95,7 @@ config_parse(jsconf_t *conf, const char *file)
 	yaml_token_type_t prev_token;
 	int level;
 	char key[128];
+	char section[128]; /* level 1 key of a level 2 mapping */
 	int res = 0;
 	origin_t *new_origin;
 
@@ -67,6 +116,8 @@ config_parse(jsconf_t *conf, const char *file)
 
 	prev_token = YAML_NO_TOKEN;
 	level = 0;
+	key[0] = '\0';
+	section[0] = '\0';
 	do {
 		yaml_parser_scan(&parser, &token);
 		switch(token.type)
@@ -96,7 +147,25 @@ config_parse(jsconf_t *conf, const char *file)
 				break;
 			case YAML_SCALAR_TOKEN:
 				if (prev_token == YAML_KEY_TOKEN)
+				{
 					strncpy(key, (char*) token.data.scalar.value, sizeof(key));
+					key[sizeof(key) - 1] = '\0';
+					if (level == 1)
+						strcpy(section, key);
+				}
+				/* domain: server, or a pool of servers in a sequence */
+				if ( (((prev_token == YAML_VALUE_TOKEN) && (level == 2)) ||
+					  ((prev_token == YAML_BLOCK_ENTRY_TOKEN) && (level >= 2))) &&
+					 (strcmp(section, "xmpp_servers") == 0) )
+				{
+					if (!config_add_xmpp_server(conf, key,
+						(char*) token.data.scalar.value))
+					{
+						LOG(LOG_WARNING, "parseconfig.c:config_parse: invalid "
+							"XMPP server %s for %s",
+							(char*) token.data.scalar.value, key);
+					}
+				}
 				if ( (prev_token == YAML_BLOCK_ENTRY_TOKEN) &&
 					 (level == 2) &&
 					 (strcmp(key, "origin") == 0) )
@@ -176,6 +245,39 @@ config_parse(jsconf_t *conf, const char *file)
 						else if (strcmp(value, "LOG_DEBUG") == 0)
 							conf->log_level = LOG_DEBUG;
 					}
+					else if (strcmp(key, "log_backend") == 0)
+					{
+						char *value = (char*) token.data.scalar.value;
+						if (strcmp(value, "syslog") == 0)
+							conf->log_backend = LOG_BACKEND_SYSLOG;
+						else if (strcmp(value, "file") == 0)
+							conf->log_backend = LOG_BACKEND_FILE;
+						else if (strcmp(value, "stderr") == 0)
+							conf->log_backend = LOG_BACKEND_STDERR;
+					}
+					else if (strcmp(key, "log_file") == 0)
+					{
+						char *new_log_file = strdup((char*) token.data.scalar.value);
+						if (new_log_file == NULL)
+						{
+							LOG(LOG_WARNING,
+								"parseconfig.c:config_parse: out of memory");
+							break;
+						}
+						free(conf->log_file);
+						conf->log_file = new_log_file;
+					}
+					else if (strcmp(key, "log_async") == 0)
+					{
+						conf->log_async = config_parse_bool(
+							(char*) token.data.scalar.value);
+					}
+					else if (strcmp(key, "log_ring_size") == 0)
+					{
+						conf->log_ring_size = atoi((char*) token.data.scalar.value);
+						if (conf->log_ring_size < 1)
+							conf->log_ring_size = 1;
+					}
 					else if (strcmp(key, "max_message_size") == 0)
 					{
 						conf->max_message_size = atoi((char*) token.data.scalar.value);
@@ -184,6 +286,134 @@ config_parse(jsconf_t *conf, const char *file)
 					{
 						conf->max_frame_size = atoi((char*) token.data.scalar.value);
 					}
+					else if (strcmp(key, "workers") == 0)
+					{
+						conf->workers = atoi((char*) token.data.scalar.value);
+						if (conf->workers < 1)
+							conf->workers = 1;
+					}
+					else if (strcmp(key, "dns_cache_ttl") == 0)
+					{
+						conf->dns_cache_ttl = atoi((char*) token.data.scalar.value);
+					}
+					else if (strcmp(key, "dns_negative_ttl") == 0)
+					{
+						conf->dns_negative_ttl = atoi((char*) token.data.scalar.value);
+					}
+					else if (strcmp(key, "reverse_dns") == 0)
+					{
+						conf->reverse_dns = config_parse_bool(
+							(char*) token.data.scalar.value);
+					}
+					else if (strcmp(key, "buffer_growth_limit") == 0)
+					{
+						conf->buffer_growth_limit = atoi((char*) token.data.scalar.value);
+					}
+					else if (strcmp(key, "buffer_shrink_threshold") == 0)
+					{
+						conf->buffer_shrink_threshold = atoi((char*) token.data.scalar.value);
+					}
+					else if (strcmp(key, "coalesce_writes") == 0)
+					{
+						conf->coalesce_writes = config_parse_bool(
+							(char*) token.data.scalar.value);
+					}
+					else if (strcmp(key, "framer") == 0)
+					{
+						char *value = (char*) token.data.scalar.value;
+						if (strcmp(value, "expat") == 0)
+							conf->framer_engine = FRAMER_EXPAT;
+						else if (strcmp(value, "scanner") == 0)
+							conf->framer_engine = FRAMER_SCANNER;
+					}
+					else if (strcmp(key, "metrics_port") == 0)
+					{
+						conf->metrics_port = atoi((char*) token.data.scalar.value);
+					}
+					else if (strcmp(key, "metrics_listen") == 0)
+					{
+						char *new_listen = strdup((char*) token.data.scalar.value);
+						if (new_listen == NULL)
+						{
+							LOG(LOG_WARNING,
+								"parseconfig.c:config_parse: out of memory");
+							break;
+						}
+						free(conf->metrics_listen);
+						conf->metrics_listen = new_listen;
+					}
+					else if (strcmp(key, "xmpp_port") == 0)
+					{
+						conf->xmpp_port = atoi((char*) token.data.scalar.value);
+						if ( (conf->xmpp_port < 1) || (conf->xmpp_port > 65535) )
+							conf->xmpp_port = 5222;
+					}
+					else if (strcmp(key, "xmpp_srv") == 0)
+					{
+						conf->xmpp_srv = config_parse_bool(
+							(char*) token.data.scalar.value);
+					}
+					else if (strcmp(key, "xmpp_balance") == 0)
+					{
+						char *value = (char*) token.data.scalar.value;
+						if (strcmp(value, "least_connections") == 0)
+							conf->xmpp_balance = BALANCE_LEAST_CONNECTIONS;
+						else if (strcmp(value, "hash_jid") == 0)
+							conf->xmpp_balance = BALANCE_HASH_JID;
+						else if (strcmp(value, "hash_address") == 0)
+							conf->xmpp_balance = BALANCE_HASH_ADDRESS;
+					}
+					else if (strcmp(key, "xmpp_check_interval") == 0)
+					{
+						conf->xmpp_check_interval = atoi((char*) token.data.scalar.value);
+						if (conf->xmpp_check_interval < 0)
+							conf->xmpp_check_interval = 0;
+					}
+					else if (strcmp(key, "xmpp_check_timeout") == 0)
+					{
+						conf->xmpp_check_timeout = atoi((char*) token.data.scalar.value);
+						if (conf->xmpp_check_timeout < 1)
+							conf->xmpp_check_timeout = 1;
+					}
+					else if (strcmp(key, "xmpp_connect_timeout") == 0)
+					{
+						conf->xmpp_connect_timeout = atoi((char*) token.data.scalar.value);
+						if (conf->xmpp_connect_timeout < 0)
+							conf->xmpp_connect_timeout = 0;
+					}
+					else if (strcmp(key, "xmpp_tls") == 0)
+					{
+						char *value = (char*) token.data.scalar.value;
+						if (strcmp(value, "required") == 0)
+							conf->xmpp_tls = XMPP_TLS_REQUIRED;
+						else if (config_parse_bool(value))
+							conf->xmpp_tls = XMPP_TLS_YES;
+						else
+							conf->xmpp_tls = XMPP_TLS_NO;
+					}
+					else if (strcmp(key, "xmpp_tls_verify") == 0)
+					{
+						conf->xmpp_tls_verify = config_parse_bool(
+							(char*) token.data.scalar.value);
+					}
+					else if (strcmp(key, "xmpp_tls_ca_file") == 0)
+					{
+						char *new_ca_file = strdup((char*) token.data.scalar.value);
+						if (new_ca_file == NULL)
+						{
+							LOG(LOG_WARNING,
+								"parseconfig.c:config_parse: out of memory");
+							break;
+						}
+						free(conf->xmpp_tls_ca_file);
+						conf->xmpp_tls_ca_file = new_ca_file;
+					}
+					else if (strcmp(key, "xmpp_tls_session_cache") == 0)
+					{
+						conf->xmpp_tls_session_cache = atoi((char*) token.data.scalar.value);
+						if (conf->xmpp_tls_session_cache < 0)
+							conf->xmpp_tls_session_cache = 0;
+					}
 				}
 				break;
 			/* Others */
@@ -197,6 +427,9 @@ config_parse(jsconf_t *conf, const char *file)
 		yaml_token_delete(&token);
 	} while (token.type != YAML_STREAM_END_TOKEN);
 	
+	if (!config_compile_origins(conf))
+		LOG(LOG_WARNING,
+			"parseconfig.c:config_parse: out of memory compiling origins");
 	res = 1;
 
 Exit:
@@ -219,6 +452,9 @@ config_check_origin(jsconf_t *conf, const char *origin)
 	                        any origin is accepted */
 		return 1;
 
+	if (conf->origins != NULL)
+		return originset_match(conf->origins, origin);
+
 	for (; current != NULL; current = current->next)
 	{
 		res = fnmatch(current->url, origin, 0);
@@ -228,3 +464,105 @@ config_check_origin(jsconf_t *conf, const char *origin)
 	return 0;
 }
 
+int
+config_compile_origins(jsconf_t *conf)
+{
+	originset_t *set;
+	origin_t *current;
+
+	originset_delete(conf->origins);
+	conf->origins = NULL;
+	set = originset_create();
+	if (set == NULL)
+		return 0;
+	for (current = conf->origin_list; current != NULL; current = current->next)
+	{
+		if (!originset_add(set, current->url))
+		{
+			originset_delete(set);
+			return 0;
+		}
+	}
+	conf->origins = set;
+	return 1;
+}
+
+
+int
+config_add_xmpp_server(jsconf_t *conf, const char *domain, const char *server)
+{
+	xmpp_server_t *new_server = NULL, **link;
+	const char *host, *colon, *end;
+	size_t host_length;
+	char *pend;
+	long port = 0;
+
+	/* [IPv6 address]:port, host:port or host; an IPv6 address without
+	   brackets has no port */
+	host = server;
+	if (server[0] == '[')
+	{
+		host = server + 1;
+		end = strchr(host, ']');
+		if (end == NULL)
+			return 0;
+		colon = (end[1] == ':') ? end + 1 : NULL;
+		if ( (colon == NULL) && (end[1] != '\0') )
+			return 0;
+	}
+	else
+	{
+		colon = strchr(server, ':');
+		if ( (colon != NULL) && (strchr(colon + 1, ':') != NULL) )
+			colon = NULL;
+		end = (colon != NULL) ? colon : server + strlen(server);
+	}
+	host_length = end - host;
+	if (host_length == 0)
+		return 0;
+	if (colon != NULL)
+	{
+		port = strtol(colon + 1, &pend, 10);
+		if ( (*pend != '\0') || (port < 1) || (port > 65535) )
+			return 0;
+	}
+
+	new_server = (xmpp_server_t*) malloc(sizeof(*new_server));
+	if (new_server == NULL)
+		goto Error;
+	memset(new_server, 0, sizeof(*new_server));
+	new_server->domain = strdup(domain);
+	new_server->host = strndup(host, host_length);
+	if ( (new_server->domain == NULL) || (new_server->host == NULL) )
+		goto Error;
+	new_server->port = (int) port;
+	for (link = &conf->xmpp_servers; *link != NULL; link = &(*link)->next)
+		;
+	*link = new_server;
+	return 1;
+
+Error:
+	if (new_server != NULL)
+	{
+		free(new_server->domain);
+		free(new_server->host);
+		free(new_server);
+	}
+	return 0;
+}
+
+xmpp_server_t *
+config_find_xmpp_server(jsconf_t *conf, const char *domain)
+{
+	xmpp_server_t *current, *any = NULL;
+
+	for (current = conf->xmpp_servers; current != NULL;
+		current = current->next)
+	{
+		if (strcasecmp(current->domain, domain) == 0)
+			return current;
+		if ( (any == NULL) && (strcmp(current->domain, "*") == 0) )
+			any = current;
+	}
+	return any;
+}
@@ -3,6 +3,7 @@
 
 #include <yaml.h>
 #include <syslog.h>
+#include "origin.h"
 
 #define YAML_MAX_VALUE_SIZE 128
 #define YAML_MAX_STACK_SIZE 16
@@ -14,16 +15,53 @@ struct _origin_t
 	origin_t *next;
 };
 
+/* Static XMPP server of a domain (xmpp_servers); the servers of a domain
+   form a pool, in the order of the configuration */
+typedef struct _xmpp_server_t xmpp_server_t;
+struct _xmpp_server_t
+{
+	char *domain; /* "*" stands for all domains not listed */
+	char *host;
+	int port; /* 0 = xmpp_port */
+	xmpp_server_t *next;
+};
+
 typedef struct _jsconf_t
 {
 	char *port;
 	origin_t *origin_list;
+	originset_t *origins; /* origin_list compiled by config_compile_origins */
 	char *cidr;
 	char *host;
 	char *resource;
 	int log_level;
+	int log_backend; /* LOG_BACKEND_SYSLOG, LOG_BACKEND_FILE or LOG_BACKEND_STDERR */
+	char *log_file; /* file for LOG_BACKEND_FILE */
+	int log_async; /* write log messages from a separate thread */
+	int log_ring_size; /* messages queued per thread before dropping */
 	int max_message_size;
 	int max_frame_size;
+	int workers; /* number of worker threads (event loops) */
+	int dns_cache_ttl; /* seconds to cache resolved XMPP server addresses */
+	int dns_negative_ttl; /* seconds to cache failed lookups */
+	int reverse_dns; /* look up host names of clients for logging */
+	int buffer_growth_limit; /* maximum growth step of a buffer in bytes */
+	int buffer_shrink_threshold; /* shrink drained buffers larger than this */
+	int coalesce_writes; /* write all stanzas of one read in one pass */
+	int framer_engine; /* FRAMER_EXPAT or FRAMER_SCANNER */
+	int metrics_port; /* port of the metrics endpoint, 0 = disabled */
+	char *metrics_listen; /* address of the metrics endpoint */
+	int xmpp_port; /* port of XMPP servers not found through SRV records */
+	int xmpp_srv; /* look up _xmpp-client._tcp SRV records */
+	xmpp_server_t *xmpp_servers; /* static XMPP servers by domain */
+	int xmpp_balance; /* BALANCE_..., how a pool's server is picked */
+	int xmpp_check_interval; /* seconds between health checks, 0 = off */
+	int xmpp_check_timeout; /* seconds to wait for a health check */
+	int xmpp_connect_timeout; /* seconds to connect to an XMPP server */
+	int xmpp_tls; /* XMPP_TLS_..., STARTTLS towards XMPP servers */
+	int xmpp_tls_verify; /* verify the certificates of XMPP servers */
+	char *xmpp_tls_ca_file; /* CA certificates, NULL = system default */
+	int xmpp_tls_session_cache; /* TLS sessions cached per worker */
 } jsconf_t;
 
 jsconf_t *config_create();
@@ -32,5 +70,20 @@ void config_delete(jsconf_t *conf);
 int config_parse(jsconf_t *conf, const char *file);
 int config_check_origin(jsconf_t *conf, const char *origin);
 
+/* config_compile_origins builds conf->origins from the origin list; it is
+   called by config_parse. Returns 0 if out of memory, in which case
+   config_check_origin falls back to matching the list one by one. */
+int config_compile_origins(jsconf_t *conf);
+
+/* config_add_xmpp_server adds a static XMPP server for domain; server is
+   "host", "host:port" or "[IPv6 address]:port". Returns 0 if server is
+   invalid or out of memory. */
+int config_add_xmpp_server(jsconf_t *conf, const char *domain,
+	const char *server);
+
+/* config_find_xmpp_server returns the first static XMPP server of domain,
+   the one of "*" if domain isn't listed, or NULL */
+xmpp_server_t *config_find_xmpp_server(jsconf_t *conf, const char *domain);
+
 #endif /* _PARSECONFIG_H_ */
 
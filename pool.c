@@ -0,0 +1,379 @@
+#include "pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <netinet/in.h>
+#include "log.h"
+
+static void backend_check_resolved(int result, struct sockaddr *address,
+	socklen_t address_size, void *arg);
+
+static pool_t *
+poolset_find_exact(poolset_t *set, const char *domain)
+{
+	pool_t *pool;
+
+	for (pool = set->pools; pool != NULL; pool = pool->next_pool)
+	{
+		if (strcasecmp(pool->domain, domain) == 0)
+			return pool;
+	}
+	return NULL;
+}
+
+static pool_t *
+poolset_add_pool(poolset_t *set, const char *domain)
+{
+	pool_t *pool, **link;
+
+	pool = (pool_t*) malloc(sizeof(*pool));
+	if (pool == NULL)
+		return NULL;
+	memset(pool, 0, sizeof(*pool));
+	pool->domain = strdup(domain);
+	pool->backends = (backend_t*) malloc(POOL_MAX_SERVERS *
+		sizeof(backend_t));
+	if ( (pool->domain == NULL) || (pool->backends == NULL) )
+	{
+		free(pool->domain);
+		free(pool->backends);
+		free(pool);
+		return NULL;
+	}
+	pool->set = set;
+	for (link = &set->pools; *link != NULL; link = &(*link)->next_pool)
+		;
+	*link = pool;
+	return pool;
+}
+
+static void
+poolset_timer_cb(evutil_socket_t fd, short what, void *arg)
+{
+	(void) fd;
+	(void) what;
+	poolset_check((poolset_t*) arg);
+}
+
+poolset_t *
+poolset_create(struct event_base *base, dnscache_t *cache, jsconf_t *conf)
+{
+	poolset_t *set;
+	pool_t *pool;
+	backend_t *backend;
+	xmpp_server_t *server;
+	size_t total = 0;
+	struct timeval interval;
+
+	set = (poolset_t*) malloc(sizeof(*set));
+	if (set == NULL)
+		goto Error;
+	memset(set, 0, sizeof(*set));
+	set->base = base;
+	set->dnscache = cache;
+	set->balance = conf->xmpp_balance;
+	set->check_interval = conf->xmpp_check_interval;
+	set->check_timeout = conf->xmpp_check_timeout;
+
+	for (server = conf->xmpp_servers; server != NULL; server = server->next)
+		total++;
+	if (total > 0)
+	{
+		set->metrics = (backend_metrics_t*) calloc(total,
+			sizeof(backend_metrics_t));
+		if (set->metrics == NULL)
+			goto Error;
+	}
+
+	for (server = conf->xmpp_servers; server != NULL; server = server->next)
+	{
+		pool = poolset_find_exact(set, server->domain);
+		if (pool == NULL)
+		{
+			pool = poolset_add_pool(set, server->domain);
+			if (pool == NULL)
+				goto Error;
+		}
+		if (pool->count == POOL_MAX_SERVERS)
+		{
+			LOG(LOG_WARNING, "pool.c:poolset_create: %s has more than %d "
+				"XMPP servers, ignoring %s", pool->domain, POOL_MAX_SERVERS,
+				server->host);
+			continue;
+		}
+		backend = &pool->backends[pool->count];
+		memset(backend, 0, sizeof(*backend));
+		backend->pool = pool;
+		backend->index = pool->count;
+		backend->host = server->host;
+		backend->port = (server->port != 0) ? server->port : conf->xmpp_port;
+		backend->up = 1;
+		backend->metrics = &set->metrics[set->metrics_count++];
+		snprintf(backend->metrics->domain, sizeof(backend->metrics->domain),
+			"%s", pool->domain);
+		snprintf(backend->metrics->server, sizeof(backend->metrics->server),
+			(strchr(backend->host, ':') != NULL) ? "[%s]:%d" : "%s:%d",
+			backend->host, backend->port);
+		metric_add(&backend->metrics->up, 1);
+		pool->count++;
+	}
+
+	if ( (set->pools != NULL) && (set->check_interval > 0) &&
+		(base != NULL) && (cache != NULL) )
+	{
+		set->check_timer = event_new(base, -1, EV_PERSIST, poolset_timer_cb,
+			set);
+		if (set->check_timer == NULL)
+			goto Error;
+		interval.tv_sec = set->check_interval;
+		interval.tv_usec = 0;
+		event_add(set->check_timer, &interval);
+	}
+	return set;
+
+Error:
+	if (set != NULL)
+		poolset_delete(set);
+	return NULL;
+}
+
+void
+poolset_delete(poolset_t *set)
+{
+	pool_t *pool, *next;
+	int i;
+
+	if (set->check_timer != NULL)
+		event_free(set->check_timer);
+	pool = set->pools;
+	while (pool != NULL)
+	{
+		next = pool->next_pool;
+		for (i = 0; i < pool->count; i++)
+		{
+			if (pool->backends[i].check_waiter != NULL)
+				dnscache_cancel(pool->backends[i].check_waiter);
+			if (pool->backends[i].check_bev != NULL)
+				bufferevent_free(pool->backends[i].check_bev);
+		}
+		free(pool->backends);
+		free(pool->domain);
+		free(pool);
+		pool = next;
+	}
+	free(set->metrics);
+	free(set);
+}
+
+pool_t *
+poolset_find(poolset_t *set, const char *domain)
+{
+	pool_t *pool, *any = NULL;
+
+	for (pool = set->pools; pool != NULL; pool = pool->next_pool)
+	{
+		if (strcasecmp(pool->domain, domain) == 0)
+			return pool;
+		if ( (any == NULL) && (strcmp(pool->domain, "*") == 0) )
+			any = pool;
+	}
+	return any;
+}
+
+static void
+backend_set_up(backend_t *backend, int up)
+{
+	if (backend->up == up)
+		return;
+	backend->up = up;
+	if (up)
+	{
+		metric_add(&backend->metrics->up, 1);
+		LOG(LOG_NOTICE, "pool.c:backend_set_up: XMPP server %s of %s is up",
+			backend->metrics->server, backend->pool->domain);
+	}
+	else
+	{
+		metric_sub(&backend->metrics->up, 1);
+		LOG(LOG_WARNING, "pool.c:backend_set_up: XMPP server %s of %s is "
+			"down", backend->metrics->server, backend->pool->domain);
+	}
+}
+
+static void
+backend_check_eventcb(struct bufferevent *bev, short events, void *arg)
+{
+	backend_t *backend = (backend_t*) arg;
+
+	bufferevent_free(bev);
+	backend->check_bev = NULL;
+	if (events & BEV_EVENT_CONNECTED)
+		backend_set_up(backend, 1);
+	else
+	{
+		metric_add(&backend->metrics->failures, 1);
+		backend_set_up(backend, 0);
+	}
+}
+
+static void
+backend_check_resolved(int result, struct sockaddr *address,
+	socklen_t address_size, void *arg)
+{
+	backend_t *backend = (backend_t*) arg;
+	poolset_t *set = backend->pool->set;
+	struct sockaddr_storage server_address;
+	struct timeval timeout;
+
+	backend->check_waiter = NULL;
+	if (!result)
+		goto Error;
+
+	memcpy(&server_address, address, address_size);
+	if (server_address.ss_family == AF_INET)
+		((struct sockaddr_in*) &server_address)->sin_port =
+			htons(backend->port);
+	else if (server_address.ss_family == AF_INET6)
+		((struct sockaddr_in6*) &server_address)->sin6_port =
+			htons(backend->port);
+
+	backend->check_bev = bufferevent_socket_new(set->base, -1,
+		BEV_OPT_CLOSE_ON_FREE);
+	if (backend->check_bev == NULL)
+		return;
+	/* The write timeout covers connecting */
+	timeout.tv_sec = set->check_timeout;
+	timeout.tv_usec = 0;
+	bufferevent_set_timeouts(backend->check_bev, NULL, &timeout);
+	bufferevent_setcb(backend->check_bev, NULL, NULL, backend_check_eventcb,
+		backend);
+	if (bufferevent_socket_connect(backend->check_bev,
+		(struct sockaddr*) &server_address, address_size) < 0)
+	{
+		bufferevent_free(backend->check_bev);
+		backend->check_bev = NULL;
+		goto Error;
+	}
+	return;
+
+Error:
+	metric_add(&backend->metrics->failures, 1);
+	backend_set_up(backend, 0);
+}
+
+void
+poolset_check(poolset_t *set)
+{
+	pool_t *pool;
+	backend_t *backend;
+	int i;
+
+	for (pool = set->pools; pool != NULL; pool = pool->next_pool)
+	{
+		for (i = 0; i < pool->count; i++)
+		{
+			backend = &pool->backends[i];
+			/* Skip servers whose previous check is still running */
+			if ( (backend->check_waiter != NULL) ||
+				(backend->check_bev != NULL) )
+				continue;
+			backend->check_waiter = dnscache_resolve(set->dnscache,
+				backend->host, backend_check_resolved, backend);
+		}
+	}
+}
+
+/* pool_hash scores a server for a key (rendezvous hashing: the server
+   with the highest score gets the key, so when a server goes away, only
+   its own keys move to other servers) */
+static uint64_t
+pool_hash(const char *key, const char *server)
+{
+	uint64_t hash = 14695981039346656037ULL; /* FNV-1a */
+	const char *pch;
+
+	for (pch = key; *pch != '\0'; pch++)
+		hash = (hash ^ (unsigned char) *pch) * 1099511628211ULL;
+	hash = (hash ^ 0xff) * 1099511628211ULL;
+	for (pch = server; *pch != '\0'; pch++)
+		hash = (hash ^ (unsigned char) *pch) * 1099511628211ULL;
+
+	/* Finalizer of splitmix64, so that similar keys get unrelated scores */
+	hash ^= hash >> 30;
+	hash *= 0xbf58476d1ce4e5b9ULL;
+	hash ^= hash >> 27;
+	hash *= 0x94d049bb133111ebULL;
+	hash ^= hash >> 31;
+	return hash;
+}
+
+backend_t *
+pool_select(pool_t *pool, const char *key, uint64_t tried)
+{
+	backend_t *backend, *best;
+	unsigned long connections, best_connections = 0;
+	uint64_t score, best_score = 0;
+	int pass, i, j;
+
+	if (key == NULL)
+		key = "";
+	for (pass = 0; pass < 2; pass++)
+	{
+		best = NULL;
+		for (i = 0; i < pool->count; i++)
+		{
+			j = (pool->set->balance == BALANCE_LEAST_CONNECTIONS) ?
+				(pool->next + i) % pool->count : i;
+			backend = &pool->backends[j];
+			if ( (tried & ((uint64_t) 1 << j)) ||
+				((pass == 0) && !backend->up) )
+				continue;
+			if (pool->set->balance == BALANCE_LEAST_CONNECTIONS)
+			{
+				connections = metric_get(&backend->metrics->connections);
+				if ( (best == NULL) || (connections < best_connections) )
+				{
+					best = backend;
+					best_connections = connections;
+				}
+			}
+			else
+			{
+				score = pool_hash(key, backend->metrics->server);
+				if ( (best == NULL) || (score > best_score) )
+				{
+					best = backend;
+					best_score = score;
+				}
+			}
+		}
+		if (best != NULL)
+		{
+			pool->next = (best->index + 1) % pool->count;
+			return best;
+		}
+	}
+	return NULL;
+}
+
+void
+backend_acquire(backend_t *backend)
+{
+	metric_add(&backend->metrics->connections, 1);
+	metric_add(&backend->metrics->sessions, 1);
+}
+
+void
+backend_release(backend_t *backend)
+{
+	metric_sub(&backend->metrics->connections, 1);
+}
+
+void
+backend_failed(backend_t *backend)
+{
+	metric_add(&backend->metrics->failures, 1);
+	if (backend->pool->set->check_interval > 0)
+		backend_set_up(backend, 0);
+}
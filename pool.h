@@ -0,0 +1,104 @@
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include <stdint.h>
+#include <event2/event.h>
+#include <event2/bufferevent.h>
+#include "parseconfig.h"
+#include "dnscache.h"
+#include "metrics.h"
+
+/* Pools of XMPP servers (xmpp_servers in the configuration).
+
+   The static servers of a domain form a pool. A session is sent to one of
+   the pool's servers, picked by the number of sessions the worker has on
+   each of them or by hashing the user's JID or the browser's address; if
+   the connection fails, the session is retried on another server of the
+   pool. Servers are checked by connecting to them every
+   xmpp_check_interval seconds; a server whose check or connection fails
+   is skipped until a check succeeds again.
+
+   Like the DNS cache, there is one set of pools per worker, used only
+   from the worker's thread. Connection counts and health are therefore
+   per worker; with connections spread evenly over the workers, least
+   connections per worker approximates least connections overall.
+ */
+
+#define POOL_MAX_SERVERS 64 /* servers per pool, see pool_select */
+
+/* How a pool's server is picked (xmpp_balance) */
+enum
+{
+	BALANCE_LEAST_CONNECTIONS, /* fewest sessions, round robin on ties */
+	BALANCE_HASH_JID,          /* hash of the user's JID, if the stream
+	                              header has one, else of the address */
+	BALANCE_HASH_ADDRESS       /* hash of the browser's address */
+};
+
+typedef struct _pool_t pool_t;
+typedef struct _poolset_t poolset_t;
+
+typedef struct _backend_t
+{
+	pool_t *pool;
+	int index;              /* in pool->backends */
+	const char *host;       /* owned by the configuration */
+	int port;
+	int up;                 /* 1 if healthy */
+	backend_metrics_t *metrics;
+	dnscache_waiter_t *check_waiter; /* health check resolving host */
+	struct bufferevent *check_bev;   /* health check connecting */
+} backend_t;
+
+struct _pool_t
+{
+	char *domain; /* "*" for all domains without a pool */
+	backend_t *backends;
+	int count;
+	int next; /* where least connections starts looking */
+	poolset_t *set;
+	pool_t *next_pool;
+};
+
+struct _poolset_t
+{
+	struct event_base *base;
+	dnscache_t *dnscache;
+	pool_t *pools;
+	int balance;
+	int check_interval;
+	int check_timeout;
+	struct event *check_timer;
+	backend_metrics_t *metrics; /* of all servers of all pools */
+	size_t metrics_count;
+};
+
+/* poolset_create builds the pools of conf->xmpp_servers. base and cache
+   may be NULL if there are no health checks. */
+poolset_t *poolset_create(struct event_base *base, dnscache_t *cache,
+	jsconf_t *conf);
+void poolset_delete(poolset_t *set);
+
+/* poolset_find returns the pool of domain, the pool of "*" if domain has
+   none, or NULL */
+pool_t *poolset_find(poolset_t *set, const char *domain);
+
+/* poolset_check starts a health check of all servers; it is called every
+   check_interval seconds */
+void poolset_check(poolset_t *set);
+
+/* pool_select picks a server that isn't in tried (bit i stands for
+   backends[i]). Healthy servers come first; if none is left, servers
+   that failed are tried anyway. Returns NULL if all have been tried. key
+   is hashed by the hashing methods. */
+backend_t *pool_select(pool_t *pool, const char *key, uint64_t tried);
+
+/* backend_acquire and backend_release count the sessions of a server */
+void backend_acquire(backend_t *backend);
+void backend_release(backend_t *backend);
+
+/* backend_failed records a failed connection; with health checks on, the
+   server is skipped until the next successful check */
+void backend_failed(backend_t *backend);
+
+#endif /* _POOL_H_ */
@@ -0,0 +1,189 @@
+#include <stdlib.h>
+#include "CuTest.h"
+#include <stdio.h>
+#include <string.h>
+#include "pool.h"
+
+static jsconf_t *
+make_config(int balance, int check_interval)
+{
+	jsconf_t *conf;
+
+	conf = config_create();
+	conf->xmpp_balance = balance;
+	conf->xmpp_check_interval = check_interval;
+	config_add_xmpp_server(conf, "example.com", "xmpp1.example.com");
+	config_add_xmpp_server(conf, "example.com", "xmpp2.example.com:5223");
+	config_add_xmpp_server(conf, "example.com", "[2001:db8::1]:5222");
+	config_add_xmpp_server(conf, "*", "localhost");
+	return conf;
+}
+
+void TestPoolCreate(CuTest *tc)
+{
+	jsconf_t *conf;
+	poolset_t *set;
+	pool_t *pool;
+
+	conf = make_config(BALANCE_LEAST_CONNECTIONS, 0);
+	set = poolset_create(NULL, NULL, conf);
+	CuAssertPtrNotNull(tc, set);
+	CuAssertIntEquals(tc, 4, set->metrics_count);
+
+	pool = poolset_find(set, "Example.com");
+	CuAssertPtrNotNull(tc, pool);
+	CuAssertIntEquals(tc, 3, pool->count);
+	CuAssertStrEquals(tc, "xmpp1.example.com", pool->backends[0].host);
+	CuAssertIntEquals(tc, 5222, pool->backends[0].port);
+	CuAssertIntEquals(tc, 5223, pool->backends[1].port);
+	CuAssertStrEquals(tc, "xmpp2.example.com:5223",
+		pool->backends[1].metrics->server);
+	CuAssertStrEquals(tc, "[2001:db8::1]:5222",
+		pool->backends[2].metrics->server);
+	CuAssertStrEquals(tc, "example.com", pool->backends[2].metrics->domain);
+	CuAssertIntEquals(tc, 1, metric_get(&pool->backends[2].metrics->up));
+
+	/* Other domains go to the "*" pool */
+	pool = poolset_find(set, "example.net");
+	CuAssertPtrNotNull(tc, pool);
+	CuAssertStrEquals(tc, "*", pool->domain);
+	CuAssertIntEquals(tc, 1, pool->count);
+
+	poolset_delete(set);
+	config_delete(conf);
+
+	/* No static servers, no pools */
+	conf = config_create();
+	set = poolset_create(NULL, NULL, conf);
+	CuAssertPtrNotNull(tc, set);
+	CuAssertPtrEquals(tc, NULL, poolset_find(set, "example.com"));
+	poolset_delete(set);
+	config_delete(conf);
+}
+
+void TestPoolLeastConnections(CuTest *tc)
+{
+	jsconf_t *conf;
+	poolset_t *set;
+	pool_t *pool;
+	backend_t *backend;
+
+	conf = make_config(BALANCE_LEAST_CONNECTIONS, 10);
+	set = poolset_create(NULL, NULL, conf);
+	pool = poolset_find(set, "example.com");
+
+	/* Round robin while the counts are equal */
+	backend = pool_select(pool, NULL, 0);
+	CuAssertIntEquals(tc, 0, backend->index);
+	backend_acquire(backend);
+	backend = pool_select(pool, NULL, 0);
+	CuAssertIntEquals(tc, 1, backend->index);
+	backend_acquire(backend);
+	backend = pool_select(pool, NULL, 0);
+	CuAssertIntEquals(tc, 2, backend->index);
+	backend_acquire(backend);
+	backend_acquire(&pool->backends[0]);
+
+	/* Fewest connections */
+	backend_release(&pool->backends[2]);
+	CuAssertIntEquals(tc, 2, pool_select(pool, NULL, 0)->index);
+	CuAssertIntEquals(tc, 2, pool_select(pool, NULL, 0)->index);
+	CuAssertIntEquals(tc, 2,
+		metric_get(&pool->backends[0].metrics->connections));
+	CuAssertIntEquals(tc, 2,
+		metric_get(&pool->backends[0].metrics->sessions));
+
+	/* A failed server is skipped, also when it has the fewest
+	   connections */
+	backend_failed(&pool->backends[2]);
+	CuAssertIntEquals(tc, 0, pool->backends[2].up);
+	CuAssertIntEquals(tc, 0, metric_get(&pool->backends[2].metrics->up));
+	CuAssertIntEquals(tc, 1,
+		metric_get(&pool->backends[2].metrics->failures));
+	CuAssertIntEquals(tc, 1, pool_select(pool, NULL, 0)->index);
+
+	/* Servers already tried are skipped; failed servers are tried when
+	   no healthy one is left */
+	CuAssertIntEquals(tc, 0, pool_select(pool, NULL, 0x2)->index);
+	CuAssertIntEquals(tc, 2, pool_select(pool, NULL, 0x3)->index);
+	CuAssertPtrEquals(tc, NULL, pool_select(pool, NULL, 0x7));
+
+	poolset_delete(set);
+	config_delete(conf);
+
+	/* Without health checks, nothing would bring a server back, so
+	   failures don't take it out of the pool */
+	conf = make_config(BALANCE_LEAST_CONNECTIONS, 0);
+	set = poolset_create(NULL, NULL, conf);
+	pool = poolset_find(set, "example.com");
+	backend_failed(&pool->backends[0]);
+	CuAssertIntEquals(tc, 1, pool->backends[0].up);
+	CuAssertIntEquals(tc, 0, pool_select(pool, NULL, 0)->index);
+	poolset_delete(set);
+	config_delete(conf);
+}
+
+void TestPoolHash(CuTest *tc)
+{
+	jsconf_t *conf;
+	poolset_t *set;
+	pool_t *pool;
+	char key[64];
+	int chosen[300];
+	int hits[3] = {0, 0, 0};
+	int i, moved;
+
+	conf = make_config(BALANCE_HASH_JID, 10);
+	set = poolset_create(NULL, NULL, conf);
+	pool = poolset_find(set, "example.com");
+
+	/* The same key always gets the same server, and the keys are spread
+	   over all servers */
+	for (i = 0; i < 300; i++)
+	{
+		snprintf(key, sizeof(key), "user%d@example.com", i);
+		chosen[i] = pool_select(pool, key, 0)->index;
+		CuAssertIntEquals(tc, chosen[i], pool_select(pool, key, 0)->index);
+		hits[chosen[i]]++;
+	}
+	CuAssertTrue(tc, hits[0] > 50);
+	CuAssertTrue(tc, hits[1] > 50);
+	CuAssertTrue(tc, hits[2] > 50);
+
+	/* When a server fails, only its keys move */
+	backend_failed(&pool->backends[1]);
+	moved = 0;
+	for (i = 0; i < 300; i++)
+	{
+		snprintf(key, sizeof(key), "user%d@example.com", i);
+		if (chosen[i] != 1)
+			CuAssertIntEquals(tc, chosen[i], pool_select(pool, key, 0)->index);
+		else
+		{
+			CuAssertTrue(tc, pool_select(pool, key, 0)->index != 1);
+			moved++;
+		}
+	}
+	CuAssertIntEquals(tc, hits[1], moved);
+
+	/* A key's failover server is the one it gets when its server fails */
+	for (i = 0; i < 300; i++)
+	{
+		snprintf(key, sizeof(key), "user%d@example.com", i);
+		if (chosen[i] == 1)
+			CuAssertIntEquals(tc, pool_select(pool, key, 0)->index,
+				pool_select(pool, key, (uint64_t) 1 << 1)->index);
+	}
+
+	poolset_delete(set);
+	config_delete(conf);
+}
+
+CuSuite* PoolGetSuite()
+{
+	CuSuite* suite = CuSuiteNew();
+	SUITE_ADD_TEST(suite, TestPoolCreate);
+	SUITE_ADD_TEST(suite, TestPoolLeastConnections);
+	SUITE_ADD_TEST(suite, TestPoolHash);
+	return suite;
+}
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 #include <openssl/sha.h>
 #include "base64.h"
@@ -17,7 +18,21 @@ enum State
 	ST_ERROR	/* input has an error */
 };
 
-static void _process(request_t *h, char *key, char *value);
+/* Headers we are interested in */
+enum Header
+{
+	HDR_OTHER,
+	HDR_HOST,
+	HDR_UPGRADE,
+	HDR_CONNECTION,
+	HDR_WS_KEY,
+	HDR_WS_PROTOCOL,
+	HDR_WS_VERSION,
+	HDR_ORIGIN
+};
+
+static int _header_id(const char *name, size_t length);
+static void _process(request_t *h, int id, const char *value, size_t length);
 static void _get_protocols(request_t *h);
 
 /* _find_connection_upgrade returns 1 if h->connection_str is a list
@@ -34,14 +49,9 @@ rq_create()
 	h = (request_t*) malloc(sizeof(request_t));
 	if (h != NULL)
 	{
-		char *line = (char*) malloc(LINE_BUFFER_SIZE);
-		if (line == NULL)
-		{
-			free(h);
-			return NULL;
-		}
-		h->line = line;
+		h->line = NULL;
 		h->length = 0;
+		h->scanned = 0;
 		h->done = 0;
 		h->error = 0;
 		h->state = ST_START;
@@ -99,17 +109,7 @@ rq_create()
 void
 rq_delete(request_t *h)
 {
-	struct _strlist_t *current, *next;
-
-	/* Delete the list of protocols */
-	current = h->protocols_head;
-	while (current != NULL)
-	{
-		next = current->next;
-		free(current);
-		current = next;
-	}
-	
+	free(h->line);
 	free(h);
 }
 
@@ -117,6 +117,7 @@ void
 rq_clear(request_t *h)
 {
 	h->length = 0;
+	h->scanned = 0;
 	h->done = 0;
 	h->error = 0;
 	h->state = ST_START;
@@ -145,6 +146,15 @@ rq_add_line(request_t *h, const char *line)
 	size_t len = strlen(line);
 	int res;
 	
+	if (h->line == NULL)
+	{
+		h->line = (char*) malloc(LINE_BUFFER_SIZE);
+		if (h->line == NULL)
+		{
+			h->error = 1;
+			return;
+		}
+	}
 	switch (h->state)
 	{
 		case ST_START:
@@ -168,27 +178,16 @@ rq_add_line(request_t *h, const char *line)
 				{
 					/* We have a full line of header, now we can analyze it. */
 					char *colon = strchr(h->line, ':');
-					size_t keylen;
-					char *key;
-					char *value;
 					if (colon == NULL)
 					{
 						/* We didn't find a colon. */
 						h->error = 1;
 						return;
 					}
-					keylen = colon - h->line;
-					key = strndup(h->line, keylen);
-					if (key == NULL)
-					{
-						/* Allocation error */
-						h->error = 1;
-						return;
-					}
-					value = strdup(colon + 1);
 		
 					/* Now we have key and value, process them */
-					_process(h, key, value);
+					_process(h, _header_id(h->line, colon - h->line),
+						colon + 1, strlen(colon + 1) );
 				}
 			}
 			if (len > 0)
@@ -210,44 +209,224 @@ rq_add_line(request_t *h, const char *line)
 	}
 }
 
-static void
-_process(request_t *h, char *key, char *value)
+/* _header_id recognizes the headers we are interested in by their length
+   first, so most headers are rejected without comparing strings. */
+static int
+_header_id(const char *name, size_t length)
 {
-	if (strcasecmp(key, "host") == 0)
+	switch (length)
 	{
-		str_trim_beginning(&h->host_str, value);
+		case 4:
+			if (strncasecmp(name, "Host", 4) == 0)
+				return HDR_HOST;
+			break;
+		case 6:
+			if (strncasecmp(name, "Origin", 6) == 0)
+				return HDR_ORIGIN;
+			break;
+		case 7:
+			if (strncasecmp(name, "Upgrade", 7) == 0)
+				return HDR_UPGRADE;
+			break;
+		case 10:
+			if (strncasecmp(name, "Connection", 10) == 0)
+				return HDR_CONNECTION;
+			break;
+		case 17:
+			if (strncasecmp(name, "Sec-WebSocket-Key", 17) == 0)
+				return HDR_WS_KEY;
+			break;
+		case 21:
+			if (strncasecmp(name, "Sec-WebSocket-Version", 21) == 0)
+				return HDR_WS_VERSION;
+			break;
+		case 22:
+			if (strncasecmp(name, "Sec-WebSocket-Protocol", 22) == 0)
+				return HDR_WS_PROTOCOL;
+			break;
 	}
-	else if (strcasecmp(key, "upgrade") == 0)
+	return HDR_OTHER;
+}
+
+/* _set_trimmed sets str to value without leading and trailing whitespace;
+   value doesn't have to be zero-terminated. */
+static void
+_set_trimmed(str_t *str, const char *value, size_t length)
+{
+	while ( (length > 0) && isspace((unsigned char) value[0]) )
 	{
-		str_trim_beginning(&h->upgrade_str, value);
-		if ( str_is_equal_nocase(&h->upgrade_str, "websocket") )
-			h->fl_upgrade_found = 1;
+		value++;
+		length--;
 	}
-	else if (strcasecmp(key, "connection") == 0)
+	while ( (length > 0) && isspace((unsigned char) value[length - 1]) )
+		length--;
+	str_setn_string(str, value, length);
+}
+
+static void
+_process(request_t *h, int id, const char *value, size_t length)
+{
+	switch (id)
 	{
-		str_trim_beginning(&h->connection_str, value);
-		if ( _find_connection_upgrade(h) )
-			h->fl_connection_found = 1;
+		case HDR_HOST:
+			_set_trimmed(&h->host_str, value, length);
+			break;
+		case HDR_UPGRADE:
+			_set_trimmed(&h->upgrade_str, value, length);
+			if ( str_is_equal_nocase(&h->upgrade_str, "websocket") )
+				h->fl_upgrade_found = 1;
+			break;
+		case HDR_CONNECTION:
+			_set_trimmed(&h->connection_str, value, length);
+			if ( _find_connection_upgrade(h) )
+				h->fl_connection_found = 1;
+			break;
+		case HDR_WS_KEY:
+			_set_trimmed(&h->ws_key_str, value, length);
+			break;
+		case HDR_WS_PROTOCOL:
+			_set_trimmed(&h->ws_protocol_str, value, length);
+			_get_protocols(h);
+			break;
+		case HDR_WS_VERSION:
+			_set_trimmed(&h->ws_version_str, value, length);
+			break;
+		case HDR_ORIGIN:
+			_set_trimmed(&h->origin_str, value, length);
+			str_tolower(&h->origin_str);
+			break;
 	}
-	else if (strcasecmp(key, "Sec-WebSocket-Key") == 0)
+}
+
+/* _find_header_end returns the size of the header in data (up to and
+   including the empty line), or 0 if the empty line hasn't arrived yet.
+   Lines may end with CRLF or LF. */
+static size_t
+_find_header_end(request_t *h, const char *data, size_t length)
+{
+	const char *p;
+	size_t i;
+
+	/* Continue where the last search stopped, the line feed that ends
+	   the last line may already have been seen */
+	i = (h->scanned > 2) ? h->scanned - 2 : 0;
+	while (i < length)
 	{
-		str_trim_beginning(&h->ws_key_str, value);
+		p = (const char*) memchr(data + i, '\n', length - i);
+		if (p == NULL)
+			break;
+		i = p - data + 1;
+		if ( (i < length) && (data[i] == '\n') )
+			return i + 1;
+		if ( (i + 1 < length) && (data[i] == '\r') && (data[i + 1] == '\n') )
+			return i + 2;
 	}
-	else if (strcasecmp(key, "Sec-WebSocket-Protocol") == 0)
+	h->scanned = length;
+	return 0;
+}
+
+/* _parse_request_line splits "GET /resource HTTP/1.1" */
+static int
+_parse_request_line(request_t *h, const char *line, size_t length)
+{
+	str_t *fields[3];
+	size_t i, start;
+	int n = 0;
+
+	fields[0] = &h->method_str;
+	fields[1] = &h->resource_str;
+	fields[2] = &h->protocol_str;
+	i = 0;
+	while (n < 3)
 	{
-		str_trim_beginning(&h->ws_protocol_str, value);
-		_get_protocols(h);
+		while ( (i < length) && ( (line[i] == ' ') || (line[i] == '\t') ) )
+			i++;
+		if (i == length)
+			return 0;
+		start = i;
+		while ( (i < length) && (line[i] != ' ') && (line[i] != '\t') )
+			i++;
+		str_setn_string(fields[n++], line + start, i - start);
 	}
-	else if (strcasecmp(key, "Sec-WebSocket-Version") == 0)
+	return 1;
+}
+
+size_t
+rq_parse(request_t *h, const char *data, size_t length)
+{
+	size_t size, pos, eol, line_length;
+	const char *line, *colon;
+	int id = HDR_OTHER; /* header waiting for continuation lines */
+	const char *value = NULL;
+	size_t value_length = 0;
+	char folded[1024]; /* value of a header with continuation lines */
+	str_t folded_str;
+
+	if (length > RQ_MAX_HEADER_SIZE)
+		length = RQ_MAX_HEADER_SIZE;
+	size = _find_header_end(h, data, length);
+	if (size == 0)
 	{
-		str_trim_beginning(&h->ws_version_str, value);
+		if (length == RQ_MAX_HEADER_SIZE)
+			goto Error; /* too large */
+		return 0;
 	}
-	else if (strcasecmp(key, "Origin") == 0)
+
+	str_init( &folded_str, folded, sizeof(folded) );
+	for (pos = 0; pos < size; pos = eol + 1)
 	{
-		str_trim_beginning(&h->origin_str, value);
-		str_tolower(&h->origin_str);
+		eol = (const char*) memchr(data + pos, '\n', size - pos) - data;
+		line = data + pos;
+		line_length = eol - pos;
+		if ( (line_length > 0) && (line[line_length - 1] == '\r') )
+			line_length--;
+
+		if (h->state == ST_START)
+		{
+			if ( !_parse_request_line(h, line, line_length) )
+				goto Error;
+			h->state = ST_HEADER;
+			continue;
+		}
+
+		if ( (line_length > 0) && ( (line[0] == ' ') || (line[0] == '\t') ) )
+		{
+			/* Continuation of the previous header line */
+			if (value == NULL)
+				goto Error;
+			if (value != folded)
+			{
+				str_setn_string(&folded_str, value, value_length);
+				value = folded;
+			}
+			/* skip the starting space */
+			str_appendn_string(&folded_str, line + 1, line_length - 1);
+			value_length = str_get_length(&folded_str);
+			continue;
+		}
+
+		/* A new header line (or the empty line) ends the previous header */
+		if (value != NULL)
+			_process(h, id, value, value_length);
+		value = NULL;
+		if (line_length == 0)
+			break;
+
+		colon = (const char*) memchr(line, ':', line_length);
+		if (colon == NULL)
+			goto Error;
+		id = _header_id(line, colon - line);
+		value = colon + 1;
+		value_length = line + line_length - value;
 	}
-	free((void*)key);
+
+	h->done = 1;
+	return size;
+
+Error:
+	h->error = 1;
+	h->state = ST_ERROR;
+	return 0;
 }
 
 int
@@ -304,6 +483,12 @@ rq_get_origin(request_t *h)
 	return str_get_string(&h->origin_str);
 }
 
+int
+rq_get_error_code(request_t *h)
+{
+	return h->error_code;
+}
+
 int
 rq_get_protocol_count(request_t *h)
 {
@@ -323,17 +508,17 @@ parse_request_line(request_t *h, const char *line)
 	method = strtok(line_copy, " \t");
 	if (method == NULL)
 		goto Error;
-	str_set_string(&h->method_str, method);
+	str_set_string(&h->method_str, "%s", method);
 
 	resource = strtok(NULL, " \t");
 	if (resource == NULL)
 		goto Error;
-	str_set_string(&h->resource_str, resource);
+	str_set_string(&h->resource_str, "%s", resource);
 
 	protocol = strtok(NULL, " \t");
 	if (protocol == NULL)
 		goto Error;
-	str_set_string(&h->protocol_str, resource);
+	str_set_string(&h->protocol_str, "%s", protocol);
 	
 	free(line_copy);
 	return 1;
@@ -376,65 +561,68 @@ void rq_get_access(char *challenge, str_t *response)
 	// return response;
 }
 
+/* _next_token finds the next comma-separated token of list after *pos,
+   without whitespace around it. Returns 0 at the end of the list. */
+static int
+_next_token(const char *list, size_t *pos, const char **token,
+	size_t *token_length)
+{
+	size_t i = *pos;
+	size_t end;
+
+	if (list[i] == '\0')
+		return 0;
+	while ( isspace((unsigned char) list[i]) )
+		i++;
+	*token = list + i;
+	while ( (list[i] != ',') && (list[i] != '\0') )
+		i++;
+	end = i;
+	while ( (end > (size_t) (*token - list)) &&
+		isspace((unsigned char) list[end - 1]) )
+		end--;
+	*token_length = end - (*token - list);
+	*pos = (list[i] == ',') ? i + 1 : i;
+	return 1;
+}
+
 static void
 _get_protocols(request_t *h)
 {
-	char *str, *saveptr, *token;
-	char token_nows_buffer[16];
-	str_t token_nows_str;
+	const char *list = str_get_string(&h->ws_protocol_str);
+	const char *token;
+	size_t pos = 0, token_length;
 	struct _strlist_t *new_protocol;
 	
-	str_init( &token_nows_str, token_nows_buffer, sizeof(token_nows_buffer) );
-	str = str_get_string(&h->ws_protocol_str);
-	while (1)
+	while ( _next_token(list, &pos, &token, &token_length) )
 	{
-		token = strtok_r(str, ",", &saveptr);
-		str = NULL;
-		if (token == NULL)
+		if (h->protocol_count >= RQ_MAX_PROTOCOLS)
 			break;
-		str_trim_whitespace(&token_nows_str, token);
-		new_protocol = (struct _strlist_t *) malloc(sizeof(*new_protocol));
-		if (new_protocol != NULL)
-		{
-			str_init(
-				&new_protocol->el_str,
-				new_protocol->el_buffer,
-				sizeof(new_protocol->el_buffer) );
-			str_copy_string(&new_protocol->el_str, &token_nows_str);
-			new_protocol->next = h->protocols_head;
-			h->protocols_head = new_protocol;
-			h->protocol_count++;
-		}
+		new_protocol = &h->protocol_nodes[h->protocol_count];
+		str_init(
+			&new_protocol->el_str,
+			new_protocol->el_buffer,
+			sizeof(new_protocol->el_buffer) );
+		str_setn_string(&new_protocol->el_str, token, token_length);
+		new_protocol->next = h->protocols_head;
+		h->protocols_head = new_protocol;
+		h->protocol_count++;
 	}
 }
 
 static int
 _find_connection_upgrade(request_t *h)
 {
-	char *str, *saveptr, *token;
-	char tmp_connection_buffer[64];
-	str_t tmp_connection_str;
-	char token_nows_buffer[16];
-	str_t token_nows_str;
-	struct _strlist_t *new_connpar;
-	
-	str_init( &tmp_connection_str, tmp_connection_buffer, sizeof(tmp_connection_buffer) );
-	str_init( &token_nows_str, token_nows_buffer, sizeof(token_nows_buffer) );
+	const char *list = str_get_string(&h->connection_str);
+	const char *token;
+	size_t pos = 0, token_length;
 	
-	/* We copy connection_str to tmp_connection_str, because strtok will spoil
-	   the internal buffer */
-	str_copy_string(&tmp_connection_str, &h->connection_str);
-	str = str_get_string(&tmp_connection_str);
-	while (1)
+	while ( _next_token(list, &pos, &token, &token_length) )
 	{
-		token = strtok_r(str, ",", &saveptr);
-		str = NULL;
-		if (token == NULL)
-			break;
-		str_trim_whitespace(&token_nows_str, token);
-		if ( str_is_equal_nocase(&token_nows_str, "Upgrade") )
+		if ( (token_length == 7) && (strncasecmp(token, "Upgrade", 7) == 0) )
 			return 1;
 	}
+	return 0;
 }
 
 char *
@@ -473,6 +661,7 @@ rq_analyze(request_t *h, jsconf_t *conf, str_t *response)
 
 	if ( !str_is_equal_nocase(&h->method_str, "GET") )
 	{
+		h->error_code = 405;
 		str_set_string(
 			response,
 			"HTTP/1.1 405 Method Not Allowed\r\n"
@@ -481,6 +670,7 @@ rq_analyze(request_t *h, jsconf_t *conf, str_t *response)
 	}
 	if ( !config_check_origin( conf, rq_get_origin(h) ) )
 	{
+		h->error_code = 403;
 		str_set_string(
 			response,
 			"HTTP/1.1 403 Forbidden\r\n"
@@ -489,6 +679,7 @@ rq_analyze(request_t *h, jsconf_t *conf, str_t *response)
 	}
 	if ( !rq_protocols_contains(h, "xmpp") )
 	{
+		h->error_code = 400;
 		str_set_string(
 			response,
 			"HTTP/1.1 400 Bad Request\r\n"
@@ -499,6 +690,7 @@ rq_analyze(request_t *h, jsconf_t *conf, str_t *response)
 	/* Check if Sec-WebSocket-Key exists */
 	if ( strcmp(rq_get_websocket_key(h), "") == 0 )
 	{
+		h->error_code = 400;
 		str_set_string(
 			response,
 			"HTTP/1.1 400 Bad Request\r\n"
@@ -509,6 +701,7 @@ rq_analyze(request_t *h, jsconf_t *conf, str_t *response)
 	/* Check Host */
 	if ( (conf->host != NULL) && ( strcmp(conf->host, rq_get_host(h) ) != 0 ) )
 	{
+		h->error_code = 400;
 		str_set_string(
 			response,
 			"HTTP/1.1 400 Bad Request\r\n"
@@ -519,6 +712,7 @@ rq_analyze(request_t *h, jsconf_t *conf, str_t *response)
 	/* Check for Upgrade: WebSocket */
 	if ( !h->fl_upgrade_found )
 	{
+		h->error_code = 400;
 		str_set_string(
 			response,
 			"HTTP/1.1 400 Bad Request\r\n"
@@ -529,6 +723,7 @@ rq_analyze(request_t *h, jsconf_t *conf, str_t *response)
 	/* Check for Connection: Upgrade */
 	if ( !h->fl_connection_found )
 	{
+		h->error_code = 400;
 		str_set_string(
 			response,
 			"HTTP/1.1 400 Bad Request\r\n"
@@ -540,6 +735,7 @@ rq_analyze(request_t *h, jsconf_t *conf, str_t *response)
 	if ( (conf->resource != NULL) &&
 		 ( !str_is_equal_nocase(&h->resource_str, conf->resource) ) )
 	{
+		h->error_code = 404;
 		str_set_string(
 			response,
 			"HTTP/1.1 404 Not Found\r\n"
@@ -550,6 +746,7 @@ rq_analyze(request_t *h, jsconf_t *conf, str_t *response)
 	/* Check for version 13 */
 	if ( strcmp( rq_get_websocket_version(h), "13" ) != 0 )
 	{
+		h->error_code = 426;
 		str_set_string(
 			response,
 			"HTTP/1.1 426 Upgrade Required\r\n"
@@ -572,6 +769,7 @@ rq_analyze(request_t *h, jsconf_t *conf, str_t *response)
 		"\r\n",
 		str_get_string(&accept_str) );
 #endif
+	h->error_code = 101;
 	str_set_string( response,
 		"HTTP/1.1 101 Switching Protocols\r\n"
 		"Upgrade: websocket\r\n"
@@ -4,6 +4,12 @@
 #include "util.h"
 #include "parseconfig.h"
 
+/* Maximum number of sub-protocols kept from Sec-WebSocket-Protocol */
+#define RQ_MAX_PROTOCOLS 16
+
+/* Maximum size of a request header accepted by rq_parse */
+#define RQ_MAX_HEADER_SIZE 8192
+
 struct _strlist_t
 {
 	char el_buffer[16]; /* Enough capacity for a sub-protocol name */
@@ -14,8 +20,9 @@ struct _strlist_t
 typedef struct _request_t
 {
 	int state;
-	char *line;
+	char *line; /* line buffer of rq_add_line, allocated on first use */
 	unsigned int length;
+	size_t scanned; /* rq_parse: bytes known not to contain the end */
 	int done; /* becomes 1 when we are done parsing headers */
 	int error; /* becomes 1 when there is a parsing error */
 
@@ -48,6 +55,7 @@ typedef struct _request_t
 
 	struct _strlist_t *protocols_head; /* the head of the list of protocols */
 	int protocol_count;
+	struct _strlist_t protocol_nodes[RQ_MAX_PROTOCOLS];
 
 	char ws_version_buffer[32];
 	str_t ws_version_str;
@@ -66,6 +74,14 @@ void rq_clear(request_t *h);
 
 void rq_add_line(request_t *h, const char *line);
 
+/* rq_parse parses a request header (request line, header lines and the
+   empty line that ends it) in one pass over data, which doesn't have to
+   be zero-terminated, without allocating memory. data is the input
+   received so far; call it again with more input while it returns 0.
+   Returns the size of the header, or 0 if it is not complete yet (or on
+   error, see rq_is_error). */
+size_t rq_parse(request_t *h, const char *data, size_t length);
+
 int rq_done(request_t *h);
 
 /* rq_is_error checks if there are simple errors in parsing the request.
@@ -86,6 +102,10 @@ int rq_is_error(request_t *h);
 */
 int rq_analyze(request_t *h, jsconf_t *conf, str_t *response);
 
+/* rq_get_error_code returns the HTTP status of the response generated by
+   rq_analyze */
+int rq_get_error_code(request_t *h);
+
 char *rq_get_host(request_t *h);
 char *rq_get_upgrade(request_t *h);
 char *rq_get_connection(request_t *h);
@@ -2,6 +2,8 @@
 #include "CuTest.h"
 #include "rqparser.h"
 #include <string.h>
+#include <stdio.h>
+#include <time.h>
 
 void TestCreateParser(CuTest *tc)
 {
@@ -100,7 +102,7 @@ void TestMultipleProtocols(CuTest *tc)
 	CuAssertTrue(tc, !rq_done(h));
 	rq_add_line(h, "");
 	
-	// CuAssertStrEquals(tc, "xmpp, smtp", rq_get_websocket_protocol(h));
+	CuAssertStrEquals(tc, "xmpp, smtp", rq_get_websocket_protocol(h));
 	CuAssertIntEquals(tc, 2, rq_get_protocol_count(h));
 	CuAssertStrEquals(tc, "smtp", rq_get_protocol(h, 0));
 	CuAssertStrEquals(tc, "xmpp", rq_get_protocol(h, 1));
@@ -416,6 +418,149 @@ void TestHeaderErrors(CuTest *tc)
 	config_delete(conf_noresource);
 }
 
+static const char *handshake =
+	"GET /mychat HTTP/1.1\r\n"
+	"Host: server.example.com\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:120.0)\r\n"
+	"Accept: */*\r\n"
+	"Accept-Language: en-US,en;q=0.5\r\n"
+	"Accept-Encoding: gzip, deflate\r\n"
+	"Sec-WebSocket-Version: 13\r\n"
+	"Origin: http://FirstDomain.com\r\n"
+	"Sec-WebSocket-Protocol: xmpp, smtp\r\n"
+	"Sec-WebSocket-Extensions: permessage-deflate\r\n"
+	"sec-websocket-key: x3JJHMbDL1EzLkh9GBhXDw==\r\n"
+	"Connection: keep-alive, Upgrade\r\n"
+	"Pragma: no-cache\r\n"
+	"Cache-Control: no-cache\r\n"
+	"Upgrade: websocket\r\n"
+	"\r\n";
+
+static void
+check_handshake(CuTest *tc, request_t *h)
+{
+	CuAssertTrue(tc, rq_done(h));
+	CuAssertTrue(tc, !rq_is_error(h));
+	CuAssertStrEquals(tc, "GET", str_get_string(&h->method_str));
+	CuAssertStrEquals(tc, "/mychat", str_get_string(&h->resource_str));
+	CuAssertStrEquals(tc, "HTTP/1.1", str_get_string(&h->protocol_str));
+	CuAssertStrEquals(tc, "server.example.com", rq_get_host(h));
+	CuAssertStrEquals(tc, "websocket", rq_get_upgrade(h));
+	CuAssertStrEquals(tc, "keep-alive, Upgrade", rq_get_connection(h));
+	CuAssertStrEquals(tc, "x3JJHMbDL1EzLkh9GBhXDw==", rq_get_websocket_key(h));
+	CuAssertStrEquals(tc, "13", rq_get_websocket_version(h));
+	CuAssertStrEquals(tc, "http://firstdomain.com", rq_get_origin(h));
+	CuAssertIntEquals(tc, 2, rq_get_protocol_count(h));
+	CuAssertTrue(tc, rq_protocols_contains(h, "xmpp"));
+	CuAssertTrue(tc, h->fl_upgrade_found);
+	CuAssertTrue(tc, h->fl_connection_found);
+}
+
+/* rq_parse on a whole header and on a header that arrives byte by byte */
+void TestParseBuffer(CuTest *tc)
+{
+	request_t *h = rq_create();
+	size_t length = strlen(handshake);
+	size_t i;
+	char data[1024];
+
+	/* Input after the header is not consumed */
+	snprintf(data, sizeof(data), "%s%s", handshake, "\x81\x85");
+	CuAssertIntEquals( tc, length, rq_parse(h, data, length + 2) );
+	check_handshake(tc, h);
+
+	rq_clear(h);
+	for (i = 1; i < length; i++)
+	{
+		CuAssertIntEquals( tc, 0, rq_parse(h, handshake, i) );
+		CuAssertTrue(tc, !rq_is_error(h));
+		CuAssertTrue(tc, !rq_done(h));
+	}
+	CuAssertIntEquals( tc, length, rq_parse(h, handshake, length) );
+	check_handshake(tc, h);
+
+	rq_delete(h);
+}
+
+void TestParseBufferFormats(CuTest *tc)
+{
+	request_t *h = rq_create();
+	char *request;
+	char large[RQ_MAX_HEADER_SIZE + 64];
+
+	/* Bare LF line ends and a continuation line */
+	request = "GET /x HTTP/1.1\nHost: example\n .com\nUpgrade:websocket  \n\n";
+	CuAssertIntEquals( tc, strlen(request),
+		rq_parse(h, request, strlen(request)) );
+	CuAssertTrue(tc, !rq_is_error(h));
+	CuAssertStrEquals(tc, "example.com", rq_get_host(h));
+	CuAssertStrEquals(tc, "websocket", rq_get_upgrade(h));
+
+	/* Header line without a colon */
+	rq_clear(h);
+	request = "GET /x HTTP/1.1\r\nHost example.com\r\n\r\n";
+	CuAssertIntEquals( tc, 0, rq_parse(h, request, strlen(request)) );
+	CuAssertTrue(tc, rq_is_error(h));
+
+	/* Incomplete request line */
+	rq_clear(h);
+	request = "GET\r\n\r\n";
+	CuAssertIntEquals( tc, 0, rq_parse(h, request, strlen(request)) );
+	CuAssertTrue(tc, rq_is_error(h));
+
+	/* A header that never ends */
+	rq_clear(h);
+	memset(large, 'a', sizeof(large));
+	CuAssertIntEquals( tc, 0, rq_parse(h, large, sizeof(large)) );
+	CuAssertTrue(tc, rq_is_error(h));
+
+	rq_delete(h);
+}
+
+/* Benchmark: handshakes per second parsed with rq_add_line (one allocated
+   line per header line, as evbuffer_readln returns them) and with
+   rq_parse */
+void TestParseBenchmark(CuTest *tc)
+{
+	request_t *h = rq_create();
+	int rounds = 20000;
+	int i;
+	const char *line, *eol;
+	char *copy;
+	struct timespec start, end;
+	double lines_s, parse_s;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < rounds; i++)
+	{
+		rq_clear(h);
+		for (line = handshake; !rq_done(h); line = eol + 2)
+		{
+			eol = strstr(line, "\r\n");
+			copy = strndup(line, eol - line);
+			rq_add_line(h, copy);
+			free(copy);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	check_handshake(tc, h);
+	lines_s = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < rounds; i++)
+	{
+		rq_clear(h);
+		rq_parse(h, handshake, strlen(handshake));
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	check_handshake(tc, h);
+	parse_s = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	printf("rqparser: rq_add_line %.0f handshakes/s, rq_parse %.0f "
+		"handshakes/s\n", rounds / lines_s, rounds / parse_s);
+	rq_delete(h);
+}
+
 CuSuite* ParserGetSuite()
 {
 	CuSuite* suite = CuSuiteNew();
@@ -428,6 +573,9 @@ CuSuite* ParserGetSuite()
 	SUITE_ADD_TEST(suite, TestWebSocketResponse);
 	SUITE_ADD_TEST(suite, TestMultipleProtocols);
 	SUITE_ADD_TEST(suite, TestHeaderErrors);
+	SUITE_ADD_TEST(suite, TestParseBuffer);
+	SUITE_ADD_TEST(suite, TestParseBufferFormats);
+	SUITE_ADD_TEST(suite, TestParseBenchmark);
 	return suite;
 }
 
@@ -0,0 +1,418 @@
+#include "srv.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <event2/util.h>
+
+#define DNS_HEADER_SIZE 12
+#define DNS_FLAG_QR 0x8000 /* message is a response */
+#define DNS_FLAG_TC 0x0200 /* message is truncated */
+#define DNS_FLAG_RD 0x0100 /* recursion desired */
+#define DNS_RCODE_NXDOMAIN 3
+#define DNS_TYPE_SRV 33
+#define DNS_CLASS_IN 1
+
+struct _srv_request_t
+{
+	struct event_base *base;
+	struct evdns_base *dnsbase;
+	struct event *event;
+	evutil_socket_t fd;
+	unsigned short id;
+	unsigned char query[SRV_MAX_PACKET];
+	int query_length;
+	int attempt;
+	srv_cb_t cb;
+	void *arg;
+};
+
+static void srv_eventcb(evutil_socket_t fd, short what, void *arg);
+
+static unsigned int
+get16(const unsigned char *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static unsigned int
+get32(const unsigned char *p)
+{
+	return ((unsigned int) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void
+put16(unsigned char *p, unsigned int value)
+{
+	p[0] = (value >> 8) & 0xff;
+	p[1] = value & 0xff;
+}
+
+int
+srv_build_query(const char *name, unsigned short id, unsigned char *buf,
+	size_t size)
+{
+	size_t pos, label;
+	const char *pch;
+
+	if (size < DNS_HEADER_SIZE + 5)
+		return -1;
+	memset(buf, 0, DNS_HEADER_SIZE);
+	put16(buf, id);
+	put16(buf + 2, DNS_FLAG_RD);
+	put16(buf + 4, 1); /* one question */
+	pos = DNS_HEADER_SIZE;
+
+	pch = name;
+	while (*pch != '\0')
+	{
+		label = strcspn(pch, ".");
+		if ( (label == 0) || (label > 63) )
+			return -1;
+		if (pos + 1 + label + 5 > size)
+			return -1;
+		buf[pos++] = (unsigned char) label;
+		memcpy(buf + pos, pch, label);
+		pos += label;
+		pch += label;
+		if (*pch == '.')
+			pch++;
+	}
+	if (pos - DNS_HEADER_SIZE > 254)
+		return -1;
+	buf[pos++] = 0;
+	put16(buf + pos, DNS_TYPE_SRV);
+	put16(buf + pos + 2, DNS_CLASS_IN);
+	return (int) (pos + 4);
+}
+
+/* srv_read_name expands the (possibly compressed) name at offset into name,
+   unless name is NULL, and returns the offset that follows the name, or -1
+   if the name is malformed. The root name is returned as "". */
+static int
+srv_read_name(const unsigned char *buf, size_t length, size_t offset,
+	char *name, size_t size)
+{
+	size_t pos, out, label;
+	int end = -1; /* offset after the name, known at the first pointer */
+	int jumps = 0;
+
+	pos = offset;
+	out = 0;
+	for (;;)
+	{
+		if (pos >= length)
+			return -1;
+		label = buf[pos];
+		if (label == 0)
+		{
+			pos++;
+			break;
+		}
+		if ( (label & 0xc0) == 0xc0 )
+		{
+			if ( (pos + 1 >= length) || (++jumps > 32) )
+				return -1;
+			if (end < 0)
+				end = (int) (pos + 2);
+			pos = ((label & 0x3f) << 8) | buf[pos + 1];
+			continue;
+		}
+		if ( (label & 0xc0) != 0 )
+			return -1;
+		pos++;
+		if (pos + label > length)
+			return -1;
+		if (name != NULL)
+		{
+			if (out + label + 2 > size)
+				return -1;
+			if (out > 0)
+				name[out++] = '.';
+			memcpy(name + out, buf + pos, label);
+			out += label;
+		}
+		pos += label;
+	}
+	if (name != NULL)
+		name[out] = '\0';
+	return (end >= 0) ? end : (int) pos;
+}
+
+int
+srv_parse_response(const unsigned char *buf, size_t length,
+	unsigned short id, srv_record_t *records, size_t max, unsigned int *ttl)
+{
+	unsigned int flags, questions, answers, type, class, rdlength;
+	unsigned int record_ttl;
+	unsigned int i;
+	int pos;
+	size_t count = 0;
+	srv_record_t *record;
+
+	*ttl = 0;
+	if (length < DNS_HEADER_SIZE)
+		return -1;
+	if (get16(buf) != id)
+		return -1;
+	flags = get16(buf + 2);
+	if ( !(flags & DNS_FLAG_QR) || (flags & DNS_FLAG_TC) )
+		return -1;
+	if ( (flags & 0x000f) == DNS_RCODE_NXDOMAIN )
+		return 0;
+	if ( (flags & 0x000f) != 0 )
+		return -1;
+	questions = get16(buf + 4);
+	answers = get16(buf + 6);
+
+	pos = DNS_HEADER_SIZE;
+	for (i = 0; i < questions; i++)
+	{
+		pos = srv_read_name(buf, length, pos, NULL, 0);
+		if ( (pos < 0) || ((size_t) pos + 4 > length) )
+			return -1;
+		pos += 4; /* type and class */
+	}
+
+	for (i = 0; i < answers; i++)
+	{
+		pos = srv_read_name(buf, length, pos, NULL, 0);
+		if ( (pos < 0) || ((size_t) pos + 10 > length) )
+			return -1;
+		type = get16(buf + pos);
+		class = get16(buf + pos + 2);
+		record_ttl = get32(buf + pos + 4);
+		rdlength = get16(buf + pos + 8);
+		pos += 10;
+		if ((size_t) pos + rdlength > length)
+			return -1;
+
+		/* Other records (e.g. CNAME) may precede the SRV records */
+		if ( (type == DNS_TYPE_SRV) && (class == DNS_CLASS_IN) &&
+			(rdlength >= 7) && (count < max) )
+		{
+			record = &records[count];
+			record->priority = get16(buf + pos);
+			record->weight = get16(buf + pos + 2);
+			record->port = get16(buf + pos + 4);
+			if (srv_read_name(buf, length, pos + 6, record->target,
+				sizeof(record->target)) < 0)
+				return -1;
+			/* A target of "." means the service is not offered */
+			if (record->target[0] != '\0')
+			{
+				if ( (count == 0) || (record_ttl < *ttl) )
+					*ttl = record_ttl;
+				count++;
+			}
+		}
+		pos += rdlength;
+	}
+	return (int) count;
+}
+
+size_t
+srv_select(const srv_record_t *records, size_t count, unsigned int random)
+{
+	size_t i, candidates = 0;
+	unsigned short priority;
+	unsigned long total = 0, running = 0, point;
+
+	priority = records[0].priority;
+	for (i = 1; i < count; i++)
+	{
+		if (records[i].priority < priority)
+			priority = records[i].priority;
+	}
+	for (i = 0; i < count; i++)
+	{
+		if (records[i].priority == priority)
+		{
+			total += records[i].weight;
+			candidates++;
+		}
+	}
+
+	/* If all records of the priority have weight 0, they are equally
+	   likely; otherwise records with weight 0 are never picked. */
+	if (total == 0)
+		point = random % candidates;
+	else
+		point = random % total;
+	for (i = 0; i < count; i++)
+	{
+		if (records[i].priority != priority)
+			continue;
+		running += (total == 0) ? 1 : records[i].weight;
+		if (running > point)
+			return i;
+	}
+	return 0;
+}
+
+int
+srv_applicable(const char *domain)
+{
+	struct in_addr address;
+	struct in6_addr address6;
+
+	if (strcasecmp(domain, "localhost") == 0)
+		return 0;
+	if (domain[0] == '[')
+		return 0;
+	if ( (evutil_inet_pton(AF_INET, domain, &address) == 1) ||
+		(evutil_inet_pton(AF_INET6, domain, &address6) == 1) )
+		return 0;
+	return 1;
+}
+
+static void
+srv_close(srv_request_t *request)
+{
+	if (request->event != NULL)
+	{
+		event_free(request->event);
+		request->event = NULL;
+	}
+	if (request->fd >= 0)
+	{
+		evutil_closesocket(request->fd);
+		request->fd = -1;
+	}
+}
+
+/* srv_send sends the query to the next nameserver. Returns 0 on error. */
+static int
+srv_send(srv_request_t *request)
+{
+	struct sockaddr_storage address;
+	int address_size, count;
+	struct timeval timeout = { SRV_TIMEOUT, 0 };
+
+	srv_close(request);
+	count = evdns_base_count_nameservers(request->dnsbase);
+	if (count <= 0)
+		return 0;
+	address_size = evdns_base_get_nameserver_addr(request->dnsbase,
+		request->attempt % count, (struct sockaddr*) &address,
+		sizeof(address));
+	if ( (address_size <= 0) || ((size_t) address_size > sizeof(address)) )
+		return 0;
+
+	request->fd = socket(address.ss_family, SOCK_DGRAM, 0);
+	if (request->fd < 0)
+		return 0;
+	if ( (evutil_make_socket_nonblocking(request->fd) < 0) ||
+		(evutil_make_socket_closeonexec(request->fd) < 0) )
+		return 0;
+	if (connect(request->fd, (struct sockaddr*) &address, address_size) < 0)
+		return 0;
+	if (send(request->fd, request->query, request->query_length, 0) !=
+		request->query_length)
+		return 0;
+
+	request->event = event_new(request->base, request->fd, EV_READ,
+		srv_eventcb, request);
+	if (request->event == NULL)
+		return 0;
+	if (event_add(request->event, &timeout) < 0)
+		return 0;
+	return 1;
+}
+
+static void
+srv_finish(srv_request_t *request, int count, srv_record_t *records,
+	unsigned int ttl)
+{
+	srv_cb_t cb = request->cb;
+	void *arg = request->arg;
+
+	srv_close(request);
+	free(request);
+	if (count > 0)
+		cb(1, records, count, ttl, arg);
+	else
+		cb(0, NULL, 0, 0, arg);
+}
+
+static void
+srv_eventcb(evutil_socket_t fd, short what, void *arg)
+{
+	srv_request_t *request = (srv_request_t*) arg;
+	unsigned char answer[SRV_MAX_PACKET];
+	srv_record_t records[SRV_MAX_RECORDS];
+	struct timeval timeout = { SRV_TIMEOUT, 0 };
+	unsigned int ttl = 0;
+	ssize_t n;
+	int count = -1;
+
+	if (what & EV_READ)
+	{
+		n = recv(fd, answer, sizeof(answer), 0);
+		if ( (n < 0) &&
+			((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) )
+		{
+			event_add(request->event, &timeout);
+			return;
+		}
+		if (n >= 0)
+			count = srv_parse_response(answer, n, request->id, records,
+				SRV_MAX_RECORDS, &ttl);
+	}
+
+	/* Timeout, error, or a server failure: ask the next nameserver */
+	if (count < 0)
+	{
+		request->attempt++;
+		if ( (request->attempt < SRV_ATTEMPTS) && srv_send(request) )
+			return;
+	}
+	srv_finish(request, count, records, ttl);
+}
+
+srv_request_t *
+srv_resolve(struct event_base *base, struct evdns_base *dnsbase,
+	const char *domain, srv_cb_t cb, void *arg)
+{
+	srv_request_t *request;
+	char name[sizeof(SRV_SERVICE) + SRV_MAX_TARGET];
+
+	if ( (base == NULL) || (dnsbase == NULL) )
+		goto Error;
+	request = (srv_request_t*) malloc(sizeof(*request));
+	if (request == NULL)
+		goto Error;
+	memset(request, 0, sizeof(*request));
+	request->base = base;
+	request->dnsbase = dnsbase;
+	request->fd = -1;
+	request->cb = cb;
+	request->arg = arg;
+
+	snprintf(name, sizeof(name), "%s%s", SRV_SERVICE, domain);
+	evutil_secure_rng_get_bytes(&request->id, sizeof(request->id));
+	request->query_length = srv_build_query(name, request->id,
+		request->query, sizeof(request->query));
+	if ( (request->query_length < 0) || !srv_send(request) )
+	{
+		srv_close(request);
+		free(request);
+		goto Error;
+	}
+	return request;
+
+Error:
+	cb(0, NULL, 0, 0, arg);
+	return NULL;
+}
+
+void
+srv_cancel(srv_request_t *request)
+{
+	srv_close(request);
+	free(request);
+}
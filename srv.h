@@ -0,0 +1,71 @@
+#ifndef _SRV_H_
+#define _SRV_H_
+
+#include <stddef.h>
+#include <event2/event.h>
+#include <event2/dns.h>
+
+/* DNS SRV lookups of the XMPP client service (RFC 6120, section 3.2.1).
+
+   evdns only looks up addresses, so the SRV query is built here, sent over
+   UDP to the nameservers of the worker's evdns_base and the answer is
+   parsed here as well. Truncated answers are treated as failures; the
+   caller then falls back to the address of the domain itself.
+ */
+
+#define SRV_SERVICE "_xmpp-client._tcp."
+#define SRV_MAX_RECORDS 16
+#define SRV_MAX_TARGET 256
+#define SRV_MAX_PACKET 512 /* plain DNS over UDP, no EDNS */
+#define SRV_TIMEOUT 2      /* seconds to wait for an answer */
+#define SRV_ATTEMPTS 2     /* queries sent before giving up */
+
+typedef struct _srv_record_t
+{
+	unsigned short priority;
+	unsigned short weight;
+	unsigned short port;
+	char target[SRV_MAX_TARGET];
+} srv_record_t;
+
+/* Result callback; result is 1 if count > 0 records were found, 0 if the
+   domain has no usable records or the lookup failed. ttl is the smallest
+   TTL of the records. */
+typedef void (*srv_cb_t)(int result, srv_record_t *records, size_t count,
+	unsigned int ttl, void *arg);
+
+typedef struct _srv_request_t srv_request_t;
+
+/* srv_resolve looks up the SRV records of the XMPP client service of
+   domain. If the query can't be sent, cb is called before srv_resolve
+   returns and the return value is NULL. Otherwise the request can be
+   passed to srv_cancel until cb has been called. */
+srv_request_t *srv_resolve(struct event_base *base,
+	struct evdns_base *dnsbase, const char *domain, srv_cb_t cb, void *arg);
+void srv_cancel(srv_request_t *request);
+
+/* srv_applicable returns 0 for domains that must not be looked up in the
+   DNS: localhost and IP address literals */
+int srv_applicable(const char *domain);
+
+/* srv_select picks one of the records of the lowest priority, with
+   probability proportional to its weight (RFC 2782). random is a random
+   number. Returns the index of the record. */
+size_t srv_select(const srv_record_t *records, size_t count,
+	unsigned int random);
+
+/* Lower-level interface, also used by unit tests */
+
+/* srv_build_query writes a query for the SRV records of name into buf and
+   returns its length, or -1 if the name is invalid or buf is too small */
+int srv_build_query(const char *name, unsigned short id, unsigned char *buf,
+	size_t size);
+
+/* srv_parse_response parses the answer to query id and stores up to max
+   records. Returns the number of records (0 if there are none or the
+   domain doesn't exist) or -1 if the answer is malformed, truncated,
+   reports an error or doesn't belong to the query. */
+int srv_parse_response(const unsigned char *buf, size_t length,
+	unsigned short id, srv_record_t *records, size_t max, unsigned int *ttl);
+
+#endif /* _SRV_H_ */
@@ -0,0 +1,194 @@
+#include <stdlib.h>
+#include "CuTest.h"
+#include <string.h>
+#include "srv.h"
+
+static size_t
+append(unsigned char *buf, size_t pos, const void *data, size_t length)
+{
+	memcpy(buf + pos, data, length);
+	return pos + length;
+}
+
+/* append_srv appends an SRV answer for the question name; target is in
+   wire format */
+static size_t
+append_srv(unsigned char *buf, size_t pos, unsigned int ttl,
+	unsigned int priority, unsigned int weight, unsigned int port,
+	const char *target, size_t target_length)
+{
+	unsigned char rr[16];
+	size_t rdlength = 6 + target_length;
+
+	rr[0] = 0xc0; rr[1] = 12; /* pointer to the question name */
+	rr[2] = 0; rr[3] = 33;    /* SRV */
+	rr[4] = 0; rr[5] = 1;     /* IN */
+	rr[6] = ttl >> 24; rr[7] = ttl >> 16; rr[8] = ttl >> 8; rr[9] = ttl;
+	rr[10] = rdlength >> 8; rr[11] = rdlength;
+	rr[12] = priority >> 8; rr[13] = priority;
+	rr[14] = weight >> 8; rr[15] = weight;
+	pos = append(buf, pos, rr, 16);
+	buf[pos++] = port >> 8;
+	buf[pos++] = port;
+	return append(buf, pos, target, target_length);
+}
+
+void TestSRVBuildQuery(CuTest *tc)
+{
+	unsigned char buf[SRV_MAX_PACKET];
+	static const unsigned char expected[] =
+		"\x12\x34\x01\x00\x00\x01\x00\x00\x00\x00\x00\x00"
+		"\x0c_xmpp-client\x04_tcp\x07" "example\x03" "com\x00"
+		"\x00\x21\x00\x01";
+	int length;
+
+	length = srv_build_query("_xmpp-client._tcp.example.com", 0x1234, buf,
+		sizeof(buf));
+	CuAssertIntEquals(tc, sizeof(expected) - 1, length);
+	CuAssertTrue( tc, memcmp(buf, expected, length) == 0 );
+
+	/* A trailing dot makes no difference */
+	length = srv_build_query("_xmpp-client._tcp.example.com.", 0x1234, buf,
+		sizeof(buf));
+	CuAssertIntEquals(tc, sizeof(expected) - 1, length);
+
+	/* Invalid names and short buffers */
+	CuAssertIntEquals(tc, -1, srv_build_query("a..b", 1, buf, sizeof(buf)));
+	CuAssertIntEquals(tc, -1, srv_build_query(
+		"a123456789012345678901234567890123456789012345678901234567890123.com",
+		1, buf, sizeof(buf)));
+	CuAssertIntEquals(tc, -1, srv_build_query("example.com", 1, buf, 20));
+}
+
+void TestSRVParseResponse(CuTest *tc)
+{
+	unsigned char buf[SRV_MAX_PACKET];
+	srv_record_t records[4];
+	unsigned int ttl;
+	size_t length;
+	static const unsigned char a_record[] =
+		"\xc0\x0c\x00\x01\x00\x01\x00\x00\x00\x3c\x00\x04\x0a\x00\x00\x01";
+
+	length = srv_build_query("_xmpp-client._tcp.example.com", 0x4321, buf,
+		sizeof(buf));
+	buf[2] = 0x81; /* response, recursion desired */
+	buf[3] = 0x80; /* recursion available, no error */
+	buf[7] = 4;    /* answers */
+	/* Target compressed with a pointer to "example.com" of the question */
+	length = append_srv(buf, length, 300, 10, 60, 5222,
+		"\x05xmpp1\xc0\x1e", 8);
+	length = append(buf, length, a_record, sizeof(a_record) - 1);
+	length = append_srv(buf, length, 120, 10, 20, 5223,
+		"\x05xmpp2\x07" "example\x03" "com", 19);
+	/* "." means the service isn't offered there */
+	length = append_srv(buf, length, 60, 20, 0, 5222, "", 1);
+
+	CuAssertIntEquals(tc, 2, srv_parse_response(buf, length, 0x4321,
+		records, 4, &ttl));
+	CuAssertIntEquals(tc, 120, ttl);
+	CuAssertIntEquals(tc, 10, records[0].priority);
+	CuAssertIntEquals(tc, 60, records[0].weight);
+	CuAssertIntEquals(tc, 5222, records[0].port);
+	CuAssertStrEquals(tc, "xmpp1.example.com", records[0].target);
+	CuAssertIntEquals(tc, 20, records[1].weight);
+	CuAssertIntEquals(tc, 5223, records[1].port);
+	CuAssertStrEquals(tc, "xmpp2.example.com", records[1].target);
+
+	/* At most max records are returned */
+	CuAssertIntEquals(tc, 1, srv_parse_response(buf, length, 0x4321,
+		records, 1, &ttl));
+
+	/* Answer to another query */
+	CuAssertIntEquals(tc, -1, srv_parse_response(buf, length, 0x4322,
+		records, 4, &ttl));
+
+	/* Cut off in the middle of a record */
+	CuAssertIntEquals(tc, -1, srv_parse_response(buf, length - 3, 0x4321,
+		records, 4, &ttl));
+
+	/* Truncated */
+	buf[2] |= 0x02;
+	CuAssertIntEquals(tc, -1, srv_parse_response(buf, length, 0x4321,
+		records, 4, &ttl));
+	buf[2] &= ~0x02;
+
+	/* Server failure */
+	buf[3] = 0x82;
+	CuAssertIntEquals(tc, -1, srv_parse_response(buf, length, 0x4321,
+		records, 4, &ttl));
+
+	/* Domain doesn't exist */
+	buf[3] = 0x83;
+	CuAssertIntEquals(tc, 0, srv_parse_response(buf, length, 0x4321,
+		records, 4, &ttl));
+
+	/* A compression loop */
+	length = srv_build_query("_xmpp-client._tcp.example.com", 0x4321, buf,
+		sizeof(buf));
+	buf[2] = 0x81;
+	buf[3] = 0x80;
+	buf[7] = 1;
+	length = append_srv(buf, length, 300, 10, 60, 5222, "\xc0\x2f", 2);
+	buf[length - 1] = length - 2; /* points to itself */
+	CuAssertIntEquals(tc, -1, srv_parse_response(buf, length, 0x4321,
+		records, 4, &ttl));
+}
+
+void TestSRVSelect(CuTest *tc)
+{
+	srv_record_t records[4];
+	int hits[4];
+	unsigned int random;
+
+	memset(records, 0, sizeof(records));
+	records[0].priority = 20;
+	records[0].weight = 100;
+	records[1].priority = 10;
+	records[1].weight = 30;
+	records[2].priority = 10;
+	records[2].weight = 0;
+	records[3].priority = 10;
+	records[3].weight = 70;
+
+	/* Only the lowest priority is used, in proportion to the weights */
+	memset(hits, 0, sizeof(hits));
+	for (random = 0; random < 1000; random++)
+		hits[srv_select(records, 4, random)]++;
+	CuAssertIntEquals(tc, 0, hits[0]);
+	CuAssertIntEquals(tc, 300, hits[1]);
+	CuAssertIntEquals(tc, 0, hits[2]);
+	CuAssertIntEquals(tc, 700, hits[3]);
+
+	/* All weights 0: equally likely */
+	records[1].weight = 0;
+	records[3].weight = 0;
+	memset(hits, 0, sizeof(hits));
+	for (random = 0; random < 999; random++)
+		hits[srv_select(records, 4, random)]++;
+	CuAssertIntEquals(tc, 0, hits[0]);
+	CuAssertIntEquals(tc, 333, hits[1]);
+	CuAssertIntEquals(tc, 333, hits[2]);
+	CuAssertIntEquals(tc, 333, hits[3]);
+
+	CuAssertIntEquals(tc, 0, srv_select(records, 1, 12345));
+}
+
+void TestSRVApplicable(CuTest *tc)
+{
+	CuAssertIntEquals(tc, 1, srv_applicable("example.com"));
+	CuAssertIntEquals(tc, 0, srv_applicable("localhost"));
+	CuAssertIntEquals(tc, 0, srv_applicable("LocalHost"));
+	CuAssertIntEquals(tc, 0, srv_applicable("127.0.0.1"));
+	CuAssertIntEquals(tc, 0, srv_applicable("::1"));
+	CuAssertIntEquals(tc, 0, srv_applicable("[2001:db8::1]"));
+}
+
+CuSuite* SRVGetSuite()
+{
+	CuSuite* suite = CuSuiteNew();
+	SUITE_ADD_TEST(suite, TestSRVBuildQuery);
+	SUITE_ADD_TEST(suite, TestSRVParseResponse);
+	SUITE_ADD_TEST(suite, TestSRVSelect);
+	SUITE_ADD_TEST(suite, TestSRVApplicable);
+	return suite;
+}
@@ -37,10 +37,10 @@ streamparser_start(void *data, const char *el, const char **attr)
 				{
 					// printf("attr: %s value: %s\n", *attr, *(attr+1));
 					if (strcmp(*attr, "to") == 0)
-					{
 						parser->server = strdup(*(attr + 1));
-						break;
-					}
+					else if ( (strcmp(*attr, "from") == 0) &&
+						(parser->from == NULL) )
+						parser->from = strdup(*(attr + 1));
 				}
 			}
 			free(namespace);
@@ -86,10 +86,13 @@ streamparser_end_namespace(
 static int
 streamparser_initialize(streamparser_t *parser)
 {
-	if (parser->parser != NULL)
-		XML_ParserFree(parser->parser);
-	parser->parser = XML_ParserCreateNS(NULL, /* ':' */ '\xFF');
 	if (parser->parser == NULL)
+	{
+		parser->parser = xmlpool_get(parser->pool);
+		if (parser->parser == NULL)
+			goto Error;
+	}
+	else if ( !xmlpool_reset(parser->pool, parser->parser) )
 		goto Error;
 
 	XML_SetElementHandler(
@@ -113,6 +116,12 @@ Error:
 
 streamparser_t *
 streamparser_create()
+{
+	return streamparser_create_pooled(NULL);
+}
+
+streamparser_t *
+streamparser_create_pooled(xmlpool_t *pool)
 {
 	streamparser_t *parser;
 	
@@ -120,6 +129,7 @@ streamparser_create()
 	if (parser == NULL)
 		goto Error;
 	memset(parser, 0, sizeof(*parser));
+	parser->pool = pool;
 	if (!streamparser_initialize(parser))
 		goto Error;
 
@@ -137,8 +147,9 @@ Error:
 void
 streamparser_delete(streamparser_t *parser)
 {
-	XML_ParserFree(parser->parser);
+	xmlpool_put(parser->pool, parser->parser);
 	free(parser->server);
+	free(parser->from);
 	free(parser);
 }
 
@@ -180,3 +191,9 @@ streamparser_get_server(streamparser_t *parser)
 	return parser->server;
 }
 
+const char *
+streamparser_get_from(streamparser_t *parser)
+{
+	return parser->from;
+}
+
@@ -2,15 +2,19 @@
 #define _STREAMPARSE_H_
 
 #include <expat.h>
+#include "xmlpool.h"
 
 typedef struct _streamparser_t
 {
 	XML_Parser parser;
+	xmlpool_t *pool; /* where the parser comes from, may be NULL */
 	int error;
 	char *server;
+	char *from; /* JID of the user, if the stream header has it */
 } streamparser_t;
 
 streamparser_t *streamparser_create();
+streamparser_t *streamparser_create_pooled(xmlpool_t *pool);
 void streamparser_delete(streamparser_t *parser);
 int streamparser_reset(streamparser_t *parser);
 
@@ -18,6 +22,7 @@ int streamparser_add(streamparser_t *parser, const char *data);
 int streamparser_is_error(streamparser_t *parser);
 int streamparser_has_server(streamparser_t *parser);
 const char *streamparser_get_server(streamparser_t *parser);
+const char *streamparser_get_from(streamparser_t *parser);
 
 #endif /* _STREAMPARSE_H_ */
 
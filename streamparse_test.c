@@ -31,8 +31,21 @@ void TestParsing(CuTest *tc)
 	CuAssertTrue(tc, res);
 	server = streamparser_get_server(parser);
 	CuAssertStrEquals(tc, "cloud01", server);
+	CuAssertPtrEquals(tc, NULL, (void*) streamparser_get_from(parser));
 
 	streamparser_delete(parser);
+
+	/* The stream header may name the user */
+	parser = streamparser_create();
+	CuAssertPtrNotNull(tc, parser);
+	res = streamparser_add(parser,
+		"<stream:stream xmlns='jabber:client' from='juliet@cloud01' "
+		"to='cloud01' version='1.0' "
+		"xmlns:stream='http://etherx.jabber.org/streams'>");
+	CuAssertTrue(tc, res);
+	CuAssertStrEquals(tc, "cloud01", streamparser_get_server(parser));
+	CuAssertStrEquals(tc, "juliet@cloud01", streamparser_get_from(parser));
+	streamparser_delete(parser);
 }
 
 void TestParsingError(CuTest *tc)
@@ -16,6 +16,10 @@ def pytest_addoption(parser):
 		help='Path to server')
 	parser.addoption('--jsconfig', action='store', default='jabsocket.conf',
 		help='Path to configuration file')
+	parser.addoption('--dontrunmock', action='store_true',
+		help='Don\'t run the mock XMPP server')
+	parser.addoption('--mock', action='store', default='jabsocket_mockxmpp',
+		help='Path to mock XMPP server')
 
 @pytest.fixture()
 def client(request):
@@ -36,3 +40,16 @@ def client(request):
 	request.addfinalizer(fin)
 	return my_client
 
+@pytest.fixture()
+def mockxmpp(request):
+	'''Runs the mock XMPP server on localhost:5222; it sends a roster of
+	   three items after the stream header and echoes the stanzas.'''
+	dontrunmock = pytest.config.getvalue('dontrunmock')
+	mock = pytest.config.getvalue('mock')
+	if not dontrunmock:
+		pid = util.start(mock, mock, '--step', 'roster 3')
+	time.sleep(0.05) # Give the child process a chance to run
+	def fin():
+		if not dontrunmock:
+			util.stop(pid)
+	request.addfinalizer(fin)
@@ -0,0 +1,36 @@
+import WSClient
+import pytest
+
+def open_stream(client):
+	client.sendHandshakeRequest(host='localhost', subprotocol='xmpp')
+	response = client.recvHandshakeResponse(1000)
+	assert '101' in response[0]
+	client.sendFrame(
+		"<stream:stream to='localhost' xmlns='jabber:client' "
+		"xmlns:stream='http://etherx.jabber.org/streams' version='1.0'>",
+		fin=1, masked=1, opcode=1, mask='abcd')
+
+class TestForwarding:
+	def test_stream_opening(self, mockxmpp, client):
+		open_stream(client)
+
+		# The stream header, features and roster come in separate messages.
+		r = client.recvFrame(1000)
+		assert '<stream:stream' in r['data']
+		r = client.recvFrame(1000)
+		assert r['data'].startswith('<stream:features>')
+		r = client.recvFrame(1000)
+		assert r['data'].startswith("<iq type='result'")
+		assert r['data'].count('<item ') == 3
+
+	def test_echo(self, mockxmpp, client):
+		open_stream(client)
+		for i in range(3):
+			client.recvFrame(1000)
+
+		stanza = "<message to='echo@localhost' id='m1'><body>%s</body></message>"
+		client.sendFrame(stanza % ('x' * 200), fin=1, masked=1, opcode=1,
+			mask='wxyz')
+		r = client.recvFrame(1000)
+		assert r['data'] == stanza % ('x' * 200)
+		assert r['opcode'] == 1
@@ -0,0 +1,274 @@
+#include "tlsclient.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <openssl/err.h>
+#include "log.h"
+
+/* Index of the ex data of an SSL object that holds its cache key */
+static int tlsclient_key_index = -1;
+static pthread_once_t tlsclient_once = PTHREAD_ONCE_INIT;
+
+static void
+tlsclient_free_key(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx,
+	long argl, void *argp)
+{
+	(void) parent;
+	(void) ad;
+	(void) idx;
+	(void) argl;
+	(void) argp;
+	free(ptr);
+}
+
+static void
+tlsclient_init(void)
+{
+	tlsclient_key_index = SSL_get_ex_new_index(0, NULL, NULL, NULL,
+		tlsclient_free_key);
+}
+
+static tlsclient_entry_t *
+tlsclient_slot(tlsclient_t *tls, const char *key)
+{
+	uint32_t hash = 2166136261u; /* FNV-1a */
+	const char *pch;
+
+	for (pch = key; *pch != '\0'; pch++)
+		hash = (hash ^ (unsigned char) *pch) * 16777619u;
+	return &tls->sessions[hash % tls->session_count];
+}
+
+/* tlsclient_new_session is called by OpenSSL for every session the server
+   sends: after the handshake with TLS 1.2, in NewSessionTicket messages
+   with TLS 1.3 */
+static int
+tlsclient_new_session(SSL *ssl, SSL_SESSION *session)
+{
+	tlsclient_t *tls;
+	const char *key;
+
+	tls = (tlsclient_t*) SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+	key = (const char*) SSL_get_ex_data(ssl, tlsclient_key_index);
+	if ( (key == NULL) || !SSL_SESSION_is_resumable(session) )
+		return 0;
+	tlsclient_store(tls, key, session);
+	return 1; /* the cache keeps the reference */
+}
+
+tlsclient_t *
+tlsclient_create(jsconf_t *conf)
+{
+	tlsclient_t *tls;
+	char error[256];
+	int ok;
+
+	tls = (tlsclient_t*) malloc(sizeof(*tls));
+	if (tls == NULL)
+		goto Error;
+	memset(tls, 0, sizeof(*tls));
+	pthread_once(&tlsclient_once, tlsclient_init);
+	if (tlsclient_key_index < 0)
+		goto Error;
+
+	tls->ctx = SSL_CTX_new(TLS_client_method());
+	if (tls->ctx == NULL)
+		goto Error;
+	SSL_CTX_set_app_data(tls->ctx, tls);
+	SSL_CTX_set_min_proto_version(tls->ctx, TLS1_2_VERSION);
+	/* Most XMPP connections are idle most of the time; their read and
+	   write buffers go back to the allocator in between */
+	SSL_CTX_set_mode(tls->ctx, SSL_MODE_RELEASE_BUFFERS);
+
+	if (conf->xmpp_tls_verify)
+	{
+		if (conf->xmpp_tls_ca_file != NULL)
+			ok = SSL_CTX_load_verify_locations(tls->ctx,
+				conf->xmpp_tls_ca_file, NULL);
+		else
+			ok = SSL_CTX_set_default_verify_paths(tls->ctx);
+		if (!ok)
+		{
+			ERR_error_string_n(ERR_get_error(), error, sizeof(error));
+			LOG(LOG_ERR, "tlsclient.c:tlsclient_create: couldn't load CA "
+				"certificates from %s: %s", (conf->xmpp_tls_ca_file != NULL) ?
+				conf->xmpp_tls_ca_file : "the default location", error);
+			goto Error;
+		}
+		SSL_CTX_set_verify(tls->ctx, SSL_VERIFY_PEER, NULL);
+	}
+	else
+		SSL_CTX_set_verify(tls->ctx, SSL_VERIFY_NONE, NULL);
+
+	if (conf->xmpp_tls_session_cache > 0)
+	{
+		tls->sessions = (tlsclient_entry_t*) calloc(
+			conf->xmpp_tls_session_cache, sizeof(tlsclient_entry_t));
+		if (tls->sessions == NULL)
+			goto Error;
+		tls->session_count = conf->xmpp_tls_session_cache;
+		/* OpenSSL only hands the sessions to tlsclient_new_session */
+		SSL_CTX_set_session_cache_mode(tls->ctx,
+			SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+		SSL_CTX_sess_set_new_cb(tls->ctx, tlsclient_new_session);
+	}
+	else
+		SSL_CTX_set_session_cache_mode(tls->ctx, SSL_SESS_CACHE_OFF);
+	return tls;
+
+Error:
+	if (tls != NULL)
+		tlsclient_delete(tls);
+	return NULL;
+}
+
+void
+tlsclient_delete(tlsclient_t *tls)
+{
+	size_t i;
+
+	for (i = 0; i < tls->session_count; i++)
+	{
+		if (tls->sessions[i].key != NULL)
+		{
+			free(tls->sessions[i].key);
+			SSL_SESSION_free(tls->sessions[i].session);
+		}
+	}
+	free(tls->sessions);
+	if (tls->ctx != NULL)
+		SSL_CTX_free(tls->ctx);
+	free(tls);
+}
+
+int
+tlsclient_key(char *key, const char *domain, const char *host, int port)
+{
+	int n;
+
+	n = snprintf(key, TLSCLIENT_MAX_KEY, "%s %s:%d", domain, host, port);
+	return (n > 0) && (n < TLSCLIENT_MAX_KEY);
+}
+
+SSL *
+tlsclient_new_ssl(tlsclient_t *tls, const char *domain, const char *host,
+	int port)
+{
+	SSL *ssl;
+	SSL_SESSION *session;
+	struct in6_addr address;
+	char key[TLSCLIENT_MAX_KEY];
+	char *saved_key;
+
+	ssl = SSL_new(tls->ctx);
+	if (ssl == NULL)
+		return NULL;
+	/* No server name for IP addresses (RFC 6066, section 3) */
+	if ( (inet_pton(AF_INET, domain, &address) != 1) &&
+		(inet_pton(AF_INET6, domain, &address) != 1) )
+		SSL_set_tlsext_host_name(ssl, domain);
+	if ( (SSL_get_verify_mode(ssl) & SSL_VERIFY_PEER) &&
+		!SSL_set1_host(ssl, domain) )
+		goto Error;
+
+	if ( (tls->session_count > 0) && tlsclient_key(key, domain, host, port) )
+	{
+		saved_key = strdup(key);
+		if (saved_key == NULL)
+			goto Error;
+		if (!SSL_set_ex_data(ssl, tlsclient_key_index, saved_key))
+		{
+			free(saved_key);
+			goto Error;
+		}
+		session = tlsclient_lookup(tls, key);
+		if ( (session != NULL) && SSL_set_session(ssl, session) )
+			tls->hits++;
+		else
+			tls->misses++;
+	}
+	return ssl;
+
+Error:
+	SSL_free(ssl);
+	return NULL;
+}
+
+void
+tlsclient_forget(tlsclient_t *tls, SSL *ssl)
+{
+	const char *key;
+
+	key = (const char*) SSL_get_ex_data(ssl, tlsclient_key_index);
+	if (key != NULL)
+		tlsclient_remove(tls, key);
+}
+
+void
+tlsclient_store(tlsclient_t *tls, const char *key, SSL_SESSION *session)
+{
+	tlsclient_entry_t *entry;
+	char *new_key;
+
+	if (tls->session_count == 0)
+	{
+		SSL_SESSION_free(session);
+		return;
+	}
+	entry = tlsclient_slot(tls, key);
+	if ( (entry->key != NULL) && (strcmp(entry->key, key) == 0) )
+	{
+		/* A newer session (ticket) of the same server */
+		SSL_SESSION_free(entry->session);
+		entry->session = session;
+		tls->stored++;
+		return;
+	}
+	new_key = strdup(key);
+	if (new_key == NULL)
+	{
+		SSL_SESSION_free(session);
+		return;
+	}
+	if (entry->key != NULL)
+	{
+		free(entry->key);
+		SSL_SESSION_free(entry->session);
+	}
+	entry->key = new_key;
+	entry->session = session;
+	tls->stored++;
+}
+
+SSL_SESSION *
+tlsclient_lookup(tlsclient_t *tls, const char *key)
+{
+	tlsclient_entry_t *entry;
+
+	if (tls->session_count == 0)
+		return NULL;
+	entry = tlsclient_slot(tls, key);
+	if ( (entry->key == NULL) || (strcmp(entry->key, key) != 0) )
+		return NULL;
+	return entry->session;
+}
+
+void
+tlsclient_remove(tlsclient_t *tls, const char *key)
+{
+	tlsclient_entry_t *entry;
+
+	if (tls->session_count == 0)
+		return;
+	entry = tlsclient_slot(tls, key);
+	if ( (entry->key == NULL) || (strcmp(entry->key, key) != 0) )
+		return;
+	free(entry->key);
+	SSL_SESSION_free(entry->session);
+	entry->key = NULL;
+	entry->session = NULL;
+}
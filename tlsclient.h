@@ -0,0 +1,85 @@
+#ifndef _TLSCLIENT_H_
+#define _TLSCLIENT_H_
+
+#include <openssl/ssl.h>
+#include "parseconfig.h"
+
+/* TLS towards XMPP servers (xmpp_tls).
+
+   jabsocket negotiates STARTTLS with the XMPP server itself (see
+   cmanager.c), so the browser's stream is encrypted between jabsocket and
+   the server without a TLS stack in JavaScript. Each worker has one
+   SSL_CTX, used by all its sessions, and a cache of TLS sessions keyed by
+   server: a new connection to a server the worker has already talked to
+   offers the session (or session ticket) of the previous one, and the
+   server can resume it instead of doing a full handshake.
+
+   Like the DNS cache, the cache belongs to one worker and is only used
+   from the worker's thread. It is a table of a fixed size; a server whose
+   slot is taken by another server replaces that server's session.
+ */
+
+/* xmpp_tls */
+enum
+{
+	XMPP_TLS_NO,      /* STARTTLS is left to the browser */
+	XMPP_TLS_YES,     /* STARTTLS if the server offers it */
+	XMPP_TLS_REQUIRED /* sessions are closed if the server doesn't offer
+	                     STARTTLS */
+};
+
+#define TLSCLIENT_DEFAULT_CACHE_SIZE 1024
+#define TLSCLIENT_MAX_KEY 1300 /* domain, host and port */
+
+typedef struct _tlsclient_entry_t
+{
+	char *key; /* NULL if the slot is free */
+	SSL_SESSION *session;
+} tlsclient_entry_t;
+
+typedef struct _tlsclient_t
+{
+	SSL_CTX *ctx;
+	tlsclient_entry_t *sessions;
+	size_t session_count; /* size of the table, 0 = no resumption */
+
+	/* Statistics */
+	unsigned long hits;   /* a session was offered to the server */
+	unsigned long misses;
+	unsigned long stored; /* sessions (tickets) received */
+} tlsclient_t;
+
+/* tlsclient_create creates the SSL_CTX of a worker from the configuration
+   (xmpp_tls_verify, xmpp_tls_ca_file, xmpp_tls_session_cache). Returns
+   NULL on error. */
+tlsclient_t *tlsclient_create(jsconf_t *conf);
+void tlsclient_delete(tlsclient_t *tls);
+
+/* tlsclient_new_ssl creates an SSL object for a connection to port of
+   host, the XMPP server of domain. The server's certificate has to be
+   valid for domain (RFC 6120, section 13.7.2), which is also sent as the
+   server name. If the cache has a session of the server, it is offered
+   for resumption; sessions the server sends are stored in the cache.
+   Returns NULL if out of memory. */
+SSL *tlsclient_new_ssl(tlsclient_t *tls, const char *domain,
+	const char *host, int port);
+
+/* tlsclient_forget removes the cached session of the server of an SSL
+   object, e.g. after a failed handshake */
+void tlsclient_forget(tlsclient_t *tls, SSL *ssl);
+
+/* Access to the cache by key, see tlsclient_key. tlsclient_store takes
+   over the caller's reference to session; tlsclient_lookup returns NULL
+   if there is no session for key. */
+void tlsclient_store(tlsclient_t *tls, const char *key,
+	SSL_SESSION *session);
+SSL_SESSION *tlsclient_lookup(tlsclient_t *tls, const char *key);
+void tlsclient_remove(tlsclient_t *tls, const char *key);
+
+/* tlsclient_key writes the cache key of a server to key (of size
+   TLSCLIENT_MAX_KEY). Returns 0 if the names are too long, in which case
+   the server's sessions aren't cached. */
+int tlsclient_key(char *key, const char *domain, const char *host,
+	int port);
+
+#endif /* _TLSCLIENT_H_ */
@@ -0,0 +1,134 @@
+#include <stdlib.h>
+#include "CuTest.h"
+#include <stdio.h>
+#include <string.h>
+#include "tlsclient.h"
+
+void TestTLSClientCache(CuTest *tc)
+{
+	jsconf_t *conf;
+	tlsclient_t *tls;
+	SSL_SESSION *session1, *session2, *session3;
+	char key1[TLSCLIENT_MAX_KEY], key2[TLSCLIENT_MAX_KEY];
+	char long_name[TLSCLIENT_MAX_KEY];
+
+	conf = config_create();
+	conf->xmpp_tls_verify = 0;
+	conf->xmpp_tls_session_cache = 16;
+	tls = tlsclient_create(conf);
+	CuAssertPtrNotNull(tc, tls);
+	CuAssertIntEquals(tc, 16, tls->session_count);
+
+	CuAssertTrue(tc, tlsclient_key(key1, "example.com", "xmpp1.example.com",
+		5222));
+	CuAssertStrEquals(tc, "example.com xmpp1.example.com:5222", key1);
+	CuAssertTrue(tc, tlsclient_key(key2, "example.com", "xmpp2.example.com",
+		5222));
+	memset(long_name, 'a', sizeof(long_name) - 1);
+	long_name[sizeof(long_name) - 1] = '\0';
+	CuAssertTrue(tc, !tlsclient_key(key1, long_name, "xmpp1.example.com",
+		5222));
+	tlsclient_key(key1, "example.com", "xmpp1.example.com", 5222);
+
+	/* Sessions are kept by server; a newer one replaces the older */
+	session1 = SSL_SESSION_new();
+	session2 = SSL_SESSION_new();
+	session3 = SSL_SESSION_new();
+	CuAssertPtrEquals(tc, NULL, tlsclient_lookup(tls, key1));
+	tlsclient_store(tls, key1, session1);
+	tlsclient_store(tls, key2, session2);
+	CuAssertPtrEquals(tc, session1, tlsclient_lookup(tls, key1));
+	CuAssertPtrEquals(tc, session2, tlsclient_lookup(tls, key2));
+	tlsclient_store(tls, key1, session3);
+	CuAssertPtrEquals(tc, session3, tlsclient_lookup(tls, key1));
+	CuAssertIntEquals(tc, 3, tls->stored);
+
+	tlsclient_remove(tls, key1);
+	CuAssertPtrEquals(tc, NULL, tlsclient_lookup(tls, key1));
+	CuAssertPtrEquals(tc, session2, tlsclient_lookup(tls, key2));
+	tlsclient_delete(tls);
+
+	/* With a single slot, servers take each other's place */
+	conf->xmpp_tls_session_cache = 1;
+	tls = tlsclient_create(conf);
+	CuAssertPtrNotNull(tc, tls);
+	tlsclient_store(tls, key1, SSL_SESSION_new());
+	tlsclient_store(tls, key2, SSL_SESSION_new());
+	CuAssertPtrEquals(tc, NULL, tlsclient_lookup(tls, key1));
+	CuAssertPtrNotNull(tc, tlsclient_lookup(tls, key2));
+	tlsclient_delete(tls);
+
+	/* No cache */
+	conf->xmpp_tls_session_cache = 0;
+	tls = tlsclient_create(conf);
+	CuAssertPtrNotNull(tc, tls);
+	tlsclient_store(tls, key1, SSL_SESSION_new());
+	CuAssertPtrEquals(tc, NULL, tlsclient_lookup(tls, key1));
+	tlsclient_delete(tls);
+	config_delete(conf);
+}
+
+void TestTLSClientSSL(CuTest *tc)
+{
+	jsconf_t *conf;
+	tlsclient_t *tls;
+	SSL *ssl;
+	SSL_SESSION *session;
+	char key[TLSCLIENT_MAX_KEY];
+
+	conf = config_create();
+	tls = tlsclient_create(conf);
+	CuAssertPtrNotNull(tc, tls);
+	CuAssertIntEquals(tc, TLSCLIENT_DEFAULT_CACHE_SIZE, tls->session_count);
+
+	/* The domain is the server name and is verified */
+	ssl = tlsclient_new_ssl(tls, "example.com", "xmpp1.example.com", 5222);
+	CuAssertPtrNotNull(tc, ssl);
+	CuAssertStrEquals(tc, "example.com",
+		SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name));
+	CuAssertIntEquals(tc, SSL_VERIFY_PEER, SSL_get_verify_mode(ssl));
+	CuAssertIntEquals(tc, 0, tls->hits);
+	CuAssertIntEquals(tc, 1, tls->misses);
+	SSL_free(ssl);
+
+	/* A cached session of the server is offered */
+	tlsclient_key(key, "example.com", "xmpp1.example.com", 5222);
+	session = SSL_SESSION_new();
+	tlsclient_store(tls, key, session);
+	ssl = tlsclient_new_ssl(tls, "example.com", "xmpp1.example.com", 5222);
+	CuAssertPtrNotNull(tc, ssl);
+	CuAssertPtrEquals(tc, session, SSL_get_session(ssl));
+	CuAssertIntEquals(tc, 1, tls->hits);
+
+	/* ... and forgotten if the handshake fails */
+	tlsclient_forget(tls, ssl);
+	CuAssertPtrEquals(tc, NULL, tlsclient_lookup(tls, key));
+	SSL_free(ssl);
+
+	/* Another port is another server */
+	ssl = tlsclient_new_ssl(tls, "example.com", "xmpp1.example.com", 5223);
+	CuAssertPtrNotNull(tc, ssl);
+	CuAssertPtrEquals(tc, NULL, SSL_get_session(ssl));
+	SSL_free(ssl);
+
+	/* No server name for addresses */
+	ssl = tlsclient_new_ssl(tls, "127.0.0.1", "127.0.0.1", 5222);
+	CuAssertPtrNotNull(tc, ssl);
+	CuAssertPtrEquals(tc, NULL,
+		(void*) SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name));
+	SSL_free(ssl);
+	tlsclient_delete(tls);
+
+	/* A missing CA file is an error */
+	conf->xmpp_tls_ca_file = strdup("./test/no-such-ca.pem");
+	CuAssertPtrEquals(tc, NULL, tlsclient_create(conf));
+	config_delete(conf);
+}
+
+CuSuite* TLSClientGetSuite()
+{
+	CuSuite* suite = CuSuiteNew();
+	SUITE_ADD_TEST(suite, TestTLSClientCache);
+	SUITE_ADD_TEST(suite, TestTLSClientSSL);
+	return suite;
+}
@@ -1,6 +1,10 @@
 #include "util.h"
 #include <string.h>
 #include <ctype.h>
+#include <stdio.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 /* General functionality */
 
@@ -84,10 +88,24 @@ str_setn_string(str_t *str, const char *str_in, size_t maxsize)
 	str->length = i;
 }
 
+void
+str_appendn_string(str_t *str, const char *str_in, size_t maxsize)
+{
+	size_t i;
+
+	for (i = 0; (i < maxsize) && (str_in[i] != '\0'); i++)
+	{
+		if (str->length + 1 >= str->capacity)
+			break;
+		str->buffer[str->length++] = str_in[i];
+	}
+	str->buffer[str->length] = '\0';
+}
+
 void
 str_copy_string(str_t *dst, str_t *src)
 {
-	str_set_string( dst, str_get_string(src) );
+	str_set_string( dst, "%s", str_get_string(src) );
 }
 
 void
@@ -99,7 +117,7 @@ str_trim_beginning(str_t *str, const char *str_in)
 	{
 		if (!isspace(*pch))
 		{
-			str_set_string(str, pch);
+			str_set_string(str, "%s", pch);
 			return;
 		}
 		pch++;
@@ -205,8 +223,12 @@ data_set_data(data_t *data, byte *data_in, size_t size)
 	data->length = i;
 }
 
+/* WebSocket frame unmask */
+
+typedef void (*unmask_fn_t)(byte *data, size_t length, byte *mask);
+
 void
-unmask(byte *data, size_t length, byte *mask)
+unmask_scalar(byte *data, size_t length, byte *mask)
 {
 	size_t i, index;
 
@@ -220,10 +242,208 @@ unmask(byte *data, size_t length, byte *mask)
 	}
 }
 
+/* unmask_head unmasks bytes up to the first address aligned to alignment
+   and stores in rotated the mask as it applies from there on. Returns the
+   number of bytes processed. */
+static size_t
+unmask_head(byte *data, size_t length, byte *mask, size_t alignment,
+	byte *rotated)
+{
+	size_t head;
+	size_t i;
+
+	head = (alignment - ((uintptr_t) data & (alignment - 1))) &
+		(alignment - 1);
+	if (head > length)
+		head = length;
+	unmask_scalar(data, head, mask);
+	for (i = 0; i < 4; i++)
+		rotated[i] = mask[(head + i) & 3];
+	return head;
+}
+
+/* Portable version: 8 bytes at a time */
+static void
+unmask_word(byte *data, size_t length, byte *mask)
+{
+	byte rotated[4];
+	uint64_t pattern;
+	uint64_t word;
+	size_t i;
+
+	i = unmask_head(data, length, mask, 8, rotated);
+	memcpy(&pattern, rotated, 4);
+	memcpy((byte*) &pattern + 4, rotated, 4);
+	for (; i + 8 <= length; i += 8)
+	{
+		memcpy(&word, data + i, 8);
+		word ^= pattern;
+		memcpy(data + i, &word, 8);
+	}
+	/* The loop consumed a multiple of 4 bytes, so the tail starts at
+	   rotated[0]. */
+	unmask_scalar(data + i, length - i, rotated);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static void
+unmask_sse2(byte *data, size_t length, byte *mask)
+{
+	byte rotated[4];
+	int32_t mask32;
+	__m128i pattern;
+	size_t i;
+
+	i = unmask_head(data, length, mask, 16, rotated);
+	memcpy(&mask32, rotated, 4);
+	pattern = _mm_set1_epi32(mask32);
+	for (; i + 16 <= length; i += 16)
+	{
+		__m128i *p = (__m128i*) (data + i);
+		_mm_store_si128( p, _mm_xor_si128(_mm_load_si128(p), pattern) );
+	}
+	unmask_word(data + i, length - i, rotated);
+}
+
+__attribute__((target("avx2")))
+static void
+unmask_avx2(byte *data, size_t length, byte *mask)
+{
+	byte rotated[4];
+	int32_t mask32;
+	__m256i pattern;
+	size_t i;
+
+	i = unmask_head(data, length, mask, 32, rotated);
+	memcpy(&mask32, rotated, 4);
+	pattern = _mm256_set1_epi32(mask32);
+	for (; i + 64 <= length; i += 64)
+	{
+		__m256i *p = (__m256i*) (data + i);
+		_mm256_store_si256( p,
+			_mm256_xor_si256(_mm256_load_si256(p), pattern) );
+		_mm256_store_si256( p + 1,
+			_mm256_xor_si256(_mm256_load_si256(p + 1), pattern) );
+	}
+	for (; i + 32 <= length; i += 32)
+	{
+		__m256i *p = (__m256i*) (data + i);
+		_mm256_store_si256( p,
+			_mm256_xor_si256(_mm256_load_si256(p), pattern) );
+	}
+	unmask_word(data + i, length - i, rotated);
+}
+#endif
+
+static const char *unmask_names[UNMASK_IMPL_COUNT] =
+	{ "scalar", "word", "sse2", "avx2" };
+static int unmask_impl = -1;
+static unmask_fn_t unmask_fn = unmask_word;
+
+static int
+unmask_is_supported(int impl)
+{
+	switch (impl)
+	{
+		case UNMASK_IMPL_SCALAR:
+		case UNMASK_IMPL_WORD:
+			return 1;
+#if defined(__x86_64__) || defined(__i386__)
+		case UNMASK_IMPL_SSE2:
+			return __builtin_cpu_supports("sse2");
+		case UNMASK_IMPL_AVX2:
+			return __builtin_cpu_supports("avx2");
+#endif
+	}
+	return 0;
+}
+
+int
+unmask_set_impl(int impl)
+{
+	if ( (impl < 0) || (impl >= UNMASK_IMPL_COUNT) ||
+		!unmask_is_supported(impl) )
+		return 0;
+	switch (impl)
+	{
+		case UNMASK_IMPL_SCALAR:
+			unmask_fn = unmask_scalar;
+			break;
+		case UNMASK_IMPL_WORD:
+			unmask_fn = unmask_word;
+			break;
+#if defined(__x86_64__) || defined(__i386__)
+		case UNMASK_IMPL_SSE2:
+			unmask_fn = unmask_sse2;
+			break;
+		case UNMASK_IMPL_AVX2:
+			unmask_fn = unmask_avx2;
+			break;
+#endif
+	}
+	unmask_impl = impl;
+	return 1;
+}
+
+/* unmask_init selects the fastest supported implementation. It is called
+   from main before the workers start; unmask calls it otherwise. */
+void
+unmask_init(void)
+{
+	int impl;
+
+	for (impl = UNMASK_IMPL_COUNT - 1; impl > 0; impl--)
+	{
+		if ( unmask_set_impl(impl) )
+			return;
+	}
+	unmask_set_impl(UNMASK_IMPL_SCALAR);
+}
+
+int
+unmask_get_impl(void)
+{
+	if (unmask_impl < 0)
+		unmask_init();
+	return unmask_impl;
+}
+
+const char *
+unmask_impl_name(int impl)
+{
+	if ( (impl < 0) || (impl >= UNMASK_IMPL_COUNT) )
+		return "unknown";
+	return unmask_names[impl];
+}
+
+void
+unmask(byte *data, size_t length, byte *mask)
+{
+	if (unmask_impl < 0)
+		unmask_init();
+	unmask_fn(data, length, mask);
+}
+
 /* Dynamic data buffer */
 
 #define INIT_BUFFER_SIZE 128
 
+static size_t buffer_growth_limit = BUFFER_DEFAULT_GROWTH_LIMIT;
+static size_t buffer_shrink_threshold = 0;
+
+void
+buffer_set_growth_limit(size_t limit)
+{
+	buffer_growth_limit = limit;
+}
+
+void
+buffer_set_shrink_threshold(size_t threshold)
+{
+	buffer_shrink_threshold = threshold;
+}
+
 buffer_t *
 buffer_create(size_t max_length)
 {
@@ -239,18 +459,18 @@ buffer_create(size_t max_length)
 	buffer = (buffer_t*) malloc(sizeof(*buffer));
 	if (buffer != NULL)
 	{
-		buffer->data = (unsigned char*) malloc(init_capacity);
-		if (buffer->data == NULL)
+		buffer->base = (unsigned char*) malloc(init_capacity);
+		if (buffer->base == NULL)
 			goto Error;
+		buffer->data = buffer->base;
 		buffer->length = 0;
 		buffer->capacity = init_capacity;
 		buffer->max_length = max_length;
+		buffer->high_water = 0;
 	}
 	return buffer;
 
 Error:
-	if (buffer != NULL)
-		free(buffer->data);
 	free(buffer);
 	return NULL;
 }
@@ -258,68 +478,98 @@ Error:
 void
 buffer_delete(buffer_t *buffer)
 {
-	free(buffer->data);
+	free(buffer->base);
 	free(buffer);
 }
 
 int
 buffer_set_data(buffer_t *buffer, unsigned char *input, size_t length)
 {
-	buffer->length = 0;
+	buffer_clear(buffer);
 	return buffer_append(buffer, input, length);
 }
 
 void
 buffer_clear(buffer_t *buffer)
 {
+	buffer->data = buffer->base;
 	buffer->length = 0;
 }
 
+/* buffer_make_room makes sure that length bytes can be appended after the
+   unread data. */
+static int
+buffer_make_room(buffer_t *buffer, size_t length)
+{
+	size_t offset = buffer->data - buffer->base;
+	size_t free_space;
+	size_t new_cap;
+	unsigned char *new_base;
+
+	if (offset + buffer->length + length <= buffer->capacity)
+		return 1;
+
+	/* Compact if the consumed space is large enough and at least as large
+	   as the data we have to move, so the move is amortized over the
+	   bytes consumed. */
+	free_space = buffer->capacity - buffer->length;
+	if ( (free_space >= length) && (offset >= buffer->length) )
+	{
+		memmove(buffer->base, buffer->data, buffer->length);
+		buffer->data = buffer->base;
+		return 1;
+	}
+
+	/* Resize: double the capacity, but don't grow by more than
+	   buffer_growth_limit at a time, unless the data needs more */
+	new_cap = buffer->capacity * 2;
+	if ( (buffer_growth_limit > 0) &&
+		(new_cap - buffer->capacity > buffer_growth_limit) )
+		new_cap = buffer->capacity + buffer_growth_limit;
+	if (new_cap < buffer->length + length)
+		new_cap = buffer->length + length;
+	if ( (buffer->max_length > 0) && (new_cap > buffer->max_length) )
+		new_cap = buffer->max_length;
+	if (offset == 0)
+	{
+		new_base = realloc(buffer->base, new_cap);
+		if (new_base == NULL)
+			return 0;
+	}
+	else
+	{
+		/* Copy only the unread data into the new block */
+		new_base = malloc(new_cap);
+		if (new_base == NULL)
+			return 0;
+		memcpy(new_base, buffer->data, buffer->length);
+		free(buffer->base);
+	}
+	buffer->base = new_base;
+	buffer->data = new_base;
+	buffer->capacity = new_cap;
+	return 1;
+}
+
 int
 buffer_append(buffer_t *buffer, unsigned char *data, size_t length)
 {
-	unsigned char *new_buff;
-	size_t new_cap;
-	
 	if (length == 0)
 		return 1;
 	
-	if (buffer->max_length == 0) /* unlimited buffer size */
-	{
-		if (buffer->length + length > buffer->capacity)
-		{
-			/* Buffer not large enough, we have to resize */
-		
-			new_cap = buffer->length + length + 1024;
-			new_buff = realloc(buffer->data, new_cap);
-			if (new_buff == NULL)
-				goto Error;
-			buffer->data = new_buff;
-			buffer->capacity = new_cap;
-		}
-		if (buffer->length + length > buffer->capacity)
-			length = buffer->capacity - buffer->length;
-	}
-	else /* limited buffer size */
+	if (buffer->max_length > 0) /* limited buffer size */
 	{
 		if (buffer->length + length > buffer->max_length)
 			length = buffer->max_length - buffer->length;
 		if (length == 0) /* no more room in the buffer */
 			goto Error;
-		if (buffer->length + length > buffer->capacity)
-		{
-			new_cap = buffer->length + length + 1024;
-			if (new_cap > buffer->max_length)
-				new_cap = buffer->max_length;
-			new_buff = realloc(buffer->data, new_cap);
-			if (new_buff == NULL)
-				goto Error;
-			buffer->data = new_buff;
-			buffer->capacity = new_cap;
-		}
 	}
+	if ( !buffer_make_room(buffer, length) )
+		goto Error;
 	memcpy(buffer->data + buffer->length, data, length);
 	buffer->length += length;
+	if (buffer->length > buffer->high_water)
+		buffer->high_water = buffer->length;
 	return 1;
 	
 Error:
@@ -356,7 +606,12 @@ buffer_peek_data(buffer_t *buffer, unsigned char **data, size_t *length)
 void
 buffer_remove_data(buffer_t *buffer, size_t length)
 {
-	memmove(buffer->data, buffer->data + length, buffer->capacity - length);
+	if (length >= buffer->length)
+	{
+		buffer_clear(buffer);
+		return;
+	}
+	buffer->data += length;
 	buffer->length -= length;
 }
 
@@ -370,3 +625,28 @@ buffer_move(buffer_t *src_buffer, buffer_t *dst_buffer)
 	return 1;
 }
 
+void
+buffer_shrink(buffer_t *buffer)
+{
+	unsigned char *new_base;
+	size_t new_cap;
+
+	if ( (buffer_shrink_threshold == 0) || (buffer->length > 0) ||
+		(buffer->capacity <= buffer_shrink_threshold) )
+		return;
+	new_cap = INIT_BUFFER_SIZE;
+	if ( (buffer->max_length > 0) && (buffer->max_length < new_cap) )
+		new_cap = buffer->max_length;
+	new_base = realloc(buffer->base, new_cap);
+	if (new_base == NULL)
+		return; /* keep the larger block */
+	buffer->base = new_base;
+	buffer->data = new_base;
+	buffer->capacity = new_cap;
+}
+
+size_t
+buffer_get_high_water(buffer_t *buffer)
+{
+	return buffer->high_water;
+}
@@ -27,6 +27,7 @@ char *str_get_string(str_t *str);
 void str_set_string(str_t *str, const char *fmt, ...);
 void str_set_vstring(str_t *str, const char *fmt, va_list ap);
 void str_setn_string(str_t *str, const char *str_in, size_t maxsize);
+void str_appendn_string(str_t *str, const char *str_in, size_t maxsize);
 
 void str_copy_string(str_t *dst, str_t *src);
 void str_trim_beginning(str_t *str, const char *str_in);
@@ -51,19 +52,53 @@ size_t data_get_capacity(data_t *data);
 byte *data_get_buffer(data_t *data);
 void data_set_data(data_t *data, byte *data_in, size_t size);
 
-/* WebSocket frame unmask */
+/* WebSocket frame unmask
+
+   unmask XORs data with the 4-byte mask, mask[0] applying to data[0].
+   The implementation is chosen once, from what the CPU supports: AVX2,
+   SSE2 or a portable 64-bit word loop; unmask_scalar is the byte-by-byte
+   reference. */
+enum
+{
+	UNMASK_IMPL_SCALAR,
+	UNMASK_IMPL_WORD,
+	UNMASK_IMPL_SSE2,
+	UNMASK_IMPL_AVX2,
+	UNMASK_IMPL_COUNT
+};
+
 void unmask(byte *data, size_t length, byte *mask);
+void unmask_scalar(byte *data, size_t length, byte *mask);
+void unmask_init(void);
+int unmask_set_impl(int impl); /* returns 0 if the CPU doesn't support it */
+int unmask_get_impl(void);
+const char *unmask_impl_name(int impl);
+
+/* Dynamic data buffer
 
-/* Dynamic data buffer */
+   Unread data starts at data, which points into the allocated block at
+   base. Removing data from the front only advances data; the unread data
+   is moved back to base when an append needs the room and the move is
+   paid for by the data consumed since the last move. */
 
 typedef struct _buffer_t
 {
-	unsigned char *data;
-	size_t length;
-	size_t capacity;
+	unsigned char *base; /* allocated block */
+	unsigned char *data; /* first unread byte, base <= data */
+	size_t length;   /* number of unread bytes */
+	size_t capacity; /* size of the allocated block */
 	size_t max_length;
+	size_t high_water; /* largest number of unread bytes ever held */
 } buffer_t;
 
+/* Growth policy, shared by all buffers. The capacity doubles when the
+   buffer has to grow, but never grows by more than the growth limit at a
+   time. An empty buffer whose capacity exceeds the shrink threshold can
+   give the memory back with buffer_shrink (0 disables shrinking). */
+#define BUFFER_DEFAULT_GROWTH_LIMIT (1024 * 1024)
+void buffer_set_growth_limit(size_t limit);
+void buffer_set_shrink_threshold(size_t threshold);
+
 buffer_t *buffer_create(size_t max_length);
 void buffer_delete(buffer_t *buffer);
 
@@ -76,6 +111,8 @@ void buffer_get_data2(buffer_t *buffer, data_t *data, size_t length);
 void buffer_peek_data(buffer_t *buffer, unsigned char **data, size_t *length);
 void buffer_remove_data(buffer_t *buffer, size_t length);
 int buffer_move(buffer_t *src_buffer, buffer_t *dst_buffer);
+void buffer_shrink(buffer_t *buffer);
+size_t buffer_get_high_water(buffer_t *buffer);
 
 #endif /* _UTIL_H_ */
 
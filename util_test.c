@@ -1,6 +1,9 @@
 #include "CuTest.h"
 #include <stdlib.h>
 #include "util.h"
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
 
 static void
 TestUtilStr(CuTest *tc)
@@ -234,6 +237,176 @@ void TestLimitedSizeBuffer(CuTest *tc)
 	buffer_delete(buffer);
 }
 
+/* Removing data from the front of the buffer doesn't move the rest */
+void TestBufferRemove(CuTest *tc)
+{
+	buffer_t *buffer;
+	unsigned char input[200];
+	unsigned char *base;
+	size_t i;
+
+	for (i = 0; i < sizeof(input); i++)
+		input[i] = (unsigned char) i;
+
+	buffer = buffer_create(0);
+	CuAssertTrue(tc, buffer != NULL);
+	CuAssertIntEquals(tc, 128, buffer->capacity);
+
+	/* Consuming advances the read position only */
+	buffer_append(buffer, input, 120);
+	base = buffer->base;
+	buffer_remove_data(buffer, 100);
+	CuAssertIntEquals( tc, 20, buffer_get_length(buffer) );
+	CuAssertPtrEquals(tc, base + 100, buffer->data);
+	CuAssertIntEquals( tc, 0, memcmp(buffer->data, input + 100, 20) );
+
+	/* Appending reuses the consumed space by moving the 20 unread bytes */
+	buffer_append(buffer, input + 120, 50);
+	CuAssertIntEquals( tc, 70, buffer_get_length(buffer) );
+	CuAssertIntEquals(tc, 128, buffer->capacity);
+	CuAssertPtrEquals(tc, buffer->base, buffer->data);
+	CuAssertIntEquals( tc, 0, memcmp(buffer->data, input + 100, 70) );
+
+	/* Not enough consumed space: the buffer grows instead */
+	buffer_remove_data(buffer, 10);
+	buffer_append(buffer, input, 100);
+	CuAssertIntEquals( tc, 160, buffer_get_length(buffer) );
+	CuAssertTrue(tc, buffer->capacity >= 160);
+	CuAssertIntEquals( tc, 0, memcmp(buffer->data, input + 110, 60) );
+	CuAssertIntEquals( tc, 0, memcmp(buffer->data + 60, input, 100) );
+
+	/* Removing everything resets the read position */
+	buffer_remove_data(buffer, buffer_get_length(buffer));
+	CuAssertIntEquals( tc, 0, buffer_get_length(buffer) );
+	CuAssertPtrEquals(tc, buffer->base, buffer->data);
+
+	buffer_delete(buffer);
+
+	/* Limited buffer: the limit applies to the unread data */
+	buffer = buffer_create(8);
+	CuAssertTrue( tc, buffer_append(buffer, input, 8) );
+	buffer_remove_data(buffer, 6);
+	CuAssertTrue( tc, buffer_append(buffer, input + 8, 5) );
+	CuAssertIntEquals( tc, 7, buffer_get_length(buffer) );
+	CuAssertIntEquals(tc, 8, buffer->capacity);
+	CuAssertIntEquals( tc, 0, memcmp(buffer->data, input + 6, 7) );
+	buffer_delete(buffer);
+}
+
+void TestBufferGrowth(CuTest *tc)
+{
+	buffer_t *buffer;
+	unsigned char input[1000];
+	size_t i;
+
+	memset( input, 'g', sizeof(input) );
+	buffer = buffer_create(0);
+
+	/* The capacity doubles */
+	buffer_append(buffer, input, 129);
+	CuAssertIntEquals(tc, 256, buffer->capacity);
+	buffer_append(buffer, input, 200);
+	CuAssertIntEquals(tc, 512, buffer->capacity);
+
+	/* ... unless a single append needs more */
+	buffer_append(buffer, input, 1000);
+	CuAssertIntEquals(tc, 1329, buffer->capacity);
+	buffer_delete(buffer);
+
+	/* With a growth limit, large buffers grow in steps of the limit */
+	buffer_set_growth_limit(1000);
+	buffer = buffer_create(0);
+	for (i = 0; i < 10; i++)
+		buffer_append(buffer, input, sizeof(input));
+	CuAssertIntEquals(tc, 10000, buffer_get_length(buffer));
+	CuAssertTrue(tc, buffer->capacity <= 11000);
+	CuAssertIntEquals( tc, 10000, buffer_get_high_water(buffer) );
+
+	/* Shrinking only happens when enabled and the buffer is empty */
+	buffer_shrink(buffer);
+	CuAssertTrue(tc, buffer->capacity >= 10000);
+	buffer_set_shrink_threshold(4096);
+	buffer_shrink(buffer);
+	CuAssertTrue(tc, buffer->capacity >= 10000);
+	buffer_remove_data(buffer, 10000);
+	buffer_shrink(buffer);
+	CuAssertIntEquals(tc, 128, buffer->capacity);
+
+	/* The high-water mark survives draining */
+	CuAssertIntEquals( tc, 10000, buffer_get_high_water(buffer) );
+	buffer_append(buffer, input, 10);
+	CuAssertIntEquals( tc, 0, memcmp(buffer->data, input, 10) );
+
+	buffer_set_growth_limit(BUFFER_DEFAULT_GROWTH_LIMIT);
+	buffer_set_shrink_threshold(0);
+	buffer_delete(buffer);
+}
+
+/* Every supported unmask implementation gives the same result as the
+   scalar reference, for all combinations of alignment and length. */
+void TestUnmaskImplementations(CuTest *tc)
+{
+	byte mask[] = { 0xb3, 0x11, 0x09, 0xc3 };
+	byte reference[300];
+	byte data[300];
+	size_t offset, length, i;
+	int impl;
+	int saved_impl;
+
+	saved_impl = unmask_get_impl();
+	for (impl = 0; impl < UNMASK_IMPL_COUNT; impl++)
+	{
+		if ( !unmask_set_impl(impl) )
+			continue;
+		for (offset = 0; offset < 33; offset++)
+		{
+			for (length = 0; length + offset <= 260; length += 7)
+			{
+				for (i = 0; i < sizeof(data); i++)
+					data[i] = reference[i] = (byte) (i * 31 + 7);
+				unmask_scalar(reference + offset, length, mask);
+				unmask(data + offset, length, mask);
+				CuAssertTrue( tc,
+					memcmp(data, reference, sizeof(data)) == 0 );
+			}
+		}
+	}
+	unmask_set_impl(saved_impl);
+}
+
+/* Microbenchmark: throughput of each supported implementation */
+void TestUnmaskBenchmark(CuTest *tc)
+{
+	byte mask[] = { 0xb3, 0x11, 0x09, 0xc3 };
+	size_t size = 1024 * 1024;
+	int rounds = 64;
+	byte *data;
+	struct timespec start, end;
+	double seconds;
+	int impl, i;
+	int saved_impl;
+
+	data = (byte*) malloc(size + 1);
+	CuAssertPtrNotNull(tc, data);
+	memset(data, 0x5a, size + 1);
+	saved_impl = unmask_get_impl();
+	for (impl = 0; impl < UNMASK_IMPL_COUNT; impl++)
+	{
+		if ( !unmask_set_impl(impl) )
+			continue;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < rounds; i++)
+			unmask(data + 1, size, mask); /* unaligned start */
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		seconds = (end.tv_sec - start.tv_sec) +
+			(end.tv_nsec - start.tv_nsec) / 1e9;
+		printf("unmask %-6s: %8.1f MB/s\n", unmask_impl_name(impl),
+			size * (double) rounds / seconds / 1e6);
+	}
+	unmask_set_impl(saved_impl);
+	free(data);
+}
+
 CuSuite* UtilGetSuite()
 {
 	CuSuite* suite = CuSuiteNew();
@@ -244,6 +417,10 @@ CuSuite* UtilGetSuite()
 	SUITE_ADD_TEST(suite, TestBuffer);
 	SUITE_ADD_TEST(suite, TestBuffer2);
 	SUITE_ADD_TEST(suite, TestLimitedSizeBuffer);
+	SUITE_ADD_TEST(suite, TestBufferRemove);
+	SUITE_ADD_TEST(suite, TestBufferGrowth);
+	SUITE_ADD_TEST(suite, TestUnmaskImplementations);
+	SUITE_ADD_TEST(suite, TestUnmaskBenchmark);
 	return suite;
 }
 
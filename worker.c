@@ -0,0 +1,223 @@
+#include "worker.h"
+#include <string.h>
+#include "cmanager.h"
+#include "log.h"
+
+static void *worker_thread(void *arg);
+
+static void
+worker_stop_cb(evutil_socket_t fd, short what, void *arg)
+{
+	worker_t *worker = (worker_t*) arg;
+
+	(void) fd;
+	(void) what;
+	event_base_loopbreak(worker->base);
+}
+
+worker_t *
+worker_create(int id, jsconf_t *conf, struct sockaddr *address,
+	size_t address_size, int reuseport)
+{
+	worker_t *worker;
+
+	worker = (worker_t*) malloc(sizeof(*worker));
+	if (worker == NULL)
+		goto Error;
+	memset(worker, 0, sizeof(*worker));
+	worker->id = id;
+	worker->conf = conf;
+	worker->stop_fds[0] = worker->stop_fds[1] = -1;
+	metrics_init(&worker->metrics);
+
+	worker->base = event_base_new();
+	if (worker->base == NULL)
+	{
+		LOG(LOG_ERR, "worker.c:worker_create: (worker %d) couldn't open "
+			"event base", id);
+		goto Error;
+	}
+	/* Other threads can't touch the event base, so they stop the worker
+	   through a socket pair that its loop watches */
+	if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, worker->stop_fds) < 0)
+	{
+		LOG(LOG_ERR, "worker.c:worker_create: (worker %d) couldn't create "
+			"socket pair", id);
+		worker->stop_fds[0] = worker->stop_fds[1] = -1;
+		goto Error;
+	}
+	evutil_make_socket_nonblocking(worker->stop_fds[1]);
+	worker->stop_event = event_new(worker->base, worker->stop_fds[0],
+		EV_READ, worker_stop_cb, worker);
+	if ( (worker->stop_event == NULL) ||
+		(event_add(worker->stop_event, NULL) != 0) )
+		goto Error;
+
+	worker->dnsbase = evdns_base_new(worker->base,
+		EVDNS_BASE_INITIALIZE_NAMESERVERS);
+	if (worker->dnsbase == NULL)
+	{
+		LOG(LOG_ERR, "worker.c:worker_create: (worker %d) couldn't create "
+			"DNS resolver", id);
+		goto Error;
+	}
+	worker->dnscache = dnscache_create(worker->base, worker->dnsbase,
+		conf->dns_cache_ttl, conf->dns_negative_ttl);
+	if (worker->dnscache == NULL)
+		goto Error;
+	worker->pools = poolset_create(worker->base, worker->dnscache, conf);
+	if (worker->pools == NULL)
+		goto Error;
+	worker->metrics.backends = worker->pools->metrics;
+	worker->metrics.backend_count = worker->pools->metrics_count;
+	if (conf->xmpp_tls != XMPP_TLS_NO)
+	{
+		worker->tls = tlsclient_create(conf);
+		if (worker->tls == NULL)
+		{
+			LOG(LOG_ERR, "worker.c:worker_create: (worker %d) couldn't set "
+				"up TLS", id);
+			goto Error;
+		}
+	}
+	worker->xmlpool = xmlpool_create(XMLPOOL_DEFAULT_MAX_FREE);
+	if (worker->xmlpool == NULL)
+		goto Error;
+
+	worker->wsserver = ws_create(worker->base, address, address_size,
+		reuseport);
+	if (worker->wsserver == NULL)
+	{
+		LOG(LOG_ERR, "worker.c:worker_create: (worker %d) couldn't create "
+			"WebSocket server", id);
+		goto Error;
+	}
+	ws_set_config(worker->wsserver, conf);
+	ws_set_dnsbase(worker->wsserver, worker->dnsbase);
+	ws_set_metrics(worker->wsserver, &worker->metrics);
+	ws_set_cb(worker->wsserver, cm_create, cm_delete, cmanager, worker);
+
+	return worker;
+
+Error:
+	if (worker != NULL)
+	{
+		if (worker->wsserver != NULL)
+			ws_delete(worker->wsserver);
+		if (worker->xmlpool != NULL)
+			xmlpool_delete(worker->xmlpool);
+		if (worker->tls != NULL)
+			tlsclient_delete(worker->tls);
+		if (worker->pools != NULL)
+			poolset_delete(worker->pools);
+		if (worker->dnscache != NULL)
+			dnscache_delete(worker->dnscache);
+		if (worker->dnsbase != NULL)
+			evdns_base_free(worker->dnsbase, 0);
+		if (worker->stop_event != NULL)
+			event_free(worker->stop_event);
+		if (worker->stop_fds[0] >= 0)
+		{
+			evutil_closesocket(worker->stop_fds[0]);
+			evutil_closesocket(worker->stop_fds[1]);
+		}
+		if (worker->base != NULL)
+			event_base_free(worker->base);
+		free(worker);
+	}
+	return NULL;
+}
+
+void
+worker_delete(worker_t *worker)
+{
+	if (worker->wsserver != NULL)
+		ws_delete(worker->wsserver);
+	if (worker->tls != NULL)
+	{
+		LOG(LOG_INFO, "worker.c:worker_delete: (worker %d) TLS sessions: "
+			"%lu offered, %lu not cached, %lu received", worker->id,
+			worker->tls->hits, worker->tls->misses, worker->tls->stored);
+		tlsclient_delete(worker->tls);
+	}
+	if (worker->pools != NULL)
+		poolset_delete(worker->pools);
+	if (worker->dnscache != NULL)
+	{
+		LOG(LOG_INFO, "worker.c:worker_delete: (worker %d) DNS cache: "
+			"%lu hits, %lu negative hits, %lu misses, %lu coalesced",
+			worker->id, worker->dnscache->hits,
+			worker->dnscache->negative_hits, worker->dnscache->misses,
+			worker->dnscache->coalesced);
+		dnscache_delete(worker->dnscache);
+	}
+	if (worker->xmlpool != NULL)
+	{
+		LOG(LOG_INFO, "worker.c:worker_delete: (worker %d) XML parsers: "
+			"%lu created, %lu reused", worker->id, worker->xmlpool->created,
+			worker->xmlpool->reused);
+		xmlpool_delete(worker->xmlpool);
+	}
+	if (worker->dnsbase != NULL)
+		evdns_base_free(worker->dnsbase, 0);
+	if (worker->stop_event != NULL)
+		event_free(worker->stop_event);
+	if (worker->stop_fds[0] >= 0)
+	{
+		evutil_closesocket(worker->stop_fds[0]);
+		evutil_closesocket(worker->stop_fds[1]);
+	}
+	if (worker->base != NULL)
+		event_base_free(worker->base);
+	free(worker);
+}
+
+void
+worker_run(worker_t *worker)
+{
+	LOG(LOG_INFO, "worker.c:worker_run: worker %d running", worker->id);
+	event_base_dispatch(worker->base);
+	LOG(LOG_INFO, "worker.c:worker_run: worker %d exiting", worker->id);
+}
+
+static void *
+worker_thread(void *arg)
+{
+	worker_t *worker = (worker_t*) arg;
+
+	worker_run(worker);
+	return NULL;
+}
+
+int
+worker_start(worker_t *worker)
+{
+	if (pthread_create(&worker->thread, NULL, worker_thread, worker) != 0)
+	{
+		LOG(LOG_ERR, "worker.c:worker_start: couldn't start worker %d",
+			worker->id);
+		return 0;
+	}
+	worker->fl_thread = 1;
+	return 1;
+}
+
+void
+worker_stop(worker_t *worker)
+{
+	char byte = 0;
+
+	if (send(worker->stop_fds[1], &byte, 1, 0) < 0)
+		LOG(LOG_ERR, "worker.c:worker_stop: couldn't stop worker %d",
+			worker->id);
+}
+
+void
+worker_join(worker_t *worker)
+{
+	if (worker->fl_thread)
+	{
+		pthread_join(worker->thread, NULL);
+		worker->fl_thread = 0;
+	}
+}
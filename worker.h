@@ -0,0 +1,57 @@
+#ifndef _WORKER_H_
+#define _WORKER_H_
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <event2/event.h>
+#include "parseconfig.h"
+#include "wsserver.h"
+#include "util.h"
+#include "dnscache.h"
+#include "pool.h"
+#include "tlsclient.h"
+#include "xmlpool.h"
+#include "metrics.h"
+
+/* A worker owns one event loop together with everything that is attached
+   to it: the listener (bound with SO_REUSEPORT when there is more than one
+   worker, so the kernel spreads incoming connections across the workers)
+   and all connection managers created for connections accepted on that
+   listener. Nothing is shared between workers except the read-only
+   configuration, so no locking is needed on the connection paths.
+ */
+typedef struct _worker_t
+{
+	int id;
+	pthread_t thread;
+	int fl_thread; /* 1 if the worker runs in its own thread */
+	struct event_base *base;
+	evutil_socket_t stop_fds[2]; /* worker_stop writes to stop_fds[1] */
+	struct event *stop_event;
+	wsserver_t *wsserver;
+	jsconf_t *conf;
+	struct evdns_base *dnsbase; /* resolver shared by the worker's sessions */
+	dnscache_t *dnscache;       /* XMPP server addresses and SRV records */
+	poolset_t *pools;           /* pools of XMPP servers (xmpp_servers) */
+	tlsclient_t *tls;           /* TLS to XMPP servers, NULL if xmpp_tls
+	                               is off */
+	xmlpool_t *xmlpool;         /* expat parsers of the worker's sessions */
+	metrics_t metrics;          /* counters, read by the metrics endpoint */
+} worker_t;
+
+worker_t *worker_create(int id, jsconf_t *conf, struct sockaddr *address,
+	size_t address_size, int reuseport);
+void worker_delete(worker_t *worker);
+
+/* worker_run runs the worker's event loop in the calling thread */
+void worker_run(worker_t *worker);
+
+/* worker_start runs the worker's event loop in a new thread */
+int worker_start(worker_t *worker);
+void worker_join(worker_t *worker);
+
+/* worker_stop makes the worker's event loop return. It can be called from
+   any thread. */
+void worker_stop(worker_t *worker);
+
+#endif /* _WORKER_H_ */
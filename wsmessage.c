@@ -1,4 +1,13 @@
 #include "wsmessage.h"
+#include <string.h>
+#include <arpa/inet.h>
+
+/* Decoder states */
+enum _wsmsg_state_t
+{
+	WSMSG_ST_HEADER,	/* collecting the frame header */
+	WSMSG_ST_PAYLOAD	/* copying the payload to its destination */
+};
 
 wsmsg_t *
 wsmsg_create(jsconf_t *conf)
@@ -12,7 +21,7 @@ wsmsg_create(jsconf_t *conf)
 	wsmsg->frame = 0;
 	wsmsg->message = 0;
 	wsmsg->error = 0;
-	wsmsg->frame_buffer = buffer_create(2 * conf->max_frame_size);
+	wsmsg->frame_buffer = buffer_create(2 * (size_t) conf->max_frame_size);
 	if (wsmsg->frame_buffer == NULL)
 		goto Error;
 	wsmsg->message_buffer = buffer_create(conf->max_message_size);
@@ -22,6 +31,8 @@ wsmsg_create(jsconf_t *conf)
 	if (wsmsg->frame_data == NULL)
 		goto Error;
 	wsmsg->max_frame_size = conf->max_frame_size;
+	wsmsg->max_message_size = conf->max_message_size;
+	wsmsg->state = WSMSG_ST_HEADER;
 	
 	wsmsg->message_opcode = 0;
 	wsmsg->message_started = 0;
@@ -57,183 +68,259 @@ wsmsg_delete(wsmsg_t *wsmsg)
 	}
 }
 
-/* _frame_status_t: status of the buffer in which we are accumulating a frame
-   (still building, ready, error)
- */
-enum _frame_status_t
+static int
+_is_control(int opcode)
 {
-	FS_BUILDING,	/* still building a frame */
-	FS_READY,		/* a frame is ready in the buffer */
-	FS_ERROR		/* there is an error with the data in the buffer */
-};
+	return (opcode == OPCODE_CLOSE) || (opcode == OPCODE_PING) ||
+		(opcode == OPCODE_PONG);
+}
 
-enum _frame_status_t
-get_frame(
-	buffer_t *src_buffer,
-	int *fin, /* FIN flag */
-	int *opcode,
-	int *mask, /* MASK flag */
-	buffer_t *buffer /* buffer that will get the frame payload */
-	)
+/* _wsmsg_header_size returns the size of the whole frame header, computed
+   from its first two bytes. */
+static size_t
+_wsmsg_header_size(byte *header)
 {
-	int opcode_tmp;
-	int fin_tmp;
-	size_t message_length;
-	size_t header_length;
-	size_t frame_length;
-	int mask_tmp;
-	byte *message;
-	byte *data = src_buffer->data;
-	size_t length = src_buffer->length;
-	
-	if (length < 2)
-		return FS_BUILDING;
-	if ( (data[0] & 0x70) != 0 ) /* RSV1-3 must be 0 */
-		return FS_ERROR;
-	opcode_tmp = data[0] & 0x0f;
-	fin_tmp = 0;
-	if ( (data[0] & 0x80) != 0 )
-		fin_tmp = 1;
-	message_length = data[1] & 0x7f;
-	mask_tmp = 0;
-	if ( (data[1] & 0x80) != 0 )
-		mask_tmp = 1;
-	if (message_length == 126)
+	size_t size = 2;
+
+	if ( (header[1] & 0x7f) == 126 )
+		size += 2;
+	else if ( (header[1] & 0x7f) == 127 )
+		size += 8;
+	if ( (header[1] & 0x80) != 0 )
+		size += 4;
+	return size;
+}
+
+uint64_t
+wsmsg_decode_length(const byte *data)
+{
+	uint64_t length = 0;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		length = (length << 8) | data[i];
+	return length;
+}
+
+size_t
+wsmsg_encode_header(byte *header, int fin, int opcode, uint64_t length)
+{
+	int i;
+
+	header[0] = (fin ? 0x80 : 0) | (opcode & 0x0f);
+	if (length <= 125)
+	{
+		header[1] = (byte) length;
+		return 2;
+	}
+	if (length <= 0xffff)
+	{
+		header[1] = 126;
+		header[2] = (byte) (length >> 8);
+		header[3] = (byte) length;
+		return 4;
+	}
+	header[1] = 127;
+	for (i = 9; i >= 2; i--)
+	{
+		header[i] = (byte) length;
+		length >>= 8;
+	}
+	return 10;
+}
+
+/* _wsmsg_start_frame validates a complete header and prepares the decoder
+   for the payload. Returns 0 if the frame is not acceptable. */
+static int
+_wsmsg_start_frame(wsmsg_t *wsmsg)
+{
+	byte *header = wsmsg->header;
+	uint64_t payload_length;
+	size_t index;
+
+	if ( (header[0] & 0x70) != 0 ) /* RSV1-3 must be 0 */
+		return 0;
+	wsmsg->fin = ( (header[0] & 0x80) != 0 );
+	wsmsg->opcode = header[0] & 0x0f;
+	wsmsg->mask = ( (header[1] & 0x80) != 0 );
+
+	payload_length = header[1] & 0x7f;
+	index = 2;
+	if (payload_length == 126)
 	{
 		/* RFC-6455: payload length is encoded in next two bytes (2 and 3) */
 		uint16_t netshort;
-		if (length < 4)
-			goto Exit;
-		netshort = *(uint16_t*) (data + 2);
-		message_length = ntohs(netshort);
-		header_length = 4;
+		memcpy(&netshort, header + 2, 2);
+		payload_length = ntohs(netshort);
+		index = 4;
 	}
-	else if (message_length == 127)
+	else if (payload_length == 127)
 	{
-		/* RFC-6455: payload length is encoded in next 8 bytes (2 to 9) */
-		/* In the current implementation, we don't deal with message lengths
-		   that don't fit in 4 bytes */
-		uint32_t netlong;
-		if (length < 10)
-			goto Exit;
-		netlong = *(uint32_t*) (data + 6);
-		message_length = ntohl(netlong);
-		header_length = 10;
+		/* RFC-6455: payload length is encoded in next 8 bytes (2 to 9),
+		   most significant bit must be 0 */
+		if (header[2] & 0x80)
+			return 0;
+		payload_length = wsmsg_decode_length(header + 2);
+		if (payload_length > SIZE_MAX)
+			return 0;
+		index = 10;
 	}
-	else
-		header_length = 2;
-	
-	/* Copy message_length bytes from buffer+header_length to buffer */
-	if (mask_tmp)
+	if (wsmsg->mask)
+		memcpy(wsmsg->frame_mask, header + index, 4);
+
+	if ( (wsmsg->max_frame_size > 0) &&
+		(payload_length > wsmsg->max_frame_size) )
+		return 0;
+
+	if ( _is_control(wsmsg->opcode) )
 	{
-		message = data + header_length + 4;
-		frame_length = header_length + 4 + message_length;
+		/* RFC 6455: Control frames themselves MUST NOT be fragmented
+		   and MUST have a payload length of 125 bytes or less. */
+		if ( !wsmsg->fin || (payload_length > 125) )
+			return 0;
+		buffer_clear(wsmsg->frame_data);
+		wsmsg->target = wsmsg->frame_data;
 	}
 	else
 	{
-		message = data + header_length;
-		frame_length = header_length + message_length;
+		if ( wsmsg->message_started && (wsmsg->opcode != OPCODE_CONTINUATION) )
+			return 0;
+		if ( !wsmsg->message_started &&
+			(wsmsg->opcode == OPCODE_CONTINUATION) )
+			return 0;
+		if ( (wsmsg->max_message_size > 0) &&
+			(buffer_get_length(wsmsg->message_buffer) + payload_length >
+				wsmsg->max_message_size) )
+			return 0;
+		wsmsg->target = wsmsg->message_buffer;
 	}
-	if ( !buffer_set_data(buffer, message, message_length) )
-		return FS_ERROR;
-	
-	if (frame_length > length) /* We don't yet have the whole frame */
-		goto Exit;
-
-	/* Unmask */
-	if (mask_tmp)
-		unmask(buffer->data, buffer->length, data + header_length);
-	
-	/* Set output data */
-	*fin = fin_tmp;
-	*opcode = opcode_tmp;
-	*mask = mask_tmp;
-	
-	/* Remove data from source buffer */
-	buffer_remove_data(src_buffer, frame_length);
-	
-	return FS_READY;
 
-Exit:
-	return FS_BUILDING;
+	wsmsg->remaining = payload_length;
+	wsmsg->mask_offset = 0;
+	wsmsg->state = WSMSG_ST_PAYLOAD;
+	wsmsg->frames++;
+	return 1;
 }
 
+/* _wsmsg_end_frame is called when the whole payload of a frame has been
+   received. */
 static void
-_wsmsg_process(wsmsg_t *wsmsg)
+_wsmsg_end_frame(wsmsg_t *wsmsg)
 {
-	int fin;
-	int opcode;
-	int mask;
-	enum _frame_status_t fs;
-	int res;
+	wsmsg->state = WSMSG_ST_HEADER;
+	wsmsg->header_length = 0;
+	wsmsg->header_size = 0;
 
-	if (wsmsg->message || wsmsg->frame || wsmsg->error)
+	if ( _is_control(wsmsg->opcode) )
+	{
+		wsmsg->frame = 1;
 		return;
+	}
+	if (!wsmsg->message_started)
+	{
+		wsmsg->message_started = 1;
+		wsmsg->message_opcode = wsmsg->opcode;
+	}
+	if (wsmsg->fin)
+		wsmsg->message = 1; /* We have a full message */
+}
+
+/* _wsmsg_decode runs the decoder over data and returns the number of bytes
+   consumed. It stops after a complete message or control frame, which has
+   to be picked up before decoding can continue. */
+static size_t
+_wsmsg_decode(wsmsg_t *wsmsg, byte *data, size_t length)
+{
+	size_t consumed = 0;
+	size_t n;
+	size_t start;
+	size_t i;
+	byte mask[4];
 
-	while (1)
+	while ( (consumed < length) &&
+		!(wsmsg->message || wsmsg->frame || wsmsg->error) )
 	{
-		fs = get_frame(
-			wsmsg->frame_buffer,
-			&fin,
-			&opcode,
-			&mask,
-			wsmsg->frame_data);
-		if (fs == FS_BUILDING)
-			return;
-		if (fs == FS_READY)
+		if (wsmsg->state == WSMSG_ST_HEADER)
+		{
+			/* The size of the header is known after the first two bytes */
+			n = (wsmsg->header_length < 2 ? 2 : wsmsg->header_size) -
+				wsmsg->header_length;
+			if (n > length - consumed)
+				n = length - consumed;
+			memcpy(wsmsg->header + wsmsg->header_length, data + consumed, n);
+			wsmsg->header_length += n;
+			consumed += n;
+			if (wsmsg->header_length < 2)
+				break;
+			if (wsmsg->header_size == 0)
+				wsmsg->header_size = _wsmsg_header_size(wsmsg->header);
+			if (wsmsg->header_length < wsmsg->header_size)
+				continue;
+			if ( !_wsmsg_start_frame(wsmsg) )
+			{
+				wsmsg->error = 1;
+				break;
+			}
+			if (wsmsg->remaining == 0)
+				_wsmsg_end_frame(wsmsg);
+		}
+		else /* WSMSG_ST_PAYLOAD */
 		{
-			if ( (opcode == OPCODE_CLOSE) || (opcode == OPCODE_PING) ||
-				(opcode == OPCODE_PONG) )
+			n = length - consumed;
+			if (n > wsmsg->remaining)
+				n = wsmsg->remaining;
+			start = buffer_get_length(wsmsg->target);
+			if ( !buffer_append(wsmsg->target, data + consumed, n) ||
+				(buffer_get_length(wsmsg->target) != start + n) )
 			{
-				/* RFC 6455: Control frames themselves MUST NOT be fragmented. */
-				if (!fin)
-					goto Error;
-				wsmsg->frame = 1;
-				wsmsg->fin = fin;
-				wsmsg->opcode = opcode;
-				wsmsg->mask = mask;
-				return;
+				wsmsg->error = 1;
+				break;
 			}
-			if ( wsmsg->message_started && (opcode != OPCODE_CONTINUATION) )
-				goto Error;
-			if ( !wsmsg->message_started && (opcode == OPCODE_CONTINUATION) )
-				goto Error;
-
-			res = buffer_append(
-				wsmsg->message_buffer, 
-				wsmsg->frame_data->data,
-				wsmsg->frame_data->length);
-			if (!res)
-				goto Error;
-			if (!wsmsg->message_started)
+			if (wsmsg->mask)
 			{
-				wsmsg->message_started = 1;
-				wsmsg->message_opcode = opcode;
+				/* Unmask in place, starting at the right byte of the key */
+				for (i = 0; i < 4; i++)
+					mask[i] = wsmsg->frame_mask[(wsmsg->mask_offset + i) & 3];
+				unmask(wsmsg->target->data + start, n, mask);
+				wsmsg->mask_offset = (wsmsg->mask_offset + n) & 3;
 			}
-			if (fin)
-				wsmsg->message = 1; /* We have a full message */
-			/* Remove data from frame_data */
-			buffer_remove_data(wsmsg->frame_data, wsmsg->frame_data->length);
+			consumed += n;
+			wsmsg->remaining -= n;
+			if (wsmsg->remaining == 0)
+				_wsmsg_end_frame(wsmsg);
 		}
-		if (fs == FS_ERROR)
-			goto Error;
 	}
+	return consumed;
+}
 
-Error:
-	wsmsg->error = 1;
+/* _wsmsg_process continues decoding input that was held back while a
+   message or a control frame was waiting to be picked up. */
+static void
+_wsmsg_process(wsmsg_t *wsmsg)
+{
+	size_t consumed;
+
+	if (wsmsg->message || wsmsg->frame || wsmsg->error)
+		return;
+	consumed = _wsmsg_decode(
+		wsmsg,
+		wsmsg->frame_buffer->data,
+		buffer_get_length(wsmsg->frame_buffer) );
+	buffer_remove_data(wsmsg->frame_buffer, consumed);
+	buffer_shrink(wsmsg->frame_buffer);
 }
 
 int
 wsmsg_add(wsmsg_t *wsmsg, byte *data, size_t length)
 {
-	int fin;
-	int opcode;
-	int mask;
-	enum _frame_status_t fs;
-	int res;
-	
-	res = buffer_append(wsmsg->frame_buffer, data, length);
-	if (!res)
+	size_t consumed = 0;
+
+	/* Decode directly from the caller's data unless older input is still
+	   waiting in frame_buffer. */
+	if (buffer_get_length(wsmsg->frame_buffer) == 0)
+		consumed = _wsmsg_decode(wsmsg, data, length);
+	if ( !buffer_append(wsmsg->frame_buffer, data + consumed,
+		length - consumed) )
 		return 0;
 	_wsmsg_process(wsmsg);
 	return 1;
@@ -264,6 +351,7 @@ wsmsg_get_message(
 	wsmsg->message = 0;
 	wsmsg->message_started = 0;
 	res = buffer_move(wsmsg->message_buffer, buffer);
+	buffer_shrink(wsmsg->message_buffer);
 	*opcode = wsmsg->message_opcode;
 	_wsmsg_process(wsmsg);
 	return res;
@@ -12,12 +12,29 @@
 #define OPCODE_PING          0x09
 #define OPCODE_PONG          0x0a
 
+/* Maximum size of a frame header: 2 bytes, 8 bytes of extended payload
+   length and 4 bytes of masking key */
+#define WSMSG_MAX_HEADER_SIZE 14
+
 typedef struct _wsmsg_t_
 {
 	int frame; /* We have a control frame in the frame buffer */
 	int message; /* We have a message in the message buffer */
 	int error; /* We have an error (connection has to be terminated) */
-	buffer_t *frame_buffer; /* accumulates bytes of a new frame */
+	buffer_t *frame_buffer; /* holds input that arrives while a message or
+	                           a control frame waits to be picked up */
+
+	/* Frame decoder state. Input is consumed once: header bytes are
+	   collected in header, payload bytes are unmasked and appended
+	   directly to their destination buffer as they arrive. */
+	int state; /* WSMSG_ST_HEADER or WSMSG_ST_PAYLOAD */
+	byte header[WSMSG_MAX_HEADER_SIZE];
+	size_t header_length; /* header bytes received so far */
+	size_t header_size; /* size of the whole header, once known */
+	uint64_t remaining; /* payload bytes of the current frame still to come */
+	byte frame_mask[4]; /* masking key of the current frame */
+	size_t mask_offset; /* index into frame_mask of the next payload byte */
+	buffer_t *target; /* frame_data or message_buffer */
 
 	/* Data and parameters of the received frame */
 	buffer_t *frame_data; /* unmasked payload of the frame */
@@ -32,6 +49,9 @@ typedef struct _wsmsg_t_
 	                        message_buffer */
 
 	size_t max_frame_size;
+	size_t max_message_size;
+
+	unsigned long frames; /* frames decoded so far */
 } wsmsg_t;
 
 wsmsg_t *wsmsg_create(jsconf_t *conf);
@@ -52,5 +72,16 @@ int wsmsg_get_frame(
 	int *opcode,
 	int *mask);
 
+/* wsmsg_encode_header writes the header of an unmasked frame carrying
+   length bytes of payload into header (at least WSMSG_MAX_HEADER_SIZE
+   bytes) and returns its size. The shortest length encoding is used, as
+   RFC 6455 requires. */
+size_t wsmsg_encode_header(byte *header, int fin, int opcode,
+	uint64_t length);
+
+/* wsmsg_decode_length reads a 64-bit extended payload length in network
+   byte order */
+uint64_t wsmsg_decode_length(const byte *data);
+
 #endif /* _WSMESSAGE_H_ */
 
@@ -2,6 +2,9 @@
 #include "CuTest.h"
 #include "wsmessage.h"
 #include "util.h"
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
 
 void
 TestUnmask(CuTest *tc)
@@ -223,6 +226,263 @@ TestTwoMessages(CuTest *tc)
 	config_delete(conf);
 }
 
+/* build_frame builds a masked frame with the given payload; the caller
+   frees the result */
+static byte *
+build_frame(int opcode, int fin, byte *payload, size_t length,
+	byte *mask, size_t *frame_size)
+{
+	byte *frame;
+	size_t header_size;
+	size_t i;
+
+	frame = (byte*) malloc(length + 14);
+	frame[0] = (fin ? 0x80 : 0) | opcode;
+	if (length <= 125)
+	{
+		frame[1] = 0x80 | length;
+		header_size = 2;
+	}
+	else if (length <= 0xffff)
+	{
+		frame[1] = 0x80 | 126;
+		frame[2] = (length >> 8) & 0xff;
+		frame[3] = length & 0xff;
+		header_size = 4;
+	}
+	else
+	{
+		frame[1] = 0x80 | 127;
+		for (i = 0; i < 8; i++)
+			frame[2 + i] = ((uint64_t) length >> (8 * (7 - i))) & 0xff;
+		header_size = 10;
+	}
+	memcpy(frame + header_size, mask, 4);
+	header_size += 4;
+	for (i = 0; i < length; i++)
+		frame[header_size + i] = payload[i] ^ mask[i % 4];
+	*frame_size = header_size + length;
+	return frame;
+}
+
+/* add_chunked feeds data to wsmsg in chunks of chunk_size bytes */
+static void
+add_chunked(wsmsg_t *wsmsg, byte *data, size_t length, size_t chunk_size)
+{
+	size_t offset, n;
+
+	for (offset = 0; offset < length; offset += n)
+	{
+		n = length - offset;
+		if (n > chunk_size)
+			n = chunk_size;
+		wsmsg_add(wsmsg, data + offset, n);
+	}
+}
+
+void
+TestChunkedFrames(CuTest *tc)
+{
+	jsconf_t *conf;
+	wsmsg_t *wsmsg;
+	buffer_t *buffer;
+	byte mask[] = { 0x12, 0x34, 0x56, 0x78 };
+	byte payload[300];
+	byte *frame;
+	size_t frame_size;
+	size_t chunk_size;
+	size_t i;
+	int opcode;
+
+	for (i = 0; i < sizeof(payload); i++)
+		payload[i] = 'a' + i % 26;
+	conf = config_create();
+	buffer = buffer_create(0);
+	frame = build_frame(OPCODE_TEXT, 1, payload, sizeof(payload), mask,
+		&frame_size);
+
+	/* Every chunk size, down to one byte at a time, gives the same
+	   message: the header and the mask offset survive chunk boundaries. */
+	for (chunk_size = 1; chunk_size <= 9; chunk_size++)
+	{
+		wsmsg = wsmsg_create(conf);
+		add_chunked(wsmsg, frame, frame_size, chunk_size);
+		CuAssertTrue( tc, !wsmsg_fail(wsmsg) );
+		CuAssertTrue( tc, wsmsg_has_message(wsmsg) );
+		CuAssertTrue( tc, wsmsg_get_message(wsmsg, buffer, &opcode) );
+		CuAssertIntEquals(tc, OPCODE_TEXT, opcode);
+		CuAssertIntEquals(tc, sizeof(payload), buffer_get_length(buffer));
+		CuAssertTrue( tc, memcmp(buffer->data, payload, sizeof(payload)) == 0 );
+		wsmsg_delete(wsmsg);
+	}
+
+	free(frame);
+	buffer_delete(buffer);
+	config_delete(conf);
+}
+
+void
+TestFrameTooLarge(CuTest *tc)
+{
+	jsconf_t *conf;
+	wsmsg_t *wsmsg;
+	byte mask[] = { 0x12, 0x34, 0x56, 0x78 };
+	byte payload[65];
+	byte *frame;
+	size_t frame_size;
+
+	memset( payload, 'x', sizeof(payload) );
+	conf = config_create();
+	config_parse(conf, "./test/jabsocket.conf"); /* max_frame_size: 64 */
+	wsmsg = wsmsg_create(conf);
+
+	/* The frame is rejected as soon as its 8-byte header has been seen */
+	frame = build_frame(OPCODE_TEXT, 1, payload, sizeof(payload), mask,
+		&frame_size);
+	wsmsg_add(wsmsg, frame, 8);
+	CuAssertTrue( tc, wsmsg_fail(wsmsg) );
+
+	free(frame);
+	wsmsg_delete(wsmsg);
+	config_delete(conf);
+}
+
+/* Frame headers use the shortest length encoding and round-trip through
+   the 64-bit extended length. */
+void
+TestEncodeHeader(CuTest *tc)
+{
+	byte header[WSMSG_MAX_HEADER_SIZE];
+	uint64_t big = 0x140000005ULL; /* does not fit in 32 bits */
+
+	CuAssertIntEquals( tc, 2, wsmsg_encode_header(header, 1, OPCODE_TEXT, 0) );
+	CuAssertIntEquals(tc, 0x81, header[0]);
+	CuAssertIntEquals(tc, 0, header[1]);
+	CuAssertIntEquals( tc, 2,
+		wsmsg_encode_header(header, 1, OPCODE_TEXT, 125) );
+	CuAssertIntEquals(tc, 125, header[1]);
+
+	CuAssertIntEquals( tc, 4,
+		wsmsg_encode_header(header, 0, OPCODE_BINARY, 126) );
+	CuAssertIntEquals(tc, 0x02, header[0]);
+	CuAssertIntEquals(tc, 126, header[1]);
+	CuAssertIntEquals(tc, 0, header[2]);
+	CuAssertIntEquals(tc, 126, header[3]);
+	CuAssertIntEquals( tc, 4,
+		wsmsg_encode_header(header, 1, OPCODE_TEXT, 65535) );
+	CuAssertIntEquals(tc, 0xff, header[2]);
+	CuAssertIntEquals(tc, 0xff, header[3]);
+
+	/* 65536 and above use the 64-bit length (the old code switched at
+	   131071 and wrote a 16-bit value into it) */
+	CuAssertIntEquals( tc, 10,
+		wsmsg_encode_header(header, 1, OPCODE_TEXT, 65536) );
+	CuAssertIntEquals(tc, 127, header[1]);
+	CuAssertTrue( tc, wsmsg_decode_length(header + 2) == 65536 );
+	CuAssertIntEquals( tc, 10,
+		wsmsg_encode_header(header, 1, OPCODE_TEXT, big) );
+	CuAssertIntEquals(tc, 0x01, header[5]);
+	CuAssertTrue( tc, wsmsg_decode_length(header + 2) == big );
+}
+
+/* The decoder reads all 8 bytes of the extended length and checks the
+   result against max_frame_size. */
+void
+TestExtendedLength(CuTest *tc)
+{
+	jsconf_t *conf;
+	wsmsg_t *wsmsg;
+	byte header[WSMSG_MAX_HEADER_SIZE + 4];
+	byte mask[] = { 0x12, 0x34, 0x56, 0x78 };
+	uint64_t big = 0x100000005ULL;
+	size_t header_size;
+
+	/* Unlimited frame size: a 4 GB + 5 frame is accepted as such, not as a
+	   5 byte frame */
+	header_size = wsmsg_encode_header(header, 1, OPCODE_TEXT, big);
+	header[1] |= 0x80;
+	memcpy(header + header_size, mask, 4);
+	conf = config_create();
+	wsmsg = wsmsg_create(conf);
+	wsmsg_add(wsmsg, header, header_size + 4);
+	CuAssertTrue( tc, !wsmsg_fail(wsmsg) );
+	CuAssertTrue( tc, wsmsg->remaining == big );
+	wsmsg_delete(wsmsg);
+
+	/* The most significant bit must be 0 */
+	header[2] = 0x80;
+	wsmsg = wsmsg_create(conf);
+	wsmsg_add(wsmsg, header, header_size + 4);
+	CuAssertTrue( tc, wsmsg_fail(wsmsg) );
+	wsmsg_delete(wsmsg);
+	config_delete(conf);
+
+	/* A length whose low 32 bits are small is still too large */
+	header[2] = 0;
+	conf = config_create();
+	config_parse(conf, "./test/jabsocket.conf"); /* max_frame_size: 64 */
+	wsmsg = wsmsg_create(conf);
+	wsmsg_add(wsmsg, header, header_size + 4);
+	CuAssertTrue( tc, wsmsg_fail(wsmsg) );
+	wsmsg_delete(wsmsg);
+	config_delete(conf);
+}
+
+static double
+time_large_frame(size_t frame_length, size_t chunk_size, int *ok)
+{
+	jsconf_t *conf;
+	wsmsg_t *wsmsg;
+	buffer_t *buffer;
+	byte mask[] = { 0xa1, 0xb2, 0xc3, 0xd4 };
+	byte *payload;
+	byte *frame;
+	size_t frame_size;
+	struct timespec start, end;
+	int opcode;
+
+	payload = (byte*) malloc(frame_length);
+	memset(payload, 'z', frame_length);
+	frame = build_frame(OPCODE_TEXT, 1, payload, frame_length, mask,
+		&frame_size);
+	conf = config_create();
+	wsmsg = wsmsg_create(conf);
+	buffer = buffer_create(0);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	add_chunked(wsmsg, frame, frame_size, chunk_size);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	*ok = wsmsg_has_message(wsmsg) &&
+		wsmsg_get_message(wsmsg, buffer, &opcode) &&
+		(buffer_get_length(buffer) == frame_length) &&
+		(memcmp(buffer->data, payload, frame_length) == 0);
+
+	buffer_delete(buffer);
+	wsmsg_delete(wsmsg);
+	config_delete(conf);
+	free(frame);
+	free(payload);
+	return (end.tv_sec - start.tv_sec) * 1e3 +
+		(end.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+/* Benchmark: a large frame delivered in 1 KB chunks. The cost has to grow
+   linearly with the frame size (each byte is consumed once). */
+void
+TestLargeFrameChunked(CuTest *tc)
+{
+	double ms1, ms4;
+	int ok;
+
+	ms1 = time_large_frame(1024 * 1024, 1024, &ok);
+	CuAssertTrue(tc, ok);
+	ms4 = time_large_frame(4 * 1024 * 1024, 1024, &ok);
+	CuAssertTrue(tc, ok);
+	printf("wsmessage: 1 MB frame in 1 KB chunks: %.2f ms, "
+		"4 MB frame: %.2f ms\n", ms1, ms4);
+}
+
 CuSuite* WSMessageGetSuite()
 {
 	CuSuite* suite = CuSuiteNew();
@@ -230,6 +490,11 @@ CuSuite* WSMessageGetSuite()
 	SUITE_ADD_TEST(suite, TestSingleFrameMessage);
 	SUITE_ADD_TEST(suite, TestControlFrame);
 	SUITE_ADD_TEST(suite, TestTwoMessages);
+	SUITE_ADD_TEST(suite, TestChunkedFrames);
+	SUITE_ADD_TEST(suite, TestFrameTooLarge);
+	SUITE_ADD_TEST(suite, TestLargeFrameChunked);
+	SUITE_ADD_TEST(suite, TestEncodeHeader);
+	SUITE_ADD_TEST(suite, TestExtendedLength);
 	return suite;
 }
 
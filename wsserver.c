@@ -1,6 +1,8 @@
 #include "wsserver.h"
 #include <string.h>
 #include <event2/buffer.h>
+#include <netdb.h>
+#include <stdio.h>
 #include "log.h"
 
 static void ws_accept_conn_cb(struct evconnlistener *listener,
@@ -9,6 +11,9 @@ static void ws_accept_conn_cb(struct evconnlistener *listener,
 static void wsconn_read_cb(struct bufferevent *bev, void *ctx);
 static void wsconn_write_cb(struct bufferevent *bev, void *ctx);
 static void wsconn_event_cb(struct bufferevent *bev, short events, void *ctx);
+static void wsconn_resolve_host(wsconn_t *conn, struct sockaddr *address);
+static void wsconn_ptr_cb(int result, char type, int count, int ttl,
+	void *addresses, void *arg);
 
 static void wsconn_process_frame(wsconn_t *conn);
 
@@ -25,6 +30,8 @@ static void wsconn_delete(wsconn_t *conn);
 
 static void wsconn_write_frame(wsconn_t *conn, uint8_t opcode,
 	void *data, size_t size);
+static void wsconn_output_cb(struct evbuffer *buffer,
+	const struct evbuffer_cb_info *info, void *arg);
 
 /* States */
 enum _ws_state_t
@@ -44,9 +51,10 @@ enum _cm_state_t
 };
 
 wsserver_t *
-ws_create(struct event_base *base, void *sin, size_t size)
+ws_create(struct event_base *base, void *sin, size_t size, int reuseport)
 {
 	wsserver_t *wss = 0;
+	unsigned flags;
 
 	wss = (wsserver_t*) malloc(sizeof(*wss));
 	memset(wss, 0, sizeof(*wss));
@@ -54,9 +62,11 @@ ws_create(struct event_base *base, void *sin, size_t size)
 	{
 		memset(wss, 0, sizeof(*wss));
 		wss->base = base;
+		flags = LEV_OPT_CLOSE_ON_FREE|LEV_OPT_REUSEABLE;
+		if (reuseport)
+			flags |= LEV_OPT_REUSEABLE_PORT;
 		wss->listener = evconnlistener_new_bind(base, ws_accept_conn_cb, wss,
-			LEV_OPT_CLOSE_ON_FREE|LEV_OPT_REUSEABLE, -1,
-			(struct sockaddr*) sin, size);
+			flags, -1, (struct sockaddr*) sin, size);
 		if (wss->listener == NULL)
 		{
 			printf("Couldn't create listener\n");
@@ -91,6 +101,18 @@ ws_set_config(wsserver_t *ws, jsconf_t *conf)
 	ws->conf = conf;
 }
 
+void
+ws_set_dnsbase(wsserver_t *ws, struct evdns_base *dnsbase)
+{
+	ws->dnsbase = dnsbase;
+}
+
+void
+ws_set_metrics(wsserver_t *ws, metrics_t *metrics)
+{
+	ws->metrics = metrics;
+}
+
 static void
 ws_accept_conn_cb(struct evconnlistener *listener,
     evutil_socket_t fd, struct sockaddr *address, int socklen,
@@ -100,6 +122,7 @@ ws_accept_conn_cb(struct evconnlistener *listener,
 	wsserver_t *ws = (wsserver_t*)ctx;
 	wsconn_t *conn;
 	
+	metric_add(&ws->metrics->connections, 1);
 	conn = wsconn_create(ws, listener, fd, address, socklen);
 	if (conn == NULL)
 	{
@@ -107,17 +130,59 @@ ws_accept_conn_cb(struct evconnlistener *listener,
 		goto Exit;
 	}
 	LOG(LOG_DEBUG, "wsserver.c:ws_accept_conn_cb: created connection");
+	/* Only numeric host and port here: a reverse lookup in getnameinfo
+	   would block the event loop. */
 	if ( getnameinfo(address, socklen, conn->host, sizeof(conn->host),
-		conn->serv, sizeof(conn->serv), 0) != 0 )
+		conn->serv, sizeof(conn->serv), NI_NUMERICHOST|NI_NUMERICSERV) != 0 )
 			LOG(LOG_WARNING, "wsserver.c:ws_accept_conn_cb: getnameinfo failed");
 	else
 		LOG(LOG_INFO, "wsserver.c:ws_accept_conn_cb: connection from host %s:%s",
 			conn->host, conn->serv);
+	if (ws->conf->reverse_dns && (ws->dnsbase != NULL) )
+		wsconn_resolve_host(conn, address);
 
 Exit:
 	return;
 }
 
+/* wsconn_resolve_host starts an asynchronous PTR lookup of the client's
+   address; the result is stored in conn->hostname and only used for
+   logging. */
+static void
+wsconn_resolve_host(wsconn_t *conn, struct sockaddr *address)
+{
+	struct evdns_base *dnsbase = conn->wsserver->dnsbase;
+
+	if (address->sa_family == AF_INET)
+		conn->ptr_request = evdns_base_resolve_reverse(dnsbase,
+			&((struct sockaddr_in*) address)->sin_addr, DNS_QUERY_NO_SEARCH,
+			wsconn_ptr_cb, conn);
+	else if (address->sa_family == AF_INET6)
+		conn->ptr_request = evdns_base_resolve_reverse_ipv6(dnsbase,
+			&((struct sockaddr_in6*) address)->sin6_addr, DNS_QUERY_NO_SEARCH,
+			wsconn_ptr_cb, conn);
+}
+
+static void
+wsconn_ptr_cb(int result, char type, int count, int ttl, void *addresses,
+	void *arg)
+{
+	wsconn_t *conn = (wsconn_t*) arg;
+
+	/* A cancelled request is reported after the connection has been
+	   deleted, so conn must not be touched. */
+	if (result == DNS_ERR_CANCEL)
+		return;
+	conn->ptr_request = NULL;
+	if ( (result == DNS_ERR_NONE) && (type == DNS_PTR) && (count > 0) )
+	{
+		snprintf(conn->hostname, sizeof(conn->hostname), "%s",
+			*(char**) addresses);
+		LOG(LOG_INFO, "wsserver.c:wsconn_ptr_cb: (%s:%s) host name %s",
+			conn->host, conn->serv, conn->hostname);
+	}
+}
+
 static wsconn_t *wsconn_create(
 	wsserver_t *wsserver,
 	struct evconnlistener *listener,
@@ -134,6 +199,7 @@ static wsconn_t *wsconn_create(
 		goto Error;
 	memset(conn, 0, sizeof(*conn));
 	conn->wsserver = wsserver;
+	conn->accepted = metrics_now();
 	conn->cb = wsserver->cb;
 	conn->cb_ctx = wsserver->cb_ctx;
 
@@ -172,6 +238,7 @@ static wsconn_t *wsconn_create(
 	conn->cm_state = CM_ST_CREATED;
 
 	bufferevent_setcb(bev, wsconn_read_cb, wsconn_write_cb, wsconn_event_cb, conn);
+	evbuffer_add_cb(bufferevent_get_output(bev), wsconn_output_cb, conn);
 
 	bufferevent_enable(bev, EV_READ|EV_WRITE);
 
@@ -195,6 +262,12 @@ Error:
 
 static void wsconn_delete(wsconn_t *conn)
 {
+	LOG(LOG_INFO, "wsserver.c:wsconn_delete (%s:%s) Deleting connection "
+		"(largest message %lu bytes)\n", conn->host, conn->serv,
+		(unsigned long) ( conn->message_buffer != NULL ?
+			buffer_get_high_water(conn->message_buffer) : 0 ) );
+	if (conn->ptr_request != NULL)
+		evdns_cancel_request(conn->wsserver->dnsbase, conn->ptr_request);
 	if (conn->bev != NULL)
 		bufferevent_free(conn->bev);
 	if (conn->req != NULL)
@@ -206,8 +279,6 @@ static void wsconn_delete(wsconn_t *conn)
 	if (conn->cb != NULL)
 		conn->cb(conn, WSCB_DELETE, conn->custom_ctx);
 	free(conn);
-	LOG(LOG_INFO, "wsserver.c:wsconn_delete (%s:%s) Deleting connection\n",
-		conn->host, conn->serv);
 }
 
 static void
@@ -216,8 +287,7 @@ wsconn_read_cb(struct bufferevent *bev, void *ctx)
 	wsconn_t *conn = (wsconn_t*) ctx;
 	struct evbuffer *input;
 	size_t length;
-	char *line;
-	size_t line_length;
+	size_t header_size;
 	unsigned char *input_buffer;
 
 	input = bufferevent_get_input(bev);
@@ -226,28 +296,23 @@ wsconn_read_cb(struct bufferevent *bev, void *ctx)
 	switch (conn->ws_state)
 	{
 		case WS_ST_START:
-			while (1)
+			/* Parse the request header in place once it is complete */
+			if (length > RQ_MAX_HEADER_SIZE)
+				length = RQ_MAX_HEADER_SIZE;
+			input_buffer = evbuffer_pullup(input, length);
+			if (input_buffer == NULL)
+				goto Error;
+			header_size = rq_parse(conn->req, (char*) input_buffer, length);
+			if ( rq_is_error(conn->req) )
 			{
-				line = evbuffer_readln(input, &line_length, EVBUFFER_EOL_CRLF);
-				if (line != NULL)
-				{
-					rq_add_line(conn->req, line);
-					free(line);
-					if ( rq_is_error(conn->req) )
-						goto Error;
-					if (rq_done(conn->req))
-					{
-						wsconn_handshake(conn);
-						break;
-					}
-				}
-				else /* line == NULL */
-				{
-					LOG(LOG_INFO, "wsserver.c:ws_accept_conn_cb: (%s:%s) evbuffer_readln error",
-						conn->host, conn->serv);
-					break;
-				}
-			} /* while (1) */
+				metric_add(&conn->wsserver->metrics->handshake_errors, 1);
+				goto Error;
+			}
+			if (header_size == 0)
+				break; /* wait for the rest of the header */
+			metric_add(&conn->wsserver->metrics->bytes_in, header_size);
+			evbuffer_drain(input, header_size);
+			wsconn_handshake(conn);
 			break;
 		case WS_ST_RECEIVING:
 			wsconn_process_frame(conn);
@@ -276,6 +341,11 @@ wsconn_handshake(wsconn_t *conn)
 		output,
 		str_get_string(&response_str),
 		str_get_length(&response_str) );
+	metrics_handshake(conn->wsserver->metrics,
+		rq_get_error_code(conn->req) );
+	metrics_observe(&conn->wsserver->metrics->handshake, conn->accepted);
+	metric_add(&conn->wsserver->metrics->bytes_out,
+		str_get_length(&response_str) );
 
 	if (res)
 	{
@@ -296,10 +366,6 @@ static void
 wsconn_process_frame(wsconn_t *conn)
 {
 	struct evbuffer *input;
-	size_t length;
-	char *line;
-	size_t line_length;
-	unsigned char *input_buffer;
 	struct bufferevent *bev;
 	buffer_t *buffer;
 	
@@ -309,20 +375,25 @@ wsconn_process_frame(wsconn_t *conn)
 
 	bev = conn->bev;
 	input = bufferevent_get_input(bev);
-	length = evbuffer_get_length(input);
-	bev = conn->bev;
+	conn->read_time = metrics_now();
 
-	input_buffer = (unsigned char*) malloc(length);
-	if (input_buffer == NULL)
+	/* Feed the input to the frame decoder extent by extent, without
+	   copying it out of the evbuffer first. */
+	while (evbuffer_get_length(input) > 0)
 	{
-		LOG(LOG_WARNING,
-			"wsserver.c:wsconn_process_frame: malloc failed");
-		goto Exit;
+		struct evbuffer_iovec extent;
+
+		if (evbuffer_peek(input, -1, NULL, &extent, 1) < 1)
+			break;
+		wsmsg_add( conn->wsmsg, extent.iov_base, extent.iov_len );
+		metric_add(&conn->wsserver->metrics->bytes_in, extent.iov_len);
+		evbuffer_drain(input, extent.iov_len);
 	}
-	evbuffer_remove(input, input_buffer, length);
-	// wsfb_append(conn->buffer, input_buffer, length);
-	wsmsg_add( conn->wsmsg, input_buffer, length );
-	free(input_buffer);
+	/* Frames decoded while picking up messages below are counted on the
+	   next read */
+	metric_add(&conn->wsserver->metrics->frames_in,
+		conn->wsmsg->frames - conn->frames_counted);
+	conn->frames_counted = conn->wsmsg->frames;
 	while (1)
 	{
 		int opcode;
@@ -350,6 +421,9 @@ wsconn_process_frame(wsconn_t *conn)
 				wsconn_close(conn);
 				break;
 			}
+			LOG(LOG_DEBUG, "wsserver.c:wsconn_read_cb: (%s:%s) frame opcode %d "
+				"fin %d length %lu", conn->host, conn->serv, opcode, fin,
+				(unsigned long) buffer_get_length(buffer) );
 			if (opcode == OPCODE_CLOSE) /* Close frame */
 			{
 				uint16_t *status_network;
@@ -413,6 +487,10 @@ wsconn_process_frame(wsconn_t *conn)
 				break;
 			}
 		}
+		/* The message has been handed over; release the memory of an
+		   unusually large one. */
+		buffer_clear(conn->message_buffer);
+		buffer_shrink(conn->message_buffer);
 	}
 
 Exit:
@@ -475,77 +553,127 @@ ws_cb_t ws_get_cb(wsserver_t *ws)
 	return ws->cb;
 }
 
+/* wsconn_write_frame builds the frame header on the stack and copies
+   header and payload straight into space reserved in the output evbuffer,
+   so the payload is copied exactly once and nothing is allocated besides
+   the evbuffer's own chain. */
 static void wsconn_write_frame(wsconn_t *conn, uint8_t opcode,
 	void *data, size_t size)
 {
-	int res;
-	buffer_t *buffer;
-	unsigned char block0[] = { 0 }; /* F + opcode */
-	unsigned char block1[9] = { 0 };   /* MASK + length (lower 7 bits + 0, 2, or
-										  8 bytes */
-	size_t block1_size;
-	unsigned char *message;
-	size_t message_size;
-	struct bufferevent *bev = conn->bev;
+	byte header[WSMSG_MAX_HEADER_SIZE];
+	size_t header_size;
 	struct evbuffer *output;
-	
-	block0[0] = 0x80 + (0x0F & opcode);
+	struct evbuffer_iovec vec;
 
-	buffer = buffer_create(0); /* TODO: limited size buffer */
-	if (buffer == NULL)
-		goto Exit;
-	output = bufferevent_get_output(bev);
-
-	if (buffer == NULL)
-		goto Exit;
-	res = buffer_append(buffer, block0, 1);
-	if (!res)
-		goto Exit;
+	output = bufferevent_get_output(conn->bev);
+	header_size = wsmsg_encode_header(header, 1, opcode, size);
 
-	if (size <= 125)
+	if (evbuffer_reserve_space(output, header_size + size, &vec, 1) < 1)
 	{
-		/* Size is in the lower nibble of byte 1 */
-		block1[0] = size;
-		block1_size = 1;
+		LOG(LOG_ERR, "wsserver.c:wsconn_write_frame: couldn't reserve %lu "
+			"bytes", (unsigned long) (header_size + size) );
+		return;
 	}
-	else if (size < ((2 << 16) - 1))
+	memcpy(vec.iov_base, header, header_size);
+	memcpy((unsigned char*) vec.iov_base + header_size, data, size);
+	vec.iov_len = header_size + size;
+	evbuffer_commit_space(output, &vec, 1);
+	metric_add(&conn->wsserver->metrics->frames_out, 1);
+	metric_add(&conn->wsserver->metrics->bytes_out, vec.iov_len);
+}
+
+void wsconn_write(wsconn_t *conn, void *data, size_t size)
+{
+	wsconn_write_frame(conn, 1, data, size); /* opcode=1 - text frame */
+}
+
+void
+wsconn_mark_output(wsconn_t *conn, uint64_t time)
+{
+	int last;
+
+	if (conn->output_added == conn->output_drained)
+		return; /* already written to the socket */
+	if (conn->mark_count == WSCONN_MAX_MARKS)
 	{
-		/* Size is in bytes 2 and 3 */
-		uint16_t u16 = htons((uint16_t) size);
-		block1[0] = 126;
-		memcpy(&block1[1], &u16, 2);
-		block1_size = 3;
+		/* Extend the last mark; its stanzas were read earlier, so the
+		   time measured for these is a bit longer than it really is */
+		last = (conn->mark_first + conn->mark_count - 1) % WSCONN_MAX_MARKS;
+		conn->marks[last].end = conn->output_added;
+		return;
 	}
-	else
+	last = (conn->mark_first + conn->mark_count) % WSCONN_MAX_MARKS;
+	conn->marks[last].end = conn->output_added;
+	conn->marks[last].time = time;
+	conn->mark_count++;
+}
+
+/* wsconn_output_cb keeps count of the bytes added to and drained from the
+   output buffer and completes the marks whose bytes have been drained */
+static void
+wsconn_output_cb(struct evbuffer *buffer, const struct evbuffer_cb_info *info,
+	void *arg)
+{
+	wsconn_t *conn = (wsconn_t*) arg;
+
+	(void) buffer;
+	conn->output_added += info->n_added;
+	conn->output_drained += info->n_deleted;
+	while ( (conn->mark_count > 0) &&
+		(conn->marks[conn->mark_first].end <= conn->output_drained) )
 	{
-		/* Size is in bytes 1-8 */
-		uint32_t u32 = htons((uint32_t) size);
-		block1[0] = 127;
-		memcpy(&block1[5], &u32, 4);
-		block1_size = 9;
+		metrics_observe(&conn->wsserver->metrics->to_browser,
+			conn->marks[conn->mark_first].time);
+		conn->mark_first = (conn->mark_first + 1) % WSCONN_MAX_MARKS;
+		conn->mark_count--;
 	}
-	res = buffer_append(buffer, block1, block1_size);
-	if (!res)
-		goto Exit;
+}
 
-	res = buffer_append(buffer, data, size);
-	if (!res)
-		goto Exit;
+size_t
+wsbatch_frame_size(size_t size)
+{
+	byte header[WSMSG_MAX_HEADER_SIZE];
 
-	/* Write to output buffer */
-	buffer_peek_data(buffer, &message, &message_size);
-	evbuffer_add(output, message, message_size);
-	buffer_remove_data(buffer, message_size);
+	return wsmsg_encode_header(header, 1, OPCODE_TEXT, size) + size;
+}
 
-Exit:
-	if (buffer != NULL)
-		buffer_delete(buffer);
-	return;
+int
+wsbatch_begin(wsconn_t *conn, wsbatch_t *batch, size_t size)
+{
+	struct evbuffer *output = bufferevent_get_output(conn->bev);
+
+	batch->used = 0;
+	batch->frames = 0;
+	if (evbuffer_reserve_space(output, size, &batch->vec, 1) < 1)
+	{
+		LOG(LOG_ERR, "wsserver.c:wsbatch_begin: couldn't reserve %lu bytes",
+			(unsigned long) size);
+		return 0;
+	}
+	return 1;
 }
 
-void wsconn_write(wsconn_t *conn, void *data, size_t size)
+byte *
+wsbatch_add(wsbatch_t *batch, size_t size)
 {
-	wsconn_write_frame(conn, 1, data, size); /* opcode=1 - text frame */
+	byte *header = (byte*) batch->vec.iov_base + batch->used;
+	size_t header_size;
+
+	header_size = wsmsg_encode_header(header, 1, OPCODE_TEXT, size);
+	batch->used += header_size + size;
+	batch->frames++;
+	return header + header_size;
+}
+
+void
+wsbatch_end(wsconn_t *conn, wsbatch_t *batch)
+{
+	struct evbuffer *output = bufferevent_get_output(conn->bev);
+
+	batch->vec.iov_len = batch->used;
+	evbuffer_commit_space(output, &batch->vec, 1);
+	metric_add(&conn->wsserver->metrics->frames_out, batch->frames);
+	metric_add(&conn->wsserver->metrics->bytes_out, batch->used);
 }
 
 void wsconn_close(wsconn_t *conn)
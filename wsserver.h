@@ -4,10 +4,16 @@
 #include <stdlib.h>
 #include <event2/listener.h>
 #include <event2/bufferevent.h>
+#include <event2/buffer.h>
+#include <event2/dns.h>
 #include "rqparser.h"
 #include "parseconfig.h"
 #include "util.h"
 #include "wsmessage.h"
+#include "metrics.h"
+
+/* Output marks kept per connection (see wsconn_mark_output) */
+#define WSCONN_MAX_MARKS 16
 
 /* Forward declarations */
 typedef struct _wsserver_t wsserver_t;
@@ -42,6 +48,8 @@ struct _wsserver_t
 	ws_cb_t cb;
 	void *cb_ctx;
 	jsconf_t *conf;
+	struct evdns_base *dnsbase; /* used for reverse lookups of clients */
+	metrics_t *metrics; /* counters of the worker */
 };
 
 struct _wsconn_t
@@ -61,18 +69,48 @@ struct _wsconn_t
 	void *cb_ctx;
 	void *custom_ctx;
 	
-	/* Host address and port as obtained by getnameinfo */
+	/* Numeric host address and port as obtained by getnameinfo */
 	char host[128];
 	char serv[32];
+
+	/* Host name obtained by an asynchronous reverse lookup (if enabled in
+	   the configuration); empty until the lookup completes. */
+	char hostname[256];
+	struct evdns_request *ptr_request;
 	
 	/* Status obtained from Close frame received from the client */
 	uint16_t status;
+
+	unsigned long frames_counted; /* frames of wsmsg added to the metrics */
+
+	uint64_t accepted;  /* when the connection was accepted (metrics_now) */
+	uint64_t read_time; /* when the last input from the browser was read */
+
+	/* Output written for stanzas from the XMPP server: each mark holds the
+	   number of bytes added to the output buffer up to the end of the
+	   stanzas and when they were read, so the time until they leave the
+	   buffer can be measured. */
+	uint64_t output_added;
+	uint64_t output_drained;
+	struct
+	{
+		uint64_t end;
+		uint64_t time;
+	} marks[WSCONN_MAX_MARKS];
+	int mark_first;
+	int mark_count;
 };
 
-wsserver_t *ws_create(struct event_base *base, void *sin, size_t size);
+/* ws_create binds a listener to the address sin; if reuseport is set, the
+   socket is bound with SO_REUSEPORT so that several workers can listen on
+   the same address. */
+wsserver_t *ws_create(struct event_base *base, void *sin, size_t size,
+	int reuseport);
 void ws_delete(wsserver_t *ws);
 
 void ws_set_config(wsserver_t *ws, jsconf_t *conf);
+void ws_set_dnsbase(wsserver_t *ws, struct evdns_base *dnsbase);
+void ws_set_metrics(wsserver_t *ws, metrics_t *metrics);
 
 void ws_set_cb(
 				wsserver_t *ws,
@@ -84,6 +122,28 @@ void ws_set_cb(
 ws_cb_t ws_get_cb(wsserver_t *ws);
 
 void wsconn_write(wsconn_t *conn, void *data, size_t size);
+
+/* wsconn_mark_output records that everything written so far was read from
+   the XMPP server at time (metrics_now); once it has been written to the
+   socket, the time it took goes to the to_browser histogram */
+void wsconn_mark_output(wsconn_t *conn, uint64_t time);
+
+/* Batched output: several frames are written with one reservation in the
+   output buffer. wsbatch_begin reserves size bytes (the sum of
+   wsbatch_frame_size over all frames), wsbatch_add writes the header of
+   a text frame with a payload of size bytes and returns where the payload
+   goes, wsbatch_end commits what has been written. */
+typedef struct _wsbatch_t
+{
+	struct evbuffer_iovec vec;
+	size_t used;
+	size_t frames;
+} wsbatch_t;
+
+size_t wsbatch_frame_size(size_t size);
+int wsbatch_begin(wsconn_t *conn, wsbatch_t *batch, size_t size);
+byte *wsbatch_add(wsbatch_t *batch, size_t size);
+void wsbatch_end(wsconn_t *conn, wsbatch_t *batch);
 void wsconn_handshake(wsconn_t *conn);
 void wsconn_initiate_close(wsconn_t *conn, uint16_t status, unsigned char *reason,
 	size_t reason_size);
@@ -0,0 +1,76 @@
+#include "xmlpool.h"
+#include <string.h>
+
+xmlpool_t *
+xmlpool_create(size_t max_free)
+{
+	xmlpool_t *pool;
+
+	pool = (xmlpool_t*) malloc(sizeof(*pool));
+	if (pool == NULL)
+		goto Error;
+	memset(pool, 0, sizeof(*pool));
+	pool->max_free = max_free;
+	if (max_free > 0)
+	{
+		pool->free_list = (XML_Parser*) malloc(max_free * sizeof(XML_Parser));
+		if (pool->free_list == NULL)
+			goto Error;
+	}
+	return pool;
+
+Error:
+	free(pool);
+	return NULL;
+}
+
+void
+xmlpool_delete(xmlpool_t *pool)
+{
+	size_t i;
+
+	for (i = 0; i < pool->free_count; i++)
+		XML_ParserFree(pool->free_list[i]);
+	free(pool->free_list);
+	free(pool);
+}
+
+XML_Parser
+xmlpool_get(xmlpool_t *pool)
+{
+	XML_Parser parser;
+
+	if ( (pool != NULL) && (pool->free_count > 0) )
+	{
+		pool->reused++;
+		return pool->free_list[--pool->free_count];
+	}
+	parser = XML_ParserCreateNS(NULL, /* ':' */ '\xFF');
+	if ( (parser != NULL) && (pool != NULL) )
+		pool->created++;
+	return parser;
+}
+
+void
+xmlpool_put(xmlpool_t *pool, XML_Parser parser)
+{
+	if (parser == NULL)
+		return;
+	if ( (pool == NULL) || (pool->free_count >= pool->max_free) ||
+		!XML_ParserReset(parser, NULL) )
+	{
+		XML_ParserFree(parser);
+		return;
+	}
+	pool->free_list[pool->free_count++] = parser;
+}
+
+int
+xmlpool_reset(xmlpool_t *pool, XML_Parser parser)
+{
+	if ( !XML_ParserReset(parser, NULL) )
+		return 0;
+	if (pool != NULL)
+		pool->reused++;
+	return 1;
+}
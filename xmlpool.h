@@ -0,0 +1,40 @@
+#ifndef _XMLPOOL_H_
+#define _XMLPOOL_H_
+
+#include <stdlib.h>
+#include <expat.h>
+
+/* Pool of namespace-aware expat parsers (namespace separator '\xFF').
+   Parsers that are no longer needed are reset with XML_ParserReset and
+   kept on a free list, so a new stream doesn't have to create a parser.
+   Each worker has its own pool; a pool must only be used from one
+   thread. All functions accept a NULL pool, in which case parsers are
+   simply created and freed. */
+typedef struct _xmlpool_t
+{
+	XML_Parser *free_list;
+	size_t free_count;
+	size_t max_free; /* parsers kept on the free list at most */
+
+	unsigned long created; /* parsers created by XML_ParserCreateNS */
+	unsigned long reused;  /* parsers reused after XML_ParserReset */
+} xmlpool_t;
+
+#define XMLPOOL_DEFAULT_MAX_FREE 256
+
+xmlpool_t *xmlpool_create(size_t max_free);
+void xmlpool_delete(xmlpool_t *pool);
+
+/* xmlpool_get returns a parser ready for a new document, without any
+   handlers or user data. */
+XML_Parser xmlpool_get(xmlpool_t *pool);
+
+/* xmlpool_put returns a parser to the pool (or frees it) */
+void xmlpool_put(xmlpool_t *pool, XML_Parser parser);
+
+/* xmlpool_reset prepares a parser that is still in use for a new document
+   (for example a restarted XMPP stream); handlers and user data have to be
+   set again. Returns 0 on failure. */
+int xmlpool_reset(xmlpool_t *pool, XML_Parser parser);
+
+#endif /* _XMLPOOL_H_ */
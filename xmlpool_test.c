@@ -0,0 +1,95 @@
+#include <stdlib.h>
+#include "CuTest.h"
+#include <string.h>
+#include "xmlpool.h"
+#include "framer.h"
+#include "streamparse.h"
+
+static const char *stream_header =
+	"<stream:stream xmlns:stream='http://etherx.jabber.org/streams' "
+	"xmlns='jabber:client' to='example.com' version='1.0'>";
+
+void TestXMLPoolReuse(CuTest *tc)
+{
+	xmlpool_t *pool;
+	XML_Parser parser1, parser2;
+
+	pool = xmlpool_create(1);
+	CuAssertPtrNotNull(tc, pool);
+
+	parser1 = xmlpool_get(pool);
+	parser2 = xmlpool_get(pool);
+	CuAssertPtrNotNull(tc, parser1);
+	CuAssertPtrNotNull(tc, parser2);
+	CuAssertIntEquals(tc, 2, pool->created);
+
+	/* Only one parser is kept, the other one is freed */
+	xmlpool_put(pool, parser1);
+	xmlpool_put(pool, parser2);
+	CuAssertIntEquals(tc, 1, pool->free_count);
+
+	CuAssertTrue( tc, xmlpool_get(pool) == parser1 );
+	CuAssertIntEquals(tc, 2, pool->created);
+	CuAssertIntEquals(tc, 1, pool->reused);
+	xmlpool_put(pool, parser1);
+
+	xmlpool_delete(pool);
+}
+
+/* Stream restarts and new sessions don't create parsers, and reused
+   parsers work like new ones */
+void TestXMLPoolSessions(CuTest *tc)
+{
+	xmlpool_t *pool;
+	framer_t *framer;
+	streamparser_t *parser;
+	char *data;
+	size_t size;
+	int session, restart;
+
+	pool = xmlpool_create(XMLPOOL_DEFAULT_MAX_FREE);
+	CuAssertPtrNotNull(tc, pool);
+
+	for (session = 0; session < 3; session++)
+	{
+		parser = streamparser_create_pooled(pool);
+		CuAssertPtrNotNull(tc, parser);
+		CuAssertTrue( tc, streamparser_add(parser, stream_header) );
+		CuAssertStrEquals( tc, "example.com",
+			streamparser_get_server(parser) );
+		streamparser_delete(parser);
+
+		framer = framer_create_engine(FRAMER_EXPAT, pool);
+		CuAssertPtrNotNull(tc, framer);
+		for (restart = 0; restart < 3; restart++)
+		{
+			CuAssertTrue( tc, framer_reset(framer) );
+			CuAssertTrue( tc, framer_add(framer, (unsigned char*) stream_header,
+				strlen(stream_header) ) );
+			CuAssertTrue( tc, framer_add(framer, (unsigned char*)
+				"<presence/>", 11) );
+			CuAssertTrue( tc, framer_get_frame(framer, &data, &size) );
+			free(data);
+			CuAssertTrue( tc, framer_get_frame(framer, &data, &size) );
+			CuAssertIntEquals(tc, 11, size);
+			CuAssertTrue( tc, memcmp(data, "<presence/>", 11) == 0 );
+			free(data);
+		}
+		framer_delete(framer);
+	}
+
+	/* A single parser goes back and forth: created for the first stream
+	   parser, then reused by every framer, stream parser and restart */
+	CuAssertIntEquals(tc, 1, pool->created);
+	CuAssertIntEquals(tc, 3 * 5 - 1, pool->reused);
+
+	xmlpool_delete(pool);
+}
+
+CuSuite* XMLPoolGetSuite()
+{
+	CuSuite* suite = CuSuiteNew();
+	SUITE_ADD_TEST(suite, TestXMLPoolReuse);
+	SUITE_ADD_TEST(suite, TestXMLPoolSessions);
+	return suite;
+}
@@ -0,0 +1,210 @@
+#include "xmlscan.h"
+#include <string.h>
+
+/* Scanner states */
+enum _xmlscan_state_t
+{
+	XS_TEXT,      /* character data, looking for '<' */
+	XS_LT,        /* after '<' */
+	XS_NAME,      /* element name of a start or end tag */
+	XS_TAG,       /* inside a tag, after the name */
+	XS_QUOTE,     /* inside a quoted attribute value */
+	XS_BANG,      /* after "<!" */
+	XS_BANG_DASH, /* after "<!-" */
+	XS_SKIP       /* comment, CDATA section, PI or declaration; looking
+	                 for scan->terminator */
+};
+
+#define IS_SPACE(c) ( (c) == ' ' || (c) == '\t' || (c) == '\r' || (c) == '\n' )
+
+void
+xmlscan_init(xmlscan_t *scan, xmlscan_cb_t cb, void *ctx)
+{
+	memset(scan, 0, sizeof(*scan));
+	scan->state = XS_TEXT;
+	scan->cb = cb;
+	scan->ctx = ctx;
+}
+
+static void
+xmlscan_skip_until(xmlscan_t *scan, const char *terminator)
+{
+	scan->terminator = terminator;
+	scan->match = 0;
+	scan->state = XS_SKIP;
+}
+
+/* xmlscan_tag is called on the '>' that closes a tag; end is the stream
+   offset just past it. */
+static int
+xmlscan_tag(xmlscan_t *scan, size_t end)
+{
+	int what;
+
+	if (scan->name_length == 0)
+		return 0;
+	if (scan->end_tag)
+		what = XMLSCAN_END;
+	else if (scan->slash)
+		what = XMLSCAN_EMPTY;
+	else
+		what = XMLSCAN_START;
+	scan->state = XS_TEXT;
+	scan->cb(scan->ctx, what, scan->name, scan->name_length,
+		scan->tag_start, end - scan->tag_start);
+	return 1;
+}
+
+int
+xmlscan_add(xmlscan_t *scan, const byte *data, size_t length)
+{
+	size_t i = 0;
+	const byte *p;
+	byte c;
+
+	if (scan->error)
+		return 0;
+
+	while (i < length)
+	{
+		switch (scan->state)
+		{
+			case XS_TEXT:
+				/* memchr is vectorized in the C library, text between
+				   tags is skipped at memory speed */
+				p = (const byte*) memchr(data + i, '<', length - i);
+				if (p == NULL)
+				{
+					i = length;
+					break;
+				}
+				i = p - data;
+				scan->tag_start = scan->offset + i;
+				i++;
+				scan->state = XS_LT;
+				break;
+
+			case XS_LT:
+				c = data[i++];
+				scan->name_length = 0;
+				scan->slash = 0;
+				scan->end_tag = 0;
+				if (c == '/')
+				{
+					scan->end_tag = 1;
+					scan->state = XS_NAME;
+				}
+				else if (c == '!')
+					scan->state = XS_BANG;
+				else if (c == '?')
+					xmlscan_skip_until(scan, "?>");
+				else if ( IS_SPACE(c) || (c == '>') || (c == '<') )
+					goto Error;
+				else
+				{
+					scan->name[scan->name_length++] = c;
+					scan->state = XS_NAME;
+				}
+				break;
+
+			case XS_NAME:
+				c = data[i];
+				if ( IS_SPACE(c) || (c == '/') || (c == '>') )
+				{
+					scan->state = XS_TAG;
+					break;
+				}
+				if (c == '<')
+					goto Error;
+				if (scan->name_length < XMLSCAN_MAX_NAME)
+					scan->name[scan->name_length++] = c;
+				i++;
+				break;
+
+			case XS_TAG:
+				c = data[i++];
+				if (c == '>')
+				{
+					if ( !xmlscan_tag(scan, scan->offset + i) )
+						goto Error;
+				}
+				else if ( (c == '"') || (c == '\'') )
+				{
+					scan->quote = c;
+					scan->slash = 0;
+					scan->state = XS_QUOTE;
+				}
+				else if (c == '/')
+					scan->slash = 1;
+				else if (c == '<')
+					goto Error;
+				else if ( !IS_SPACE(c) )
+					scan->slash = 0;
+				break;
+
+			case XS_QUOTE:
+				p = (const byte*) memchr(data + i, scan->quote, length - i);
+				if (p == NULL)
+				{
+					i = length;
+					break;
+				}
+				i = p - data + 1;
+				scan->state = XS_TAG;
+				break;
+
+			case XS_BANG:
+				c = data[i++];
+				if (c == '-')
+					scan->state = XS_BANG_DASH;
+				else if (c == '[')
+					xmlscan_skip_until(scan, "]]>"); /* CDATA section */
+				else if (c == '>')
+					scan->state = XS_TEXT;
+				else
+					xmlscan_skip_until(scan, ">"); /* declaration */
+				break;
+
+			case XS_BANG_DASH:
+				c = data[i++];
+				if (c != '-')
+					goto Error;
+				xmlscan_skip_until(scan, "-->");
+				break;
+
+			case XS_SKIP:
+				if (scan->match == 0)
+				{
+					p = (const byte*) memchr(data + i, scan->terminator[0],
+						length - i);
+					if (p == NULL)
+					{
+						i = length;
+						break;
+					}
+					i = p - data + 1;
+					scan->match = 1;
+				}
+				else
+				{
+					c = data[i++];
+					if (c == scan->terminator[scan->match])
+						scan->match++;
+					else if ( (scan->match == 2) &&
+						(c == scan->terminator[1]) )
+						; /* "--->" and "]]]>": still two matched */
+					else
+						scan->match = (c == scan->terminator[0]) ? 1 : 0;
+				}
+				if (scan->terminator[scan->match] == '\0')
+					scan->state = XS_TEXT;
+				break;
+		}
+	}
+	scan->offset += length;
+	return 1;
+
+Error:
+	scan->error = 1;
+	return 0;
+}
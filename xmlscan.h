@@ -0,0 +1,54 @@
+#ifndef _XMLSCAN_H_
+#define _XMLSCAN_H_
+
+#include <stdlib.h>
+#include "util.h"
+
+/* xmlscan is a byte-level scanner that finds the tags of an XML stream
+   without parsing it: it tracks tags, quoted attribute values, comments,
+   CDATA sections, processing instructions and declarations, and reports
+   every start, end and empty-element tag with its offset from the start
+   of the stream and its size. It does not check well-formedness beyond
+   what it needs to find tags, and it doesn't resolve namespaces. Input
+   may be split at any byte. */
+
+/* Tag types passed to the callback */
+enum
+{
+	XMLSCAN_START, /* <name ...> */
+	XMLSCAN_END,   /* </name> */
+	XMLSCAN_EMPTY  /* <name .../> */
+};
+
+/* Callback: what is the tag type, name and name_length the qualified name
+   (truncated to XMLSCAN_MAX_NAME bytes), index and size locate the whole
+   tag in the stream. */
+typedef void (*xmlscan_cb_t)(void *ctx, int what, const char *name,
+	size_t name_length, size_t index, size_t size);
+
+#define XMLSCAN_MAX_NAME 64
+
+typedef struct _xmlscan_t
+{
+	int state;
+	int error;
+	size_t offset; /* stream offset of the next byte */
+	size_t tag_start; /* stream offset of the current tag's '<' */
+	int end_tag; /* current tag is an end tag */
+	int slash; /* last significant character in the tag was '/' */
+	byte quote; /* quote character of the current attribute value */
+	const char *terminator; /* end of the current comment, CDATA, ... */
+	size_t match; /* bytes of terminator matched so far */
+	char name[XMLSCAN_MAX_NAME];
+	size_t name_length;
+	xmlscan_cb_t cb;
+	void *ctx;
+} xmlscan_t;
+
+void xmlscan_init(xmlscan_t *scan, xmlscan_cb_t cb, void *ctx);
+
+/* xmlscan_add scans length bytes of data and calls the callback for each
+   tag that is completed. Returns 0 if the input can't be XML. */
+int xmlscan_add(xmlscan_t *scan, const byte *data, size_t length);
+
+#endif /* _XMLSCAN_H_ */